@@ -0,0 +1,132 @@
+/*
+ * Ingest benchmark: one recvmsg() per uevent versus recvmmsg() batches.
+ *
+ * A sender thread pushes kernel-formatted uevents through an AF_UNIX datagram
+ * socketpair (netlink needs root and real hardware); the reader parses every
+ * message with the same demi_parse_uevent() that demi_read() uses.
+ *
+ * cc -O2 -DDEMI_PLATFORM_LINUX -Iinclude -Isrc/linux -o bench_read_batch \
+ *    bench_read_batch.c src/linux/demi.c src/linux/demi_bpf.c src/linux/demi_tokenize.c src/demi_event.c src/demi_filter.c src/demi_log.c -lpthread
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "include/demi.h"
+#include "demi_internal.h"
+
+#define EVENTS 200000
+
+static char g_msg[1024];
+static size_t g_msg_len;
+
+static void build_uevent(void)
+{
+    static const char *vars[] = {
+        "add@/devices/pci0000:00/0000:00:1f.2/ata1/host0/target0:0:0/0:0:0:0/block/sda",
+        "ACTION=add",
+        "DEVPATH=/devices/pci0000:00/0000:00:1f.2/ata1/host0/target0:0:0/0:0:0:0/block/sda",
+        "SUBSYSTEM=block",
+        "MAJOR=8",
+        "MINOR=0",
+        "DEVNAME=sda",
+        "DEVTYPE=disk",
+        "DISKSEQ=9",
+        "SEQNUM=4321",
+    };
+
+    g_msg_len = 0;
+    for (size_t i = 0; i < sizeof(vars) / sizeof(vars[0]); i++) {
+        size_t len = strlen(vars[i]) + 1;
+        memcpy(g_msg + g_msg_len, vars[i], len);
+        g_msg_len += len;
+    }
+}
+
+static void *sender(void *arg)
+{
+    int fd = *(int *)arg;
+    for (int i = 0; i < EVENTS; i++) {
+        while (send(fd, g_msg, g_msg_len, 0) == -1) {
+        }
+    }
+    return NULL;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char *name, int batch)
+{
+    int sv[2];
+    pthread_t tid;
+    struct demi_event de;
+    struct mmsghdr hdrs[DEMI_BATCH_MAX];
+    struct iovec iovs[DEMI_BATCH_MAX];
+    static char bufs[DEMI_BATCH_MAX][DEMI_MSG_MAX];
+    long syscalls = 0, events = 0;
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == -1) {
+        perror("socketpair");
+        exit(1);
+    }
+    int rcvbuf = 4 * 1024 * 1024;
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    double t0 = now_sec();
+    pthread_create(&tid, NULL, sender, &sv[1]);
+
+    while (events < EVENTS) {
+        if (batch == 1) {
+            ssize_t len = recv(sv[0], bufs[0], DEMI_MSG_MAX, 0);
+            syscalls++;
+            if (len > 0 && demi_parse_uevent(bufs[0], (size_t)len, &de) == 0) {
+                events++;
+            }
+            continue;
+        }
+
+        for (int i = 0; i < batch; i++) {
+            iovs[i].iov_base = bufs[i];
+            iovs[i].iov_len = DEMI_MSG_MAX;
+            memset(&hdrs[i].msg_hdr, 0, sizeof(hdrs[i].msg_hdr));
+            hdrs[i].msg_hdr.msg_iov = &iovs[i];
+            hdrs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(sv[0], hdrs, (unsigned int)batch, MSG_WAITFORONE, NULL);
+        syscalls++;
+        for (int i = 0; i < n; i++) {
+            if (demi_parse_uevent(bufs[i], hdrs[i].msg_len, &de) == 0) {
+                events++;
+            }
+        }
+    }
+
+    pthread_join(tid, NULL);
+    double elapsed = now_sec() - t0;
+    close(sv[0]);
+    close(sv[1]);
+
+    printf("  %-22s %8ld events %8ld recv syscalls (%.2f events/syscall) %8.0f events/s %6.0f ns/event\n",
+           name, events, syscalls, (double)events / (double)syscalls,
+           events / elapsed, elapsed * 1e9 / events);
+}
+
+int main() {
+    build_uevent();
+    demi_set_allowed_devices("sd*");
+
+    printf("=== uevent ingest benchmark (%d events, %zu bytes each) ===\n", EVENTS, g_msg_len);
+    run("recvmsg (demi_read)", 1);
+    run("recvmmsg batch 16", 16);
+    run("recvmmsg batch 64", DEMI_BATCH_MAX);
+    return 0;
+}
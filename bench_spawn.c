@@ -0,0 +1,116 @@
+/*
+ * Helper spawn latency as the daemon grows: fork+exec, posix_spawn from the
+ * daemon, and a request to the fork server, each timed from the request to
+ * the exit report of /bin/true, with 0 to 1024 MB of touched heap.
+ *
+ * cc -O2 -Iinclude -o bench_spawn bench_spawn.c src/demi_zygote.c src/demi_log.c -lpthread
+ */
+#include <errno.h>
+#include <poll.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "include/demi.h"
+#include "include/demi_zygote.h"
+
+#define ROUNDS 200
+
+extern char **environ;
+
+static char *const g_argv[] = { "/bin/true", NULL };
+static int g_done;
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double time_fork(void)
+{
+    double t0 = now_us();
+    for (int i = 0; i < ROUNDS; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            execv(g_argv[0], g_argv);
+            _exit(127);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return (now_us() - t0) / ROUNDS;
+}
+
+static double time_posix_spawn(void)
+{
+    double t0 = now_us();
+    for (int i = 0; i < ROUNDS; i++) {
+        pid_t pid;
+        posix_spawn(&pid, g_argv[0], NULL, NULL, g_argv, environ);
+        waitpid(pid, NULL, 0);
+    }
+    return (now_us() - t0) / ROUNDS;
+}
+
+static void exited(pid_t pid, int status, const struct rusage *usage, void *arg)
+{
+    (void)pid;
+    (void)status;
+    (void)usage;
+    (void)arg;
+    g_done = 1;
+}
+
+static double time_zygote(void)
+{
+    double t0 = now_us();
+    for (int i = 0; i < ROUNDS; i++) {
+        g_done = 0;
+        if (demi_zygote_spawn(g_argv[0], g_argv, NULL, NULL, exited, NULL) == -1) {
+            return -1;
+        }
+        while (!g_done) {
+            struct pollfd pfd = { .fd = demi_zygote_fd(), .events = POLLIN };
+            poll(&pfd, 1, -1);
+            demi_zygote_dispatch();
+        }
+    }
+    return (now_us() - t0) / ROUNDS;
+}
+
+int main() {
+    static const size_t sizes_mb[] = { 0, 64, 256, 1024 };
+
+    /* Forked first, while this process is small, like the daemon does */
+    if (demi_zygote_start() == -1) {
+        printf("cannot start fork server: %s\n", strerror(errno));
+        return 1;
+    }
+
+    printf("=== helper spawn latency (%d spawns of /bin/true each) ===\n\n", ROUNDS);
+    printf("  %8s  %14s  %14s  %14s\n", "heap", "fork+exec", "posix_spawn", "fork server");
+
+    for (size_t i = 0; i < sizeof(sizes_mb) / sizeof(sizes_mb[0]); i++) {
+        size_t bytes = sizes_mb[i] << 20;
+        char *heap = bytes ? malloc(bytes) : NULL;
+        if (bytes && !heap) {
+            printf("  %6zu MB  (allocation failed)\n", sizes_mb[i]);
+            continue;
+        }
+        if (heap) {
+            memset(heap, 1, bytes);     /* populate the page tables */
+        }
+
+        printf("  %6zu MB  %11.1f us  %11.1f us  %11.1f us\n", sizes_mb[i],
+               time_fork(), time_posix_spawn(), time_zygote());
+        free(heap);
+    }
+
+    demi_zygote_stop();
+    printf("\n=== helper spawn latency done ===\n");
+    return 0;
+}
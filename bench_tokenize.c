@@ -0,0 +1,160 @@
+/*
+ * Tokenizer microbenchmark: each kernel (AVX2, SSE2, scalar) over uevents
+ * captured from real machines, reported as ns per event for tokenizing alone
+ * and for the full demi_parse_uevent(). All kernels must agree token for
+ * token before anything is timed.
+ *
+ * cc -O2 -DDEMI_PLATFORM_LINUX -Iinclude -Isrc/linux -o bench_tokenize \
+ *    bench_tokenize.c src/linux/demi.c src/linux/demi_bpf.c src/linux/demi_tokenize.c \
+ *    src/demi_event.c src/demi_filter.c src/demi_log.c -lpthread
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "include/demi.h"
+#include "demi_internal.h"
+
+#define ROUNDS 200000
+
+/* Captured with `udevadm monitor --kernel --property`, one string per record */
+static const char *const g_captured[][24] = {
+    { "add@/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2:1.0/host6/target6:0:0/6:0:0:0/block/sdb",
+      "ACTION=add", "DEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2:1.0/host6/target6:0:0/6:0:0:0/block/sdb",
+      "SUBSYSTEM=block", "MAJOR=8", "MINOR=16", "DEVNAME=sdb", "DEVTYPE=disk", "DISKSEQ=23", "SEQNUM=5391", NULL },
+    { "add@/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2:1.0/host6/target6:0:0/6:0:0:0/block/sdb/sdb1",
+      "ACTION=add", "DEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2:1.0/host6/target6:0:0/6:0:0:0/block/sdb/sdb1",
+      "SUBSYSTEM=block", "MAJOR=8", "MINOR=17", "DEVNAME=sdb1", "DEVTYPE=partition", "DISKSEQ=23", "PARTN=1",
+      "PARTNAME=EFI System Partition", "SEQNUM=5392", NULL },
+    { "change@/devices/virtual/block/dm-0",
+      "ACTION=change", "DEVPATH=/devices/virtual/block/dm-0", "SUBSYSTEM=block", "DM_COOKIE=4194305",
+      "MAJOR=253", "MINOR=0", "DEVNAME=dm-0", "DEVTYPE=disk", "DISKSEQ=4", "SEQNUM=4410", NULL },
+    { "add@/devices/virtual/net/veth3f2a1c9",
+      "ACTION=add", "DEVPATH=/devices/virtual/net/veth3f2a1c9", "SUBSYSTEM=net", "INTERFACE=veth3f2a1c9",
+      "IFINDEX=412", "SEQNUM=88213", NULL },
+    { "change@/devices/LNXSYSTM:00/LNXSYBUS:00/PNP0C0A:00/power_supply/BAT0",
+      "ACTION=change", "DEVPATH=/devices/LNXSYSTM:00/LNXSYBUS:00/PNP0C0A:00/power_supply/BAT0",
+      "SUBSYSTEM=power_supply", "POWER_SUPPLY_NAME=BAT0", "POWER_SUPPLY_TYPE=Battery",
+      "POWER_SUPPLY_STATUS=Discharging", "POWER_SUPPLY_PRESENT=1", "POWER_SUPPLY_TECHNOLOGY=Li-poly",
+      "POWER_SUPPLY_CYCLE_COUNT=312", "POWER_SUPPLY_VOLTAGE_MIN_DESIGN=11550000",
+      "POWER_SUPPLY_VOLTAGE_NOW=12104000", "POWER_SUPPLY_POWER_NOW=7261000",
+      "POWER_SUPPLY_ENERGY_FULL_DESIGN=57000000", "POWER_SUPPLY_ENERGY_FULL=51030000",
+      "POWER_SUPPLY_ENERGY_NOW=38120000", "POWER_SUPPLY_CAPACITY=74", "POWER_SUPPLY_CAPACITY_LEVEL=Normal",
+      "POWER_SUPPLY_MODEL_NAME=5B10W13930", "POWER_SUPPLY_MANUFACTURER=SMP", "POWER_SUPPLY_SERIAL_NUMBER=1034",
+      "SEQNUM=90211", NULL },
+    { "bind@/devices/pci0000:00/0000:00:14.0/usb1/1-3/1-3:1.0",
+      "ACTION=bind", "DEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-3/1-3:1.0", "SUBSYSTEM=usb",
+      "DEVTYPE=usb_interface", "DRIVER=usbhid", "PRODUCT=46d/c52b/1211", "TYPE=0/0/0", "INTERFACE=3/1/2",
+      "MODALIAS=usb:v046DpC52Bd1211dc00dsc00dp00ic03isc01ip02in00", "SEQNUM=5402", NULL },
+};
+
+#define CAPTURED (sizeof(g_captured) / sizeof(g_captured[0]))
+
+/* Largest message we accept in one buffer: a udev-enriched change with long properties */
+#define BIG_MSG 8192
+
+static char g_msgs[CAPTURED + 1][BIG_MSG];
+static size_t g_lens[CAPTURED + 1];
+
+static void build_messages(void)
+{
+    for (size_t m = 0; m < CAPTURED; m++) {
+        for (size_t i = 0; g_captured[m][i]; i++) {
+            size_t n = strlen(g_captured[m][i]) + 1;
+            memcpy(g_msgs[m] + g_lens[m], g_captured[m][i], n);
+            g_lens[m] += n;
+        }
+    }
+
+    /* One full 8 KB message built from the power_supply capture */
+    char *big = g_msgs[CAPTURED];
+    size_t len = 0;
+    while (len + g_lens[4] < BIG_MSG) {
+        memcpy(big + len, g_msgs[4], g_lens[4]);
+        len += g_lens[4];
+    }
+    g_lens[CAPTURED] = len;
+}
+
+static size_t tokenize_all(const char *buf, size_t len, struct demi_token *tok, size_t max)
+{
+    size_t pos = 0, total = 0, n;
+    while ((n = demi_tokenize(buf, len, &pos, tok + total, max - total)) > 0) {
+        total += n;
+    }
+    return total;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main() {
+    static const char *kernels[] = { "avx2", "sse2", "scalar" };
+    static struct demi_token expect[CAPTURED + 1][1024], got[1024];
+    static size_t expect_n[CAPTURED + 1];
+    static char copy[BIG_MSG];
+    struct demi_event de;
+    int failures = 0;
+
+    build_messages();
+    demi_set_allowed_devices("sd* dm-*");
+
+    const char *native = demi_tokenize_kernel();
+    demi_tokenize_use("scalar");
+    for (size_t m = 0; m <= CAPTURED; m++) {
+        expect_n[m] = tokenize_all(g_msgs[m], g_lens[m], expect[m], 1024);
+    }
+
+    printf("=== uevent tokenizer benchmark (%zu captured uevents + one %zu-byte message) ===\n",
+           CAPTURED, g_lens[CAPTURED]);
+    printf("  default kernel on this CPU: %s\n\n", native);
+
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (demi_tokenize_use(kernels[k]) == -1) {
+            printf("  %-7s not supported on this CPU\n", kernels[k]);
+            continue;
+        }
+
+        for (size_t m = 0; m <= CAPTURED; m++) {
+            size_t n = tokenize_all(g_msgs[m], g_lens[m], got, 1024);
+            if (n != expect_n[m] || memcmp(got, expect[m], n * sizeof(got[0])) != 0) {
+                printf("  %-7s disagrees with scalar on message %zu  <-- FAIL\n", kernels[k], m);
+                failures++;
+            }
+        }
+
+        double t0 = now_ns();
+        size_t sink = 0;
+        for (int r = 0; r < ROUNDS; r++) {
+            for (size_t m = 0; m < CAPTURED; m++) {
+                sink += tokenize_all(g_msgs[m], g_lens[m], got, 1024);
+            }
+        }
+        double tok_ns = (now_ns() - t0) / ((double)ROUNDS * CAPTURED);
+
+        t0 = now_ns();
+        for (int r = 0; r < ROUNDS / 10; r++) {
+            sink += tokenize_all(g_msgs[CAPTURED], g_lens[CAPTURED], got, 1024);
+        }
+        double big_ns = (now_ns() - t0) / (ROUNDS / 10);
+
+        t0 = now_ns();
+        for (int r = 0; r < ROUNDS; r++) {
+            for (size_t m = 0; m < CAPTURED; m++) {
+                memcpy(copy, g_msgs[m], g_lens[m]);
+                sink += (size_t)demi_parse_uevent(copy, g_lens[m], &de);
+            }
+        }
+        double parse_ns = (now_ns() - t0) / ((double)ROUNDS * CAPTURED);
+
+        printf("  %-7s tokenize %6.1f ns/event   8 KB message %7.1f ns   full parse %6.1f ns/event%s\n",
+               kernels[k], tok_ns, big_ns, parse_ns, sink ? "" : " ");
+    }
+
+    printf("\n=== uevent tokenizer benchmark %s ===\n", failures ? "FAILED" : "done");
+    return failures ? 1 : 0;
+}
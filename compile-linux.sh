@@ -1,2 +1,2 @@
 #!/bin/sh
-cc -DDEMI_PLATFORM_LINUX -DDEMI_LOCK_TIMEOUT_SECONDS=10 -Iinclude -Isrc/linux -o devd-watcher main.c src/linux/*.c src/demi_filter.c -lpthread
+cc -rdynamic -DDEMI_PLATFORM_LINUX -Iinclude -Isrc/linux -o devd-watcher main.c src/linux/*.c src/demi_acct.c src/demi_filter.c src/demi_coalesce.c src/demi_devq.c src/demi_event.c src/demi_exporter.c src/demi_hist.c src/demi_log.c src/demi_metrics.c src/demi_plugin.c src/demi_pool.c src/demi_rate.c src/demi_resident.c src/demi_shpool.c src/demi_spawn.c src/demi_state.c src/demi_trace.c src/demi_wheel.c src/demi_zygote.c -lpthread -ldl
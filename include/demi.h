@@ -1,6 +1,9 @@
 #ifndef _DEMI_H_
 #define _DEMI_H_
 
+#include <stdarg.h>
+#include <stddef.h>
+
 //usr/include/sys/param.h:#define SPECNAMELEN    255             /* max length of devicename */
 
 /* Public limit for device name length */
@@ -13,23 +16,141 @@ enum demi_event_type {
     DEMI_ATTACH,
     DEMI_DETACH,
     DEMI_CHANGE,
+    DEMI_RESYNC,    /* events were lost; device state must be rescanned */
     // DEMI_HOTPLUG,
     // DEMI_LEASE,
 };
 
+/* Well-known uevent keys, found through a perfect hash while parsing */
+enum demi_key {
+    DEMI_KEY_ACTION,
+    DEMI_KEY_DEVNAME,
+    DEMI_KEY_SUBSYSTEM,
+    DEMI_KEY_DEVTYPE,
+    DEMI_KEY_DEVPATH,
+    DEMI_KEY_SEQNUM,
+    DEMI_KEY_MAJOR,
+    DEMI_KEY_MINOR,
+    DEMI_KEY_DISKSEQ,
+    DEMI_KEY_PARTN,
+    DEMI_KEY_COUNT
+};
+
+/* Most key=value pairs kept per event; well-known keys are kept regardless */
+#ifndef DEMI_FIELDS_MAX
+#define DEMI_FIELDS_MAX 32
+#endif
+
+/* A key=value pair as offsets into de_buf; the value is NUL-terminated there */
+struct demi_field {
+    unsigned short df_key;
+    unsigned short df_key_len;
+    unsigned short df_value;
+    unsigned short df_value_len;
+};
+
+/*
+ * Where an event is on its way from the kernel to its helper finishing.
+ * The library stamps the first three; the daemon stamps the rest.
+ */
+enum demi_stage {
+    DEMI_STAGE_RECEIVED,    /* queued on the socket by the kernel, or read if unknown */
+    DEMI_STAGE_PARSED,
+    DEMI_STAGE_FILTERED,    /* device filter applied */
+    DEMI_STAGE_ENQUEUED,    /* handed to the coalescer */
+    DEMI_STAGE_LOCKED,      /* the device queue let it go */
+    DEMI_STAGE_SPAWNED,
+    DEMI_STAGE_EXITED,
+    DEMI_STAGE_COUNT
+};
+
 struct demi_event {
     char de_devname[DEMI_DEVNAME_MAX];
     enum demi_event_type de_type;
+    unsigned long long de_seqnum;   /* kernel SEQNUM, 0 if the platform has none */
+    /* CLOCK_MONOTONIC ns per library stage, 0 if not reached */
+    unsigned long long de_stage_ns[DEMI_STAGE_FILTERED + 1];
+
+    /*
+     * Views into the receive buffer, valid until the next demi_read() or
+     * demi_read_batch() on the same thread. Use the accessors below.
+     */
+    const char *de_buf;
+    unsigned int de_known_mask;     /* bit (1 << key) per enum demi_key present */
+    struct demi_field de_known[DEMI_KEY_COUNT];
+    unsigned int de_nfields;
+    struct demi_field de_fields[DEMI_FIELDS_MAX];
+};
+
+/* Ingest counters kept by demi_read_batch() */
+struct demi_read_stats {
+    unsigned long received;     /* messages taken off the socket */
+    unsigned long filtered;     /* dropped: device not allowed */
+    unsigned long foreign;      /* dropped: not sent by the kernel */
+    unsigned long truncated;    /* dropped: larger than the receive buffer */
+    unsigned long overflows;    /* socket receive queue overflowed (ENOBUFS) */
+    unsigned long seqnum_gaps;  /* SEQNUM jumped forward */
+    unsigned long resyncs;      /* DEMI_RESYNC events returned */
+    unsigned long msg_max;      /* current per-message receive buffer */
 };
 
+typedef void (*demi_scan_fn)(const char *devname, void *arg);
+
+/* Most events demi_read_batch() returns per call */
+#ifndef DEMI_BATCH_MAX
+#define DEMI_BATCH_MAX 64
+#endif
+
 int demi_init(int flags);
 int demi_read(int fd, struct demi_event *event);
+int demi_read_batch(int fd, struct demi_event *events, int n);
+void demi_read_stats(struct demi_read_stats *st);
+
+/* Socket receive buffer applied by demi_init(); 0 keeps the system default */
+void demi_set_rcvbuf(int bytes);
+/* Report SEQNUM gaps as DEMI_RESYNC (default on) */
+void demi_set_seqnum_check(int enabled);
+/*
+ * Let only these actions ("attach detach change") and subsystems (Linux
+ * SUBSYSTEM values such as "block") reach demi_read(); NULL or empty passes
+ * all. Applied by demi_init() as a kernel socket filter where supported.
+ */
+int demi_set_event_filter(const char *actions, const char *subsystems);
+/* Call fn for every device present right now that passes the device filter */
+int demi_scan(demi_scan_fn fn, void *arg);
+
+/* Event accessors; values are NUL-terminated, len may be NULL */
+const char *demi_event_get(const struct demi_event *de, enum demi_key key, size_t *len);
+const char *demi_event_lookup(const struct demi_event *de, const char *key, size_t *len);
+/* i-th key=value pair in message order; returns -1 past the end */
+int demi_event_field(const struct demi_event *de, unsigned int i,
+                     const char **key, size_t *key_len, const char **value, size_t *value_len);
+/*
+ * Point an event's key views at buf, "KEY=value" pairs each ending in NUL as
+ * copied out through demi_event_field(); buf must outlive the event
+ */
+int demi_event_load(struct demi_event *de, const char *buf, size_t len);
+/* enum demi_key for a key name, -1 if it is not a well-known key */
+int demi_key_lookup(const char *key, size_t len);
+const char *demi_key_name(enum demi_key key);
 
 /* Device filtering functions */
 int demi_is_device_allowed(const char *devname);
 void demi_set_allowed_devices(const char *allowed_devices);
 
-/* Logging function */
+/* Compiled DEMI_ALLOWED_DEVICES pattern list; immutable once built */
+struct demi_matcher;
+struct demi_matcher *demi_matcher_compile(const char *patterns);
+int demi_matcher_match(const struct demi_matcher *m, const char *devname);
+void demi_matcher_free(struct demi_matcher *m);
+
+/* Logging functions; nothing is logged until demi_log_open() succeeds */
+int demi_log_open(const char *path);
+void demi_log_reopen(void);
+void demi_log_close(void);
+unsigned long demi_log_dropped(void);
 void demi_log(const char *message);
+void demi_logf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void demi_logv(const char *fmt, va_list ap);
 
 #endif
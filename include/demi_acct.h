@@ -0,0 +1,45 @@
+#ifndef _DEMI_ACCT_H_
+#define _DEMI_ACCT_H_
+
+#include <stdint.h>
+#include <sys/resource.h>
+
+#include "demi_hist.h"
+
+/*
+ * Helper accounting: every finished run is filed under its action and its
+ * device pattern, the device name with each run of digits replaced by '*'
+ * ("sda1" and "sdb2" are both "sd*"). Each entry keeps a histogram of wall
+ * times and the CPU time and peak RSS reported by wait4(); runs that were
+ * not reaped by the daemon or its fork server (warm shells, resident
+ * helpers, plugins) count towards wall time only.
+ */
+
+struct demi_acct;
+
+struct demi_acct_entry {
+    const char *action;
+    const char *pattern;
+    uint64_t runs;
+    uint64_t failed;
+    struct demi_hist wall_us;
+    uint64_t measured;          /* runs with rusage */
+    uint64_t user_us;
+    uint64_t sys_us;
+    uint64_t cpu_max_us;        /* user + system of the costliest run */
+    uint64_t maxrss_kb;         /* largest peak RSS of any run */
+};
+
+typedef void (*demi_acct_fn)(const struct demi_acct_entry *e, void *arg);
+
+struct demi_acct *demi_acct_create(void);
+/* usage is NULL when the run's resource usage is not known */
+int demi_acct_record(struct demi_acct *a, const char *action, const char *devname,
+                     uint64_t wall_us, const struct rusage *usage, int failed);
+/* Entries in no particular order */
+void demi_acct_foreach(const struct demi_acct *a, demi_acct_fn fn, void *arg);
+/* One summary and one histogram line per entry through demi_logf() */
+void demi_acct_log(const struct demi_acct *a);
+void demi_acct_destroy(struct demi_acct *a);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef _DEMI_COALESCE_H_
+#define _DEMI_COALESCE_H_
+
+#include "demi.h"
+#include "demi_loop.h"
+
+/*
+ * Per-device coalescing of repeated events.
+ *
+ * An event whose action has a window is held back for that long; further
+ * events of the same action for the same device replace it, so a burst
+ * costs one helper run carrying the latest state. The window starts at the
+ * first event, which bounds the delay under a steady stream. Any other
+ * action for a held device releases the held job first, so per-device order
+ * is kept. Owned by the event loop thread.
+ *
+ * A held detach followed by an attach of the same device is a flap: the
+ * flap callback decides what is left of the pair.
+ */
+
+typedef void (*demi_coalesce_fn)(void *job);
+/* Return the job to go on with as a change, or NULL to cancel both */
+typedef void *(*demi_coalesce_flap_fn)(void *detach_job, void *attach_job);
+
+struct demi_coalesce;
+
+struct demi_coalesce_stats {
+    unsigned long pending;      /* jobs held back right now */
+    unsigned long absorbed;     /* jobs replaced by a later one */
+    unsigned long delayed;      /* jobs released when their window ran out */
+    unsigned long flaps;        /* detach + attach pairs seen inside the window */
+};
+
+/* fire receives released jobs, discard the replaced ones */
+struct demi_coalesce *demi_coalesce_create(struct demi_loop *loop, demi_coalesce_fn fire,
+                                           demi_coalesce_fn discard);
+/* Hold events of this type for ms milliseconds; 0 (the default) passes them straight on */
+void demi_coalesce_set_window(struct demi_coalesce *c, enum demi_event_type type, unsigned long ms);
+/* Without a flap callback a re-attach just releases the held detach first */
+void demi_coalesce_set_flap(struct demi_coalesce *c, demi_coalesce_flap_fn flap);
+int demi_coalesce_submit(struct demi_coalesce *c, const char *key, enum demi_event_type type, void *job);
+void demi_coalesce_stats(const struct demi_coalesce *c, struct demi_coalesce_stats *st);
+/* Held jobs are discarded */
+void demi_coalesce_destroy(struct demi_coalesce *c);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef _DEMI_DEVQ_H_
+#define _DEMI_DEVQ_H_
+
+/*
+ * Per-device event serialization.
+ *
+ * Jobs submitted under the same key run strictly one after another in
+ * submission order, jobs with different keys run in parallel. A job whose
+ * device is idle is handed to the dispatch callback right away; otherwise it
+ * waits in the device's FIFO until the running job reports completion.
+ * Event loop thread only.
+ */
+
+typedef void (*demi_devq_fn)(void *job);
+
+struct demi_devq;
+
+struct demi_devq_stats {
+    unsigned long devices;      /* devices with a running job */
+    unsigned long waiting;      /* jobs queued behind a running job */
+    unsigned long max_waiting;  /* longest single-device backlog seen */
+    unsigned long deferred;     /* jobs that had to wait at all */
+};
+
+struct demi_devq *demi_devq_create(demi_devq_fn dispatch);
+void demi_devq_destroy(struct demi_devq *q, demi_devq_fn discard);
+
+int demi_devq_submit(struct demi_devq *q, const char *key, void *job);
+
+/*
+ * Report that the running job for key finished. Returns the next job for
+ * the same device, which the caller runs itself, or NULL if the device is
+ * idle again.
+ */
+void *demi_devq_done(struct demi_devq *q, const char *key);
+
+void demi_devq_stats(struct demi_devq *q, struct demi_devq_stats *st);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef _DEMI_EXPORTER_H_
+#define _DEMI_EXPORTER_H_
+
+#include <stdio.h>
+
+#include "demi_loop.h"
+
+/*
+ * Metrics exporter. Serves whatever the render callback writes on a local
+ * Unix stream socket, and can dump the same text to a file for
+ * node_exporter's textfile collector.
+ *
+ * A client that sends an HTTP request (curl --unix-socket) gets an HTTP
+ * response once its headers are in; one that sends nothing and shuts down
+ * its side, or stays silent for a second, gets the bare text. Each
+ * connection is answered once and closed. Everything runs on the loop.
+ */
+
+struct demi_exporter;
+
+/* Write the exposition text to out */
+typedef void (*demi_exporter_fn)(FILE *out, void *arg);
+
+/* Listen on path, replacing a stale socket left there */
+struct demi_exporter *demi_exporter_create(struct demi_loop *loop, const char *path,
+                                           demi_exporter_fn render, void *arg);
+void demi_exporter_destroy(struct demi_exporter *e);
+
+/* Render into path through a temporary file and rename(), so readers never see half */
+int demi_exporter_write_file(const char *path, demi_exporter_fn render, void *arg);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef _DEMI_HIST_H_
+#define _DEMI_HIST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Log-linear histogram in the manner of HdrHistogram: values below
+ * 2^DEMI_HIST_SUB_BITS get a bucket each, every power of two above that is
+ * split into 2^(DEMI_HIST_SUB_BITS - 1) equal buckets, so any recorded value
+ * is known to within 1/16 (about 6%) at a fixed, allocation-free size. Values
+ * beyond 2^DEMI_HIST_MAX_BITS land in the last bucket.
+ */
+
+#define DEMI_HIST_SUB_BITS 5
+#define DEMI_HIST_MAX_BITS 40   /* in microseconds, about 12 days */
+#define DEMI_HIST_BUCKETS ((1 << DEMI_HIST_SUB_BITS) + \
+                           (DEMI_HIST_MAX_BITS - DEMI_HIST_SUB_BITS + 1) * (1 << (DEMI_HIST_SUB_BITS - 1)))
+
+struct demi_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[DEMI_HIST_BUCKETS];
+};
+
+void demi_hist_init(struct demi_hist *h);
+void demi_hist_add(struct demi_hist *h, uint64_t value);
+/* Add every count of from into h */
+void demi_hist_merge(struct demi_hist *h, const struct demi_hist *from);
+/* Smallest recorded value v with at least q of all values <= v, to bucket precision; 0 if empty */
+uint64_t demi_hist_quantile(const struct demi_hist *h, double q);
+/* Values in buckets lying wholly at or below value, e.g. for cumulative export */
+uint64_t demi_hist_count_le(const struct demi_hist *h, uint64_t value);
+/* Largest value that falls into bucket i */
+uint64_t demi_hist_bucket_upper(size_t i);
+
+#endif
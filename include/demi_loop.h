@@ -0,0 +1,57 @@
+#ifndef _DEMI_LOOP_H_
+#define _DEMI_LOOP_H_
+
+#include <sys/types.h>
+#include <sys/resource.h>
+
+/*
+ * Single-threaded event loop: readable or writable fds, signals, one-shot timers and
+ * child exits are all delivered as callbacks from demi_loop_run(). Built on
+ * epoll with signalfd/pidfd on Linux and kqueue on FreeBSD. Timers live on
+ * one timer wheel (demi_wheel.h) and cost no descriptor or kernel timer;
+ * the loop sleeps until the nearest deadline.
+ *
+ * Sources are owned by the loop. A timer or pid source is released after
+ * its callback has run; fd and signal sources stay until removed.
+ */
+
+struct demi_loop;
+struct demi_loop_source;
+
+typedef void (*demi_loop_fn)(void *arg);
+typedef void (*demi_loop_signal_fn)(int signo, void *arg);
+/*
+ * status is as returned by wait4(), or -1 if the child was reaped elsewhere;
+ * usage is its resource usage then, NULL in that case
+ */
+typedef void (*demi_loop_exit_fn)(pid_t pid, int status, const struct rusage *usage, void *arg);
+
+/* Blocks SIGCHLD in the calling thread; create before starting other threads */
+struct demi_loop *demi_loop_create(void);
+void demi_loop_free(struct demi_loop *loop);
+
+struct demi_loop_source *demi_loop_add_fd(struct demi_loop *loop, int fd, demi_loop_fn fn, void *arg);
+/* Call fn whenever fd is writable; an fd has one fd source at a time */
+struct demi_loop_source *demi_loop_add_fd_writable(struct demi_loop *loop, int fd, demi_loop_fn fn, void *arg);
+/* Stop or resume polling an fd source, e.g. for backpressure */
+int demi_loop_pause(struct demi_loop *loop, struct demi_loop_source *src, int paused);
+
+/* Blocks signo and delivers it through the loop instead */
+struct demi_loop_source *demi_loop_add_signal(struct demi_loop *loop, int signo,
+                                              demi_loop_signal_fn fn, void *arg);
+
+/* Call fn once after ms milliseconds */
+struct demi_loop_source *demi_loop_add_timer(struct demi_loop *loop, unsigned long ms,
+                                             demi_loop_fn fn, void *arg);
+
+/* Reap child pid when it exits and report its status */
+struct demi_loop_source *demi_loop_add_pid(struct demi_loop *loop, pid_t pid,
+                                           demi_loop_exit_fn fn, void *arg);
+
+/* Safe to call from any callback, including for the source being dispatched */
+void demi_loop_remove(struct demi_loop *loop, struct demi_loop_source *src);
+
+int demi_loop_run(struct demi_loop *loop);
+void demi_loop_stop(struct demi_loop *loop);
+
+#endif
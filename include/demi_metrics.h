@@ -0,0 +1,79 @@
+#ifndef _DEMI_METRICS_H_
+#define _DEMI_METRICS_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "demi_hist.h"
+
+/*
+ * Pipeline counters and latency histograms, written out in the Prometheus
+ * text exposition format.
+ *
+ * Counters are sharded per thread: the first count a thread makes gives it
+ * its own cache-line-aligned block, and from then on it only ever writes
+ * that block, so counting takes no lock and never bounces a line between
+ * cores. Readers sum the blocks. Blocks outlive their threads so no count
+ * is lost. Latency histograms are fed and read on the event loop thread.
+ */
+
+enum demi_counter {
+    DEMI_CNT_EVENTS_ATTACH,     /* events received, by action */
+    DEMI_CNT_EVENTS_DETACH,
+    DEMI_CNT_EVENTS_CHANGE,
+    DEMI_CNT_EVENTS_OTHER,
+    DEMI_CNT_SPAWNS,            /* helper runs started, any way */
+    DEMI_CNT_SPAWN_FAILURES,    /* helpers that could not be started */
+    DEMI_CNT_HELPER_FAILURES,   /* failed with no retry left */
+    DEMI_CNT_TIMEOUTS,          /* sent SIGTERM for running too long */
+    DEMI_CNT_KILLS,             /* and then SIGKILL */
+    DEMI_CNT_RETRIES,
+    DEMI_CNT_LOCK_WAITS_DEVQ,   /* events held behind their device's running helper */
+    DEMI_CNT_LOCK_WAITS_PLUGIN, /* plugin mutex found held */
+    DEMI_COUNTER_COUNT
+};
+
+enum demi_latency {
+    DEMI_LAT_START,             /* event received to helper started */
+    DEMI_LAT_EXIT,              /* event received to helper finished */
+    DEMI_LATENCY_COUNT
+};
+
+void demi_metrics_add(enum demi_counter c, uint64_t n);
+uint64_t demi_metrics_get(enum demi_counter c);
+
+static inline void demi_metrics_inc(enum demi_counter c)
+{
+    demi_metrics_add(c, 1);
+}
+
+/* pthread_mutex_lock() that counts the times the mutex was already held */
+static inline void demi_metrics_lock(pthread_mutex_t *m, enum demi_counter c)
+{
+    if (pthread_mutex_trylock(m) != 0) {
+        demi_metrics_inc(c);
+        pthread_mutex_lock(m);
+    }
+}
+
+/* Event loop thread only */
+void demi_metrics_latency(enum demi_latency l, uint64_t us);
+
+/* The built-in counters and latency histograms */
+void demi_metrics_write(FILE *out);
+
+/*
+ * Exposition helpers. Metric names get the "devd_watcher_" prefix; labels
+ * is the inside of the braces, e.g. "action=\"attach\"", or NULL.
+ */
+void demi_prom_family(FILE *out, const char *name, const char *type, const char *help);
+void demi_prom_sample(FILE *out, const char *name, const char *labels, uint64_t value);
+/* A sample of microseconds, exported in seconds */
+void demi_prom_seconds(FILE *out, const char *name, const char *labels, uint64_t us);
+/* Copy a label value with '\\', '"' and newlines escaped */
+void demi_prom_escape(char *out, size_t size, const char *value);
+/* A histogram of microseconds, exported in seconds */
+void demi_prom_hist(FILE *out, const char *name, const char *labels, const struct demi_hist *h);
+
+#endif
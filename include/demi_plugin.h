@@ -0,0 +1,66 @@
+#ifndef _DEMI_PLUGIN_H_
+#define _DEMI_PLUGIN_H_
+
+#include "demi.h"
+#include "demi_loop.h"
+
+/*
+ * Native action plugins.
+ *
+ * A plugin is a shared object exporting
+ *
+ *     DEMI_PLUGIN_EXPORT_ABI;
+ *     int on_event(const struct demi_event *de, const char *devnode);
+ *
+ * which handles one event the way the action's helper would and returns 0,
+ * a failure status, or DEMI_PLUGIN_FALLBACK to have the helper run after
+ * all. The event and devnode are valid for the duration of the call only.
+ * A plugin built against another DEMI_PLUGIN_ABI, or without the marker,
+ * is refused: struct demi_event is shared with it as is.
+ * An optional "int on_load(void)" runs once after loading; nonzero refuses
+ * the plugin. The daemon is linked with -rdynamic, so plugins can use the
+ * demi_event accessors from demi.h.
+ *
+ * Calls are made one at a time on the daemon's plugin thread, never on the
+ * event loop. A call that outlives the time budget is logged; the calls
+ * queued behind it are handed back with DEMI_PLUGIN_FALLBACK, and until it
+ * returns no plugin is ready and every action's events go to its helper.
+ */
+
+#define DEMI_PLUGIN_ABI 1
+/* Records the ABI a plugin was built for; put it in one of its source files */
+#define DEMI_PLUGIN_EXPORT_ABI const unsigned int demi_plugin_abi = DEMI_PLUGIN_ABI
+#define DEMI_PLUGIN_FALLBACK (-1)
+
+typedef int (*demi_plugin_event_fn)(const struct demi_event *de, const char *devnode);
+
+/* ---- daemon side ---- */
+
+/* status is what on_event returned */
+typedef void (*demi_plugins_fn)(int status, void *arg);
+
+struct demi_plugins;
+
+struct demi_plugins_stats {
+    unsigned long calls;
+    unsigned long fallbacks;    /* DEMI_PLUGIN_FALLBACK returned */
+    unsigned long overruns;     /* calls that outlived the budget */
+    unsigned long latency_avg_us;
+    unsigned long latency_max_us;
+};
+
+struct demi_plugins *demi_plugins_create(struct demi_loop *loop, unsigned long budget_ms);
+int demi_plugins_load(struct demi_plugins *p, enum demi_event_type type, const char *path);
+/* A plugin is loaded for type and is not stuck over its budget */
+int demi_plugins_ready(const struct demi_plugins *p, enum demi_event_type type);
+/* de is copied; whatever its de_buf points to must stay valid until done runs */
+int demi_plugins_call(struct demi_plugins *p, enum demi_event_type type, const struct demi_event *de,
+                      const char *devnode, demi_plugins_fn done, void *arg);
+void demi_plugins_stats(const struct demi_plugins *p, struct demi_plugins_stats *st);
+/*
+ * Waits for the call in progress unless it is over budget, in which case
+ * the worker is left running; queued calls are not reported
+ */
+void demi_plugins_destroy(struct demi_plugins *p);
+
+#endif
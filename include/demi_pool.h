@@ -0,0 +1,53 @@
+#ifndef _DEMI_POOL_H_
+#define _DEMI_POOL_H_
+
+/*
+ * Bounded set of helper slots fed by a queue.
+ *
+ * Owned by the event loop thread. A submitted job is started right away
+ * through the start callback if a slot is free, otherwise it waits in the
+ * queue; when a started job finishes, demi_pool_done() frees its slot and
+ * starts the oldest queued job. When the queue is full the overflow policy
+ * decides what happens to the new job.
+ */
+
+enum demi_pool_overflow {
+    DEMI_POOL_BLOCK,        /* keep the job, report full so the caller stops feeding */
+    DEMI_POOL_DROP_OLDEST,  /* discard the oldest queued job */
+    DEMI_POOL_SPILL,        /* queue it anyway, growing the queue past capacity */
+};
+
+typedef void (*demi_pool_fn)(void *job);
+/* Return 0 if the job is running and holds a slot, -1 if it ended already */
+typedef int (*demi_pool_start_fn)(void *job);
+
+struct demi_pool;
+
+struct demi_pool_stats {
+    unsigned long depth;        /* jobs waiting for a slot */
+    unsigned long high_water;   /* largest depth seen */
+    unsigned long submitted;
+    unsigned long processed;    /* jobs started and finished */
+    unsigned long dropped;
+    unsigned long spilled;
+    unsigned int slots;
+    unsigned int running;       /* slots in use right now */
+    double utilisation;         /* busy slot fraction since the previous snapshot */
+};
+
+struct demi_pool *demi_pool_create(unsigned int slots, unsigned int capacity,
+                                   enum demi_pool_overflow overflow,
+                                   demi_pool_start_fn start, demi_pool_fn discard);
+int demi_pool_submit(struct demi_pool *pool, void *job);
+/* A started job finished; starts queued jobs while slots are free */
+void demi_pool_done(struct demi_pool *pool);
+/* Block policy: the queue is at capacity and the caller should stop submitting */
+int demi_pool_full(const struct demi_pool *pool);
+void demi_pool_stats(struct demi_pool *pool, struct demi_pool_stats *st);
+/* Discards queued jobs; running jobs stay with the caller */
+void demi_pool_destroy(struct demi_pool *pool);
+
+int demi_pool_overflow_parse(const char *name, enum demi_pool_overflow *out);
+const char *demi_pool_overflow_name(enum demi_pool_overflow overflow);
+
+#endif
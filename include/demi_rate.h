@@ -0,0 +1,25 @@
+#ifndef _DEMI_RATE_H_
+#define _DEMI_RATE_H_
+
+/*
+ * Sliding-window event rate: counts land in DEMI_RATE_SLOTS slots covering
+ * the last second, and slots older than that are dropped as time moves on.
+ * Times are monotonic milliseconds supplied by the caller.
+ */
+
+#define DEMI_RATE_SLOTS 10
+
+struct demi_rate {
+    unsigned long count[DEMI_RATE_SLOTS];
+    unsigned long long slot_start;      /* ms at which the newest slot began */
+    unsigned int newest;
+};
+
+void demi_rate_init(struct demi_rate *r, unsigned long long now_ms);
+void demi_rate_add(struct demi_rate *r, unsigned long long now_ms, unsigned long n);
+/* Events seen during the last second */
+unsigned long demi_rate_get(struct demi_rate *r, unsigned long long now_ms);
+
+unsigned long long demi_rate_now_ms(void);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef _DEMI_RESIDENT_H_
+#define _DEMI_RESIDENT_H_
+
+#include <stddef.h>
+
+#include "demi_loop.h"
+
+/*
+ * Resident helper: started once and fed event records on its stdin instead
+ * of being run per event. Each record is
+ *
+ *     EVENT <seq>\n
+ *     KEY=value\n ...
+ *     \n
+ *
+ * and is acknowledged by a "<seq> <status>\n" line on the helper's stdout,
+ * in any order. At most max_inflight records are outstanding; further ones
+ * wait here, so a helper that lags behind holds its callers' jobs open.
+ *
+ * A helper that exits is restarted (after a second if it did not stay up
+ * that long); records it had not acknowledged are reported with status -1,
+ * records not yet sent go to the new instance.
+ */
+
+/* status is what the helper acknowledged, -1 if it died first */
+typedef void (*demi_resident_fn)(int status, void *arg);
+
+struct demi_resident;
+
+struct demi_resident_stats {
+    unsigned long sent;
+    unsigned long acked;
+    unsigned long lost;         /* reported with status -1 */
+    unsigned long restarts;
+    unsigned long inflight;     /* sent, not acknowledged */
+    unsigned long waiting;      /* not sent yet */
+    unsigned long latency_avg_us;
+    unsigned long latency_max_us;
+};
+
+/* The helper leads its own process group; kill_grace_ms is from SIGTERM to SIGKILL */
+struct demi_resident *demi_resident_create(struct demi_loop *loop, const char *path,
+                                           unsigned int max_inflight, unsigned long kill_grace_ms);
+/* body is "KEY=value\n" lines; the framing is added here */
+int demi_resident_submit(struct demi_resident *r, const char *body, size_t len,
+                         demi_resident_fn done, void *arg);
+/*
+ * Give up on the record submitted with arg: it is reported with status -1.
+ * If the helper already has it, the helper is hung: its process group gets
+ * SIGTERM, then SIGKILL after the grace period, and it is restarted once
+ * reaped. Its other unacknowledged records are lost with it.
+ */
+int demi_resident_expire(struct demi_resident *r, void *arg);
+void demi_resident_stats(const struct demi_resident *r, struct demi_resident_stats *st);
+/* Closes the helper's stdin; outstanding records are not reported */
+void demi_resident_destroy(struct demi_resident *r);
+
+#endif
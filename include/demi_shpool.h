@@ -0,0 +1,49 @@
+#ifndef _DEMI_SHPOOL_H_
+#define _DEMI_SHPOOL_H_
+
+#include <stddef.h>
+
+#include "demi_loop.h"
+
+/*
+ * Warm shells for /bin/sh helpers. A few sh processes are kept running;
+ * each helper run is written to an idle one as a subshell that sets the
+ * positional parameters and sources the helper script, so no interpreter
+ * starts per event. The subshell's exit status comes back framed on a
+ * separate status pipe, leaving the helper's own stdout and stderr alone.
+ *
+ * Helpers see "sh" in $0 instead of their path. A shell that dies is
+ * restarted, a second later if it had been up for less than that; the run
+ * it was busy with is reported with status -1.
+ */
+
+/* exit_code is the helper's exit status, -1 if its shell died */
+typedef void (*demi_shpool_fn)(int exit_code, void *arg);
+
+struct demi_shpool;
+
+struct demi_shpool_stats {
+    unsigned int shells;
+    unsigned int busy;
+    unsigned long runs;
+    unsigned long restarts;     /* shells that died and were replaced */
+};
+
+struct demi_shpool *demi_shpool_create(struct demi_loop *loop, unsigned int shells);
+/*
+ * Source script with devnodes as $1.. and the nenv "NAME=value" pairs in env
+ * exported; -1 with EAGAIN when every shell is busy
+ */
+int demi_shpool_run(struct demi_shpool *pool, const char *script, const char *const *devnodes,
+                    size_t count, char *const *env, size_t nenv, demi_shpool_fn done, void *arg);
+/*
+ * Signal the process group of the shell running the job started with arg
+ * and return the group's id; the shell goes with it, is replaced, and the
+ * run is reported as lost
+ */
+int demi_shpool_kill(struct demi_shpool *pool, void *arg, int signo);
+void demi_shpool_stats(const struct demi_shpool *pool, struct demi_shpool_stats *st);
+/* Shells are told to exit; runs in progress are not reported */
+void demi_shpool_destroy(struct demi_shpool *pool);
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef _DEMI_SPAWN_H_
+#define _DEMI_SPAWN_H_
+
+#include <spawn.h>
+#include <sys/types.h>
+
+#include "demi_zygote.h"
+
+/*
+ * Helper launcher. The helper directory is resolved once, each action's
+ * helper is looked up in it and executed directly with posix_spawn, without
+ * going through /bin/sh, as the leader of a new process group. Changes to
+ * the directory are picked up by demi_helpers_reload() once
+ * demi_helpers_watch_fd() reports them.
+ */
+
+int demi_helpers_init(const char *dir);
+int demi_helpers_reload(void);
+/* Readable when the helper directory changed; drain it, then reload. -1 if not watched */
+int demi_helpers_watch_fd(void);
+void demi_helpers_cleanup(void);
+
+/*
+ * Start one helper for action with every devnode (possibly none) as an
+ * argument; envp NULL passes the daemon's environment
+ */
+int demi_helper_spawn_batch(const char *action, const char *const *devnodes, size_t count,
+                            char *const *envp, pid_t *pid);
+
+/* Same, through the fork server; the outcome arrives through its callbacks */
+int demi_helper_spawn_zygote(const char *action, const char *const *devnodes, size_t count,
+                             char *const *envp, demi_zygote_started_fn started,
+                             demi_zygote_fn exited, void *arg);
+
+/*
+ * Helper environment for an event: each NUL-terminated "KEY=value" in keys
+ * as DEMI_<KEY>=value (upper case, other characters as '_'), followed by the
+ * daemon's environment. The first *count entries are the event's. Built in
+ * a single allocation; free() it.
+ */
+char **demi_helper_env(const char *keys, size_t keys_len, size_t *count);
+
+/*
+ * Attributes every helper process starts with, however it is launched: no
+ * blocked signals, default handlers, and a process group of its own so a
+ * timeout can stop whatever it started. posix_spawnattr_destroy() it.
+ */
+int demi_helper_spawnattr(posix_spawnattr_t *attr);
+
+/*
+ * Channels to a long-lived helper: in[] a socket for its stdin, out[] a pipe
+ * it reports on. All close-on-exec; out[0] is nonblocking.
+ */
+int demi_helper_channel(int in[2], int out[2]);
+
+/* Copy the helper's path; returns 1 if it is a /bin/sh script, 0 if not */
+int demi_helper_script(const char *action, char *path, size_t size);
+
+/* Platform directory watcher: returns a pollable fd, drain returns 1 on change */
+int demi_watch_open(const char *dir);
+int demi_watch_drain(int fd);
+
+#endif
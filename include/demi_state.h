@@ -0,0 +1,29 @@
+#ifndef _DEMI_STATE_H_
+#define _DEMI_STATE_H_
+
+/*
+ * Set of device names believed to be present.
+ *
+ * Seeded from demi_scan() at startup and kept current from attach/detach
+ * events. After lost events a fresh scan is diffed against it to synthesize
+ * the attaches and detaches that were missed. Not thread-safe; the event
+ * loop owns it.
+ */
+
+struct demi_devset;
+
+typedef void (*demi_devset_fn)(const char *devname, void *arg);
+
+struct demi_devset *demi_devset_create(void);
+void demi_devset_free(struct demi_devset *s);
+
+/* Return 1 if added, 0 if already present, -1 on error */
+int demi_devset_add(struct demi_devset *s, const char *devname);
+/* Return 1 if removed, 0 if absent */
+int demi_devset_remove(struct demi_devset *s, const char *devname);
+int demi_devset_contains(const struct demi_devset *s, const char *devname);
+unsigned long demi_devset_count(const struct demi_devset *s);
+
+void demi_devset_foreach(const struct demi_devset *s, demi_devset_fn fn, void *arg);
+
+#endif
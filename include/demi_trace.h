@@ -0,0 +1,83 @@
+#ifndef _DEMI_TRACE_H_
+#define _DEMI_TRACE_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include "demi.h"
+
+/*
+ * Per-event tracing. Every event carries a CLOCK_MONOTONIC time for each
+ * enum demi_stage it reached; once its helper is done the daemon appends
+ * one fixed-size record per event to the trace file. trace2json turns the
+ * file into Chrome trace-event JSON for chrome://tracing or Perfetto.
+ *
+ * The file is a header followed by records, in host byte order. A header
+ * is written each time the file is opened, so a file appended to across
+ * restarts stays readable. Writing is buffered and happens on the event
+ * loop thread only.
+ *
+ * The same stages are USDT probes (provider devd_watcher) when built on
+ * Linux with <sys/sdt.h> available, e.g.
+ *
+ *   bpftrace -e 'usdt:./devd-watcher:devd_watcher:exited { @[str(arg1)] = hist(arg2); }'
+ */
+
+#define DEMI_TRACE_MAGIC "DEMITRC1"
+
+struct demi_trace_header {
+    char dth_magic[8];
+    uint32_t dth_record_size;
+    uint32_t dth_stages;            /* DEMI_STAGE_COUNT */
+    int64_t dth_realtime_ns;        /* CLOCK_REALTIME minus CLOCK_MONOTONIC when opened */
+};
+
+struct demi_trace_record {
+    uint64_t dtr_seqnum;            /* 0 if none, e.g. an event made up by a resync */
+    uint64_t dtr_stage_ns[DEMI_STAGE_COUNT];    /* CLOCK_MONOTONIC, 0 if not reached */
+    int32_t dtr_pid;                /* helper process group, 0 if none */
+    uint16_t dtr_type;              /* enum demi_event_type */
+    uint16_t dtr_attempt;           /* retries before the run that finished */
+    uint16_t dtr_batch;             /* devices the helper ran for */
+    uint16_t dtr_failed;
+    char dtr_devname[36];           /* first 35 bytes of the name, NUL-terminated */
+};
+
+static inline unsigned long long demi_trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+/* Append to path; the previous file, if any, is closed */
+int demi_trace_open(const char *path);
+/* Reopen the same path, after it was rotated */
+void demi_trace_reopen(void);
+void demi_trace_close(void);
+int demi_trace_enabled(void);
+void demi_trace_write(const struct demi_trace_record *r);
+void demi_trace_flush(void);
+
+/*
+ * USDT probes. Arguments are the SEQNUM and device name, then per probe:
+ * received the kernel's receive time, filtered whether the device is
+ * allowed, spawned the helper's pid, exited whether it failed. Define
+ * DEMI_NO_SDT to leave them out.
+ */
+#if !defined(DEMI_NO_SDT) && defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define DEMI_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef DEMI_HAVE_SDT
+#define DEMI_PROBE2(name, a1, a2) DTRACE_PROBE2(devd_watcher, name, a1, a2)
+#define DEMI_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(devd_watcher, name, a1, a2, a3)
+#else
+#define DEMI_PROBE2(name, a1, a2) ((void)(a1), (void)(a2))
+#define DEMI_PROBE3(name, a1, a2, a3) ((void)(a1), (void)(a2), (void)(a3))
+#endif
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef _DEMI_WHEEL_H_
+#define _DEMI_WHEEL_H_
+
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel: DEMI_WHEEL_LEVELS levels of DEMI_WHEEL_SLOTS
+ * slots, one millisecond per level-0 slot and each level's slot spanning a
+ * whole turn of the one below. Timers are intrusive and sit on a slot's
+ * list, so adding and cancelling are O(1); a slot of an upper level is
+ * spread over the lower ones when time reaches it. Deadlines past the top
+ * level wait in its last slot and are placed again from there.
+ *
+ * Times are monotonic milliseconds supplied by the caller. Nothing here
+ * allocates or sleeps; the caller waits for demi_wheel_timeout() and then
+ * calls demi_wheel_expire().
+ */
+
+#define DEMI_WHEEL_BITS 6
+#define DEMI_WHEEL_SLOTS (1 << DEMI_WHEEL_BITS)
+#define DEMI_WHEEL_LEVELS 4     /* 64^4 ms, about 4.6 hours */
+
+struct demi_wheel_timer {
+    struct demi_wheel_timer *prev;
+    struct demi_wheel_timer *next;
+    uint64_t expires;
+    int level;          /* -1 while not on a slot */
+    int slot;
+};
+
+struct demi_wheel {
+    uint64_t now;       /* next millisecond not yet expired */
+    uint64_t occupied[DEMI_WHEEL_LEVELS];   /* bit per non-empty slot */
+    unsigned long count;
+    struct demi_wheel_timer slots[DEMI_WHEEL_LEVELS][DEMI_WHEEL_SLOTS];
+};
+
+typedef void (*demi_wheel_fn)(struct demi_wheel_timer *t, void *arg);
+
+void demi_wheel_init(struct demi_wheel *w, uint64_t now_ms);
+/* t must not be pending; a deadline already past expires on the next call */
+void demi_wheel_add(struct demi_wheel *w, struct demi_wheel_timer *t, uint64_t expires_ms);
+/* No-op for a timer that is not pending */
+void demi_wheel_cancel(struct demi_wheel *w, struct demi_wheel_timer *t);
+int demi_wheel_pending(const struct demi_wheel_timer *t);
+
+/*
+ * Milliseconds until the wheel next needs demi_wheel_expire(), -1 if no
+ * timer is pending. May be earlier than the nearest deadline when an upper
+ * slot has to be spread out first, never later.
+ */
+long demi_wheel_timeout(const struct demi_wheel *w, uint64_t now_ms);
+/*
+ * Call fn for every timer due by now_ms, in deadline order. Each is taken
+ * off the wheel before its call, which may add or cancel any timer.
+ * Returns how many fired.
+ */
+unsigned long demi_wheel_expire(struct demi_wheel *w, uint64_t now_ms, demi_wheel_fn fn, void *arg);
+
+#endif
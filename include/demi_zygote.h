@@ -0,0 +1,49 @@
+#ifndef _DEMI_ZYGOTE_H_
+#define _DEMI_ZYGOTE_H_
+
+#include <sys/types.h>
+#include <sys/resource.h>
+
+/*
+ * Fork server. A small process forked at startup, before the daemon has
+ * threads or much memory, starts helpers on request and reports how they
+ * ended, so spawn cost does not grow with the daemon.
+ *
+ * Requests and reports travel over a SOCK_SEQPACKET socketpair. The daemon
+ * watches demi_zygote_fd() and calls demi_zygote_dispatch() when it is
+ * readable; helpers are children of the zygote, not of the daemon. The
+ * daemon's end never blocks: requests the socket will not take yet are
+ * queued, and while demi_zygote_queued() the daemon calls
+ * demi_zygote_flush() whenever demi_zygote_write_fd() is writable.
+ */
+
+/*
+ * pid is -1 and status the errno if the helper could not be started;
+ * otherwise status is as returned by wait4() and usage is the helper's
+ * resource usage. usage is NULL when the helper did not start or was lost.
+ */
+typedef void (*demi_zygote_fn)(pid_t pid, int status, const struct rusage *usage, void *arg);
+/* The helper is running */
+typedef void (*demi_zygote_started_fn)(pid_t pid, void *arg);
+
+/* Fork the zygote; call before any thread is created */
+int demi_zygote_start(void);
+int demi_zygote_fd(void);
+/* The same socket under another descriptor, to poll for writing separately */
+int demi_zygote_write_fd(void);
+int demi_zygote_queued(void);
+/* Send what the socket takes now; -1 if it failed, the rest stays queued */
+int demi_zygote_flush(void);
+/* Ask the zygote to run path with argv (NULL-terminated); envp NULL keeps its environment */
+int demi_zygote_spawn(const char *path, char *const argv[], char *const envp[],
+                      demi_zygote_started_fn started, demi_zygote_fn exited, void *arg);
+/*
+ * Read the zygote's reports and run the callbacks. Returns -1 with
+ * ECONNRESET once the zygote is gone; helpers it had started are then
+ * killed with their process groups and reported as killed by SIGKILL,
+ * and requests not yet started as failed with ECONNRESET.
+ */
+int demi_zygote_dispatch(void);
+void demi_zygote_stop(void);
+
+#endif
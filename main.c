@@ -1,17 +1,33 @@
 #include "include/demi.h"
+#include "demi_internal.h"   /* DEMI_CLOEXEC, DEMI_NONBLOCK */
+#include "include/demi_acct.h"
+#include "include/demi_coalesce.h"
+#include "include/demi_devq.h"
+#include "include/demi_exporter.h"
+#include "include/demi_loop.h"
+#include "include/demi_metrics.h"
+#include "include/demi_plugin.h"
+#include "include/demi_pool.h"
+#include "include/demi_rate.h"
+#include "include/demi_resident.h"
+#include "include/demi_shpool.h"
+#include "include/demi_spawn.h"
+#include "include/demi_state.h"
+#include "include/demi_trace.h"
+#include "include/demi_zygote.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <pthread.h>
 #include <string.h>
 #include <limits.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <time.h>
-#include <sys/file.h>
 #include <getopt.h>
 #include <syslog.h>
+#include <sys/wait.h>
+#include <signal.h>
 
 #ifndef DEMI_PLATFORM_FREEBSD
 #ifdef __FreeBSD__
@@ -19,29 +35,201 @@
 #endif
 #endif
 
-#ifndef DEMI_LOCK_TIMEOUT_SECONDS
-#define DEMI_LOCK_TIMEOUT_SECONDS 5
+#ifndef DEMI_WORKERS
+#define DEMI_WORKERS 4
 #endif
 
+#ifndef DEMI_QUEUE_SIZE
+#define DEMI_QUEUE_SIZE 1024
+#endif
+
+#ifndef DEMI_BATCH_SIZE
+#define DEMI_BATCH_SIZE 64
+#endif
+
+#ifndef DEMI_RESIDENT_INFLIGHT
+#define DEMI_RESIDENT_INFLIGHT 16
+#endif
+
+#ifndef DEMI_PLUGIN_BUDGET_MS
+#define DEMI_PLUGIN_BUDGET_MS 100
+#endif
+
+#ifndef DEMI_KILL_GRACE_MS
+#define DEMI_KILL_GRACE_MS 5000
+#endif
+
+#ifndef DEMI_RETRY_BACKOFF_MS
+#define DEMI_RETRY_BACKOFF_MS 1000
+#endif
+
+#ifndef DEMI_METRICS_TEXTFILE_INTERVAL_SECONDS
+#define DEMI_METRICS_TEXTFILE_INTERVAL_SECONDS 15
+#endif
+
+#ifndef DEMI_TRACE_FLUSH_MS
+#define DEMI_TRACE_FLUSH_MS 1000
+#endif
+
+#ifndef DEMI_RETRY_BACKOFF_MAX_MS
+#define DEMI_RETRY_BACKOFF_MAX_MS 60000
+#endif
+
+#ifndef DEMI_STORM_SETTLE_MS
+#define DEMI_STORM_SETTLE_MS 2000
+#endif
+
+#ifndef DEMI_RCVBUF_BYTES
+#define DEMI_RCVBUF_BYTES (16 * 1024 * 1024)
+#endif
+
+#if defined(DEMI_PLATFORM_LINUX) || defined(MI_PLATFORM_LINUX)
+#define DEMI_PLATFORM_NAME "linux"
+#elif defined(DEMI_PLATFORM_FREEBSD) || defined(MI_PLATFORM_FREEBSD)
+#define DEMI_PLATFORM_NAME "freebsd"
+#else
+#define DEMI_PLATFORM_NAME "unknown"
+#endif
+
+#define DEMI_HELPER_DIR "helpers/" DEMI_PLATFORM_NAME
+
 struct helper_args {
-    char *command;
+    const char *action;
+    enum demi_event_type type;
+    struct helper_args *batch_next;     /* further devices run by the same helper */
+    char *keys;                 /* the event's KEY=value pairs, each NUL-terminated */
+    size_t keys_len;
+    int plugin_declined;        /* the plugin asked for the shell helper */
+    pid_t pid;                  /* process group of the running helper, 0 if unknown */
+    int in_shell;               /* running in a warm shell */
+    int in_resident;            /* passed to a resident helper */
+    int kill_signal;            /* sent after a timeout, 0 if none */
+    unsigned int attempt;       /* retries so far */
+    struct demi_loop_source *timer;     /* timeout, kill escalation or retry */
+    unsigned long long seqnum;          /* its event's, 0 if synthesized */
+    unsigned long long stage_ns[DEMI_STAGE_COUNT];  /* CLOCK_MONOTONIC, see demi_trace.h */
+    unsigned long long started_us;      /* this attempt, for accounting */
+    struct rusage usage;
+    int has_usage;              /* usage is the reaped helper's */
+    char devnode[DEMI_DEVNAME_MAX + sizeof("/dev/")];
     char dev_basename[256];
 };
 
+/* Devices waiting to share one helper run, per action */
+struct helper_batch {
+    struct helper_args *head;
+    struct helper_args *tail;
+    unsigned int count;
+    struct demi_loop_source *timer;
+};
+
+struct storm_stats {
+    unsigned long storms;       /* times storm mode was entered */
+    unsigned long suppressed;   /* events that ran no helper during a storm */
+    unsigned long reconciles;   /* reconcile helpers started */
+};
+
+struct batch_stats {
+    unsigned long runs;         /* helpers started for more than one device */
+    unsigned long devices;      /* devices handled by those runs */
+    unsigned long largest;
+};
+
 struct config {
-    char *lock_dir;
-    int lock_timeout_seconds;
     char *allowed_devices;
     char *log_file;
+    char *helper_dir;
+    int workers;
+    int queue_size;
+    enum demi_pool_overflow queue_overflow;
+    int stats_interval_seconds;
+    int rcvbuf_bytes;
+    int seqnum_check;
+    char *event_actions;
+    char *event_subsystems;
+    unsigned long coalesce_ms[DEMI_RESYNC + 1];    /* per action, 0 = off */
+    int flap_to_change;         /* a cancelled detach/attach pair still runs change */
+    unsigned long batch_window_ms;  /* 0 = one helper per device */
+    unsigned int batch_size;
+    int batch_actions[DEMI_RESYNC + 1];
+    unsigned long storm_rate;   /* events per second that start a storm, 0 = off */
+    unsigned long storm_settle_ms;
+    int zygote;                 /* start helpers from a fork server */
+    unsigned int warm_shells;   /* sh processes kept for /bin/sh helpers, 0 = off */
+    int resident_actions[DEMI_RESYNC + 1];
+    unsigned int resident_inflight;
+    char *plugins[DEMI_RESYNC + 1];     /* shared object per action, NULL = helper only */
+    unsigned long timeout_ms[DEMI_RESYNC + 1];  /* per action, 0 = wait forever */
+    unsigned long kill_grace_ms;    /* from SIGTERM to SIGKILL */
+    unsigned int retry_limit;   /* runs after the first for a failing helper */
+    unsigned long retry_backoff_ms; /* before the first retry, doubled for each next one */
+    unsigned long plugin_budget_ms;
+    char *metrics_socket;       /* Prometheus text on this Unix socket, NULL = off */
+    char *metrics_textfile;     /* and/or dumped here for node_exporter */
+    int metrics_textfile_interval_seconds;
+    char *trace_file;           /* per-event stage timestamps, NULL = off */
 };
 
 static struct config g_config = {
-    .lock_dir = NULL,
-    .lock_timeout_seconds = DEMI_LOCK_TIMEOUT_SECONDS,
     .allowed_devices = NULL,
-    .log_file = NULL
+    .log_file = NULL,
+    .helper_dir = NULL,
+    .workers = DEMI_WORKERS,
+    .queue_size = DEMI_QUEUE_SIZE,
+    .queue_overflow = DEMI_POOL_BLOCK,
+    .stats_interval_seconds = 0,
+    .rcvbuf_bytes = DEMI_RCVBUF_BYTES,
+    .seqnum_check = 1,
+    .event_actions = NULL,
+    .event_subsystems = NULL,
+    .coalesce_ms = {0},
+    .flap_to_change = 0,
+    .batch_window_ms = 0,
+    .batch_size = DEMI_BATCH_SIZE,
+    .batch_actions = { [DEMI_ATTACH] = 1, [DEMI_DETACH] = 1, [DEMI_CHANGE] = 1 },
+    .storm_rate = 0,
+    .storm_settle_ms = DEMI_STORM_SETTLE_MS,
+    .zygote = 0,
+    .warm_shells = 0,
+    .resident_actions = {0},
+    .resident_inflight = DEMI_RESIDENT_INFLIGHT,
+    .plugins = {NULL},
+    .plugin_budget_ms = DEMI_PLUGIN_BUDGET_MS,
+    .timeout_ms = {0},
+    .kill_grace_ms = DEMI_KILL_GRACE_MS,
+    .retry_limit = 0,
+    .retry_backoff_ms = DEMI_RETRY_BACKOFF_MS,
+    .metrics_socket = NULL,
+    .metrics_textfile = NULL,
+    .metrics_textfile_interval_seconds = DEMI_METRICS_TEXTFILE_INTERVAL_SECONDS,
+    .trace_file = NULL
 };
 
+static struct demi_pool *g_pool = NULL;
+static struct demi_devq *g_devq = NULL;
+static struct demi_coalesce *g_coalesce = NULL;
+static struct helper_batch g_batches[DEMI_RESYNC + 1];
+static struct batch_stats g_batch_stats;
+static struct demi_rate g_event_rate;
+static int g_storm = 0;
+static unsigned long long g_storm_since;    /* ms the storm began */
+static unsigned long long g_storm_hot;      /* ms the rate was last above half the threshold */
+static unsigned long g_storm_suppressed;    /* suppressed count when the storm began */
+static struct storm_stats g_storm_stats;
+static struct demi_devset *g_devices = NULL;    /* devices believed present */
+static struct demi_loop *g_loop = NULL;
+static struct demi_loop_source *g_demi_src = NULL;
+static int g_demi_fd = -1;
+static int g_demi_paused = 0;
+static int g_stopping = 0;
+static struct demi_loop_source *g_zygote_src = NULL;
+static struct demi_loop_source *g_zygote_write_src = NULL;     /* while requests are queued */
+static struct demi_shpool *g_shpool = NULL;
+static struct demi_resident *g_resident[DEMI_RESYNC + 1];  /* may share one handler */
+static struct demi_plugins *g_plugins = NULL;
+static struct demi_acct *g_acct = NULL;
+static struct demi_exporter *g_exporter = NULL;
+
 static void trim_whitespace(char *str) {
     char *end = str + strlen(str) - 1;
     while (end > str && (*end == ' ' || *end == '\t' || *end == '\n' || *end == '\r')) {
@@ -63,8 +251,10 @@ static int parse_config_file(const char *config_path) {
         return -1;
     }
 
-    char line[512];
-    while (fgets(line, sizeof(line), file)) {
+    // Lines are read whole: per-serial allowlists easily exceed any fixed buffer
+    char *line = NULL;
+    size_t line_cap = 0;
+    while (getline(&line, &line_cap, file) != -1) {
         // Skip comments and empty lines
         if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') {
             continue;
@@ -92,171 +282,1353 @@ static int parse_config_file(const char *config_path) {
         }
 
         // Parse configuration parameters
-        if (strcmp(key, "DEMI_LOCK_DIR") == 0) {
-            free(g_config.lock_dir);
-            g_config.lock_dir = strdup(value);
-        } else if (strcmp(key, "DEMI_LOCK_TIMEOUT_SECONDS") == 0) {
-            g_config.lock_timeout_seconds = atoi(value);
-            if (g_config.lock_timeout_seconds <= 0) {
-                g_config.lock_timeout_seconds = DEMI_LOCK_TIMEOUT_SECONDS;
-            }
-        } else if (strcmp(key, "DEMI_ALLOWED_DEVICES") == 0) {
+        if (strcmp(key, "DEMI_ALLOWED_DEVICES") == 0) {
             free(g_config.allowed_devices);
             g_config.allowed_devices = strdup(value);
         } else if (strcmp(key, "DEMI_LOG_FILE") == 0) {
             free(g_config.log_file);
             g_config.log_file = strdup(value);
+        } else if (strcmp(key, "DEMI_HELPER_DIR") == 0) {
+            free(g_config.helper_dir);
+            g_config.helper_dir = strdup(value);
+        } else if (strcmp(key, "DEMI_WORKERS") == 0) {
+            g_config.workers = atoi(value);
+            if (g_config.workers <= 0) {
+                g_config.workers = DEMI_WORKERS;
+            }
+        } else if (strcmp(key, "DEMI_QUEUE_SIZE") == 0) {
+            g_config.queue_size = atoi(value);
+            if (g_config.queue_size <= 0) {
+                g_config.queue_size = DEMI_QUEUE_SIZE;
+            }
+        } else if (strcmp(key, "DEMI_QUEUE_OVERFLOW") == 0) {
+            if (demi_pool_overflow_parse(value, &g_config.queue_overflow) == -1) {
+                fprintf(stderr, "unknown DEMI_QUEUE_OVERFLOW '%s', using block\n", value);
+                g_config.queue_overflow = DEMI_POOL_BLOCK;
+            }
+        } else if (strcmp(key, "DEMI_STATS_INTERVAL_SECONDS") == 0) {
+            g_config.stats_interval_seconds = atoi(value);
+            if (g_config.stats_interval_seconds < 0) {
+                g_config.stats_interval_seconds = 0;
+            }
+        } else if (strcmp(key, "DEMI_RCVBUF_BYTES") == 0) {
+            g_config.rcvbuf_bytes = atoi(value);
+            if (g_config.rcvbuf_bytes < 0) {
+                g_config.rcvbuf_bytes = 0;
+            }
+        } else if (strcmp(key, "DEMI_EVENT_ACTIONS") == 0) {
+            free(g_config.event_actions);
+            g_config.event_actions = strdup(value);
+        } else if (strcmp(key, "DEMI_EVENT_SUBSYSTEMS") == 0) {
+            free(g_config.event_subsystems);
+            g_config.event_subsystems = strdup(value);
+        } else if (strcmp(key, "DEMI_COALESCE_ATTACH_MS") == 0) {
+            g_config.coalesce_ms[DEMI_ATTACH] = strtoul(value, NULL, 10);
+        } else if (strcmp(key, "DEMI_DETACH_GRACE_MS") == 0) {
+            g_config.coalesce_ms[DEMI_DETACH] = strtoul(value, NULL, 10);
+        } else if (strcmp(key, "DEMI_DETACH_FLAP") == 0) {
+            if (strcmp(value, "change") == 0) {
+                g_config.flap_to_change = 1;
+            } else if (strcmp(value, "cancel") == 0) {
+                g_config.flap_to_change = 0;
+            } else {
+                fprintf(stderr, "unknown DEMI_DETACH_FLAP '%s', using cancel\n", value);
+                g_config.flap_to_change = 0;
+            }
+        } else if (strcmp(key, "DEMI_COALESCE_CHANGE_MS") == 0) {
+            g_config.coalesce_ms[DEMI_CHANGE] = strtoul(value, NULL, 10);
+        } else if (strcmp(key, "DEMI_BATCH_WINDOW_MS") == 0) {
+            g_config.batch_window_ms = strtoul(value, NULL, 10);
+        } else if (strcmp(key, "DEMI_BATCH_SIZE") == 0) {
+            g_config.batch_size = (unsigned int)strtoul(value, NULL, 10);
+            if (g_config.batch_size == 0) {
+                g_config.batch_size = DEMI_BATCH_SIZE;
+            }
+        } else if (strcmp(key, "DEMI_BATCH_ACTIONS") == 0) {
+            g_config.batch_actions[DEMI_ATTACH] = strstr(value, "attach") != NULL;
+            g_config.batch_actions[DEMI_DETACH] = strstr(value, "detach") != NULL;
+            g_config.batch_actions[DEMI_CHANGE] = strstr(value, "change") != NULL;
+        } else if (strcmp(key, "DEMI_STORM_RATE") == 0) {
+            g_config.storm_rate = strtoul(value, NULL, 10);
+        } else if (strcmp(key, "DEMI_STORM_SETTLE_MS") == 0) {
+            g_config.storm_settle_ms = strtoul(value, NULL, 10);
+        } else if (strcmp(key, "DEMI_RESIDENT_ACTIONS") == 0) {
+            g_config.resident_actions[DEMI_ATTACH] = strstr(value, "attach") != NULL;
+            g_config.resident_actions[DEMI_DETACH] = strstr(value, "detach") != NULL;
+            g_config.resident_actions[DEMI_CHANGE] = strstr(value, "change") != NULL;
+        } else if (strcmp(key, "DEMI_RESIDENT_INFLIGHT") == 0) {
+            g_config.resident_inflight = (unsigned int)strtoul(value, NULL, 10);
+            if (g_config.resident_inflight == 0) {
+                g_config.resident_inflight = DEMI_RESIDENT_INFLIGHT;
+            }
+        } else if (strcmp(key, "DEMI_WARM_SHELLS") == 0) {
+            g_config.warm_shells = (unsigned int)strtoul(value, NULL, 10);
+        } else if (strcmp(key, "DEMI_SPAWNER") == 0) {
+            if (strcmp(value, "zygote") == 0) {
+                g_config.zygote = 1;
+            } else if (strcmp(value, "direct") == 0) {
+                g_config.zygote = 0;
+            } else {
+                fprintf(stderr, "unknown DEMI_SPAWNER '%s', using direct\n", value);
+                g_config.zygote = 0;
+            }
+        } else if (strcmp(key, "DEMI_PLUGIN_ATTACH") == 0) {
+            free(g_config.plugins[DEMI_ATTACH]);
+            g_config.plugins[DEMI_ATTACH] = *value ? strdup(value) : NULL;
+        } else if (strcmp(key, "DEMI_PLUGIN_DETACH") == 0) {
+            free(g_config.plugins[DEMI_DETACH]);
+            g_config.plugins[DEMI_DETACH] = *value ? strdup(value) : NULL;
+        } else if (strcmp(key, "DEMI_PLUGIN_CHANGE") == 0) {
+            free(g_config.plugins[DEMI_CHANGE]);
+            g_config.plugins[DEMI_CHANGE] = *value ? strdup(value) : NULL;
+        } else if (strcmp(key, "DEMI_PLUGIN_BUDGET_MS") == 0) {
+            g_config.plugin_budget_ms = strtoul(value, NULL, 10);
+            if (g_config.plugin_budget_ms == 0) {
+                g_config.plugin_budget_ms = DEMI_PLUGIN_BUDGET_MS;
+            }
+        } else if (strcmp(key, "DEMI_TIMEOUT_ATTACH_MS") == 0) {
+            g_config.timeout_ms[DEMI_ATTACH] = strtoul(value, NULL, 10);
+        } else if (strcmp(key, "DEMI_TIMEOUT_DETACH_MS") == 0) {
+            g_config.timeout_ms[DEMI_DETACH] = strtoul(value, NULL, 10);
+        } else if (strcmp(key, "DEMI_TIMEOUT_CHANGE_MS") == 0) {
+            g_config.timeout_ms[DEMI_CHANGE] = strtoul(value, NULL, 10);
+        } else if (strcmp(key, "DEMI_TIMEOUT_RECONCILE_MS") == 0) {
+            g_config.timeout_ms[DEMI_RESYNC] = strtoul(value, NULL, 10);
+        } else if (strcmp(key, "DEMI_KILL_GRACE_MS") == 0) {
+            g_config.kill_grace_ms = strtoul(value, NULL, 10);
+        } else if (strcmp(key, "DEMI_RETRY_LIMIT") == 0) {
+            g_config.retry_limit = (unsigned int)strtoul(value, NULL, 10);
+        } else if (strcmp(key, "DEMI_RETRY_BACKOFF_MS") == 0) {
+            g_config.retry_backoff_ms = strtoul(value, NULL, 10);
+        } else if (strcmp(key, "DEMI_METRICS_SOCKET") == 0) {
+            free(g_config.metrics_socket);
+            g_config.metrics_socket = *value ? strdup(value) : NULL;
+        } else if (strcmp(key, "DEMI_METRICS_TEXTFILE") == 0) {
+            free(g_config.metrics_textfile);
+            g_config.metrics_textfile = *value ? strdup(value) : NULL;
+        } else if (strcmp(key, "DEMI_METRICS_TEXTFILE_INTERVAL_SECONDS") == 0) {
+            g_config.metrics_textfile_interval_seconds = atoi(value);
+            if (g_config.metrics_textfile_interval_seconds <= 0) {
+                g_config.metrics_textfile_interval_seconds = DEMI_METRICS_TEXTFILE_INTERVAL_SECONDS;
+            }
+        } else if (strcmp(key, "DEMI_TRACE_FILE") == 0) {
+            free(g_config.trace_file);
+            g_config.trace_file = *value ? strdup(value) : NULL;
+        } else if (strcmp(key, "DEMI_SEQNUM_CHECK") == 0) {
+            g_config.seqnum_check = strcmp(value, "no") != 0 && strcmp(value, "0") != 0;
         }
     }
 
+    free(line);
     fclose(file);
     return 0;
 }
 
 static void cleanup_config(void) {
-    free(g_config.lock_dir);
     free(g_config.allowed_devices);
     free(g_config.log_file);
+    free(g_config.helper_dir);
+    free(g_config.event_actions);
+    free(g_config.event_subsystems);
+    free(g_config.metrics_socket);
+    free(g_config.metrics_textfile);
+    free(g_config.trace_file);
+    for (int type = 0; type <= DEMI_RESYNC; type++) {
+        free(g_config.plugins[type]);
+    }
 }
 
-void demi_log(const char *message) {
-    if (!g_config.log_file) {
-        return; // No logging configured
+static const char *action_name(enum demi_event_type type)
+{
+    switch (type) {
+        case DEMI_ATTACH:
+            return "attach";
+        case DEMI_DETACH:
+            return "detach";
+        case DEMI_CHANGE:
+            return "change";
+        default:
+            return NULL;
     }
+}
 
-    FILE *log_fp = fopen(g_config.log_file, "a");
-    if (!log_fp) {
-        return; // Cannot open log file
+static void free_helper(struct helper_args *ha)
+{
+    free(ha->keys);
+    free(ha);
+}
+
+static void free_helper_args(void *arg)
+{
+    struct helper_args *ha = (struct helper_args *)arg;
+    while (ha) {
+        struct helper_args *next = ha->batch_next;
+        free_helper(ha);
+        ha = next;
     }
+}
+
+static void submit_helper(void *arg);
 
-    // Get current time
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    
-    // Format time in syslog format: Sep 12 21:10:36
-    char time_str[32];
-    strftime(time_str, sizeof(time_str), "%b %d %H:%M:%S", tm_info);
-    
-    // Write log entry in syslog format: Sep 12 21:10:36 devd-watcher: message
-    fprintf(log_fp, "%s devd-watcher: %s\n", time_str, message);
-    fclose(log_fp);
+/* The job is over, whether its helper ran or not: let each device's next event go */
+static void finish_helper(struct helper_args *ha)
+{
+    while (ha) {
+        struct helper_args *member = ha;
+        ha = ha->batch_next;
+
+        struct helper_args *next = (struct helper_args *)demi_devq_done(g_devq, member->dev_basename);
+        free_helper(member);
+        if (next) {
+            submit_helper(next);
+        }
+    }
 }
 
-/* Select lock directory per-platform */
-#if defined(DEMI_PLATFORM_FREEBSD) || defined(MI_PLATFORM_FREEBSD)
-#define DEMI_LOCK_DIR "/var/run/devd-watcher"
-#else
-#define DEMI_LOCK_DIR "run"
-#endif
+static void discard_helper(void *arg)
+{
+    struct helper_args *ha = (struct helper_args *)arg;
 
-static int ensure_lock_directory(const char *dir_path)
+    if (g_stopping) {
+        free_helper_args(ha);
+        return;
+    }
+    demi_logf("helper pool: queue full, dropped event for %s", ha->dev_basename);
+    finish_helper(ha);
+}
+
+/* Block policy: stop reading events while the helper queue is full */
+static void update_backpressure(void)
 {
-    struct stat st;
-    if (stat(dir_path, &st) == 0) {
-        if (S_ISDIR(st.st_mode)) {
-            return 0;
+    int full = demi_pool_full(g_pool);
+
+    if (g_demi_src && full != g_demi_paused) {
+        demi_loop_pause(g_loop, g_demi_src, full);
+        g_demi_paused = full;
+    }
+}
+
+static void run_helper(struct helper_args *ha);
+static void zygote_watch_writes(void);
+
+static void helper_retry(void *arg)
+{
+    struct helper_args *ha = (struct helper_args *)arg;
+
+    ha->timer = NULL;   /* released by the loop */
+    run_helper(ha);
+    update_backpressure();
+}
+
+static unsigned long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + (unsigned long long)ts.tv_nsec / 1000ULL;
+}
+
+/* One record per device the finished run was for */
+static void trace_helper(const struct helper_args *ha, int failed)
+{
+    struct demi_trace_record r;
+    unsigned int count = 0;
+
+    if (!demi_trace_enabled()) {
+        return;
+    }
+    for (const struct helper_args *m = ha; m; m = m->batch_next) {
+        count++;
+    }
+    for (const struct helper_args *m = ha; m; m = m->batch_next) {
+        memset(&r, 0, sizeof(r));
+        r.dtr_seqnum = m->seqnum;
+        for (int stage = 0; stage < DEMI_STAGE_COUNT; stage++) {
+            r.dtr_stage_ns[stage] = m->stage_ns[stage];
         }
-        return -1;
+        r.dtr_pid = (int32_t)ha->pid;
+        r.dtr_type = (uint16_t)m->type;
+        r.dtr_attempt = (uint16_t)ha->attempt;
+        r.dtr_batch = (uint16_t)count;
+        r.dtr_failed = (uint16_t)(failed != 0);
+        /* Records are fixed-size; longer names are cut short on purpose */
+        snprintf(r.dtr_devname, sizeof(r.dtr_devname), "%.*s", (int)sizeof(r.dtr_devname) - 1, m->dev_basename);
+        demi_trace_write(&r);
+    }
+}
+
+/*
+ * Every helper run ends here. A failed one goes again after a doubling
+ * delay while retries are left; its devices stay busy meanwhile, so their
+ * later events wait behind it. A helper stopped for hanging is not retried.
+ */
+static void helper_finished(struct helper_args *ha, int failed)
+{
+    if (ha->timer) {
+        demi_loop_remove(g_loop, ha->timer);
+        ha->timer = NULL;
+    }
+    if (ha->kill_signal == SIGTERM && ha->pid > 0) {
+        /* The leader gave in; nothing else it started outlives the timeout either */
+        kill(-ha->pid, SIGKILL);
+    }
+    demi_pool_done(g_pool);
+    if (g_acct) {
+        demi_acct_record(g_acct, ha->action, ha->dev_basename, now_us() - ha->started_us,
+                         ha->has_usage ? &ha->usage : NULL, failed);
+    }
+
+    if (failed && !ha->kill_signal && ha->attempt < g_config.retry_limit) {
+        unsigned long delay = g_config.retry_backoff_ms;
+        for (unsigned int i = 0; i < ha->attempt && delay < DEMI_RETRY_BACKOFF_MAX_MS; i++) {
+            delay *= 2;
+        }
+        if (delay > DEMI_RETRY_BACKOFF_MAX_MS) {
+            delay = DEMI_RETRY_BACKOFF_MAX_MS;
+        }
+
+        ha->attempt++;
+        ha->timer = demi_loop_add_timer(g_loop, delay, helper_retry, ha);
+        if (ha->timer) {
+            demi_metrics_inc(DEMI_CNT_RETRIES);
+            demi_logf("retrying helper %s %s in %lu ms (%u of %u)", ha->action, ha->devnode,
+                      delay, ha->attempt, g_config.retry_limit);
+            update_backpressure();
+            return;
+        }
+        demi_logf("retry timer failed: %s", strerror(errno));
+    }
+    if (failed) {
+        demi_metrics_inc(DEMI_CNT_HELPER_FAILURES);
     }
-    if (errno != ENOENT) {
+    unsigned long long now = demi_trace_now();
+    for (struct helper_args *m = ha; m; m = m->batch_next) {
+        m->stage_ns[DEMI_STAGE_EXITED] = now;
+        demi_metrics_latency(DEMI_LAT_EXIT, (now - m->stage_ns[DEMI_STAGE_RECEIVED]) / 1000);
+        DEMI_PROBE3(exited, m->seqnum, m->dev_basename, failed);
+    }
+    trace_helper(ha, failed);
+    finish_helper(ha);
+    update_backpressure();
+}
+
+/* SIGTERM to the helper's process group when its time is up, SIGKILL after the grace period */
+static void helper_timed_out(void *arg)
+{
+    struct helper_args *ha = (struct helper_args *)arg;
+    int signo = ha->kill_signal ? SIGKILL : SIGTERM;
+    int rc;
+
+    ha->timer = NULL;   /* released by the loop */
+    if (signo == SIGTERM) {
+        demi_metrics_inc(DEMI_CNT_TIMEOUTS);
+        demi_logf("helper %s %s still running after %lu ms, terminating it", ha->action, ha->devnode,
+                  g_config.timeout_ms[ha->type]);
+    } else {
+        demi_metrics_inc(DEMI_CNT_KILLS);
+        demi_logf("helper %s %s outlived SIGTERM by %lu ms, killing it", ha->action, ha->devnode,
+                  g_config.kill_grace_ms);
+    }
+    ha->kill_signal = signo;
+
+    if (ha->in_resident) {
+        /* Reports the record failed, which finishes ha; a hung helper is restarted */
+        if (demi_resident_expire(g_resident[ha->type], ha) == -1) {
+            demi_logf("cannot expire resident %s record for %s: %s", ha->action, ha->devnode,
+                      strerror(errno));
+        }
+        return;
+    }
+    if (ha->in_shell) {
+        rc = demi_shpool_kill(g_shpool, ha, signo);
+        if (rc > 0) {
+            ha->pid = rc;   /* the shell's group, for the final SIGKILL */
+        }
+    } else if ((rc = kill(-ha->pid, signo)) == -1 && errno == ESRCH) {
+        rc = kill(ha->pid, signo);  /* it left its group */
+    }
+    if (rc == -1) {
+        demi_logf("cannot signal helper %s %s: %s", ha->action, ha->devnode, strerror(errno));
+    }
+
+    if (signo == SIGTERM) {
+        ha->timer = demi_loop_add_timer(g_loop, g_config.kill_grace_ms, helper_timed_out, ha);
+    }
+}
+
+/* Counted and traced for every run; latency only for the first try at an event */
+static void helper_started(struct helper_args *ha, pid_t pid)
+{
+    unsigned long long now = demi_trace_now();
+
+    demi_metrics_inc(DEMI_CNT_SPAWNS);
+    for (struct helper_args *m = ha; m; m = m->batch_next) {
+        m->stage_ns[DEMI_STAGE_SPAWNED] = now;
+        DEMI_PROBE3(spawned, m->seqnum, m->dev_basename, pid);
+    }
+    if (ha->attempt > 0 || ha->plugin_declined) {
+        return;
+    }
+    for (struct helper_args *m = ha; m; m = m->batch_next) {
+        demi_metrics_latency(DEMI_LAT_START, (now - m->stage_ns[DEMI_STAGE_RECEIVED]) / 1000);
+    }
+}
+
+/* The helper is running: start the action's clock */
+static void helper_watch(struct helper_args *ha, pid_t pid)
+{
+    ha->pid = pid;
+    if (g_config.timeout_ms[ha->type] == 0) {
+        return;
+    }
+    ha->timer = demi_loop_add_timer(g_loop, g_config.timeout_ms[ha->type], helper_timed_out, ha);
+    if (!ha->timer) {
+        demi_logf("cannot time helper %s %s: %s", ha->action, ha->devnode, strerror(errno));
+    }
+}
+
+static void helper_exited(pid_t pid, int status, const struct rusage *usage, void *arg)
+{
+    struct helper_args *ha = (struct helper_args *)arg;
+    int failed = 0;
+
+    if (usage) {
+        ha->usage = *usage;
+        ha->has_usage = 1;
+    }
+    if (status == -1) {
+        demi_logf("helper %s %s (pid %d) was reaped elsewhere", ha->action, ha->devnode, (int)pid);
+    } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        demi_logf("helper %s %s%s failed: status=%d", ha->action, ha->devnode,
+                  ha->batch_next ? " (batch)" : "", status);
+        failed = 1;
+    }
+
+    helper_finished(ha, failed);
+}
+
+static void helper_zygote_started(pid_t pid, void *arg)
+{
+    helper_started((struct helper_args *)arg, pid);
+    helper_watch((struct helper_args *)arg, pid);
+}
+
+static void helper_shell_done(int exit_code, void *arg)
+{
+    struct helper_args *ha = (struct helper_args *)arg;
+
+    if (exit_code == -1) {
+        demi_logf("helper %s %s was lost with its warm shell", ha->action, ha->devnode);
+    } else if (exit_code != 0) {
+        demi_logf("helper %s %s%s failed: exit=%d", ha->action, ha->devnode,
+                  ha->batch_next ? " (batch)" : "", exit_code);
+    }
+
+    helper_finished(ha, exit_code != 0);
+}
+
+static void helper_resident_done(int status, void *arg)
+{
+    struct helper_args *ha = (struct helper_args *)arg;
+
+    if (status == -1) {
+        demi_logf("resident %s helper died before acknowledging %s", ha->action, ha->devnode);
+    } else if (status != 0) {
+        demi_logf("resident helper %s %s failed: status=%d", ha->action, ha->devnode, status);
+    }
+
+    helper_finished(ha, status != 0);
+}
+
+static int start_helper(void *arg);
+
+static void helper_plugin_done(int status, void *arg)
+{
+    struct helper_args *ha = (struct helper_args *)arg;
+
+    if (status == DEMI_PLUGIN_FALLBACK) {
+        /* start_helper() finishes the job itself if the helper cannot start */
+        ha->plugin_declined = 1;
+        if (start_helper(ha) == -1) {
+            demi_pool_done(g_pool);
+            update_backpressure();
+        }
+        return;
+    }
+    if (status != 0) {
+        demi_logf("plugin %s %s failed: status=%d", ha->action, ha->devnode, status);
+    }
+
+    helper_finished(ha, status != 0);
+}
+
+/* The plugin sees the event's own keys, which stay with ha until it returns */
+static int start_plugin(struct helper_args *ha)
+{
+    struct demi_event de;
+
+    memset(&de, 0, sizeof(de));
+    de.de_type = ha->type;
+    snprintf(de.de_devname, sizeof(de.de_devname), "%s", ha->devnode + strlen("/dev/"));
+    if (demi_event_load(&de, ha->keys, ha->keys_len) == -1) {
+        errno = EINVAL;
         return -1;
     }
-    return mkdir(dir_path, 0755);
+    return demi_plugins_call(g_plugins, ha->type, &de, ha->devnode, helper_plugin_done, ha);
 }
 
-static int acquire_lock_with_timeout(const char *lock_path, int timeout_seconds, int *out_fd)
+/* One record: our action and devnode, then the event's own keys */
+static int start_resident(struct helper_args *ha)
 {
-    int open_flags = O_CREAT | O_RDWR;
-#ifdef O_CLOEXEC
-    open_flags |= O_CLOEXEC;
-#endif
-    int fd = open(lock_path, open_flags, 0644);
-    if (fd == -1) {
+    size_t cap = sizeof("DEMI_ACTION=\nDEMI_DEVNODE=\n") + strlen(ha->action) + strlen(ha->devnode) + ha->keys_len;
+    char *body = malloc(cap);
+    if (!body) {
         return -1;
     }
 
-    struct timespec sleep_req = {0};
-    sleep_req.tv_sec = 0;
-    sleep_req.tv_nsec = 100000000L; /* 100ms */
-
-    time_t start = time(NULL);
-    for (;;) {
-        if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
-            /* On successful lock, record timestamp and owner into the lock file */
-            (void)lseek(fd, 0, SEEK_SET);
-            (void)ftruncate(fd, 0);
-            time_t now = time(NULL);
-            char lock_note[64];
-            int note_len = snprintf(lock_note, sizeof(lock_note), "%ld:devd-watcher\n", (long)now);
-            if (note_len > 0) {
-                ssize_t ignored = write(fd, lock_note, (size_t)note_len);
-                (void)ignored;
-            }
-            if (out_fd) {
-                *out_fd = fd;
-            }
+    size_t len = (size_t)snprintf(body, cap, "DEMI_ACTION=%s\nDEMI_DEVNODE=%s\n", ha->action, ha->devnode);
+    for (size_t i = 0; i < ha->keys_len; i++) {
+        /* Keys end in NUL here and in a newline on the wire; values cannot span lines */
+        char c = ha->keys[i];
+        body[len++] = c == '\0' ? '\n' : c == '\n' ? ' ' : c;
+    }
+
+    int rc = demi_resident_submit(g_resident[ha->type], body, len, helper_resident_done, ha);
+    free(body);
+    return rc;
+}
+
+/* Reported by the fork server; pid -1 means the helper never started */
+static void helper_zygote_exited(pid_t pid, int status, const struct rusage *usage, void *arg)
+{
+    struct helper_args *ha = (struct helper_args *)arg;
+
+    if (pid == -1) {
+        fprintf(stderr, "failed to run %s helper for %s: %s\n", ha->action, ha->devnode, strerror(status));
+        demi_metrics_inc(DEMI_CNT_SPAWN_FAILURES);
+        demi_pool_done(g_pool);
+        finish_helper(ha);
+        update_backpressure();
+        return;
+    }
+    helper_exited(pid, status, usage, arg);
+}
+
+static int start_helper(void *arg)
+{
+    struct helper_args *ha = (struct helper_args *)arg;
+
+    ha->pid = 0;
+    ha->in_shell = 0;
+    ha->in_resident = 0;
+    ha->kill_signal = 0;
+    ha->has_usage = 0;
+    ha->started_us = now_us();
+
+    /* A plugin over its time budget is skipped until it returns */
+    if (!ha->plugin_declined && demi_plugins_ready(g_plugins, ha->type)) {
+        if (start_plugin(ha) == 0) {
+            helper_started(ha, 0);
             return 0;
         }
-        if (errno != EWOULDBLOCK && errno != EAGAIN) {
-            close(fd);
-            return -1;
+        demi_logf("plugin %s %s: %s, running the helper", ha->action, ha->devnode, strerror(errno));
+    }
+
+    if (g_resident[ha->type]) {
+        if (start_resident(ha) == 0) {
+            ha->in_resident = 1;
+            helper_started(ha, 0);
+            helper_watch(ha, 0);
+            return 0;
         }
-        if (timeout_seconds >= 0 && (int)(time(NULL) - start) >= timeout_seconds) {
-            close(fd);
-            errno = EWOULDBLOCK;
-            return -1;
+        fprintf(stderr, "failed to pass %s to the resident %s helper: %s\n", ha->devnode, ha->action, strerror(errno));
+        demi_metrics_inc(DEMI_CNT_SPAWN_FAILURES);
+        finish_helper(ha);
+        return -1;
+    }
+
+    const char *one[1];
+    const char **devnodes = one;
+    size_t count = 0;
+    pid_t pid;
+
+    for (struct helper_args *m = ha->batch_next; m; m = m->batch_next) {
+        count++;
+    }
+    if (count > 0 && !(devnodes = malloc((count + 1) * sizeof(*devnodes)))) {
+        fprintf(stderr, "failed to run %s helper for %s: %s\n", ha->action, ha->devnode, strerror(errno));
+        finish_helper(ha);
+        return -1;
+    }
+    count = 0;
+    /* A reconcile run is for no device in particular and gets no argument */
+    for (struct helper_args *m = ha; m && m->devnode[0]; m = m->batch_next) {
+        devnodes[count++] = m->devnode;
+    }
+
+    /* A single device's helper sees its event as DEMI_<KEY> variables */
+    char **env = NULL;
+    size_t nenv = 0;
+    if (count == 1 && ha->keys && !(env = demi_helper_env(ha->keys, ha->keys_len, &nenv))) {
+        demi_logf("no event environment for %s helper %s: %s", ha->action, ha->devnode, strerror(errno));
+    }
+
+    /* sh helpers go to an idle warm shell; with none idle they are spawned as usual */
+    char script[PATH_MAX];
+    int rc, direct = 0, zygote = 0;
+    if (g_shpool && demi_helper_script(ha->action, script, sizeof(script)) == 1 &&
+        demi_shpool_run(g_shpool, script, devnodes, count, env, nenv, helper_shell_done, ha) == 0) {
+        rc = 0;
+        ha->in_shell = 1;
+        helper_watch(ha, 0);
+    } else if (demi_zygote_fd() != -1) {
+        zygote = 1;
+        rc = demi_helper_spawn_zygote(ha->action, devnodes, count, env, helper_zygote_started,
+                                      helper_zygote_exited, ha);
+        zygote_watch_writes();
+    } else {
+        direct = 1;
+        rc = demi_helper_spawn_batch(ha->action, devnodes, count, env, &pid);
+    }
+    free(env);
+    if (devnodes != one) {
+        free(devnodes);
+    }
+    if (rc == -1) {
+        fprintf(stderr, "failed to run %s helper for %s: %s\n", ha->action, ha->devnode, strerror(errno));
+        demi_metrics_inc(DEMI_CNT_SPAWN_FAILURES);
+        finish_helper(ha);
+        return -1;
+    }
+    if (!zygote) {
+        helper_started(ha, direct ? pid : 0);   /* the fork server reports its start */
+    }
+    if (!direct) {
+        return 0;   /* reported through helper_shell_done() or helper_zygote_exited() */
+    }
+
+    if (!demi_loop_add_pid(g_loop, pid, helper_exited, ha)) {
+        int status;
+        demi_logf("cannot watch helper %s %s (pid %d): %s, waiting for it",
+                  ha->action, ha->devnode, (int)pid, strerror(errno));
+        while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+        }
+        finish_helper(ha);
+        return -1;
+    }
+    helper_watch(ha, pid);
+    return 0;
+}
+
+static void run_helper(struct helper_args *ha)
+{
+    if (demi_pool_submit(g_pool, ha) == -1) {
+        fprintf(stderr, "failed to queue event for %s: %s\n", ha->dev_basename, strerror(errno));
+        discard_helper(ha);
+    }
+}
+
+/* Hand the collected devices to one helper */
+static void flush_batch(struct helper_batch *b)
+{
+    struct helper_args *ha = b->head;
+
+    if (b->timer) {
+        demi_loop_remove(g_loop, b->timer);
+    }
+    if (b->count > 1) {
+        g_batch_stats.runs++;
+        g_batch_stats.devices += b->count;
+        if (b->count > g_batch_stats.largest) {
+            g_batch_stats.largest = b->count;
         }
-        nanosleep(&sleep_req, NULL);
+    }
+    memset(b, 0, sizeof(*b));
+    if (ha) {
+        run_helper(ha);
     }
 }
 
-static void release_lock(int fd)
+static void batch_expired(void *arg)
 {
-    (void)flock(fd, LOCK_UN);
-    close(fd);
+    struct helper_batch *b = (struct helper_batch *)arg;
+    b->timer = NULL;    /* released by the loop */
+    flush_batch(b);
+    update_backpressure();
 }
 
-static void *run_helper(void *arg)
+/* The device queue let this event go; its device stays busy until the helper is done */
+static void submit_helper(void *arg)
 {
     struct helper_args *ha = (struct helper_args *)arg;
-    
-    // Use configured lock directory or default
-    const char *lock_dir = g_config.lock_dir ? g_config.lock_dir : DEMI_LOCK_DIR;
-    
-    if (ensure_lock_directory(lock_dir) == -1) {
-        fprintf(stderr, "failed to ensure lock directory '%s': %s\n", lock_dir, strerror(errno));
-        free(ha->command);
-        free(ha);
-        return NULL;
+
+    ha->stage_ns[DEMI_STAGE_LOCKED] = demi_trace_now();
+    DEMI_PROBE2(locked, ha->seqnum, ha->dev_basename);
+
+    /* Plugins and resident helpers have no start-up cost to share */
+    if (g_config.batch_window_ms == 0 || !g_config.batch_actions[ha->type] || g_resident[ha->type] ||
+        demi_plugins_ready(g_plugins, ha->type)) {
+        run_helper(ha);
+        return;
     }
 
-    char lock_path[512];
-    snprintf(lock_path, sizeof(lock_path), "%s/%s.lock", lock_dir, ha->dev_basename);
+    struct helper_batch *b = &g_batches[ha->type];
+    if (b->tail) {
+        b->tail->batch_next = ha;
+    } else {
+        b->head = ha;
+        b->timer = demi_loop_add_timer(g_loop, g_config.batch_window_ms, batch_expired, b);
+        if (!b->timer) {
+            demi_logf("batch timer failed: %s, running %s now", strerror(errno), ha->devnode);
+        }
+    }
+    b->tail = ha;
+    b->count++;
 
-    int lock_fd = -1;
-    if (acquire_lock_with_timeout(lock_path, g_config.lock_timeout_seconds, &lock_fd) == -1) {
-        if (errno == EWOULDBLOCK || errno == EAGAIN) {
-            fprintf(stderr, "lock busy for %s after %d seconds (path: %s), skipping\n", ha->dev_basename, g_config.lock_timeout_seconds, lock_path);
-        } else {
-            fprintf(stderr, "failed to acquire lock for %s (path: %s): %s\n", ha->dev_basename, lock_path, strerror(errno));
+    if (!b->timer || b->count >= g_config.batch_size) {
+        flush_batch(b);
+    }
+}
+
+/* A shared resident helper is listed under the first action it serves */
+static int resident_first(int type)
+{
+    if (!g_resident[type]) {
+        return 0;
+    }
+    for (int prev = 0; prev < type; prev++) {
+        if (g_resident[prev] == g_resident[type]) {
+            return 0;
         }
-        free(ha->command);
-        free(ha);
+    }
+    return 1;
+}
+
+static void log_pool_stats(void)
+{
+    struct demi_pool_stats st;
+    struct demi_devq_stats dq;
+    struct demi_read_stats rd;
+    struct demi_coalesce_stats co;
+    demi_pool_stats(g_pool, &st);
+    demi_devq_stats(g_devq, &dq);
+    demi_read_stats(&rd);
+    demi_coalesce_stats(g_coalesce, &co);
+
+    demi_logf("helper pool: depth=%lu high=%lu running=%u/%u util=%.1f%% submitted=%lu processed=%lu dropped=%lu spilled=%lu"
+              " devices=%lu waiting=%lu max_waiting=%lu deferred=%lu log_dropped=%lu",
+              st.depth, st.high_water, st.running, st.slots, st.utilisation * 100.0,
+              st.submitted, st.processed, st.dropped, st.spilled,
+              dq.devices, dq.waiting, dq.max_waiting, dq.deferred, demi_log_dropped());
+    demi_logf("ingest: received=%lu filtered=%lu foreign=%lu truncated=%lu overflows=%lu seqnum_gaps=%lu resyncs=%lu msg_max=%lu",
+              rd.received, rd.filtered, rd.foreign, rd.truncated, rd.overflows, rd.seqnum_gaps, rd.resyncs,
+              rd.msg_max);
+    demi_logf("coalesce: pending=%lu absorbed=%lu delayed=%lu flaps=%lu",
+              co.pending, co.absorbed, co.delayed, co.flaps);
+    if (g_config.storm_rate > 0) {
+        demi_logf("storm: active=%d storms=%lu suppressed=%lu reconciles=%lu rate=%lu/s",
+                  g_storm, g_storm_stats.storms, g_storm_stats.suppressed, g_storm_stats.reconciles,
+                  demi_rate_get(&g_event_rate, demi_rate_now_ms()));
+    }
+    for (int type = 0; type <= DEMI_RESYNC; type++) {
+        struct demi_resident_stats rs;
+        if (!resident_first(type)) {
+            continue;
+        }
+        demi_resident_stats(g_resident[type], &rs);
+        demi_logf("resident %s: sent=%lu acked=%lu lost=%lu inflight=%lu waiting=%lu restarts=%lu"
+                  " latency_avg=%luus latency_max=%luus",
+                  action_name((enum demi_event_type)type), rs.sent, rs.acked, rs.lost, rs.inflight,
+                  rs.waiting, rs.restarts, rs.latency_avg_us, rs.latency_max_us);
+    }
+    if (g_plugins) {
+        struct demi_plugins_stats ps;
+        demi_plugins_stats(g_plugins, &ps);
+        demi_logf("plugins: calls=%lu fallbacks=%lu overruns=%lu latency_avg=%luus latency_max=%luus",
+                  ps.calls, ps.fallbacks, ps.overruns, ps.latency_avg_us, ps.latency_max_us);
+    }
+    if (g_shpool) {
+        struct demi_shpool_stats sp;
+        demi_shpool_stats(g_shpool, &sp);
+        demi_logf("warm shells: shells=%u busy=%u runs=%lu restarts=%lu",
+                  sp.shells, sp.busy, sp.runs, sp.restarts);
+    }
+    demi_logf("helpers: spawned=%llu spawn_failures=%llu timeouts=%llu killed=%llu retries=%llu failed=%llu",
+              (unsigned long long)demi_metrics_get(DEMI_CNT_SPAWNS),
+              (unsigned long long)demi_metrics_get(DEMI_CNT_SPAWN_FAILURES),
+              (unsigned long long)demi_metrics_get(DEMI_CNT_TIMEOUTS),
+              (unsigned long long)demi_metrics_get(DEMI_CNT_KILLS),
+              (unsigned long long)demi_metrics_get(DEMI_CNT_RETRIES),
+              (unsigned long long)demi_metrics_get(DEMI_CNT_HELPER_FAILURES));
+    if (g_config.batch_window_ms > 0) {
+        demi_logf("batch: runs=%lu devices=%lu largest=%lu",
+                  g_batch_stats.runs, g_batch_stats.devices, g_batch_stats.largest);
+    }
+}
+
+enum acct_series {
+    ACCT_DURATION,
+    ACCT_CPU,
+    ACCT_RSS,
+};
+
+struct acct_export {
+    FILE *out;
+    enum acct_series series;
+};
+
+static void write_acct_entry(const struct demi_acct_entry *e, void *arg)
+{
+    struct acct_export *x = (struct acct_export *)arg;
+    char action[64], pattern[128], labels[256];
+
+    demi_prom_escape(action, sizeof(action), e->action);
+    demi_prom_escape(pattern, sizeof(pattern), e->pattern);
+    switch (x->series) {
+        case ACCT_DURATION:
+            snprintf(labels, sizeof(labels), "action=\"%s\",pattern=\"%s\"", action, pattern);
+            demi_prom_hist(x->out, "helper_duration_seconds", labels, &e->wall_us);
+            break;
+        case ACCT_CPU:
+            snprintf(labels, sizeof(labels), "action=\"%s\",pattern=\"%s\",mode=\"user\"", action, pattern);
+            demi_prom_seconds(x->out, "helper_cpu_seconds_total", labels, e->user_us);
+            snprintf(labels, sizeof(labels), "action=\"%s\",pattern=\"%s\",mode=\"system\"", action, pattern);
+            demi_prom_seconds(x->out, "helper_cpu_seconds_total", labels, e->sys_us);
+            break;
+        case ACCT_RSS:
+            snprintf(labels, sizeof(labels), "action=\"%s\",pattern=\"%s\"", action, pattern);
+            demi_prom_sample(x->out, "helper_max_rss_bytes", labels, e->maxrss_kb * 1024);
+            break;
+    }
+}
+
+/* Everything log_pool_stats() logs, plus the pipeline counters, in Prometheus text format */
+static void write_metrics(FILE *out, void *arg)
+{
+    struct demi_pool_stats st;
+    struct demi_read_stats rd;
+    struct demi_coalesce_stats co;
+    struct acct_export x = { out, ACCT_DURATION };
+
+    (void)arg;
+    demi_pool_stats(g_pool, &st);
+    demi_read_stats(&rd);
+    demi_coalesce_stats(g_coalesce, &co);
+
+    demi_metrics_write(out);
+
+    demi_prom_family(out, "messages_received_total", "counter", "Messages read off the event socket.");
+    demi_prom_sample(out, "messages_received_total", NULL, rd.received);
+    demi_prom_family(out, "messages_dropped_total", "counter", "Messages dropped before parsing, by reason.");
+    demi_prom_sample(out, "messages_dropped_total", "reason=\"foreign\"", rd.foreign);
+    demi_prom_sample(out, "messages_dropped_total", "reason=\"truncated\"", rd.truncated);
+    demi_prom_family(out, "events_filtered_total", "counter", "Events for devices not in DEMI_ALLOWED_DEVICES.");
+    demi_prom_sample(out, "events_filtered_total", NULL, rd.filtered);
+    demi_prom_family(out, "events_coalesced_total", "counter", "Events absorbed by a later event for the same device.");
+    demi_prom_sample(out, "events_coalesced_total", NULL, co.absorbed);
+    demi_prom_family(out, "flaps_total", "counter", "Detach and reattach pairs inside the detach grace period.");
+    demi_prom_sample(out, "flaps_total", NULL, co.flaps);
+    demi_prom_family(out, "receive_overflows_total", "counter", "Times the kernel dropped events for us.");
+    demi_prom_sample(out, "receive_overflows_total", NULL, rd.overflows);
+    demi_prom_family(out, "resyncs_total", "counter", "Device rescans after lost events.");
+    demi_prom_sample(out, "resyncs_total", NULL, rd.resyncs);
+    demi_prom_family(out, "storm_suppressed_total", "counter", "Events that ran no helper during an event storm.");
+    demi_prom_sample(out, "storm_suppressed_total", NULL, g_storm_stats.suppressed);
+    demi_prom_family(out, "queue_dropped_total", "counter", "Events dropped because the helper queue was full.");
+    demi_prom_sample(out, "queue_dropped_total", NULL, st.dropped);
+    demi_prom_family(out, "log_dropped_total", "counter", "Log lines dropped because the log ring was full.");
+    demi_prom_sample(out, "log_dropped_total", NULL, demi_log_dropped());
+
+    demi_prom_family(out, "queue_depth", "gauge", "Helper runs waiting for a slot.");
+    demi_prom_sample(out, "queue_depth", NULL, st.depth);
+    demi_prom_family(out, "helpers_in_flight", "gauge", "Helper slots in use.");
+    demi_prom_sample(out, "helpers_in_flight", NULL, st.running);
+    demi_prom_family(out, "helper_slots", "gauge", "Helper slots configured.");
+    demi_prom_sample(out, "helper_slots", NULL, st.slots);
+    demi_prom_family(out, "storm_active", "gauge", "1 while in event storm mode.");
+    demi_prom_sample(out, "storm_active", NULL, (uint64_t)g_storm);
+
+    demi_prom_family(out, "helper_duration_seconds", "histogram", "Helper wall time, by action and device pattern.");
+    demi_acct_foreach(g_acct, write_acct_entry, &x);
+    demi_prom_family(out, "helper_cpu_seconds_total", "counter", "Helper CPU time, by action and device pattern.");
+    x.series = ACCT_CPU;
+    demi_acct_foreach(g_acct, write_acct_entry, &x);
+    demi_prom_family(out, "helper_max_rss_bytes", "gauge", "Largest helper peak RSS, by action and device pattern.");
+    x.series = ACCT_RSS;
+    demi_acct_foreach(g_acct, write_acct_entry, &x);
+}
+
+static void metrics_tick(void *arg)
+{
+    (void)arg;
+    if (demi_exporter_write_file(g_config.metrics_textfile, write_metrics, NULL) == -1) {
+        demi_logf("metrics: cannot write %s: %s", g_config.metrics_textfile, strerror(errno));
+    }
+    if (!demi_loop_add_timer(g_loop, (unsigned long)g_config.metrics_textfile_interval_seconds * 1000,
+                             metrics_tick, NULL)) {
+        demi_logf("metrics timer failed: %s", strerror(errno));
+    }
+}
+
+static void trace_tick(void *arg)
+{
+    (void)arg;
+    demi_trace_flush();
+    if (!demi_loop_add_timer(g_loop, DEMI_TRACE_FLUSH_MS, trace_tick, NULL)) {
+        demi_logf("trace timer failed: %s", strerror(errno));
+    }
+}
+
+static void stats_tick(void *arg)
+{
+    (void)arg;
+    log_pool_stats();
+    if (!demi_loop_add_timer(g_loop, (unsigned long)g_config.stats_interval_seconds * 1000, stats_tick, NULL)) {
+        demi_logf("stats timer failed: %s", strerror(errno));
+    }
+}
+
+/* Released by the coalescer, right away or once the action's window ran out */
+static void serialize_helper(void *arg)
+{
+    struct helper_args *ha = (struct helper_args *)arg;
+
+    /* Events for one device run in order, other devices proceed in parallel */
+    if (demi_devq_submit(g_devq, ha->dev_basename, ha) == -1) {
+        fprintf(stderr, "failed to queue event for %s: %s\n", ha->dev_basename, strerror(errno));
+        free_helper_args(ha);
+    }
+}
+
+/* The device came back inside the detach grace period */
+static void *cancel_flap(void *detach_job, void *attach_job)
+{
+    struct helper_args *ha = (struct helper_args *)attach_job;
+
+    demi_logf("%s detached and reattached within the grace period, %s", ha->devnode,
+              g_config.flap_to_change ? "running change" : "skipping both helpers");
+    free_helper_args(detach_job);
+    if (!g_config.flap_to_change) {
+        free_helper_args(ha);
         return NULL;
     }
+    ha->action = action_name(DEMI_CHANGE);
+    ha->type = DEMI_CHANGE;
+    return ha;
+}
+
+/* Copy the event's KEY=value pairs; the event itself is gone after this read */
+static int copy_keys(struct helper_args *ha, const struct demi_event *de)
+{
+    const char *key, *value;
+    size_t key_len, value_len, len = 0;
+
+    ha->keys = NULL;
+    ha->keys_len = 0;
+    if (!de) {
+        return 0;
+    }
+
+    for (unsigned int i = 0; demi_event_field(de, i, &key, &key_len, &value, &value_len) == 0; i++) {
+        len += key_len + 1 + value_len + 1;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    ha->keys = malloc(len);
+    if (!ha->keys) {
+        return -1;
+    }
+    for (unsigned int i = 0; demi_event_field(de, i, &key, &key_len, &value, &value_len) == 0; i++) {
+        memcpy(ha->keys + ha->keys_len, key, key_len);
+        ha->keys_len += key_len;
+        ha->keys[ha->keys_len++] = '=';
+        memcpy(ha->keys + ha->keys_len, value, value_len);
+        ha->keys_len += value_len;
+        ha->keys[ha->keys_len++] = '\0';
+    }
+    return 0;
+}
+
+/* de is the event behind it, NULL when synthesized by a resync */
+static void queue_helper(enum demi_event_type type, const char *devname, const struct demi_event *de)
+{
+    struct helper_args *ha = (struct helper_args *)malloc(sizeof(*ha));
+    if (!ha) {
+        return;
+    }
+    ha->action = action_name(type);
+    ha->type = type;
+    ha->batch_next = NULL;
+    ha->plugin_declined = 0;
+    ha->attempt = 0;
+    ha->timer = NULL;
+    ha->seqnum = de ? de->de_seqnum : 0;
+    memset(ha->stage_ns, 0, sizeof(ha->stage_ns));
+    if (de) {
+        memcpy(ha->stage_ns, de->de_stage_ns, sizeof(de->de_stage_ns));
+    }
+    if (ha->stage_ns[DEMI_STAGE_RECEIVED] == 0) {
+        ha->stage_ns[DEMI_STAGE_RECEIVED] = demi_trace_now();
+    }
+    if (copy_keys(ha, de) == -1) {
+        free(ha);
+        return;
+    }
 
-    int rc = system(ha->command);
-    (void)rc;
+    // Prepend /dev/ to devname, so that we have full path to devnode.
+    snprintf(ha->devnode, sizeof(ha->devnode), "/dev/%s", devname);
 
-    release_lock(lock_fd);
-    if (unlink(lock_path) == -1) {
-        if (errno != ENOENT) {
-            fprintf(stderr, "failed to remove lock file '%s': %s\n", lock_path, strerror(errno));
+    /* derive basename from devnode path */
+    const char *slash = strrchr(ha->devnode, '/');
+    const char *base = slash ? slash + 1 : ha->devnode;
+    size_t base_len = strlen(base);
+    if (base_len >= sizeof(ha->dev_basename)) {
+        /* Truncate to fit and warn */
+        memcpy(ha->dev_basename, base, sizeof(ha->dev_basename) - 1);
+        ha->dev_basename[sizeof(ha->dev_basename) - 1] = '\0';
+        fprintf(stderr, "device basename too long, truncated: %s\n", ha->dev_basename);
+    } else {
+        memcpy(ha->dev_basename, base, base_len + 1);
+    }
+
+    ha->stage_ns[DEMI_STAGE_ENQUEUED] = demi_trace_now();
+    DEMI_PROBE2(enqueued, ha->seqnum, ha->dev_basename);
+
+    /* A burst of the same action for one device collapses into its latest event */
+    if (demi_coalesce_submit(g_coalesce, ha->dev_basename, type, ha) == -1) {
+        fprintf(stderr, "failed to queue event for %s: %s\n", ha->dev_basename, strerror(errno));
+        free_helper_args(ha);
+    }
+}
+
+static void add_scanned(const char *devname, void *arg)
+{
+    demi_devset_add((struct demi_devset *)arg, devname);
+}
+
+struct resync_diff {
+    const struct demi_devset *other;
+    enum demi_event_type type;
+    unsigned long count;
+};
+
+static void queue_missing(const char *devname, void *arg)
+{
+    struct resync_diff *d = (struct resync_diff *)arg;
+    if (!demi_devset_contains(d->other, devname)) {
+        queue_helper(d->type, devname, NULL);
+        d->count++;
+    }
+}
+
+/*
+ * Events were lost. Rescan what is present now and run the attach and detach
+ * helpers the missed events would have run; devices that changed without
+ * coming or going cannot be told apart and are left alone. Without
+ * run_helpers the device set is only brought up to date.
+ */
+static void resync_devices(int run_helpers)
+{
+    struct demi_devset *now = demi_devset_create();
+    if (!now) {
+        return;
+    }
+    if (demi_scan(add_scanned, now) == -1) {
+        demi_logf("resync: device scan failed: %s", strerror(errno));
+        demi_devset_free(now);
+        return;
+    }
+
+    struct resync_diff gone = { now, DEMI_DETACH, 0 };
+    struct resync_diff added = { g_devices, DEMI_ATTACH, 0 };
+    if (run_helpers) {
+        demi_devset_foreach(g_devices, queue_missing, &gone);
+        demi_devset_foreach(now, queue_missing, &added);
+    }
+
+    demi_devset_free(g_devices);
+    g_devices = now;
+    demi_logf("resync: %lu devices present, %lu attached, %lu detached while events were lost",
+              demi_devset_count(now), added.count, gone.count);
+}
+
+/* The reconcile helper runs as a job of its own, under DEMI_RESYNC and with no device */
+static int queue_reconcile(void)
+{
+    char path[PATH_MAX];
+
+    if (demi_helper_script("reconcile", path, sizeof(path)) == -1) {
+        return -1;
+    }
+    struct helper_args *ha = (struct helper_args *)calloc(1, sizeof(*ha));
+    if (!ha) {
+        return -1;
+    }
+    ha->action = "reconcile";
+    ha->type = DEMI_RESYNC;
+    ha->stage_ns[DEMI_STAGE_RECEIVED] = ha->stage_ns[DEMI_STAGE_ENQUEUED] = demi_trace_now();
+
+    /* Its empty device name keeps reconcile runs from overlapping each other */
+    serialize_helper(ha);
+    return 0;
+}
+
+/*
+ * The storm is over. Bring the device set up to date and let the reconcile
+ * helper handle everything at once; without one, run the attach and detach
+ * helpers for the devices that came or went meanwhile.
+ */
+static void storm_settled(void)
+{
+    unsigned long long now = demi_rate_now_ms();
+
+    g_storm = 0;
+    demi_logf("event storm settled after %llu ms, %lu events ran no helper; leaving storm mode",
+              now - g_storm_since, g_storm_stats.suppressed - g_storm_suppressed);
+
+    if (queue_reconcile() == -1) {
+        demi_logf("no reconcile helper (%s), resyncing devices instead", strerror(errno));
+        resync_devices(1);
+        return;
+    }
+    g_storm_stats.reconciles++;
+    resync_devices(0);
+    update_backpressure();
+}
+
+static void storm_check(void *arg)
+{
+    (void)arg;
+    unsigned long long now = demi_rate_now_ms();
+
+    if (demi_rate_get(&g_event_rate, now) * 2 >= g_config.storm_rate) {
+        g_storm_hot = now;
+    }
+    if (now - g_storm_hot >= g_config.storm_settle_ms) {
+        storm_settled();
+        return;
+    }
+    if (!demi_loop_add_timer(g_loop, 100, storm_check, NULL)) {
+        demi_logf("storm timer failed: %s", strerror(errno));
+        storm_settled();
+    }
+}
+
+/* Sliding one-second rate over everything read; above the threshold per-device helpers stop */
+static void storm_note(unsigned long events)
+{
+    if (g_config.storm_rate == 0) {
+        return;
+    }
+
+    unsigned long long now = demi_rate_now_ms();
+    demi_rate_add(&g_event_rate, now, events);
+    unsigned long rate = demi_rate_get(&g_event_rate, now);
+
+    if (g_storm) {
+        if (rate * 2 >= g_config.storm_rate) {
+            g_storm_hot = now;
         }
+        return;
+    }
+    if (rate < g_config.storm_rate) {
+        return;
+    }
+
+    g_storm = 1;
+    g_storm_since = g_storm_hot = now;
+    g_storm_suppressed = g_storm_stats.suppressed;
+    g_storm_stats.storms++;
+    demi_logf("event storm: %lu events/s, entering storm mode; per-device helpers suspended", rate);
+    if (!demi_loop_add_timer(g_loop, 100, storm_check, NULL)) {
+        demi_logf("storm timer failed: %s", strerror(errno));
+        g_storm = 0;
+    }
+}
+
+static void count_event(enum demi_event_type type)
+{
+    switch (type) {
+        case DEMI_ATTACH:
+            demi_metrics_inc(DEMI_CNT_EVENTS_ATTACH);
+            break;
+        case DEMI_DETACH:
+            demi_metrics_inc(DEMI_CNT_EVENTS_DETACH);
+            break;
+        case DEMI_CHANGE:
+            demi_metrics_inc(DEMI_CNT_EVENTS_CHANGE);
+            break;
+        case DEMI_RESYNC:
+            break;      /* ours, not received */
+        default:
+            demi_metrics_inc(DEMI_CNT_EVENTS_OTHER);
+            break;
+    }
+}
+
+static void dispatch_event(const struct demi_event *de)
+{
+    count_event(de->de_type);
+    if (g_storm) {
+        /* Settling rescans the devices; these events only count */
+        if (action_name(de->de_type)) {
+            g_storm_stats.suppressed++;
+        }
+        return;
+    }
+
+    switch (de->de_type) {
+        case DEMI_ATTACH:
+            demi_devset_add(g_devices, de->de_devname);
+            break;
+        case DEMI_DETACH:
+            demi_devset_remove(g_devices, de->de_devname);
+            break;
+        case DEMI_RESYNC:
+            resync_devices(1);
+            return;
+        default:
+            break;
+    }
+
+    if (action_name(de->de_type)) {
+        queue_helper(de->de_type, de->de_devname, de);
+    }
+}
+
+static void on_demi_readable(void *arg);
+
+static int open_events(void)
+{
+    // Nonblocking: the loop tells us when to read, a read never stalls it
+    g_demi_fd = demi_init(DEMI_NONBLOCK | DEMI_CLOEXEC);
+    if (g_demi_fd == -1) {
+        return -1;
+    }
+    g_demi_src = demi_loop_add_fd(g_loop, g_demi_fd, on_demi_readable, NULL);
+    if (!g_demi_src) {
+        close(g_demi_fd);
+        g_demi_fd = -1;
+        return -1;
+    }
+    g_demi_paused = 0;
+    return 0;
+}
+
+static void reconnect_events(void *arg)
+{
+    (void)arg;
+    if (open_events() == -1) {
+        demi_loop_add_timer(g_loop, 1000, reconnect_events, NULL);
+        return;
+    }
+    demi_logf("event source reconnected");
+    if (!g_storm) {
+        resync_devices(1);
+    }
+    update_backpressure();
+}
+
+static void on_demi_readable(void *arg)
+{
+    (void)arg;
+    struct demi_event events[DEMI_BATCH_MAX];
+
+    // One batch per wakeup keeps signals and helper exits interleaved with bursts
+    int count = demi_read_batch(g_demi_fd, events, DEMI_BATCH_MAX);
+    if (count == -1) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        }
+        if (errno != ECONNRESET) {
+            fprintf(stderr, "reading events failed: %s\n", strerror(errno));
+            demi_loop_stop(g_loop);
+            return;
+        }
+
+        // The event source went away (devd restarted): reconnect and resync
+        demi_logf("event source closed, reconnecting");
+        demi_loop_remove(g_loop, g_demi_src);
+        g_demi_src = NULL;
+        close(g_demi_fd);
+        g_demi_fd = -1;
+        demi_loop_add_timer(g_loop, 1000, reconnect_events, NULL);
+        return;
+    }
+
+    storm_note((unsigned long)count);
+    for (int i = 0; i < count; i++) {
+        dispatch_event(&events[i]);
+    }
+    update_backpressure();
+}
+
+static void on_helpers_changed(void *arg)
+{
+    (void)arg;
+    if (demi_watch_drain(demi_helpers_watch_fd()) > 0) {
+        demi_helpers_reload();
+    }
+}
+
+static void on_zygote_writable(void *arg)
+{
+    (void)arg;
+    if (demi_zygote_flush() == -1) {
+        /* The read side sees the spawner go and fails what was queued */
+        demi_logf("cannot send to helper spawner: %s", strerror(errno));
+    } else if (demi_zygote_queued()) {
+        return;
+    }
+    demi_loop_remove(g_loop, g_zygote_write_src);
+    g_zygote_write_src = NULL;
+}
+
+/* Requests the spawner's socket would not take go out as it drains */
+static void zygote_watch_writes(void)
+{
+    if (g_zygote_write_src || !demi_zygote_queued()) {
+        return;
+    }
+    g_zygote_write_src = demi_loop_add_fd_writable(g_loop, demi_zygote_write_fd(), on_zygote_writable, NULL);
+    if (!g_zygote_write_src) {
+        demi_logf("cannot watch helper spawner for writing: %s", strerror(errno));
+    }
+}
+
+static void on_zygote_readable(void *arg)
+{
+    (void)arg;
+    if (demi_zygote_dispatch() == -1) {
+        demi_logf("helper spawner lost, starting helpers directly from now on");
+        demi_loop_remove(g_loop, g_zygote_src);
+        demi_loop_remove(g_loop, g_zygote_write_src);
+        g_zygote_src = g_zygote_write_src = NULL;
+    }
+}
+
+static void on_signal(int signo, void *arg)
+{
+    (void)arg;
+    switch (signo) {
+        case SIGHUP:
+            demi_logf("SIGHUP: reopening log and reloading helpers");
+            demi_log_reopen();
+            demi_trace_reopen();
+            demi_helpers_reload();
+            break;
+        case SIGUSR1:
+            demi_logf("SIGUSR1: dumping statistics");
+            log_pool_stats();
+            demi_acct_log(g_acct);
+            demi_trace_flush();
+            break;
+        default:
+            demi_logf("signal %d: shutting down", signo);
+            demi_loop_stop(g_loop);
+            break;
     }
-    free(ha->command);
-    free(ha);
-    return NULL;
 }
 
 static void print_usage(const char *progname) {
@@ -299,84 +1671,226 @@ int main(int argc, char *argv[])
     // Register cleanup function
     atexit(cleanup_config);
 
-    // Initialize demi file descriptor with no/zero flags.
-    // Optionally, DEMI_CLOEXEC and DEMI_NONBLOCK can be bitwise ORed in flags
-    // to atomically set close-on-exec flag and nonblocking mode respectively.
-    int fd = demi_init(0);
+    // The fork server must be forked while the daemon is still small and single-threaded
+    if (g_config.zygote && demi_zygote_start() == -1) {
+        fprintf(stderr, "Warning: cannot start helper spawner, spawning directly: %s\n", strerror(errno));
+    }
 
-    if (fd == -1) {
+    // Signals are read from the loop; block them before any thread starts
+    g_loop = demi_loop_create();
+    if (!g_loop ||
+        !demi_loop_add_signal(g_loop, SIGHUP, on_signal, NULL) ||
+        !demi_loop_add_signal(g_loop, SIGUSR1, on_signal, NULL) ||
+        !demi_loop_add_signal(g_loop, SIGTERM, on_signal, NULL) ||
+        !demi_loop_add_signal(g_loop, SIGINT, on_signal, NULL)) {
+        fprintf(stderr, "failed to set up event loop: %s\n", strerror(errno));
         return EXIT_FAILURE;
     }
 
-    struct demi_event de;
+    if (g_config.log_file) {
+        if (demi_log_open(g_config.log_file) == -1) {
+            fprintf(stderr, "Warning: Could not open log file '%s': %s\n", g_config.log_file, strerror(errno));
+        } else {
+            atexit(demi_log_close);
+        }
+    }
 
-#if defined(DEMI_PLATFORM_LINUX) || defined(MI_PLATFORM_LINUX)
-#define DEMI_PLATFORM_NAME "linux"
-#elif defined(DEMI_PLATFORM_FREEBSD) || defined(MI_PLATFORM_FREEBSD)
-#define DEMI_PLATFORM_NAME "freebsd"
-#else
-#define DEMI_PLATFORM_NAME "unknown"
-#endif
+    // A large receive queue rides out bursts while helpers are busy
+    demi_set_rcvbuf(g_config.rcvbuf_bytes);
+    demi_set_seqnum_check(g_config.seqnum_check);
+    if (demi_set_event_filter(g_config.event_actions, g_config.event_subsystems) == -1) {
+        fprintf(stderr, "Warning: event filter not set: %s\n", strerror(errno));
+    }
 
-    
+    if (open_events() == -1) {
+        fprintf(stderr, "failed to open event source: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
 
-    // Read pending event. This call will block since DEMI_NONBLOCK was not set.
-    while (demi_read(fd, &de) != -1) {
-        // de_devname might not contain devname, indicating that the event shall be ignored.
-        if (de.de_devname[0] == '\0') {
-            continue;
-        }
+    const char *helper_dir = g_config.helper_dir ? g_config.helper_dir : DEMI_HELPER_DIR;
+    if (demi_helpers_init(helper_dir) == -1) {
+        fprintf(stderr, "failed to open helper directory '%s': %s\n", helper_dir, strerror(errno));
+        close(g_demi_fd);
+        return EXIT_FAILURE;
+    }
+    atexit(demi_helpers_cleanup);
+
+    g_pool = demi_pool_create((unsigned int)g_config.workers, (unsigned int)g_config.queue_size,
+                              g_config.queue_overflow, start_helper, discard_helper);
+    if (!g_pool) {
+        fprintf(stderr, "failed to create helper pool: %s\n", strerror(errno));
+        close(g_demi_fd);
+        return EXIT_FAILURE;
+    }
 
+    g_devq = demi_devq_create(submit_helper);
+    if (!g_devq) {
+        fprintf(stderr, "failed to create device queues: %s\n", strerror(errno));
+        demi_pool_destroy(g_pool);
+        close(g_demi_fd);
+        return EXIT_FAILURE;
+    }
 
-        // Prepend /dev/ to devname, so that we have full path to devnode.
-        char devnode[sizeof(de.de_devname) + sizeof("/dev/")];
-        snprintf(devnode, sizeof(devnode), "/dev/%s", de.de_devname);
+    g_coalesce = demi_coalesce_create(g_loop, serialize_helper, free_helper_args);
+    if (!g_coalesce) {
+        fprintf(stderr, "failed to create event coalescer: %s\n", strerror(errno));
+        demi_pool_destroy(g_pool);
+        demi_devq_destroy(g_devq, free_helper_args);
+        close(g_demi_fd);
+        return EXIT_FAILURE;
+    }
+    g_acct = demi_acct_create();
+    if (!g_acct) {
+        fprintf(stderr, "Warning: helper accounting disabled: %s\n", strerror(errno));
+    }
+    for (int type = 0; type <= DEMI_RESYNC; type++) {
+        demi_coalesce_set_window(g_coalesce, (enum demi_event_type)type, g_config.coalesce_ms[type]);
+    }
+    demi_coalesce_set_flap(g_coalesce, cancel_flap);
 
-        const char *action = NULL;
-        switch (de.de_type) {
-            case DEMI_ATTACH: action = "attach"; break;
-            case DEMI_DETACH: action = "detach"; break;
-            case DEMI_CHANGE: action = "change"; break;
-            default: break;
+    demi_rate_init(&g_event_rate, demi_rate_now_ms());
+
+    // Remember what is present now; no helpers run for it
+    g_devices = demi_devset_create();
+    if (!g_devices || demi_scan(add_scanned, g_devices) == -1) {
+        fprintf(stderr, "Warning: initial device scan failed: %s\n", strerror(errno));
+        if (!g_devices) {
+            demi_coalesce_destroy(g_coalesce);
+            demi_pool_destroy(g_pool);
+            demi_devq_destroy(g_devq, free_helper_args);
+            close(g_demi_fd);
+            return EXIT_FAILURE;
         }
+    }
 
-        if (action) {
-            size_t needed = (size_t)snprintf(NULL, 0, "helpers/%s/%s %s", DEMI_PLATFORM_NAME, action, devnode) + 1;
-            struct helper_args *ha = (struct helper_args *)malloc(sizeof(*ha));
-            if (!ha) {
-                continue;
-            }
-            ha->command = (char *)malloc(needed);
-            if (!ha->command) {
-                free(ha);
-                continue;
-            }
-            (void)snprintf(ha->command, needed, "helpers/%s/%s %s", DEMI_PLATFORM_NAME, action, devnode);
-
-            /* derive basename from devnode path */
-            const char *slash = strrchr(devnode, '/');
-            const char *base = slash ? slash + 1 : devnode;
-            size_t base_len = strlen(base);
-            if (base_len >= sizeof(ha->dev_basename)) {
-                /* Truncate to fit and warn */
-                memcpy(ha->dev_basename, base, sizeof(ha->dev_basename) - 1);
-                ha->dev_basename[sizeof(ha->dev_basename) - 1] = '\0';
-                fprintf(stderr, "device basename too long, truncated: %s\n", ha->dev_basename);
-            } else {
-                memcpy(ha->dev_basename, base, base_len + 1);
+    for (int type = 0; type <= DEMI_RESYNC; type++) {
+        char path[PATH_MAX];
+        if (!g_config.resident_actions[type]) {
+            continue;
+        }
+        // One "resident" helper takes every action; otherwise the action's own helper stays resident
+        int shared = demi_helper_script("resident", path, sizeof(path)) != -1;
+        if (!shared && demi_helper_script(action_name((enum demi_event_type)type), path, sizeof(path)) == -1) {
+            fprintf(stderr, "Warning: no resident helper for %s: %s\n",
+                    action_name((enum demi_event_type)type), strerror(errno));
+            continue;
+        }
+        for (int prev = 0; shared && prev < type; prev++) {
+            if (g_resident[prev]) {
+                g_resident[type] = g_resident[prev];
             }
+        }
+        if (!g_resident[type]) {
+            g_resident[type] = demi_resident_create(g_loop, path, g_config.resident_inflight,
+                                                  g_config.kill_grace_ms);
+        }
+        if (!g_resident[type]) {
+            fprintf(stderr, "Warning: cannot start resident helper %s: %s\n", path, strerror(errno));
+        }
+    }
 
-            pthread_t tid;
-            if (pthread_create(&tid, NULL, run_helper, ha) == 0) {
-                pthread_detach(tid);
-            } else {
-                free(ha->command);
-                free(ha);
+    for (int type = 0; type <= DEMI_RESYNC; type++) {
+        if (!g_config.plugins[type]) {
+            continue;
+        }
+        if (!g_plugins) {
+            g_plugins = demi_plugins_create(g_loop, g_config.plugin_budget_ms);
+            if (!g_plugins) {
+                fprintf(stderr, "Warning: cannot start plugin thread: %s\n", strerror(errno));
+                break;
             }
         }
+        if (demi_plugins_load(g_plugins, (enum demi_event_type)type, g_config.plugins[type]) == -1) {
+            fprintf(stderr, "Warning: no %s plugin, running its helper: %s\n",
+                    action_name((enum demi_event_type)type), g_config.plugins[type]);
+        }
+    }
+
+    if (g_config.warm_shells > 0) {
+        g_shpool = demi_shpool_create(g_loop, g_config.warm_shells);
+        if (!g_shpool) {
+            fprintf(stderr, "Warning: cannot start warm shells: %s\n", strerror(errno));
+        }
+    }
+
+    if (demi_zygote_fd() != -1) {
+        g_zygote_src = demi_loop_add_fd(g_loop, demi_zygote_fd(), on_zygote_readable, NULL);
+        if (!g_zygote_src) {
+            fprintf(stderr, "Warning: cannot watch helper spawner, spawning directly: %s\n", strerror(errno));
+            demi_zygote_stop();
+        }
+    }
+
+    if (demi_helpers_watch_fd() != -1 &&
+        !demi_loop_add_fd(g_loop, demi_helpers_watch_fd(), on_helpers_changed, NULL)) {
+        fprintf(stderr, "Warning: cannot watch helper directory: %s\n", strerror(errno));
+    }
+
+    if (g_config.stats_interval_seconds > 0) {
+        demi_loop_add_timer(g_loop, (unsigned long)g_config.stats_interval_seconds * 1000, stats_tick, NULL);
     }
 
+    if (g_config.metrics_socket) {
+        g_exporter = demi_exporter_create(g_loop, g_config.metrics_socket, write_metrics, NULL);
+        if (!g_exporter) {
+            fprintf(stderr, "Warning: cannot serve metrics on %s: %s\n", g_config.metrics_socket, strerror(errno));
+        }
+    }
+    if (g_config.metrics_textfile) {
+        metrics_tick(NULL);
+    }
+
+    if (g_config.trace_file) {
+        if (demi_trace_open(g_config.trace_file) == -1) {
+            fprintf(stderr, "Warning: cannot open trace file %s: %s\n", g_config.trace_file, strerror(errno));
+        } else {
+            trace_tick(NULL);
+        }
+    }
+
+    // Everything from here on (events, helper exits, signals, timers) is a loop callback
+    if (demi_loop_run(g_loop) == -1) {
+        fprintf(stderr, "event loop failed: %s\n", strerror(errno));
+    }
+
+    // Running helpers are left to finish on their own; queued events are dropped
+    g_stopping = 1;
+    struct demi_pool_stats st;
+    demi_pool_stats(g_pool, &st);
+    demi_logf("shutting down: %lu queued events dropped, %u helpers still running", st.depth, st.running);
+
+    log_pool_stats();
+    demi_acct_log(g_acct);
+    if (g_config.metrics_textfile) {
+        /* Final counts, so the file does not stay at the last tick */
+        demi_exporter_write_file(g_config.metrics_textfile, write_metrics, NULL);
+    }
+    demi_exporter_destroy(g_exporter);
+    demi_trace_close();
+    for (int type = 0; type <= DEMI_RESYNC; type++) {
+        if (g_batches[type].timer) {
+            demi_loop_remove(g_loop, g_batches[type].timer);
+        }
+        free_helper_args(g_batches[type].head);
+    }
+    demi_coalesce_destroy(g_coalesce);
+    demi_plugins_destroy(g_plugins);
+    demi_acct_destroy(g_acct);
+    demi_shpool_destroy(g_shpool);
+    for (int type = 0; type <= DEMI_RESYNC; type++) {
+        if (resident_first(type)) {
+            demi_resident_destroy(g_resident[type]);
+        }
+    }
+    demi_pool_destroy(g_pool);
+    demi_devq_destroy(g_devq, free_helper_args);
+    demi_devset_free(g_devices);
+    demi_loop_free(g_loop);
+    demi_zygote_stop();
+
     // Do not forget to close file descriptor when you are done.
-    close(fd);
+    if (g_demi_fd != -1) {
+        close(g_demi_fd);
+    }
     return EXIT_SUCCESS;
 }
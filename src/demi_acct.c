@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/demi.h"
+#include "../include/demi_acct.h"
+
+#define ACCT_BUCKETS 64
+#define ACCT_PATTERN_MAX 64
+
+struct acct_node {
+    struct acct_node *next;
+    struct demi_acct_entry e;
+    char names[];       /* action, NUL, pattern, NUL */
+};
+
+struct demi_acct {
+    struct acct_node *buckets[ACCT_BUCKETS];
+};
+
+/* FNV-1a over action, a separator and pattern */
+static uint32_t acct_hash(const char *action, const char *pattern)
+{
+    uint32_t h = 2166136261u;
+    for (const char *p = action; *p; p++) {
+        h ^= (unsigned char)*p;
+        h *= 16777619u;
+    }
+    h ^= 0xff;
+    h *= 16777619u;
+    for (const char *p = pattern; *p; p++) {
+        h ^= (unsigned char)*p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* "nvme0n1p2" -> "nvme*n*p*" */
+static void acct_pattern(const char *devname, char *out, size_t size)
+{
+    size_t len = 0;
+
+    for (const char *p = devname; *p && len + 1 < size; p++) {
+        if (*p >= '0' && *p <= '9') {
+            if (len > 0 && out[len - 1] == '*') {
+                continue;
+            }
+            out[len++] = '*';
+        } else {
+            out[len++] = *p;
+        }
+    }
+    out[len] = '\0';
+}
+
+static uint64_t tv_us(const struct timeval *tv)
+{
+    return (uint64_t)tv->tv_sec * 1000000 + (uint64_t)tv->tv_usec;
+}
+
+struct demi_acct *demi_acct_create(void)
+{
+    return calloc(1, sizeof(struct demi_acct));
+}
+
+int demi_acct_record(struct demi_acct *a, const char *action, const char *devname,
+                     uint64_t wall_us, const struct rusage *usage, int failed)
+{
+    char pattern[ACCT_PATTERN_MAX];
+
+    acct_pattern(devname, pattern, sizeof(pattern));
+    uint32_t bucket = acct_hash(action, pattern) % ACCT_BUCKETS;
+
+    struct acct_node *n = a->buckets[bucket];
+    while (n && (strcmp(n->e.action, action) != 0 || strcmp(n->e.pattern, pattern) != 0)) {
+        n = n->next;
+    }
+    if (!n) {
+        size_t action_len = strlen(action) + 1;
+        size_t pattern_len = strlen(pattern) + 1;
+        n = calloc(1, sizeof(*n) + action_len + pattern_len);
+        if (!n) {
+            return -1;
+        }
+        memcpy(n->names, action, action_len);
+        memcpy(n->names + action_len, pattern, pattern_len);
+        n->e.action = n->names;
+        n->e.pattern = n->names + action_len;
+        demi_hist_init(&n->e.wall_us);
+        n->next = a->buckets[bucket];
+        a->buckets[bucket] = n;
+    }
+
+    struct demi_acct_entry *e = &n->e;
+    e->runs++;
+    e->failed += failed != 0;
+    demi_hist_add(&e->wall_us, wall_us);
+    if (usage) {
+        uint64_t user = tv_us(&usage->ru_utime);
+        uint64_t sys = tv_us(&usage->ru_stime);
+        e->measured++;
+        e->user_us += user;
+        e->sys_us += sys;
+        if (user + sys > e->cpu_max_us) {
+            e->cpu_max_us = user + sys;
+        }
+        /* ru_maxrss is in kilobytes on Linux and FreeBSD */
+        if (usage->ru_maxrss > 0 && (uint64_t)usage->ru_maxrss > e->maxrss_kb) {
+            e->maxrss_kb = (uint64_t)usage->ru_maxrss;
+        }
+    }
+    return 0;
+}
+
+void demi_acct_foreach(const struct demi_acct *a, demi_acct_fn fn, void *arg)
+{
+    for (size_t i = 0; a && i < ACCT_BUCKETS; i++) {
+        for (const struct acct_node *n = a->buckets[i]; n; n = n->next) {
+            fn(&n->e, arg);
+        }
+    }
+}
+
+static void acct_log_entry(const struct demi_acct_entry *e, void *arg)
+{
+    const struct demi_hist *h = &e->wall_us;
+    char buckets[1024];
+    size_t len = 0;
+
+    (void)arg;
+    demi_logf("acct %s %s: runs=%llu failed=%llu wall_us p50=%llu p90=%llu p99=%llu max=%llu mean=%llu"
+              " measured=%llu cpu_user_ms=%llu cpu_sys_ms=%llu cpu_mean_us=%llu cpu_max_us=%llu maxrss_kb=%llu",
+              e->action, e->pattern, (unsigned long long)e->runs, (unsigned long long)e->failed,
+              (unsigned long long)demi_hist_quantile(h, 0.50), (unsigned long long)demi_hist_quantile(h, 0.90),
+              (unsigned long long)demi_hist_quantile(h, 0.99), (unsigned long long)h->max,
+              (unsigned long long)(h->count ? h->sum / h->count : 0), (unsigned long long)e->measured,
+              (unsigned long long)(e->user_us / 1000), (unsigned long long)(e->sys_us / 1000),
+              (unsigned long long)(e->measured ? (e->user_us + e->sys_us) / e->measured : 0),
+              (unsigned long long)e->cpu_max_us, (unsigned long long)e->maxrss_kb);
+
+    /* Non-empty buckets as upper bound:count, for plotting the whole distribution */
+    buckets[0] = '\0';
+    for (size_t i = 0; i < DEMI_HIST_BUCKETS && len < sizeof(buckets); i++) {
+        if (h->buckets[i] == 0) {
+            continue;
+        }
+        int n = snprintf(buckets + len, sizeof(buckets) - len, " %llu:%llu",
+                         (unsigned long long)demi_hist_bucket_upper(i), (unsigned long long)h->buckets[i]);
+        if (n < 0 || (size_t)n >= sizeof(buckets) - len) {
+            break;
+        }
+        len += (size_t)n;
+    }
+    demi_logf("acct %s %s: wall_us buckets%s", e->action, e->pattern, buckets);
+}
+
+void demi_acct_log(const struct demi_acct *a)
+{
+    demi_acct_foreach(a, acct_log_entry, NULL);
+}
+
+void demi_acct_destroy(struct demi_acct *a)
+{
+    if (!a) {
+        return;
+    }
+    for (size_t i = 0; i < ACCT_BUCKETS; i++) {
+        while (a->buckets[i]) {
+            struct acct_node *n = a->buckets[i];
+            a->buckets[i] = n->next;
+            free(n);
+        }
+    }
+    free(a);
+}
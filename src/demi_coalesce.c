@@ -0,0 +1,195 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/demi_coalesce.h"
+
+#define COALESCE_BUCKETS 256
+#define COALESCE_TYPES (DEMI_RESYNC + 1)
+
+struct coalesce_entry {
+    struct coalesce_entry *next;    /* hash chain */
+    struct demi_coalesce *owner;
+    struct demi_loop_source *timer;
+    enum demi_event_type type;
+    void *job;
+    char key[];
+};
+
+struct demi_coalesce {
+    struct demi_loop *loop;
+    demi_coalesce_fn fire;
+    demi_coalesce_fn discard;
+    demi_coalesce_flap_fn flap;
+    unsigned long window[COALESCE_TYPES];
+    struct coalesce_entry *buckets[COALESCE_BUCKETS];
+    unsigned long pending;
+    unsigned long absorbed;
+    unsigned long delayed;
+    unsigned long flaps;
+};
+
+/* FNV-1a */
+static uint32_t coalesce_hash(const char *key)
+{
+    uint32_t h = 2166136261u;
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct coalesce_entry **coalesce_find(struct demi_coalesce *c, const char *key)
+{
+    struct coalesce_entry **pp = &c->buckets[coalesce_hash(key) & (COALESCE_BUCKETS - 1)];
+    while (*pp && strcmp((*pp)->key, key) != 0) {
+        pp = &(*pp)->next;
+    }
+    return pp;
+}
+
+/* Unhook the entry and hand back its job */
+static void *coalesce_take(struct demi_coalesce *c, struct coalesce_entry **pp)
+{
+    struct coalesce_entry *e = *pp;
+    void *job = e->job;
+
+    *pp = e->next;
+    c->pending--;
+    free(e);
+    return job;
+}
+
+static void coalesce_expire(void *arg)
+{
+    struct coalesce_entry *e = (struct coalesce_entry *)arg;
+    struct demi_coalesce *c = e->owner;
+
+    /* The timer source is released by the loop once this returns */
+    c->delayed++;
+    c->fire(coalesce_take(c, coalesce_find(c, e->key)));
+}
+
+struct demi_coalesce *demi_coalesce_create(struct demi_loop *loop, demi_coalesce_fn fire,
+                                           demi_coalesce_fn discard)
+{
+    if (!loop || !fire) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct demi_coalesce *c = calloc(1, sizeof(*c));
+    if (!c) {
+        return NULL;
+    }
+    c->loop = loop;
+    c->fire = fire;
+    c->discard = discard;
+    return c;
+}
+
+void demi_coalesce_set_window(struct demi_coalesce *c, enum demi_event_type type, unsigned long ms)
+{
+    if ((unsigned int)type < COALESCE_TYPES) {
+        c->window[type] = ms;
+    }
+}
+
+void demi_coalesce_set_flap(struct demi_coalesce *c, demi_coalesce_flap_fn flap)
+{
+    c->flap = flap;
+}
+
+int demi_coalesce_submit(struct demi_coalesce *c, const char *key, enum demi_event_type type, void *job)
+{
+    struct coalesce_entry **pp = coalesce_find(c, key);
+
+    if (*pp && (*pp)->type == DEMI_DETACH && type == DEMI_ATTACH && c->flap) {
+        /* Gone and back inside the grace period: neither helper needs to run */
+        demi_loop_remove(c->loop, (*pp)->timer);
+        void *detach = coalesce_take(c, pp);
+        c->flaps++;
+        job = c->flap(detach, job);
+        if (!job) {
+            return 0;
+        }
+        type = DEMI_CHANGE;
+        pp = coalesce_find(c, key);
+    }
+
+    if (*pp && (*pp)->type == type) {
+        /* Same action inside the window: the newer event wins */
+        void *old = (*pp)->job;
+        (*pp)->job = job;
+        c->absorbed++;
+        if (c->discard) {
+            c->discard(old);
+        }
+        return 0;
+    }
+
+    if (*pp) {
+        /* A different action: what was held happened first, let it go now */
+        demi_loop_remove(c->loop, (*pp)->timer);
+        c->fire(coalesce_take(c, pp));
+        pp = coalesce_find(c, key);
+    }
+
+    unsigned long window = (unsigned int)type < COALESCE_TYPES ? c->window[type] : 0;
+    if (window == 0) {
+        c->fire(job);
+        return 0;
+    }
+
+    size_t key_len = strlen(key) + 1;
+    struct coalesce_entry *e = calloc(1, sizeof(*e) + key_len);
+    if (!e) {
+        return -1;
+    }
+    memcpy(e->key, key, key_len);
+    e->owner = c;
+    e->type = type;
+    e->job = job;
+
+    e->timer = demi_loop_add_timer(c->loop, window, coalesce_expire, e);
+    if (!e->timer) {
+        free(e);
+        return -1;
+    }
+    e->next = *pp;
+    *pp = e;
+    c->pending++;
+    return 0;
+}
+
+void demi_coalesce_stats(const struct demi_coalesce *c, struct demi_coalesce_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    if (!c) {
+        return;
+    }
+    st->pending = c->pending;
+    st->absorbed = c->absorbed;
+    st->delayed = c->delayed;
+    st->flaps = c->flaps;
+}
+
+void demi_coalesce_destroy(struct demi_coalesce *c)
+{
+    if (!c) {
+        return;
+    }
+
+    for (size_t i = 0; i < COALESCE_BUCKETS; i++) {
+        while (c->buckets[i]) {
+            demi_loop_remove(c->loop, c->buckets[i]->timer);
+            void *job = coalesce_take(c, &c->buckets[i]);
+            if (c->discard) {
+                c->discard(job);
+            }
+        }
+    }
+    free(c);
+}
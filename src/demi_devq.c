@@ -0,0 +1,172 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/demi_devq.h"
+#include "../include/demi_metrics.h"
+
+#define DEVQ_BUCKETS 1024
+
+struct devq_node {
+    struct devq_node *next;
+    void *job;
+};
+
+struct devq_entry {
+    struct devq_entry *next;    /* hash chain */
+    struct devq_node *head;     /* jobs waiting behind the running one */
+    struct devq_node *tail;
+    unsigned long waiting;
+    char key[];
+};
+
+struct demi_devq {
+    demi_devq_fn dispatch;
+    struct devq_entry *buckets[DEVQ_BUCKETS];
+    unsigned long devices;
+    unsigned long waiting;
+    unsigned long max_waiting;
+    unsigned long deferred;
+};
+
+/* FNV-1a */
+static uint32_t devq_hash(const char *key)
+{
+    uint32_t h = 2166136261u;
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct devq_entry **devq_find(struct demi_devq *q, const char *key)
+{
+    struct devq_entry **pp = &q->buckets[devq_hash(key) & (DEVQ_BUCKETS - 1)];
+    while (*pp && strcmp((*pp)->key, key) != 0) {
+        pp = &(*pp)->next;
+    }
+    return pp;
+}
+
+struct demi_devq *demi_devq_create(demi_devq_fn dispatch)
+{
+    if (!dispatch) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct demi_devq *q = calloc(1, sizeof(*q));
+    if (!q) {
+        return NULL;
+    }
+    q->dispatch = dispatch;
+    return q;
+}
+
+void demi_devq_destroy(struct demi_devq *q, demi_devq_fn discard)
+{
+    if (!q) {
+        return;
+    }
+
+    for (size_t i = 0; i < DEVQ_BUCKETS; i++) {
+        struct devq_entry *e = q->buckets[i];
+        while (e) {
+            struct devq_entry *next_entry = e->next;
+            struct devq_node *n = e->head;
+            while (n) {
+                struct devq_node *next_node = n->next;
+                if (discard) {
+                    discard(n->job);
+                }
+                free(n);
+                n = next_node;
+            }
+            free(e);
+            e = next_entry;
+        }
+    }
+    free(q);
+}
+
+int demi_devq_submit(struct demi_devq *q, const char *key, void *job)
+{
+    struct devq_entry **pp = devq_find(q, key);
+    if (!*pp) {
+        /* Device idle: it becomes busy and the job runs now */
+        size_t key_len = strlen(key) + 1;
+        struct devq_entry *e = calloc(1, sizeof(*e) + key_len);
+        if (!e) {
+            return -1;
+        }
+        memcpy(e->key, key, key_len);
+        *pp = e;
+        q->devices++;
+
+        q->dispatch(job);
+        return 0;
+    }
+
+    struct devq_node *n = malloc(sizeof(*n));
+    if (!n) {
+        return -1;
+    }
+    n->next = NULL;
+    n->job = job;
+
+    struct devq_entry *e = *pp;
+    if (e->tail) {
+        e->tail->next = n;
+    } else {
+        e->head = n;
+    }
+    e->tail = n;
+    e->waiting++;
+    q->waiting++;
+    q->deferred++;
+    demi_metrics_inc(DEMI_CNT_LOCK_WAITS_DEVQ);
+    if (e->waiting > q->max_waiting) {
+        q->max_waiting = e->waiting;
+    }
+    return 0;
+}
+
+void *demi_devq_done(struct demi_devq *q, const char *key)
+{
+    void *job = NULL;
+    struct devq_entry **pp = devq_find(q, key);
+    struct devq_entry *e = *pp;
+    if (e) {
+        struct devq_node *n = e->head;
+        if (n) {
+            e->head = n->next;
+            if (!e->head) {
+                e->tail = NULL;
+            }
+            e->waiting--;
+            q->waiting--;
+            job = n->job;
+            free(n);
+        } else {
+            *pp = e->next;
+            q->devices--;
+            free(e);
+        }
+    }
+    return job;
+}
+
+void demi_devq_stats(struct demi_devq *q, struct demi_devq_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    if (!q) {
+        return;
+    }
+
+    st->devices = q->devices;
+    st->waiting = q->waiting;
+    st->max_waiting = q->max_waiting;
+    st->deferred = q->deferred;
+}
@@ -0,0 +1,143 @@
+#include <string.h>
+
+#include "../include/demi.h"
+
+static const char *const g_key_names[DEMI_KEY_COUNT] = {
+    [DEMI_KEY_ACTION] = "ACTION",
+    [DEMI_KEY_DEVNAME] = "DEVNAME",
+    [DEMI_KEY_SUBSYSTEM] = "SUBSYSTEM",
+    [DEMI_KEY_DEVTYPE] = "DEVTYPE",
+    [DEMI_KEY_DEVPATH] = "DEVPATH",
+    [DEMI_KEY_SEQNUM] = "SEQNUM",
+    [DEMI_KEY_MAJOR] = "MAJOR",
+    [DEMI_KEY_MINOR] = "MINOR",
+    [DEMI_KEY_DISKSEQ] = "DISKSEQ",
+    [DEMI_KEY_PARTN] = "PARTN",
+};
+
+/*
+ * Perfect hash over the well-known keys: (len + key[2] + key[len - 2]) & 15
+ * puts each of them in its own slot, so a lookup is one hash and one memcmp.
+ * Keys shorter than 3 bytes are never well-known.
+ */
+#define KEY_HASH(key, len) (((len) + (unsigned char)(key)[2] + (unsigned char)(key)[(len) - 2]) & 15)
+
+static const signed char g_key_slots[16] = {
+    [0] = DEMI_KEY_SUBSYSTEM,
+    [1] = DEMI_KEY_DEVPATH,
+    [2] = DEMI_KEY_MINOR,
+    [3] = -1, [4] = -1, [5] = -1, [6] = -1, [7] = -1, [8] = -1,
+    [9] = DEMI_KEY_ACTION,
+    [10] = DEMI_KEY_DEVNAME,
+    [11] = DEMI_KEY_PARTN,
+    [12] = DEMI_KEY_SEQNUM,
+    [13] = DEMI_KEY_DEVTYPE,
+    [14] = DEMI_KEY_MAJOR,
+    [15] = DEMI_KEY_DISKSEQ,
+};
+
+int demi_key_lookup(const char *key, size_t len)
+{
+    if (len < 3) {
+        return -1;
+    }
+
+    int k = g_key_slots[KEY_HASH(key, len)];
+    if (k < 0 || memcmp(g_key_names[k], key, len) != 0 || g_key_names[k][len] != '\0') {
+        return -1;
+    }
+    return k;
+}
+
+const char *demi_key_name(enum demi_key key)
+{
+    return (unsigned int)key < DEMI_KEY_COUNT ? g_key_names[key] : NULL;
+}
+
+const char *demi_event_get(const struct demi_event *de, enum demi_key key, size_t *len)
+{
+    if (!de->de_buf || (unsigned int)key >= DEMI_KEY_COUNT || !(de->de_known_mask & (1u << key))) {
+        return NULL;
+    }
+
+    const struct demi_field *f = &de->de_known[key];
+    if (len) {
+        *len = f->df_value_len;
+    }
+    return de->de_buf + f->df_value;
+}
+
+const char *demi_event_lookup(const struct demi_event *de, const char *key, size_t *len)
+{
+    size_t key_len = strlen(key);
+    int known = demi_key_lookup(key, key_len);
+
+    if (known >= 0) {
+        return demi_event_get(de, (enum demi_key)known, len);
+    }
+    if (!de->de_buf) {
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < de->de_nfields; i++) {
+        const struct demi_field *f = &de->de_fields[i];
+        if (f->df_key_len == key_len && memcmp(de->de_buf + f->df_key, key, key_len) == 0) {
+            if (len) {
+                *len = f->df_value_len;
+            }
+            return de->de_buf + f->df_value;
+        }
+    }
+    return NULL;
+}
+
+int demi_event_field(const struct demi_event *de, unsigned int i,
+                     const char **key, size_t *key_len, const char **value, size_t *value_len)
+{
+    if (!de->de_buf || i >= de->de_nfields) {
+        return -1;
+    }
+
+    const struct demi_field *f = &de->de_fields[i];
+    *key = de->de_buf + f->df_key;
+    *key_len = f->df_key_len;
+    *value = de->de_buf + f->df_value;
+    if (value_len) {
+        *value_len = f->df_value_len;
+    }
+    return 0;
+}
+
+int demi_event_load(struct demi_event *de, const char *buf, size_t len)
+{
+    if (len > 0xffff || (len > 0 && buf[len - 1] != '\0')) {
+        return -1;
+    }
+
+    de->de_buf = buf;
+    de->de_known_mask = 0;
+    de->de_nfields = 0;
+
+    for (size_t pos = 0; pos < len; ) {
+        size_t end = pos + strlen(buf + pos);
+        const char *eq = memchr(buf + pos, '=', end - pos);
+
+        if (eq && eq != buf + pos && de->de_nfields < DEMI_FIELDS_MAX) {
+            struct demi_field f = {
+                .df_key = (unsigned short)pos,
+                .df_key_len = (unsigned short)(eq - (buf + pos)),
+                .df_value = (unsigned short)(eq + 1 - buf),
+                .df_value_len = (unsigned short)(end - (size_t)(eq + 1 - buf)),
+            };
+            de->de_fields[de->de_nfields++] = f;
+
+            int k = demi_key_lookup(buf + f.df_key, f.df_key_len);
+            if (k >= 0) {
+                de->de_known[k] = f;
+                de->de_known_mask |= 1u << k;
+            }
+        }
+        pos = end + 1;
+    }
+    return 0;
+}
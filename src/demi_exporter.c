@@ -0,0 +1,330 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "../include/demi.h"
+#include "../include/demi_exporter.h"
+
+#define EXPORTER_CLIENTS_MAX 16
+#define EXPORTER_REQUEST_MAX 2048
+#define EXPORTER_IDLE_MS 1000
+#define EXPORTER_SEND_TIMEOUT_MS 1000
+
+struct exporter_client {
+    struct exporter_client *prev;
+    struct exporter_client *next;
+    struct demi_exporter *e;
+    int fd;
+    struct demi_loop_source *src;
+    struct demi_loop_source *timer;
+    size_t len;
+    char request[EXPORTER_REQUEST_MAX];
+    /* The reply, once rendered; sent as the socket takes it */
+    char *reply;
+    size_t reply_len;
+    size_t reply_off;
+};
+
+struct demi_exporter {
+    struct demi_loop *loop;
+    int fd;
+    char *path;
+    struct demi_loop_source *src;
+    demi_exporter_fn render;
+    void *arg;
+    unsigned int nclients;
+    struct exporter_client *clients;
+};
+
+static void client_close(struct exporter_client *c)
+{
+    struct demi_exporter *e = c->e;
+
+    if (c->timer) {
+        demi_loop_remove(e->loop, c->timer);
+    }
+    demi_loop_remove(e->loop, c->src);
+    close(c->fd);
+
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        e->clients = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+    e->nclients--;
+    free(c->reply);
+    free(c);
+}
+
+static int is_http(const struct exporter_client *c)
+{
+    return (c->len >= 4 && memcmp(c->request, "GET ", 4) == 0) ||
+           (c->len >= 5 && memcmp(c->request, "HEAD ", 5) == 0);
+}
+
+static void client_writable(void *arg)
+{
+    struct exporter_client *c = arg;
+
+    while (c->reply_off < c->reply_len) {
+        ssize_t n = send(c->fd, c->reply + c->reply_off, c->reply_len - c->reply_off, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            if (errno != EPIPE && errno != ECONNRESET) {
+                demi_logf("metrics: cannot send: %s", strerror(errno));
+            }
+            break;
+        }
+        c->reply_off += (size_t)n;
+    }
+    client_close(c);
+}
+
+static void client_send_timeout(void *arg)
+{
+    struct exporter_client *c = arg;
+
+    c->timer = NULL;    /* released by the loop */
+    client_close(c);
+}
+
+static void client_reply(struct exporter_client *c)
+{
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out = open_memstream(&body, &body_len);
+
+    if (!out) {
+        demi_logf("metrics: cannot render: %s", strerror(errno));
+        client_close(c);
+        return;
+    }
+    c->e->render(out, c->e->arg);
+    if (fclose(out) != 0) {
+        demi_logf("metrics: cannot render: %s", strerror(errno));
+        free(body);
+        client_close(c);
+        return;
+    }
+
+    char head[160];
+    int head_len = 0;
+    if (is_http(c)) {
+        head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\nConnection: close\r\n\r\n", body_len);
+        if (c->request[0] == 'H') {
+            body_len = 0;
+        }
+    }
+    c->reply = malloc((size_t)head_len + body_len);
+    if (!c->reply) {
+        demi_logf("metrics: cannot render: %s", strerror(errno));
+        free(body);
+        client_close(c);
+        return;
+    }
+    memcpy(c->reply, head, (size_t)head_len);
+    memcpy(c->reply + head_len, body, body_len);
+    c->reply_len = (size_t)head_len + body_len;
+    free(body);
+
+    /* The request is read; from now on the socket is only written, as the peer drains it */
+    if (c->timer) {
+        demi_loop_remove(c->e->loop, c->timer);
+    }
+    demi_loop_remove(c->e->loop, c->src);
+    c->src = demi_loop_add_fd_writable(c->e->loop, c->fd, client_writable, c);
+    c->timer = demi_loop_add_timer(c->e->loop, EXPORTER_SEND_TIMEOUT_MS, client_send_timeout, c);
+    if (!c->src || !c->timer) {
+        demi_logf("metrics: cannot send: %s", strerror(errno));
+        client_close(c);
+        return;
+    }
+    client_writable(c);
+}
+
+static void client_idle(void *arg)
+{
+    struct exporter_client *c = arg;
+
+    c->timer = NULL;    /* released by the loop */
+    client_reply(c);
+}
+
+static void client_readable(void *arg)
+{
+    struct exporter_client *c = arg;
+    ssize_t n = recv(c->fd, c->request + c->len, sizeof(c->request) - 1 - c->len, 0);
+
+    if (n == -1) {
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+            client_close(c);
+        }
+        return;
+    }
+    c->len += (size_t)n;
+    c->request[c->len] = '\0';
+
+    /* Answer at end of input, at the end of HTTP headers, or when the request will not fit */
+    if (n == 0 || c->len == sizeof(c->request) - 1 ||
+        strstr(c->request, "\r\n\r\n") || strstr(c->request, "\n\n")) {
+        client_reply(c);
+    }
+}
+
+static void exporter_accept(void *arg)
+{
+    struct demi_exporter *e = arg;
+    int fd;
+
+    while ((fd = accept(e->fd, NULL, NULL)) != -1) {
+        if (e->nclients >= EXPORTER_CLIENTS_MAX) {
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        struct exporter_client *c = calloc(1, sizeof(*c));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->e = e;
+        c->fd = fd;
+        c->src = demi_loop_add_fd(e->loop, fd, client_readable, c);
+        c->timer = demi_loop_add_timer(e->loop, EXPORTER_IDLE_MS, client_idle, c);
+        if (!c->src || !c->timer) {
+            demi_loop_remove(e->loop, c->src);
+            demi_loop_remove(e->loop, c->timer);
+            close(fd);
+            free(c);
+            continue;
+        }
+
+        c->next = e->clients;
+        if (e->clients) {
+            e->clients->prev = c;
+        }
+        e->clients = c;
+        e->nclients++;
+    }
+}
+
+struct demi_exporter *demi_exporter_create(struct demi_loop *loop, const char *path,
+                                           demi_exporter_fn render, void *arg)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int saved;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+
+    /* Only ever remove a socket; anything else at path is somebody's file */
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            errno = EEXIST;
+            return NULL;
+        }
+        unlink(path);
+    }
+
+    struct demi_exporter *e = calloc(1, sizeof(*e));
+    if (!e) {
+        return NULL;
+    }
+    e->loop = loop;
+    e->render = render;
+    e->arg = arg;
+    e->path = strdup(path);
+    e->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (!e->path || e->fd == -1) {
+        goto fail;
+    }
+    fcntl(e->fd, F_SETFD, FD_CLOEXEC);
+    fcntl(e->fd, F_SETFL, fcntl(e->fd, F_GETFL) | O_NONBLOCK);
+
+    if (bind(e->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        goto fail;
+    }
+    if (listen(e->fd, EXPORTER_CLIENTS_MAX) == -1 ||
+        !(e->src = demi_loop_add_fd(loop, e->fd, exporter_accept, e))) {
+        saved = errno;
+        unlink(path);
+        errno = saved;
+        goto fail;
+    }
+    return e;
+
+fail:
+    saved = errno;
+    if (e->fd != -1) {
+        close(e->fd);
+    }
+    free(e->path);
+    free(e);
+    errno = saved;
+    return NULL;
+}
+
+void demi_exporter_destroy(struct demi_exporter *e)
+{
+    if (!e) {
+        return;
+    }
+    while (e->clients) {
+        client_close(e->clients);
+    }
+    demi_loop_remove(e->loop, e->src);
+    close(e->fd);
+    unlink(e->path);
+    free(e->path);
+    free(e);
+}
+
+int demi_exporter_write_file(const char *path, demi_exporter_fn render, void *arg)
+{
+    size_t len = strlen(path);
+    char *tmp = malloc(len + sizeof(".tmp"));
+    if (!tmp) {
+        return -1;
+    }
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".tmp", sizeof(".tmp"));
+
+    int rc = -1;
+    FILE *out = fopen(tmp, "w");
+    if (out) {
+        render(out, arg);
+        int failed = ferror(out);
+        if (fclose(out) == 0 && !failed && rename(tmp, path) == 0) {
+            rc = 0;
+        } else {
+            int saved = errno;
+            unlink(tmp);
+            errno = saved;
+        }
+    }
+    free(tmp);
+    return rc;
+}
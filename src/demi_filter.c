@@ -1,91 +1,483 @@
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include "../include/demi.h"
 
-static char *g_allowed_devices = NULL;
+/*
+ * DEMI_ALLOWED_DEVICES is compiled once into an immutable matcher:
+ *
+ *  - the literal prefix of every pattern goes into a byte trie,
+ *  - a pattern that is all literal marks its trie node as an exact match,
+ *  - "prefix*" marks the node as accepting any continuation,
+ *  - anything else ("md[0-3]", "da*p?", ...) leaves a short token program
+ *    at the node where its literal prefix ends.
+ *
+ * Matching walks the trie once along the device name and only runs the
+ * programs hanging off the nodes it passes, without allocating.
+ *
+ * Pattern syntax: '*' matches any run, '?' any single character, '[...]' a
+ * character class with ranges ("[0-3]", "[a-fx]") and '!' or '^' negation.
+ * The pattern has to match the whole device name.
+ */
 
-void demi_set_allowed_devices(const char *allowed_devices) {
-    free(g_allowed_devices);
-    if (allowed_devices && strlen(allowed_devices) > 0) {
-        g_allowed_devices = strdup(allowed_devices);
-    } else {
-        g_allowed_devices = NULL;
+#define NODE_EXACT 0x1   /* a fully literal pattern ends here */
+#define NODE_ANY   0x2   /* "prefix*": every continuation matches */
+
+enum tok_type {
+    TOK_END,
+    TOK_LIT,
+    TOK_ANY1,
+    TOK_STAR,
+    TOK_CLASS,
+};
+
+struct tok {
+    uint8_t type;
+    uint8_t ch;          /* TOK_LIT */
+    uint32_t cls;        /* TOK_CLASS: index into classes */
+};
+
+struct trie_node {
+    uint32_t edge_start;
+    uint32_t tail_start;
+    uint32_t edge_count;
+    uint32_t tail_count;
+    uint8_t flags;
+};
+
+struct trie_edge {
+    uint8_t ch;
+    uint32_t child;
+};
+
+struct char_class {
+    uint32_t bits[8];
+};
+
+struct demi_matcher {
+    struct trie_node *nodes;
+    struct trie_edge *edges;
+    uint32_t *tails;             /* token offsets of programs, grouped by node */
+    struct tok *toks;
+    struct char_class *classes;
+    size_t patterns;
+};
+
+/* Build-time trie: children and tails are singly linked through index fields */
+struct build_node {
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint32_t first_tail;
+    uint8_t ch;
+    uint8_t flags;
+};
+
+struct build_tail {
+    uint32_t next;
+    uint32_t tok;
+};
+
+#define NIL UINT32_MAX
+
+struct builder {
+    struct build_node *nodes;
+    size_t nnodes, cnodes;
+    struct build_tail *tails;
+    size_t ntails, ctails;
+    struct tok *toks;
+    size_t ntoks, ctoks;
+    struct char_class *classes;
+    size_t nclasses, cclasses;
+};
+
+static struct demi_matcher *g_matcher = NULL;
+
+static int grow(void **arr, size_t *cap, size_t need, size_t elem)
+{
+    if (need <= *cap) {
+        return 0;
+    }
+    size_t ncap = *cap ? *cap * 2 : 64;
+    while (ncap < need) {
+        ncap *= 2;
+    }
+    void *p = realloc(*arr, ncap * elem);
+    if (!p) {
+        return -1;
     }
+    *arr = p;
+    *cap = ncap;
+    return 0;
 }
 
-int demi_is_device_allowed(const char *devname) {
-    if (!g_allowed_devices || strlen(g_allowed_devices) == 0) {
-        return 1; // Allow all devices if no filter is set
+static uint32_t builder_node(struct builder *b, uint8_t ch)
+{
+    if (grow((void **)&b->nodes, &b->cnodes, b->nnodes + 1, sizeof(*b->nodes)) == -1) {
+        return NIL;
     }
+    struct build_node *n = &b->nodes[b->nnodes];
+    n->first_child = NIL;
+    n->next_sibling = NIL;
+    n->first_tail = NIL;
+    n->ch = ch;
+    n->flags = 0;
+    return (uint32_t)b->nnodes++;
+}
 
-    if (!devname || strlen(devname) == 0) {
-        return 0; // Block empty device names
+static uint32_t builder_child(struct builder *b, uint32_t parent, uint8_t ch)
+{
+    for (uint32_t c = b->nodes[parent].first_child; c != NIL; c = b->nodes[c].next_sibling) {
+        if (b->nodes[c].ch == ch) {
+            return c;
+        }
+    }
+    uint32_t c = builder_node(b, ch);
+    if (c == NIL) {
+        return NIL;
+    }
+    b->nodes[c].next_sibling = b->nodes[parent].first_child;
+    b->nodes[parent].first_child = c;
+    return c;
+}
+
+static int builder_tok(struct builder *b, struct tok t)
+{
+    if (grow((void **)&b->toks, &b->ctoks, b->ntoks + 1, sizeof(*b->toks)) == -1) {
+        return -1;
+    }
+    b->toks[b->ntoks++] = t;
+    return 0;
+}
+
+/* Parse "[...]" at p; returns the length consumed or 0 if it is not a class */
+static size_t parse_class(struct builder *b, const char *p, size_t len, uint32_t *out)
+{
+    size_t i = 1;
+    int negate = 0;
+    struct char_class cls = {{0}};
+
+    if (i < len && (p[i] == '!' || p[i] == '^')) {
+        negate = 1;
+        i++;
+    }
+    size_t first = i;
+    while (i < len && (p[i] != ']' || i == first)) {
+        unsigned char lo = (unsigned char)p[i];
+        unsigned char hi = lo;
+        if (i + 2 < len && p[i + 1] == '-' && p[i + 2] != ']') {
+            hi = (unsigned char)p[i + 2];
+            i += 2;
+        }
+        for (unsigned int c = lo; c <= hi; c++) {
+            cls.bits[c >> 5] |= 1u << (c & 31);
+        }
+        i++;
+    }
+    if (i >= len) {
+        return 0; /* unterminated: treat '[' literally */
+    }
+    if (negate) {
+        for (int w = 0; w < 8; w++) {
+            cls.bits[w] = ~cls.bits[w];
+        }
     }
+    cls.bits[0] &= ~1u; /* never match the terminating NUL */
+
+    if (grow((void **)&b->classes, &b->cclasses, b->nclasses + 1, sizeof(*b->classes)) == -1) {
+        return 0;
+    }
+    b->classes[b->nclasses] = cls;
+    *out = (uint32_t)b->nclasses++;
+    return i + 1;
+}
+
+static int builder_add(struct builder *b, const char *pat, size_t len)
+{
+    uint32_t node = 0;
+    size_t i = 0;
 
-    char *allowed_copy = strdup(g_allowed_devices);
-    if (!allowed_copy) {
-        return 1; // Allow all on memory error
-    }
-
-    char *token = strtok(allowed_copy, " ");
-    int allowed = 0;
-    while (token != NULL) {
-        // Check for bracket patterns like "md[0-3]"
-        char *bracket_start = strchr(token, '[');
-        char *bracket_end = strchr(token, ']');
-        
-        if (bracket_start && bracket_end && bracket_end > bracket_start) {
-            // Extract prefix before bracket
-            size_t prefix_len = bracket_start - token;
-            if (prefix_len > 0 && strncmp(devname, token, prefix_len) == 0) {
-                // Extract the suffix after the bracket pattern
-                char *suffix = bracket_end + 1;
-                if (strlen(suffix) == 0) {
-                    // Pattern like "md[0-3]" - check if suffix matches range
-                    char *range = bracket_start + 1;
-                    *bracket_end = '\0'; // Terminate range string
-                    
-                    // Simple range parsing for single digits like "0-3"
-                    if (strlen(range) == 3 && range[1] == '-') {
-                        char start_char = range[0];
-                        char end_char = range[2];
-                        char dev_suffix = devname[prefix_len];
-                        
-                        if (dev_suffix >= start_char && dev_suffix <= end_char) {
-                            allowed = 1;
-                            break;
-                        }
-                    }
-                } else {
-                    // Pattern like "md[0-3]suffix" - check prefix and suffix
-                    if (strstr(devname + prefix_len, suffix) != NULL) {
-                        allowed = 1;
-                        break;
-                    }
-                }
+    /* Literal prefix goes into the trie */
+    while (i < len && pat[i] != '*' && pat[i] != '?' && pat[i] != '[') {
+        node = builder_child(b, node, (uint8_t)pat[i]);
+        if (node == NIL) {
+            return -1;
+        }
+        i++;
+    }
+
+    if (i == len) {
+        b->nodes[node].flags |= NODE_EXACT;
+        return 0;
+    }
+    if (i + 1 == len && pat[i] == '*') {
+        b->nodes[node].flags |= NODE_ANY;
+        return 0;
+    }
+
+    /* Remaining tokens become a program attached to the node */
+    uint32_t start = (uint32_t)b->ntoks;
+    int rc = 0;
+    while (i < len && rc == 0) {
+        struct tok t = { TOK_LIT, (uint8_t)pat[i], 0 };
+        size_t used = 1;
+        if (pat[i] == '*') {
+            t.type = TOK_STAR;
+            while (i + used < len && pat[i + used] == '*') {
+                used++;
+            }
+        } else if (pat[i] == '?') {
+            t.type = TOK_ANY1;
+        } else if (pat[i] == '[') {
+            size_t n = parse_class(b, pat + i, len - i, &t.cls);
+            if (n > 0) {
+                t.type = TOK_CLASS;
+                used = n;
             }
+        }
+        rc = builder_tok(b, t);
+        i += used;
+    }
+    if (rc == 0) {
+        rc = builder_tok(b, (struct tok){ TOK_END, 0, 0 });
+    }
+    if (rc == -1) {
+        return -1;
+    }
+
+    if (grow((void **)&b->tails, &b->ctails, b->ntails + 1, sizeof(*b->tails)) == -1) {
+        return -1;
+    }
+    b->tails[b->ntails].tok = start;
+    b->tails[b->ntails].next = b->nodes[node].first_tail;
+    b->nodes[node].first_tail = (uint32_t)b->ntails++;
+    return 0;
+}
+
+static int cmp_edge(const void *a, const void *b)
+{
+    return (int)((const struct trie_edge *)a)->ch - (int)((const struct trie_edge *)b)->ch;
+}
+
+/* Flatten the build trie into sorted contiguous edge and tail arrays */
+static struct demi_matcher *builder_finish(struct builder *b)
+{
+    struct demi_matcher *m = calloc(1, sizeof(*m));
+    if (!m) {
+        return NULL;
+    }
+    m->nodes = calloc(b->nnodes, sizeof(*m->nodes));
+    m->edges = calloc(b->nnodes, sizeof(*m->edges));
+    m->tails = calloc(b->ntails + 1, sizeof(*m->tails));
+    if (!m->nodes || !m->edges || !m->tails) {
+        demi_matcher_free(m);
+        return NULL;
+    }
+
+    size_t nedges = 0, ntails = 0;
+    for (size_t i = 0; i < b->nnodes; i++) {
+        struct trie_node *n = &m->nodes[i];
+        n->flags = b->nodes[i].flags;
+        n->edge_start = (uint32_t)nedges;
+        for (uint32_t c = b->nodes[i].first_child; c != NIL; c = b->nodes[c].next_sibling) {
+            m->edges[nedges].ch = b->nodes[c].ch;
+            m->edges[nedges].child = c;
+            nedges++;
+        }
+        n->edge_count = (uint32_t)(nedges - n->edge_start);
+        qsort(&m->edges[n->edge_start], n->edge_count, sizeof(*m->edges), cmp_edge);
+
+        n->tail_start = (uint32_t)ntails;
+        for (uint32_t t = b->nodes[i].first_tail; t != NIL; t = b->tails[t].next) {
+            m->tails[ntails++] = b->tails[t].tok;
+        }
+        n->tail_count = (uint32_t)(ntails - n->tail_start);
+    }
+
+    m->toks = b->toks;
+    m->classes = b->classes;
+    b->toks = NULL;
+    b->classes = NULL;
+    return m;
+}
+
+static void builder_free(struct builder *b)
+{
+    free(b->nodes);
+    free(b->tails);
+    free(b->toks);
+    free(b->classes);
+}
+
+struct demi_matcher *demi_matcher_compile(const char *patterns)
+{
+    struct builder b = {0};
+
+    if (!patterns || builder_node(&b, 0) == NIL) {
+        builder_free(&b);
+        return NULL;
+    }
+
+    size_t count = 0;
+    const char *p = patterns;
+    while (*p) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        const char *start = p;
+        while (*p && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        if (p > start) {
+            if (builder_add(&b, start, (size_t)(p - start)) == -1) {
+                builder_free(&b);
+                return NULL;
+            }
+            count++;
+        }
+    }
+
+    if (count == 0) {
+        builder_free(&b);
+        return NULL;
+    }
+
+    struct demi_matcher *m = builder_finish(&b);
+    if (m) {
+        m->patterns = count;
+    }
+    builder_free(&b);
+    return m;
+}
+
+void demi_matcher_free(struct demi_matcher *m)
+{
+    if (!m) {
+        return;
+    }
+    free(m->nodes);
+    free(m->edges);
+    free(m->tails);
+    free(m->toks);
+    free(m->classes);
+    free(m);
+}
+
+/* Glob program against the rest of the name; backtracks only to the last '*' */
+static int run_program(const struct demi_matcher *m, const struct tok *prog, const char *s)
+{
+    const struct tok *star_tok = NULL;
+    const char *star_s = NULL;
+
+    for (;;) {
+        int ok = 0;
+        switch (prog->type) {
+        case TOK_END:
+            if (*s == '\0') {
+                return 1;
+            }
+            break;
+        case TOK_STAR:
+            star_tok = ++prog;
+            star_s = s;
+            continue;
+        case TOK_LIT:
+            ok = (unsigned char)*s == prog->ch && *s != '\0';
+            break;
+        case TOK_ANY1:
+            ok = *s != '\0';
+            break;
+        case TOK_CLASS: {
+            unsigned char c = (unsigned char)*s;
+            ok = (m->classes[prog->cls].bits[c >> 5] >> (c & 31)) & 1u;
+            break;
+        }
+        }
+
+        if (ok) {
+            prog++;
+            s++;
+            continue;
+        }
+        if (!star_tok || *star_s == '\0') {
+            return 0;
+        }
+        prog = star_tok;
+        s = ++star_s;
+    }
+}
+
+static uint32_t find_edge(const struct demi_matcher *m, const struct trie_node *n, unsigned char ch)
+{
+    const struct trie_edge *e = &m->edges[n->edge_start];
+    size_t lo = 0, hi = n->edge_count;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (e[mid].ch == ch) {
+            return e[mid].child;
+        }
+        if (e[mid].ch < ch) {
+            lo = mid + 1;
         } else {
-            // Simple wildcard matching for patterns like "cd*", "vtbd*", etc.
-            size_t pattern_len = strlen(token);
-            if (pattern_len > 0 && token[pattern_len - 1] == '*') {
-                // Remove the '*' and compare prefix
-                token[pattern_len - 1] = '\0';
-                if (strncmp(devname, token, pattern_len - 1) == 0) {
-                    allowed = 1;
-                    break;
-                }
-            } else {
-                // Exact match
-                if (strcmp(devname, token) == 0) {
-                    allowed = 1;
-                    break;
-                }
+            hi = mid;
+        }
+    }
+    return NIL;
+}
+
+int demi_matcher_match(const struct demi_matcher *m, const char *devname)
+{
+    uint32_t node = 0;
+    const char *s = devname;
+
+    for (;;) {
+        const struct trie_node *n = &m->nodes[node];
+
+        if (n->flags & NODE_ANY) {
+            return 1;
+        }
+        for (uint32_t t = 0; t < n->tail_count; t++) {
+            if (run_program(m, &m->toks[m->tails[n->tail_start + t]], s)) {
+                return 1;
             }
         }
-        token = strtok(NULL, " ");
+        if (*s == '\0') {
+            return (n->flags & NODE_EXACT) != 0;
+        }
+
+        node = find_edge(m, n, (unsigned char)*s);
+        if (node == NIL) {
+            return 0;
+        }
+        s++;
+    }
+}
+
+/*
+ * Not safe against concurrent demi_is_device_allowed() calls: the previous
+ * matcher is freed here. Both run on the ingest thread.
+ */
+void demi_set_allowed_devices(const char *allowed_devices) {
+    struct demi_matcher *old = g_matcher;
+    g_matcher = NULL;
+    if (allowed_devices && allowed_devices[0] != '\0') {
+        g_matcher = demi_matcher_compile(allowed_devices);
+        if (!g_matcher) {
+            fprintf(stderr, "failed to compile DEMI_ALLOWED_DEVICES, allowing all devices\n");
+        }
+    }
+    demi_matcher_free(old);
+}
+
+int demi_is_device_allowed(const char *devname) {
+    if (!g_matcher) {
+        return 1; // Allow all devices if no filter is set
+    }
+
+    if (!devname || devname[0] == '\0') {
+        return 0; // Block empty device names
     }
 
-    free(allowed_copy);
-    return allowed;
+    return demi_matcher_match(g_matcher, devname);
 }
@@ -0,0 +1,110 @@
+#include <string.h>
+
+#include "../include/demi_hist.h"
+
+#define HIST_SUB (1u << DEMI_HIST_SUB_BITS)
+#define HIST_HALF (HIST_SUB / 2)
+
+static size_t hist_index(uint64_t v)
+{
+    if (v < HIST_SUB) {
+        return (size_t)v;
+    }
+
+    unsigned int msb = 63u - (unsigned int)__builtin_clzll(v);
+    if (msb > DEMI_HIST_MAX_BITS) {
+        return DEMI_HIST_BUCKETS - 1;
+    }
+    /* The top DEMI_HIST_SUB_BITS bits pick the bucket within this power of two */
+    unsigned int shift = msb - (DEMI_HIST_SUB_BITS - 1);
+    return HIST_SUB + (size_t)(msb - DEMI_HIST_SUB_BITS) * HIST_HALF + (size_t)((v >> shift) - HIST_HALF);
+}
+
+uint64_t demi_hist_bucket_upper(size_t i)
+{
+    if (i < HIST_SUB) {
+        return i;
+    }
+    if (i >= DEMI_HIST_BUCKETS - 1) {
+        return UINT64_MAX;
+    }
+
+    size_t k = i - HIST_SUB;
+    unsigned int msb = (unsigned int)(k / HIST_HALF) + DEMI_HIST_SUB_BITS;
+    uint64_t sub = (uint64_t)(k % HIST_HALF) + HIST_HALF;
+    unsigned int shift = msb - (DEMI_HIST_SUB_BITS - 1);
+    return ((sub + 1) << shift) - 1;
+}
+
+void demi_hist_init(struct demi_hist *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void demi_hist_add(struct demi_hist *h, uint64_t value)
+{
+    if (h->count == 0 || value < h->min) {
+        h->min = value;
+    }
+    if (value > h->max) {
+        h->max = value;
+    }
+    h->count++;
+    h->sum += value;
+    h->buckets[hist_index(value)]++;
+}
+
+void demi_hist_merge(struct demi_hist *h, const struct demi_hist *from)
+{
+    if (from->count == 0) {
+        return;
+    }
+    if (h->count == 0 || from->min < h->min) {
+        h->min = from->min;
+    }
+    if (from->max > h->max) {
+        h->max = from->max;
+    }
+    h->count += from->count;
+    h->sum += from->sum;
+    for (size_t i = 0; i < DEMI_HIST_BUCKETS; i++) {
+        h->buckets[i] += from->buckets[i];
+    }
+}
+
+uint64_t demi_hist_quantile(const struct demi_hist *h, double q)
+{
+    if (h->count == 0) {
+        return 0;
+    }
+    if (q <= 0.0) {
+        return h->min;
+    }
+
+    uint64_t rank = (uint64_t)(q * (double)h->count + 0.999999);
+    uint64_t seen = 0;
+    if (rank > h->count) {
+        rank = h->count;
+    }
+    for (size_t i = 0; i < DEMI_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t upper = demi_hist_bucket_upper(i);
+            return upper > h->max ? h->max : upper < h->min ? h->min : upper;
+        }
+    }
+    return h->max;
+}
+
+uint64_t demi_hist_count_le(const struct demi_hist *h, uint64_t value)
+{
+    uint64_t count = 0;
+
+    if (h->count > 0 && h->max <= value) {
+        return h->count;
+    }
+    for (size_t i = 0; i < DEMI_HIST_BUCKETS && demi_hist_bucket_upper(i) <= value; i++) {
+        count += h->buckets[i];
+    }
+    return count;
+}
@@ -0,0 +1,308 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "../include/demi.h"
+
+/*
+ * Asynchronous logger. Producers format a complete syslog-style line into a
+ * slot of a bounded lock-free ring; one writer thread drains ready slots with
+ * writev() into a log file that stays open. When the ring is full the line is
+ * dropped and counted rather than blocking the caller.
+ */
+
+#ifndef DEMI_LOG_SLOTS
+#define DEMI_LOG_SLOTS 1024
+#endif
+
+#define DEMI_LOG_RECORD_MAX 512
+#define DEMI_LOG_BATCH 64
+
+struct log_slot {
+    _Atomic size_t seq;
+    unsigned int len;
+    char data[DEMI_LOG_RECORD_MAX];
+};
+
+struct log_time_cache {
+    time_t sec;
+    size_t len;
+    char str[32];
+};
+
+static struct log_slot g_slots[DEMI_LOG_SLOTS];
+static _Atomic size_t g_enqueue_pos;
+static size_t g_dequeue_pos;            /* writer thread only */
+
+static char *g_log_path = NULL;
+static int g_log_fd = -1;
+static _Atomic int g_log_running;
+static _Atomic int g_log_reopen;
+static _Atomic unsigned long g_log_dropped;
+static sem_t g_log_ready;
+static pthread_t g_log_writer;
+
+static _Thread_local struct log_time_cache t_time_cache;
+
+/* Format time in syslog format: Sep 12 21:10:36, once per second per thread */
+static const char *log_timestamp(size_t *len)
+{
+    time_t now = time(NULL);
+    struct log_time_cache *c = &t_time_cache;
+
+    if (c->len == 0 || c->sec != now) {
+        struct tm tm_info;
+        localtime_r(&now, &tm_info);
+        c->len = strftime(c->str, sizeof(c->str), "%b %d %H:%M:%S", &tm_info);
+        c->sec = now;
+    }
+    *len = c->len;
+    return c->str;
+}
+
+static struct log_slot *log_claim(size_t *out_pos)
+{
+    size_t pos = atomic_load_explicit(&g_enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        struct log_slot *slot = &g_slots[pos % DEMI_LOG_SLOTS];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&g_enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *out_pos = pos;
+                return slot;
+            }
+        } else if (diff < 0) {
+            return NULL; /* full */
+        } else {
+            pos = atomic_load_explicit(&g_enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+static int log_open_fd(const char *path)
+{
+    return open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+}
+
+/* writev() everything in iov, continuing after short writes */
+static void log_write_all(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+}
+
+/* Drain every ready slot; returns the number of records written */
+static size_t log_drain(void)
+{
+    size_t total = 0;
+
+    for (;;) {
+        struct iovec iov[DEMI_LOG_BATCH];
+        int count = 0;
+        size_t pos = g_dequeue_pos;
+
+        while (count < DEMI_LOG_BATCH) {
+            struct log_slot *slot = &g_slots[(pos + count) % DEMI_LOG_SLOTS];
+            size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+            if (seq != pos + count + 1) {
+                break;
+            }
+            iov[count].iov_base = slot->data;
+            iov[count].iov_len = slot->len;
+            count++;
+        }
+
+        if (count == 0) {
+            return total;
+        }
+
+        if (atomic_exchange(&g_log_reopen, 0)) {
+            int fd = log_open_fd(g_log_path);
+            if (fd != -1) {
+                if (g_log_fd != -1) {
+                    close(g_log_fd);
+                }
+                g_log_fd = fd;
+            }
+        }
+        if (g_log_fd != -1) {
+            log_write_all(g_log_fd, iov, count);
+        }
+
+        for (int i = 0; i < count; i++) {
+            struct log_slot *slot = &g_slots[(pos + i) % DEMI_LOG_SLOTS];
+            atomic_store_explicit(&slot->seq, pos + i + DEMI_LOG_SLOTS, memory_order_release);
+        }
+        g_dequeue_pos = pos + count;
+        total += (size_t)count;
+    }
+}
+
+static void *log_writer_main(void *arg)
+{
+    (void)arg;
+
+    while (atomic_load(&g_log_running)) {
+        while (sem_wait(&g_log_ready) == -1 && errno == EINTR) {
+        }
+        log_drain();
+    }
+    log_drain();
+    return NULL;
+}
+
+int demi_log_open(const char *path)
+{
+    if (!path) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (atomic_load(&g_log_running)) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    g_log_path = strdup(path);
+    if (!g_log_path) {
+        return -1;
+    }
+    g_log_fd = log_open_fd(path);
+    if (g_log_fd == -1) {
+        int saved = errno;
+        free(g_log_path);
+        g_log_path = NULL;
+        errno = saved;
+        return -1;
+    }
+
+    for (size_t i = 0; i < DEMI_LOG_SLOTS; i++) {
+        atomic_init(&g_slots[i].seq, i);
+    }
+    atomic_store(&g_enqueue_pos, 0);
+    g_dequeue_pos = 0;
+    sem_init(&g_log_ready, 0, 0);
+
+    atomic_store(&g_log_running, 1);
+    if (pthread_create(&g_log_writer, NULL, log_writer_main, NULL) != 0) {
+        atomic_store(&g_log_running, 0);
+        close(g_log_fd);
+        g_log_fd = -1;
+        free(g_log_path);
+        g_log_path = NULL;
+        sem_destroy(&g_log_ready);
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+void demi_log_reopen(void)
+{
+    if (atomic_load(&g_log_running)) {
+        atomic_store(&g_log_reopen, 1);
+    }
+}
+
+void demi_log_close(void)
+{
+    if (!atomic_exchange(&g_log_running, 0)) {
+        return;
+    }
+
+    sem_post(&g_log_ready);
+    pthread_join(g_log_writer, NULL);
+    sem_destroy(&g_log_ready);
+
+    unsigned long dropped = atomic_load(&g_log_dropped);
+    if (dropped > 0 && g_log_fd != -1) {
+        dprintf(g_log_fd, "devd-watcher: %lu log messages dropped (ring full)\n", dropped);
+    }
+    if (g_log_fd != -1) {
+        close(g_log_fd);
+        g_log_fd = -1;
+    }
+    free(g_log_path);
+    g_log_path = NULL;
+}
+
+unsigned long demi_log_dropped(void)
+{
+    return atomic_load(&g_log_dropped);
+}
+
+void demi_logv(const char *fmt, va_list ap)
+{
+    if (!atomic_load_explicit(&g_log_running, memory_order_relaxed)) {
+        return; // No logging configured
+    }
+
+    size_t pos;
+    struct log_slot *slot = log_claim(&pos);
+    if (!slot) {
+        atomic_fetch_add_explicit(&g_log_dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    // Write log entry in syslog format: Sep 12 21:10:36 devd-watcher: message
+    size_t ts_len;
+    const char *ts = log_timestamp(&ts_len);
+    static const char tag[] = " devd-watcher: ";
+    memcpy(slot->data, ts, ts_len);
+    memcpy(slot->data + ts_len, tag, sizeof(tag) - 1);
+    size_t len = ts_len + sizeof(tag) - 1;
+
+    int n = vsnprintf(slot->data + len, sizeof(slot->data) - len - 1, fmt, ap);
+    if (n > 0) {
+        len += (size_t)n;
+        if (len > sizeof(slot->data) - 2) {
+            len = sizeof(slot->data) - 2; /* truncated */
+        }
+    }
+    slot->data[len++] = '\n';
+    slot->len = (unsigned int)len;
+
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    sem_post(&g_log_ready);
+}
+
+void demi_logf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    demi_logv(fmt, ap);
+    va_end(ap);
+}
+
+void demi_log(const char *message)
+{
+    demi_logf("%s", message);
+}
@@ -0,0 +1,188 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/demi_metrics.h"
+
+#define METRICS_PREFIX "devd_watcher_"
+
+struct metrics_shard {
+    _Alignas(64) _Atomic uint64_t counters[DEMI_COUNTER_COUNT];
+    struct metrics_shard *next;
+};
+
+static _Thread_local struct metrics_shard *t_shard;
+static struct metrics_shard *g_shards = NULL;          /* never freed, see demi_metrics.h */
+static pthread_mutex_t g_shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_shard g_shared;                   /* threads that could not get their own */
+
+static struct demi_hist g_latency[DEMI_LATENCY_COUNT];
+
+static const struct {
+    enum demi_counter first;
+    enum demi_counter last;
+    const char *name;
+    const char *help;
+    const char *label;
+    const char *values[4];
+} g_families[] = {
+    { DEMI_CNT_EVENTS_ATTACH, DEMI_CNT_EVENTS_OTHER, "events_received_total",
+      "Device events received, by action.", "action", { "attach", "detach", "change", "other" } },
+    { DEMI_CNT_SPAWNS, DEMI_CNT_SPAWNS, "helper_spawns_total",
+      "Helper runs started, including plugin, resident and warm shell runs.", NULL, { NULL } },
+    { DEMI_CNT_SPAWN_FAILURES, DEMI_CNT_SPAWN_FAILURES, "helper_spawn_failures_total",
+      "Helpers that could not be started.", NULL, { NULL } },
+    { DEMI_CNT_HELPER_FAILURES, DEMI_CNT_HELPER_FAILURES, "helper_failures_total",
+      "Helpers that failed with no retry left.", NULL, { NULL } },
+    { DEMI_CNT_TIMEOUTS, DEMI_CNT_TIMEOUTS, "helper_timeouts_total",
+      "Helpers sent SIGTERM for running past their timeout.", NULL, { NULL } },
+    { DEMI_CNT_KILLS, DEMI_CNT_KILLS, "helper_kills_total",
+      "Helpers sent SIGKILL after outliving SIGTERM.", NULL, { NULL } },
+    { DEMI_CNT_RETRIES, DEMI_CNT_RETRIES, "helper_retries_total",
+      "Failed helper runs started again.", NULL, { NULL } },
+    { DEMI_CNT_LOCK_WAITS_DEVQ, DEMI_CNT_LOCK_WAITS_PLUGIN, "lock_waits_total",
+      "Times work waited for a lock, by lock; devq counts events held behind their device's running helper.", "lock", { "devq", "plugin" } },
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} g_latencies[DEMI_LATENCY_COUNT] = {
+    [DEMI_LAT_START] = { "event_to_start_seconds", "Time from receiving an event to starting its helper." },
+    [DEMI_LAT_EXIT] = { "event_to_exit_seconds", "Time from receiving an event to its helper finishing." },
+};
+
+/* Exported bucket bounds in microseconds */
+static const uint64_t g_bounds_us[] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 30000000, 60000000,
+};
+
+#define FAMILY_COUNT (sizeof(g_families) / sizeof(g_families[0]))
+#define BOUND_COUNT (sizeof(g_bounds_us) / sizeof(g_bounds_us[0]))
+
+static struct metrics_shard *metrics_shard(void)
+{
+    struct metrics_shard *s = aligned_alloc(_Alignof(struct metrics_shard), sizeof(*s));
+    if (!s) {
+        return NULL;
+    }
+    for (size_t i = 0; i < DEMI_COUNTER_COUNT; i++) {
+        atomic_init(&s->counters[i], 0);
+    }
+
+    pthread_mutex_lock(&g_shards_lock);
+    s->next = g_shards;
+    g_shards = s;
+    pthread_mutex_unlock(&g_shards_lock);
+    t_shard = s;
+    return s;
+}
+
+void demi_metrics_add(enum demi_counter c, uint64_t n)
+{
+    struct metrics_shard *s = t_shard;
+
+    if (s || (s = metrics_shard())) {
+        /* Only this thread writes its shard: no read-modify-write needed */
+        uint64_t v = atomic_load_explicit(&s->counters[c], memory_order_relaxed);
+        atomic_store_explicit(&s->counters[c], v + n, memory_order_relaxed);
+        return;
+    }
+    atomic_fetch_add_explicit(&g_shared.counters[c], n, memory_order_relaxed);
+}
+
+uint64_t demi_metrics_get(enum demi_counter c)
+{
+    uint64_t sum = atomic_load_explicit(&g_shared.counters[c], memory_order_relaxed);
+
+    pthread_mutex_lock(&g_shards_lock);
+    for (struct metrics_shard *s = g_shards; s; s = s->next) {
+        sum += atomic_load_explicit(&s->counters[c], memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&g_shards_lock);
+    return sum;
+}
+
+void demi_metrics_latency(enum demi_latency l, uint64_t us)
+{
+    demi_hist_add(&g_latency[l], us);
+}
+
+void demi_metrics_write(FILE *out)
+{
+    char labels[64];
+
+    for (size_t f = 0; f < FAMILY_COUNT; f++) {
+        demi_prom_family(out, g_families[f].name, "counter", g_families[f].help);
+        for (enum demi_counter c = g_families[f].first; c <= g_families[f].last; c++) {
+            if (g_families[f].label) {
+                snprintf(labels, sizeof(labels), "%s=\"%s\"", g_families[f].label,
+                         g_families[f].values[c - g_families[f].first]);
+            }
+            demi_prom_sample(out, g_families[f].name, g_families[f].label ? labels : NULL,
+                             demi_metrics_get(c));
+        }
+    }
+    for (size_t l = 0; l < DEMI_LATENCY_COUNT; l++) {
+        demi_prom_family(out, g_latencies[l].name, "histogram", g_latencies[l].help);
+        demi_prom_hist(out, g_latencies[l].name, NULL, &g_latency[l]);
+    }
+}
+
+void demi_prom_family(FILE *out, const char *name, const char *type, const char *help)
+{
+    fprintf(out, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s %s\n", name, help, name, type);
+}
+
+void demi_prom_sample(FILE *out, const char *name, const char *labels, uint64_t value)
+{
+    fprintf(out, METRICS_PREFIX "%s%s%s%s %llu\n", name, labels ? "{" : "", labels ? labels : "",
+            labels ? "}" : "", (unsigned long long)value);
+}
+
+void demi_prom_seconds(FILE *out, const char *name, const char *labels, uint64_t us)
+{
+    fprintf(out, METRICS_PREFIX "%s%s%s%s %llu.%06llu\n", name, labels ? "{" : "", labels ? labels : "",
+            labels ? "}" : "", (unsigned long long)(us / 1000000), (unsigned long long)(us % 1000000));
+}
+
+void demi_prom_escape(char *out, size_t size, const char *value)
+{
+    size_t len = 0;
+
+    for (const char *p = value; *p && len + 2 < size; p++) {
+        if (*p == '\\' || *p == '"') {
+            out[len++] = '\\';
+            out[len++] = *p;
+        } else if (*p == '\n') {
+            out[len++] = '\\';
+            out[len++] = 'n';
+        } else {
+            out[len++] = *p;
+        }
+    }
+    out[len] = '\0';
+}
+
+/* Cumulative buckets at the fixed bounds, then +Inf, sum and count */
+void demi_prom_hist(FILE *out, const char *name, const char *labels, const struct demi_hist *h)
+{
+    const char *sep = labels ? "," : "";
+    char series[128];
+
+    if (!labels) {
+        labels = "";
+    }
+    for (size_t i = 0; i < BOUND_COUNT; i++) {
+        fprintf(out, METRICS_PREFIX "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep,
+                (double)g_bounds_us[i] / 1e6, (unsigned long long)demi_hist_count_le(h, g_bounds_us[i]));
+    }
+    fprintf(out, METRICS_PREFIX "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+            (unsigned long long)h->count);
+    snprintf(series, sizeof(series), "%s_sum", name);
+    demi_prom_seconds(out, series, *labels ? labels : NULL, h->sum);
+    snprintf(series, sizeof(series), "%s_count", name);
+    demi_prom_sample(out, series, *labels ? labels : NULL, h->count);
+}
@@ -0,0 +1,414 @@
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/demi.h"
+#include "../include/demi_metrics.h"
+#include "../include/demi_plugin.h"
+
+#define PLUGIN_TYPES (DEMI_RESYNC + 1)
+
+struct plugin_job {
+    struct plugin_job *next;
+    struct demi_plugins *p;
+    enum demi_event_type type;
+    struct demi_event de;
+    char devnode[DEMI_DEVNAME_MAX + 8];
+    demi_plugins_fn done;
+    void *arg;
+    int status;
+    unsigned long long started_us;      /* 0 until the worker picks it up */
+    int overrun;
+    struct demi_loop_source *timer;
+};
+
+struct plugin {
+    char *path;
+    void *handle;
+    demi_plugin_event_fn on_event;
+};
+
+struct demi_plugins {
+    struct demi_loop *loop;
+    unsigned long budget_ms;
+    struct plugin plugins[PLUGIN_TYPES];
+
+    /* Shared with the worker, under lock */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct plugin_job *queue;
+    struct plugin_job *queue_tail;
+    struct plugin_job *finished;
+    int stopping;
+
+    pthread_t thread;
+    int started;
+    int wake[2];        /* worker -> loop: calls have finished */
+    struct demi_loop_source *src;
+    struct plugin_job *stuck;   /* the call over budget, holding the worker */
+
+    unsigned long calls;
+    unsigned long returned;
+    unsigned long fallbacks;
+    unsigned long overruns;
+    unsigned long long latency_total_us;
+    unsigned long latency_max_us;
+};
+
+static unsigned long long plugin_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + (unsigned long long)ts.tv_nsec / 1000;
+}
+
+static void *plugin_worker(void *arg)
+{
+    struct demi_plugins *p = arg;
+
+    demi_metrics_lock(&p->lock, DEMI_CNT_LOCK_WAITS_PLUGIN);
+    for (;;) {
+        while (!p->queue && !p->stopping) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        if (p->stopping) {
+            break;
+        }
+
+        struct plugin_job *job = p->queue;
+        p->queue = job->next;
+        if (!p->queue) {
+            p->queue_tail = NULL;
+        }
+        job->started_us = plugin_now_us();
+        demi_plugin_event_fn fn = p->plugins[job->type].on_event;
+        pthread_mutex_unlock(&p->lock);
+
+        int status = fn(&job->de, job->devnode);
+
+        demi_metrics_lock(&p->lock, DEMI_CNT_LOCK_WAITS_PLUGIN);
+        job->status = status;
+        job->next = p->finished;
+        p->finished = job;
+        /* A full pipe already has a wakeup pending */
+        while (write(p->wake[1], "", 1) == -1 && errno == EINTR) {
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static void plugin_budget(void *arg);
+
+static void plugin_arm(struct plugin_job *job, unsigned long ms)
+{
+    job->timer = demi_loop_add_timer(job->p->loop, ms, plugin_budget, job);
+}
+
+static void plugin_budget(void *arg)
+{
+    struct plugin_job *job = arg;
+    struct demi_plugins *p = job->p;
+
+    job->timer = NULL;
+    demi_metrics_lock(&p->lock, DEMI_CNT_LOCK_WAITS_PLUGIN);
+    unsigned long long started_us = job->started_us;
+    pthread_mutex_unlock(&p->lock);
+
+    /* Still queued behind another call: its own budget has not started */
+    if (started_us == 0) {
+        plugin_arm(job, p->budget_ms);
+        return;
+    }
+    unsigned long long elapsed_ms = (plugin_now_us() - started_us) / 1000;
+    if (elapsed_ms < p->budget_ms) {
+        plugin_arm(job, p->budget_ms - (unsigned long)elapsed_ms);
+        return;
+    }
+
+    /* The one worker is held: nothing behind this call would run either */
+    demi_metrics_lock(&p->lock, DEMI_CNT_LOCK_WAITS_PLUGIN);
+    struct plugin_job *queued = p->queue;
+    p->queue = p->queue_tail = NULL;
+    pthread_mutex_unlock(&p->lock);
+
+    job->overrun = 1;
+    p->stuck = job;
+    p->overruns++;
+    demi_logf("plugin %s: %s still running after %lu ms, using helpers until it returns",
+              p->plugins[job->type].path, job->devnode, p->budget_ms);
+
+    while (queued) {
+        struct plugin_job *next = queued->next;
+        if (queued->timer) {
+            demi_loop_remove(p->loop, queued->timer);
+        }
+        p->fallbacks++;
+        queued->done(DEMI_PLUGIN_FALLBACK, queued->arg);
+        free(queued);
+        queued = next;
+    }
+}
+
+static void plugin_finish(struct demi_plugins *p, struct plugin_job *job)
+{
+    unsigned long latency = (unsigned long)(plugin_now_us() - job->started_us);
+
+    if (job->timer) {
+        demi_loop_remove(p->loop, job->timer);
+    }
+    if (job->overrun) {
+        demi_logf("plugin %s: %s returned after %lu ms", p->plugins[job->type].path,
+                  job->devnode, latency / 1000);
+        p->stuck = NULL;
+    }
+    p->returned++;
+    if (job->status == DEMI_PLUGIN_FALLBACK) {
+        p->fallbacks++;
+    }
+    p->latency_total_us += latency;
+    if (latency > p->latency_max_us) {
+        p->latency_max_us = latency;
+    }
+
+    job->done(job->status, job->arg);
+    free(job);
+}
+
+static void plugin_readable(void *arg)
+{
+    struct demi_plugins *p = arg;
+    char buf[64];
+
+    while (read(p->wake[0], buf, sizeof(buf)) > 0) {
+    }
+
+    demi_metrics_lock(&p->lock, DEMI_CNT_LOCK_WAITS_PLUGIN);
+    struct plugin_job *list = p->finished;
+    p->finished = NULL;
+    pthread_mutex_unlock(&p->lock);
+
+    /* Completed newest first; report them in order */
+    struct plugin_job *ordered = NULL;
+    while (list) {
+        struct plugin_job *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    while (ordered) {
+        struct plugin_job *next = ordered->next;
+        plugin_finish(p, ordered);
+        ordered = next;
+    }
+}
+
+struct demi_plugins *demi_plugins_create(struct demi_loop *loop, unsigned long budget_ms)
+{
+    struct demi_plugins *p = calloc(1, sizeof(*p));
+    if (!p) {
+        return NULL;
+    }
+    p->loop = loop;
+    p->budget_ms = budget_ms ? budget_ms : 1;
+    p->wake[0] = p->wake[1] = -1;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    if (pipe(p->wake) == -1) {
+        goto fail;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(p->wake[i], F_SETFD, FD_CLOEXEC);
+        fcntl(p->wake[i], F_SETFL, O_NONBLOCK);
+    }
+    p->src = demi_loop_add_fd(loop, p->wake[0], plugin_readable, p);
+    if (!p->src) {
+        goto fail;
+    }
+
+    /* Signals belong to the loop thread */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int rc = pthread_create(&p->thread, NULL, plugin_worker, p);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        errno = rc;
+        goto fail;
+    }
+    p->started = 1;
+    return p;
+
+fail:
+    demi_plugins_destroy(p);
+    return NULL;
+}
+
+int demi_plugins_load(struct demi_plugins *p, enum demi_event_type type, const char *path)
+{
+    if ((unsigned int)type >= PLUGIN_TYPES || p->plugins[type].handle) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        demi_logf("plugin %s: %s", path, dlerror());
+        errno = ENOENT;
+        return -1;
+    }
+
+    const unsigned int *abi = (const unsigned int *)dlsym(handle, "demi_plugin_abi");
+    if (!abi || *abi != DEMI_PLUGIN_ABI) {
+        if (abi) {
+            demi_logf("plugin %s: built for plugin ABI %u, this daemon has %u", path, *abi, DEMI_PLUGIN_ABI);
+        } else {
+            demi_logf("plugin %s: no demi_plugin_abi symbol (DEMI_PLUGIN_EXPORT_ABI)", path);
+        }
+        dlclose(handle);
+        errno = EINVAL;
+        return -1;
+    }
+
+    demi_plugin_event_fn on_event = (demi_plugin_event_fn)dlsym(handle, "on_event");
+    int (*on_load)(void) = (int (*)(void))dlsym(handle, "on_load");
+    if (!on_event) {
+        demi_logf("plugin %s: no on_event symbol", path);
+        dlclose(handle);
+        errno = EINVAL;
+        return -1;
+    }
+    if (on_load && on_load() != 0) {
+        demi_logf("plugin %s: refused to load", path);
+        dlclose(handle);
+        errno = ECANCELED;
+        return -1;
+    }
+
+    char *copy = strdup(path);
+    if (!copy) {
+        dlclose(handle);
+        errno = ENOMEM;
+        return -1;
+    }
+    p->plugins[type].path = copy;
+    p->plugins[type].handle = handle;
+    p->plugins[type].on_event = on_event;
+    return 0;
+}
+
+int demi_plugins_ready(const struct demi_plugins *p, enum demi_event_type type)
+{
+    return p && (unsigned int)type < PLUGIN_TYPES && p->plugins[type].on_event && !p->stuck;
+}
+
+int demi_plugins_call(struct demi_plugins *p, enum demi_event_type type, const struct demi_event *de,
+                      const char *devnode, demi_plugins_fn done, void *arg)
+{
+    if (!demi_plugins_ready(p, type)) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    struct plugin_job *job = calloc(1, sizeof(*job));
+    if (!job) {
+        return -1;
+    }
+    job->p = p;
+    job->type = type;
+    job->de = *de;
+    strncpy(job->devnode, devnode, sizeof(job->devnode) - 1);
+    job->done = done;
+    job->arg = arg;
+
+    plugin_arm(job, p->budget_ms);
+    if (!job->timer) {
+        free(job);
+        return -1;
+    }
+
+    demi_metrics_lock(&p->lock, DEMI_CNT_LOCK_WAITS_PLUGIN);
+    if (p->queue_tail) {
+        p->queue_tail->next = job;
+    } else {
+        p->queue = job;
+    }
+    p->queue_tail = job;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    p->calls++;
+    return 0;
+}
+
+void demi_plugins_stats(const struct demi_plugins *p, struct demi_plugins_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->calls = p->calls;
+    st->fallbacks = p->fallbacks;
+    st->overruns = p->overruns;
+    st->latency_avg_us = p->returned ? (unsigned long)(p->latency_total_us / p->returned) : 0;
+    st->latency_max_us = p->latency_max_us;
+}
+
+static void plugin_free_jobs(struct demi_plugins *p, struct plugin_job *job)
+{
+    while (job) {
+        struct plugin_job *next = job->next;
+        if (job->timer) {
+            demi_loop_remove(p->loop, job->timer);
+        }
+        free(job);
+        job = next;
+    }
+}
+
+void demi_plugins_destroy(struct demi_plugins *p)
+{
+    if (!p) {
+        return;
+    }
+
+    if (p->started) {
+        demi_metrics_lock(&p->lock, DEMI_CNT_LOCK_WAITS_PLUGIN);
+        p->stopping = 1;
+        pthread_cond_signal(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+        if (p->stuck) {
+            /* The worker still uses p and the plugin's code; leave both to exit() */
+            demi_logf("plugin %s: %s still running at shutdown, not waiting for it",
+                      p->plugins[p->stuck->type].path, p->stuck->devnode);
+            pthread_detach(p->thread);
+            demi_loop_remove(p->loop, p->src);
+            return;
+        }
+        pthread_join(p->thread, NULL);
+    }
+    plugin_free_jobs(p, p->queue);
+    plugin_free_jobs(p, p->finished);
+
+    if (p->src) {
+        demi_loop_remove(p->loop, p->src);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (p->wake[i] != -1) {
+            close(p->wake[i]);
+        }
+    }
+    for (int i = 0; i < PLUGIN_TYPES; i++) {
+        if (p->plugins[i].handle) {
+            dlclose(p->plugins[i].handle);
+        }
+        free(p->plugins[i].path);
+    }
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
@@ -0,0 +1,266 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/demi_pool.h"
+
+struct demi_pool {
+    /* Circular queue; grows past capacity only for spill and block */
+    void **queue;
+    size_t queue_cap;
+    size_t head;
+    size_t len;
+    size_t capacity;
+
+    enum demi_pool_overflow overflow;
+    demi_pool_start_fn start;
+    demi_pool_fn discard;
+
+    unsigned int slots;
+    unsigned int running;
+    unsigned long high_water;
+    unsigned long submitted;
+    unsigned long processed;
+    unsigned long dropped;
+    unsigned long spilled;
+
+    /* Slot-time integral for utilisation */
+    uint64_t busy_ns;
+    uint64_t busy_since_ns;
+    uint64_t snap_ns;
+    uint64_t snap_busy_ns;
+};
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Account the time spent at the current running count before it changes */
+static void note_busy(struct demi_pool *pool)
+{
+    uint64_t now = monotonic_ns();
+    pool->busy_ns += (uint64_t)pool->running * (now - pool->busy_since_ns);
+    pool->busy_since_ns = now;
+}
+
+static int queue_push(struct demi_pool *pool, void *job)
+{
+    if (pool->len == pool->queue_cap) {
+        size_t cap = pool->queue_cap * 2;
+        void **queue = malloc(cap * sizeof(*queue));
+        if (!queue) {
+            return -1;
+        }
+        for (size_t i = 0; i < pool->len; i++) {
+            queue[i] = pool->queue[(pool->head + i) % pool->queue_cap];
+        }
+        free(pool->queue);
+        pool->queue = queue;
+        pool->queue_cap = cap;
+        pool->head = 0;
+    }
+
+    pool->queue[(pool->head + pool->len) % pool->queue_cap] = job;
+    pool->len++;
+    if (pool->len > pool->high_water) {
+        pool->high_water = pool->len;
+    }
+    return 0;
+}
+
+static void *queue_pop(struct demi_pool *pool)
+{
+    if (pool->len == 0) {
+        return NULL;
+    }
+    void *job = pool->queue[pool->head];
+    pool->head = (pool->head + 1) % pool->queue_cap;
+    pool->len--;
+    return job;
+}
+
+static void pool_start(struct demi_pool *pool, void *job)
+{
+    note_busy(pool);
+    pool->running++;
+    if (pool->start(job) == -1) {
+        /* Ended without holding the slot */
+        note_busy(pool);
+        pool->running--;
+        pool->processed++;
+    }
+}
+
+/* The start callback may submit again; the queue is consistent at each call */
+static void pool_start_queued(struct demi_pool *pool)
+{
+    while (pool->running < pool->slots && pool->len > 0) {
+        pool_start(pool, queue_pop(pool));
+    }
+}
+
+struct demi_pool *demi_pool_create(unsigned int slots, unsigned int capacity,
+                                   enum demi_pool_overflow overflow,
+                                   demi_pool_start_fn start, demi_pool_fn discard)
+{
+    if (slots == 0 || capacity == 0 || !start) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct demi_pool *pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->queue = calloc(capacity, sizeof(*pool->queue));
+    if (!pool->queue) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->queue_cap = capacity;
+    pool->capacity = capacity;
+    pool->overflow = overflow;
+    pool->start = start;
+    pool->discard = discard;
+    pool->slots = slots;
+    pool->busy_since_ns = pool->snap_ns = monotonic_ns();
+    return pool;
+}
+
+int demi_pool_submit(struct demi_pool *pool, void *job)
+{
+    if (!pool || !job) {
+        errno = EINVAL;
+        return -1;
+    }
+    pool->submitted++;
+
+    /* Queued jobs go first so an idle slot never jumps the line */
+    if (pool->len == 0 && pool->running < pool->slots) {
+        pool_start(pool, job);
+        /* A start that failed at once may have queued follow-ups behind a free slot */
+        pool_start_queued(pool);
+        return 0;
+    }
+
+    void *oldest = NULL;
+    if (pool->len >= pool->capacity) {
+        switch (pool->overflow) {
+        case DEMI_POOL_BLOCK:
+            /* Kept anyway; demi_pool_full() tells the caller to back off */
+            break;
+        case DEMI_POOL_DROP_OLDEST:
+            oldest = queue_pop(pool);
+            pool->dropped++;
+            break;
+        case DEMI_POOL_SPILL:
+            pool->spilled++;
+            break;
+        }
+    }
+
+    int rc = queue_push(pool, job);
+    if (rc == -1) {
+        pool->submitted--;
+    }
+    /* Discard last: it may submit again, and must find the queue whole and bounded */
+    if (oldest && pool->discard) {
+        pool->discard(oldest);
+    }
+    if (rc == -1) {
+        errno = ENOMEM;
+    }
+    return rc;
+}
+
+void demi_pool_done(struct demi_pool *pool)
+{
+    if (!pool || pool->running == 0) {
+        return;
+    }
+
+    note_busy(pool);
+    pool->running--;
+    pool->processed++;
+    pool_start_queued(pool);
+}
+
+int demi_pool_full(const struct demi_pool *pool)
+{
+    return pool->overflow == DEMI_POOL_BLOCK && pool->len >= pool->capacity;
+}
+
+void demi_pool_stats(struct demi_pool *pool, struct demi_pool_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    if (!pool) {
+        return;
+    }
+
+    note_busy(pool);
+    uint64_t now = pool->busy_since_ns;
+    uint64_t wall = now - pool->snap_ns;
+    if (wall > 0) {
+        st->utilisation = (double)(pool->busy_ns - pool->snap_busy_ns) / ((double)wall * pool->slots);
+        if (st->utilisation > 1.0) {
+            st->utilisation = 1.0;
+        }
+    }
+    pool->snap_ns = now;
+    pool->snap_busy_ns = pool->busy_ns;
+
+    st->depth = pool->len;
+    st->high_water = pool->high_water;
+    st->submitted = pool->submitted;
+    st->processed = pool->processed;
+    st->dropped = pool->dropped;
+    st->spilled = pool->spilled;
+    st->slots = pool->slots;
+    st->running = pool->running;
+}
+
+void demi_pool_destroy(struct demi_pool *pool)
+{
+    if (!pool) {
+        return;
+    }
+
+    void *job;
+    while ((job = queue_pop(pool))) {
+        if (pool->discard) {
+            pool->discard(job);
+        }
+    }
+    free(pool->queue);
+    free(pool);
+}
+
+int demi_pool_overflow_parse(const char *name, enum demi_pool_overflow *out)
+{
+    if (strcmp(name, "block") == 0) {
+        *out = DEMI_POOL_BLOCK;
+    } else if (strcmp(name, "drop-oldest") == 0) {
+        *out = DEMI_POOL_DROP_OLDEST;
+    } else if (strcmp(name, "spill") == 0) {
+        *out = DEMI_POOL_SPILL;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+const char *demi_pool_overflow_name(enum demi_pool_overflow overflow)
+{
+    switch (overflow) {
+    case DEMI_POOL_BLOCK: return "block";
+    case DEMI_POOL_DROP_OLDEST: return "drop-oldest";
+    case DEMI_POOL_SPILL: return "spill";
+    }
+    return "unknown";
+}
@@ -0,0 +1,55 @@
+#include <string.h>
+#include <time.h>
+
+#include "../include/demi_rate.h"
+
+#define RATE_SLOT_MS (1000 / DEMI_RATE_SLOTS)
+
+/* Move the newest slot up to now, clearing the slots skipped on the way */
+static void rate_advance(struct demi_rate *r, unsigned long long now_ms)
+{
+    if (now_ms < r->slot_start + RATE_SLOT_MS) {
+        return;
+    }
+
+    unsigned long long steps = (now_ms - r->slot_start) / RATE_SLOT_MS;
+    if (steps >= DEMI_RATE_SLOTS) {
+        memset(r->count, 0, sizeof(r->count));
+    } else {
+        for (unsigned long long i = 0; i < steps; i++) {
+            r->newest = (r->newest + 1) % DEMI_RATE_SLOTS;
+            r->count[r->newest] = 0;
+        }
+    }
+    r->slot_start += steps * RATE_SLOT_MS;
+}
+
+void demi_rate_init(struct demi_rate *r, unsigned long long now_ms)
+{
+    memset(r, 0, sizeof(*r));
+    r->slot_start = now_ms;
+}
+
+void demi_rate_add(struct demi_rate *r, unsigned long long now_ms, unsigned long n)
+{
+    rate_advance(r, now_ms);
+    r->count[r->newest] += n;
+}
+
+unsigned long demi_rate_get(struct demi_rate *r, unsigned long long now_ms)
+{
+    unsigned long total = 0;
+
+    rate_advance(r, now_ms);
+    for (unsigned int i = 0; i < DEMI_RATE_SLOTS; i++) {
+        total += r->count[i];
+    }
+    return total;
+}
+
+unsigned long long demi_rate_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + (unsigned long long)ts.tv_nsec / 1000000;
+}
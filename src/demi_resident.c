@@ -0,0 +1,502 @@
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "../include/demi.h"
+#include "../include/demi_resident.h"
+#include "../include/demi_spawn.h"
+
+extern char **environ;
+
+/* Restart a helper that died sooner than this after starting only after a pause */
+#define RESIDENT_MIN_UPTIME_MS 1000
+
+struct resident_record {
+    struct resident_record *next;
+    unsigned long seq;
+    int sent;
+    unsigned long long sent_us;
+    demi_resident_fn done;
+    void *arg;
+    size_t len;
+    char body[];
+};
+
+struct demi_resident {
+    struct demi_loop *loop;
+    char *path;
+    unsigned int max_inflight;
+    unsigned long kill_grace_ms;
+    pid_t pid;
+    int in_fd;          /* helper's stdin */
+    int out_fd;         /* helper's stdout: acknowledgements */
+    struct demi_loop_source *src;
+    struct demi_loop_source *restart_timer;
+    struct demi_loop_source *kill_timer;    /* SIGKILL for a group sent SIGTERM */
+    pid_t kill_pid;
+    unsigned long long started_us;
+    struct resident_record *head;       /* oldest first; sent ones lead */
+    struct resident_record *tail;
+    unsigned long next_seq;
+    char line[64];
+    size_t line_len;
+    unsigned long sent;
+    unsigned long acked;
+    unsigned long lost;
+    unsigned long restarts;
+    unsigned long inflight;
+    unsigned long waiting;
+    unsigned long long latency_total_us;
+    unsigned long latency_max_us;
+};
+
+static unsigned long long resident_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + (unsigned long long)ts.tv_nsec / 1000;
+}
+
+static void resident_readable(void *arg);
+static void resident_died(struct demi_resident *r);
+
+static void resident_signal(pid_t pid, int signo)
+{
+    if (kill(-pid, signo) == -1 && errno == ESRCH) {
+        kill(pid, signo);   /* it left its group */
+    }
+}
+
+static int resident_start(struct demi_resident *r)
+{
+    int in[2], out[2];
+
+    if (demi_helper_channel(in, out) == -1) {
+        return -1;
+    }
+
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+
+    if (demi_helper_spawnattr(&attr) == -1) {
+        int saved = errno;
+        for (int i = 0; i < 2; i++) {
+            close(in[i]);
+            close(out[i]);
+        }
+        errno = saved;
+        return -1;
+    }
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, in[1], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, out[1], STDOUT_FILENO);
+
+    char *argv[] = { r->path, NULL };
+    int rc = posix_spawn(&r->pid, r->path, &fa, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    close(in[1]);
+    close(out[1]);
+    if (rc != 0) {
+        close(in[0]);
+        close(out[0]);
+        r->pid = -1;
+        errno = rc;
+        return -1;
+    }
+
+    r->in_fd = in[0];
+    r->out_fd = out[0];
+    r->line_len = 0;
+    r->started_us = resident_now_us();
+    r->src = demi_loop_add_fd(r->loop, r->out_fd, resident_readable, r);
+    if (!r->src) {
+        int saved = errno;
+        close(r->in_fd);
+        close(r->out_fd);
+        r->in_fd = r->out_fd = -1;
+        resident_signal(r->pid, SIGKILL);
+        while (waitpid(r->pid, NULL, 0) == -1 && errno == EINTR) {
+        }
+        r->pid = -1;
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+static int resident_send(struct demi_resident *r, struct resident_record *rec)
+{
+    char header[48];
+    int hlen = snprintf(header, sizeof(header), "EVENT %lu\n", rec->seq);
+    struct iovec iov[3] = {
+        { header, (size_t)hlen },
+        { rec->body, rec->len },
+        { "\n", 1 },
+    };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 3 };
+    size_t total = (size_t)hlen + rec->len + 1;
+    size_t off = 0;
+
+    while (off < total) {
+        ssize_t n = sendmsg(r->in_fd, &msg, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        off += (size_t)n;
+
+        /* Short write: skip what went out */
+        while (n > 0 && msg.msg_iovlen > 0) {
+            if ((size_t)n < msg.msg_iov->iov_len) {
+                msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+                msg.msg_iov->iov_len -= (size_t)n;
+                break;
+            }
+            n -= (ssize_t)msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+    }
+
+    rec->sent = 1;
+    rec->sent_us = resident_now_us();
+    r->sent++;
+    r->inflight++;
+    r->waiting--;
+    return 0;
+}
+
+/* Send waiting records while the helper is up and below its in-flight limit */
+static void resident_pump(struct demi_resident *r)
+{
+    for (struct resident_record *rec = r->head; rec && r->in_fd != -1; rec = rec->next) {
+        if (rec->sent) {
+            continue;
+        }
+        if (r->inflight >= r->max_inflight) {
+            return;
+        }
+        if (resident_send(r, rec) == -1) {
+            demi_logf("resident helper %s: write failed: %s", r->path, strerror(errno));
+            resident_signal(r->pid, SIGKILL);
+            resident_died(r);
+            return;
+        }
+    }
+}
+
+static void resident_unlink(struct demi_resident *r, struct resident_record *prev, struct resident_record *rec)
+{
+    if (prev) {
+        prev->next = rec->next;
+    } else {
+        r->head = rec->next;
+    }
+    if (r->tail == rec) {
+        r->tail = prev;
+    }
+}
+
+static void resident_ack(struct demi_resident *r, unsigned long seq, int status)
+{
+    struct resident_record *prev = NULL, *rec = r->head;
+
+    while (rec && rec->seq != seq) {
+        prev = rec;
+        rec = rec->next;
+    }
+    if (!rec || !rec->sent) {
+        demi_logf("resident helper %s: acknowledged unknown record %lu", r->path, seq);
+        return;
+    }
+    resident_unlink(r, prev, rec);
+
+    unsigned long latency = (unsigned long)(resident_now_us() - rec->sent_us);
+    r->latency_total_us += latency;
+    if (latency > r->latency_max_us) {
+        r->latency_max_us = latency;
+    }
+    r->acked++;
+    r->inflight--;
+
+    rec->done(status, rec->arg);
+    free(rec);
+}
+
+static void resident_restart(void *arg)
+{
+    struct demi_resident *r = (struct demi_resident *)arg;
+
+    r->restart_timer = NULL;
+    if (resident_start(r) == -1) {
+        demi_logf("cannot restart resident helper %s: %s", r->path, strerror(errno));
+        r->restart_timer = demi_loop_add_timer(r->loop, RESIDENT_MIN_UPTIME_MS, resident_restart, r);
+        return;
+    }
+    r->restarts++;
+    resident_pump(r);
+}
+
+/* The grace period after SIGTERM is over */
+static void resident_kill(void *arg)
+{
+    struct demi_resident *r = (struct demi_resident *)arg;
+
+    r->kill_timer = NULL;
+    demi_logf("resident helper %s (pid %d) outlived SIGTERM, killing it", r->path, (int)r->kill_pid);
+    resident_signal(r->kill_pid, SIGKILL);
+}
+
+static void resident_reaped(pid_t pid, int status, const struct rusage *usage, void *arg)
+{
+    struct demi_resident *r = (struct demi_resident *)arg;
+    (void)usage;
+    unsigned long long uptime_ms = (resident_now_us() - r->started_us) / 1000;
+
+    if (r->kill_timer) {
+        /* The leader gave in; nothing else it started outlives the timeout either */
+        demi_loop_remove(r->loop, r->kill_timer);
+        r->kill_timer = NULL;
+        kill(-pid, SIGKILL);
+    }
+
+    demi_logf("resident helper %s (pid %d) exited with status %d, restarting", r->path, (int)pid, status);
+    r->pid = -1;
+    r->restart_timer = demi_loop_add_timer(r->loop,
+                                           uptime_ms < RESIDENT_MIN_UPTIME_MS ? RESIDENT_MIN_UPTIME_MS : 0,
+                                           resident_restart, r);
+}
+
+/* Unacknowledged records are lost; waiting ones stay for the next instance */
+static void resident_died(struct demi_resident *r)
+{
+    if (r->out_fd == -1) {
+        return;     /* already handled */
+    }
+    if (r->src) {
+        demi_loop_remove(r->loop, r->src);
+        r->src = NULL;
+    }
+    if (r->in_fd != -1) {
+        close(r->in_fd);
+        r->in_fd = -1;
+    }
+    if (r->out_fd != -1) {
+        close(r->out_fd);
+        r->out_fd = -1;
+    }
+
+    if (r->pid != -1 && !demi_loop_add_pid(r->loop, r->pid, resident_reaped, r)) {
+        int status = -1;
+        while (waitpid(r->pid, &status, 0) == -1 && errno == EINTR) {
+        }
+        resident_reaped(r->pid, status, NULL, r);
+    }
+
+    struct resident_record *prev = NULL, *rec = r->head;
+    while (rec) {
+        struct resident_record *next = rec->next;
+        if (rec->sent) {
+            resident_unlink(r, prev, rec);
+            r->inflight--;
+            r->lost++;
+            rec->done(-1, rec->arg);
+            free(rec);
+        } else {
+            prev = rec;
+        }
+        rec = next;
+    }
+}
+
+static void resident_line(struct demi_resident *r)
+{
+    char *end;
+    unsigned long seq = strtoul(r->line, &end, 10);
+    if (end == r->line || *end != ' ') {
+        demi_logf("resident helper %s: bad acknowledgement '%s'", r->path, r->line);
+        return;
+    }
+    resident_ack(r, seq, atoi(end + 1));
+}
+
+static void resident_readable(void *arg)
+{
+    struct demi_resident *r = (struct demi_resident *)arg;
+    char buf[512];
+    ssize_t n;
+
+    while ((n = read(r->out_fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            if (buf[i] != '\n') {
+                if (r->line_len < sizeof(r->line) - 1) {
+                    r->line[r->line_len++] = buf[i];
+                }
+                continue;
+            }
+            r->line[r->line_len] = '\0';
+            r->line_len = 0;
+            resident_line(r);
+        }
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        resident_died(r);
+        return;
+    }
+    resident_pump(r);
+}
+
+struct demi_resident *demi_resident_create(struct demi_loop *loop, const char *path,
+                                           unsigned int max_inflight, unsigned long kill_grace_ms)
+{
+    if (!loop || !path || max_inflight == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct demi_resident *r = calloc(1, sizeof(*r));
+    if (!r) {
+        return NULL;
+    }
+    r->path = strdup(path);
+    if (!r->path) {
+        free(r);
+        return NULL;
+    }
+    r->loop = loop;
+    r->max_inflight = max_inflight;
+    r->kill_grace_ms = kill_grace_ms;
+    r->pid = -1;
+    r->in_fd = r->out_fd = -1;
+    r->next_seq = 1;
+
+    if (resident_start(r) == -1) {
+        int saved = errno;
+        free(r->path);
+        free(r);
+        errno = saved;
+        return NULL;
+    }
+    return r;
+}
+
+int demi_resident_submit(struct demi_resident *r, const char *body, size_t len,
+                         demi_resident_fn done, void *arg)
+{
+    struct resident_record *rec = malloc(sizeof(*rec) + len);
+    if (!rec) {
+        return -1;
+    }
+    rec->next = NULL;
+    rec->seq = r->next_seq++;
+    rec->sent = 0;
+    rec->done = done;
+    rec->arg = arg;
+    rec->len = len;
+    memcpy(rec->body, body, len);
+
+    if (r->tail) {
+        r->tail->next = rec;
+    } else {
+        r->head = rec;
+    }
+    r->tail = rec;
+    r->waiting++;
+
+    resident_pump(r);
+    return 0;
+}
+
+int demi_resident_expire(struct demi_resident *r, void *arg)
+{
+    struct resident_record *prev = NULL, *rec = r->head;
+
+    while (rec && rec->arg != arg) {
+        prev = rec;
+        rec = rec->next;
+    }
+    if (!rec) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (rec->sent && r->pid != -1) {
+        demi_logf("resident helper %s (pid %d) did not acknowledge record %lu in time, terminating it",
+                  r->path, (int)r->pid, rec->seq);
+        resident_signal(r->pid, SIGTERM);
+        r->kill_pid = r->pid;
+        r->kill_timer = demi_loop_add_timer(r->loop, r->kill_grace_ms, resident_kill, r);
+        if (!r->kill_timer) {
+            resident_signal(r->pid, SIGKILL);
+        }
+        resident_died(r);
+        return 0;
+    }
+
+    resident_unlink(r, prev, rec);
+    if (rec->sent) {
+        r->inflight--;
+    } else {
+        r->waiting--;
+    }
+    r->lost++;
+    rec->done(-1, rec->arg);
+    free(rec);
+    return 0;
+}
+
+void demi_resident_stats(const struct demi_resident *r, struct demi_resident_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    if (!r) {
+        return;
+    }
+    st->sent = r->sent;
+    st->acked = r->acked;
+    st->lost = r->lost;
+    st->restarts = r->restarts;
+    st->inflight = r->inflight;
+    st->waiting = r->waiting;
+    st->latency_avg_us = r->acked ? (unsigned long)(r->latency_total_us / r->acked) : 0;
+    st->latency_max_us = r->latency_max_us;
+}
+
+void demi_resident_destroy(struct demi_resident *r)
+{
+    if (!r) {
+        return;
+    }
+
+    if (r->restart_timer) {
+        demi_loop_remove(r->loop, r->restart_timer);
+    }
+    if (r->kill_timer) {
+        demi_loop_remove(r->loop, r->kill_timer);
+    }
+    if (r->src) {
+        demi_loop_remove(r->loop, r->src);
+    }
+    /* End of input tells the helper to finish up */
+    if (r->in_fd != -1) {
+        close(r->in_fd);
+    }
+    if (r->out_fd != -1) {
+        close(r->out_fd);
+    }
+    while (r->head) {
+        struct resident_record *next = r->head->next;
+        free(r->head);
+        r->head = next;
+    }
+    free(r->path);
+    free(r);
+}
@@ -0,0 +1,397 @@
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "../include/demi.h"
+#include "../include/demi_shpool.h"
+#include "../include/demi_spawn.h"
+
+extern char **environ;
+
+#define SHPOOL_SHELL "/bin/sh"
+#define SHPOOL_STATUS_FD 3
+#define SHPOOL_CMD_MAX 65536
+#define SHPOOL_MIN_UPTIME_MS 1000
+
+struct shell {
+    struct demi_shpool *pool;
+    pid_t pid;
+    int cmd_fd;         /* the shell's stdin */
+    int status_fd;      /* its fd 3: one exit status per line */
+    struct demi_loop_source *src;
+    struct demi_loop_source *restart_timer;
+    unsigned long long started_ms;
+    int busy;
+    demi_shpool_fn done;
+    void *arg;
+    char line[32];
+    size_t line_len;
+};
+
+struct demi_shpool {
+    struct demi_loop *loop;
+    unsigned int nshells;
+    unsigned long runs;
+    unsigned long restarts;
+    struct shell shells[];
+};
+
+static unsigned long long shpool_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + (unsigned long long)ts.tv_nsec / 1000000;
+}
+
+static void shell_readable(void *arg);
+
+static int shell_start(struct shell *sh)
+{
+    int cmd[2], status[2];
+
+    if (demi_helper_channel(cmd, status) == -1) {
+        return -1;
+    }
+
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+
+    if (demi_helper_spawnattr(&attr) == -1) {
+        int saved = errno;
+        for (int i = 0; i < 2; i++) {
+            close(cmd[i]);
+            close(status[i]);
+        }
+        errno = saved;
+        return -1;
+    }
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, cmd[1], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, status[1], SHPOOL_STATUS_FD);
+
+    char *argv[] = { "sh", NULL };
+    int rc = posix_spawn(&sh->pid, SHPOOL_SHELL, &fa, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    close(cmd[1]);
+    close(status[1]);
+    if (rc != 0) {
+        close(cmd[0]);
+        close(status[0]);
+        errno = rc;
+        return -1;
+    }
+
+    sh->cmd_fd = cmd[0];
+    sh->status_fd = status[0];
+    sh->started_ms = shpool_now_ms();
+    sh->busy = 0;
+    sh->line_len = 0;
+    sh->src = demi_loop_add_fd(sh->pool->loop, sh->status_fd, shell_readable, sh);
+    if (!sh->src) {
+        int saved = errno;
+        close(sh->cmd_fd);
+        close(sh->status_fd);
+        sh->cmd_fd = sh->status_fd = -1;
+        kill(sh->pid, SIGKILL);
+        while (waitpid(sh->pid, NULL, 0) == -1 && errno == EINTR) {
+        }
+        sh->pid = -1;
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+static void shell_close(struct shell *sh)
+{
+    if (sh->src) {
+        demi_loop_remove(sh->pool->loop, sh->src);
+        sh->src = NULL;
+    }
+    if (sh->cmd_fd != -1) {
+        close(sh->cmd_fd);
+        sh->cmd_fd = -1;
+    }
+    if (sh->status_fd != -1) {
+        close(sh->status_fd);
+        sh->status_fd = -1;
+    }
+}
+
+static void shell_restart(void *arg)
+{
+    struct shell *sh = (struct shell *)arg;
+
+    sh->restart_timer = NULL;
+    if (shell_start(sh) == -1) {
+        demi_logf("cannot restart warm shell: %s", strerror(errno));
+        sh->restart_timer = demi_loop_add_timer(sh->pool->loop, SHPOOL_MIN_UPTIME_MS, shell_restart, sh);
+        return;
+    }
+    sh->pool->restarts++;
+}
+
+/* A shell that keeps dying right away is restarted at most once a second */
+static void shell_reaped(pid_t pid, int status, const struct rusage *usage, void *arg)
+{
+    struct shell *sh = (struct shell *)arg;
+    (void)usage;
+    unsigned long long uptime_ms = shpool_now_ms() - sh->started_ms;
+
+    demi_logf("warm shell (pid %d) exited with status %d, restarting", (int)pid, status);
+    sh->pid = -1;
+    sh->restart_timer = demi_loop_add_timer(sh->pool->loop,
+                                            uptime_ms < SHPOOL_MIN_UPTIME_MS ? SHPOOL_MIN_UPTIME_MS : 0,
+                                            shell_restart, sh);
+}
+
+/* The shell went away: report its run as lost and replace it once reaped */
+static void shell_died(struct shell *sh)
+{
+    demi_shpool_fn done = sh->busy ? sh->done : NULL;
+    void *arg = sh->arg;
+
+    shell_close(sh);
+    sh->busy = 0;
+    if (!demi_loop_add_pid(sh->pool->loop, sh->pid, shell_reaped, sh)) {
+        int status = -1;
+        while (waitpid(sh->pid, &status, 0) == -1 && errno == EINTR) {
+        }
+        shell_reaped(sh->pid, status, NULL, sh);
+    }
+    if (done) {
+        done(-1, arg);
+    }
+}
+
+static void shell_readable(void *arg)
+{
+    struct shell *sh = (struct shell *)arg;
+    char buf[64];
+    ssize_t n;
+
+    while ((n = read(sh->status_fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            if (buf[i] != '\n') {
+                if (sh->line_len < sizeof(sh->line) - 1) {
+                    sh->line[sh->line_len++] = buf[i];
+                }
+                continue;
+            }
+
+            sh->line[sh->line_len] = '\0';
+            sh->line_len = 0;
+            if (!sh->busy) {
+                continue;
+            }
+            sh->busy = 0;
+            sh->done(atoi(sh->line), sh->arg);
+        }
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        shell_died(sh);
+    }
+}
+
+struct demi_shpool *demi_shpool_create(struct demi_loop *loop, unsigned int shells)
+{
+    if (!loop || shells == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct demi_shpool *pool = calloc(1, sizeof(*pool) + shells * sizeof(struct shell));
+    if (!pool) {
+        return NULL;
+    }
+    pool->loop = loop;
+    pool->nshells = shells;
+
+    for (unsigned int i = 0; i < shells; i++) {
+        struct shell *sh = &pool->shells[i];
+        sh->pool = pool;
+        sh->pid = -1;
+        sh->cmd_fd = sh->status_fd = -1;
+        if (shell_start(sh) == -1) {
+            int saved = errno;
+            pool->nshells = i;
+            demi_shpool_destroy(pool);
+            errno = saved;
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+/* Append s to buf in single quotes */
+static int shell_quote(char *buf, size_t *len, const char *s)
+{
+    if (*len + 3 > SHPOOL_CMD_MAX) {
+        return -1;
+    }
+    buf[(*len)++] = '\'';
+    for (; *s; s++) {
+        if (*len + 6 > SHPOOL_CMD_MAX) {
+            return -1;
+        }
+        if (*s == '\'') {
+            memcpy(buf + *len, "'\\''", 4);
+            *len += 4;
+        } else {
+            buf[(*len)++] = *s;
+        }
+    }
+    buf[(*len)++] = '\'';
+    buf[(*len)++] = ' ';
+    return 0;
+}
+
+/* Append "export NAME='value'; " for a NAME=value pair */
+static int shell_export(char *buf, size_t *len, const char *var)
+{
+    const char *eq = strchr(var, '=');
+    size_t name_len = eq ? (size_t)(eq - var) : 0;
+
+    if (name_len == 0 || strspn(var, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_") != name_len) {
+        return 0;   /* not a name sh can take */
+    }
+    if (*len + sizeof("export =") + name_len > SHPOOL_CMD_MAX) {
+        return -1;
+    }
+    memcpy(buf + *len, "export ", 7);
+    *len += 7;
+    memcpy(buf + *len, var, name_len + 1);
+    *len += name_len + 1;
+    if (shell_quote(buf, len, eq + 1) == -1 || *len + 2 > SHPOOL_CMD_MAX) {
+        return -1;
+    }
+    buf[(*len)++] = ';';
+    buf[(*len)++] = ' ';
+    return 0;
+}
+
+int demi_shpool_run(struct demi_shpool *pool, const char *script, const char *const *devnodes,
+                    size_t count, char *const *env, size_t nenv, demi_shpool_fn done, void *arg)
+{
+    static char cmd[SHPOOL_CMD_MAX];
+    struct shell *sh = NULL;
+
+    for (unsigned int i = 0; i < pool->nshells; i++) {
+        if (!pool->shells[i].busy && pool->shells[i].cmd_fd != -1) {
+            sh = &pool->shells[i];
+            break;
+        }
+    }
+    if (!sh) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    /* ( export ...; set -- 'dev'...; . 'script' ) </dev/null 3>&-; echo $? >&3 */
+    size_t len = 0;
+    memcpy(cmd, "( ", 2);
+    len = 2;
+    for (size_t i = 0; i < nenv; i++) {
+        if (shell_export(cmd, &len, env[i]) == -1) {
+            errno = E2BIG;
+            return -1;
+        }
+    }
+    memcpy(cmd + len, "set -- ", 7);
+    len += 7;
+    for (size_t i = 0; i < count; i++) {
+        if (shell_quote(cmd, &len, devnodes[i]) == -1) {
+            errno = E2BIG;
+            return -1;
+        }
+    }
+    static const char dot[] = "; . ";
+    memcpy(cmd + len, dot, sizeof(dot) - 1);
+    len += sizeof(dot) - 1;
+    if (shell_quote(cmd, &len, script) == -1) {
+        errno = E2BIG;
+        return -1;
+    }
+    int n = snprintf(cmd + len, SHPOOL_CMD_MAX - len, ") </dev/null %d>&-; echo $? >&%d\n",
+                     SHPOOL_STATUS_FD, SHPOOL_STATUS_FD);
+    if (n < 0 || (size_t)n >= SHPOOL_CMD_MAX - len) {
+        errno = E2BIG;
+        return -1;
+    }
+    len += (size_t)n;
+
+    size_t off = 0;
+    while (off < len) {
+        ssize_t w = send(sh->cmd_fd, cmd + off, len - off, MSG_NOSIGNAL);
+        if (w == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int saved = errno;
+            shell_died(sh);
+            errno = saved;
+            return -1;
+        }
+        off += (size_t)w;
+    }
+
+    sh->busy = 1;
+    sh->done = done;
+    sh->arg = arg;
+    pool->runs++;
+    return 0;
+}
+
+int demi_shpool_kill(struct demi_shpool *pool, void *arg, int signo)
+{
+    for (unsigned int i = 0; pool && i < pool->nshells; i++) {
+        struct shell *sh = &pool->shells[i];
+        if (sh->busy && sh->arg == arg && sh->pid > 0) {
+            return kill(-sh->pid, signo) == -1 ? -1 : sh->pid;
+        }
+    }
+    errno = ESRCH;
+    return -1;
+}
+
+void demi_shpool_stats(const struct demi_shpool *pool, struct demi_shpool_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    if (!pool) {
+        return;
+    }
+    st->shells = pool->nshells;
+    for (unsigned int i = 0; i < pool->nshells; i++) {
+        st->busy += pool->shells[i].busy ? 1 : 0;
+    }
+    st->runs = pool->runs;
+    st->restarts = pool->restarts;
+}
+
+void demi_shpool_destroy(struct demi_shpool *pool)
+{
+    if (!pool) {
+        return;
+    }
+
+    /* End of input makes an idle shell exit; a busy one finishes its helper first */
+    for (unsigned int i = 0; i < pool->nshells; i++) {
+        struct shell *sh = &pool->shells[i];
+        if (sh->restart_timer) {
+            demi_loop_remove(pool->loop, sh->restart_timer);
+        }
+        shell_close(sh);
+        if (sh->pid != -1) {
+            waitpid(sh->pid, NULL, WNOHANG);
+        }
+    }
+    free(pool);
+}
@@ -0,0 +1,409 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "../include/demi.h"
+#include "../include/demi_spawn.h"
+#include "../include/demi_zygote.h"
+
+extern char **environ;
+
+/* O_PATH pins the directory without granting read access (Linux, FreeBSD 14+) */
+#ifdef O_PATH
+#define DEMI_DIR_OPEN_FLAGS (O_PATH | O_DIRECTORY | O_CLOEXEC)
+#else
+#define DEMI_DIR_OPEN_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#endif
+
+struct helper_entry {
+    const char *action;
+    int optional;       /* no warning when it is missing */
+    char *path;         /* absolute path, NULL if missing or not executable */
+    int sh_script;      /* starts with #!/bin/sh, so a warm shell can source it */
+};
+
+static struct helper_entry g_helpers[] = {
+    { "attach", 0, NULL, 0 },
+    { "detach", 0, NULL, 0 },
+    { "change", 0, NULL, 0 },
+    { "reconcile", 1, NULL, 0 },    /* run without devices after an event storm */
+    { "resident", 1, NULL, 0 },     /* takes every action's events on its stdin */
+};
+
+#define HELPER_COUNT (sizeof(g_helpers) / sizeof(g_helpers[0]))
+
+static pthread_rwlock_t g_helpers_lock = PTHREAD_RWLOCK_INITIALIZER;
+static char *g_helper_dir = NULL;
+static int g_helper_dir_fd = -1;
+static int g_watch_fd = -1;
+static posix_spawnattr_t g_spawn_attr;
+
+static struct helper_entry *find_helper(const char *action)
+{
+    for (size_t i = 0; i < HELPER_COUNT; i++) {
+        if (strcmp(g_helpers[i].action, action) == 0) {
+            return &g_helpers[i];
+        }
+    }
+    return NULL;
+}
+
+static int is_sh_script(const char *action)
+{
+    static const char shebang[] = "#!/bin/sh";
+    char head[sizeof(shebang)];
+    ssize_t n = -1;
+
+    int fd = openat(g_helper_dir_fd, action, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        n = read(fd, head, sizeof(head));
+        close(fd);
+    }
+    if (n < (ssize_t)sizeof(shebang) - 1 || memcmp(head, shebang, sizeof(shebang) - 1) != 0) {
+        return 0;
+    }
+    /* "#!/bin/sh" alone or followed by options, not "#!/bin/shfoo" */
+    return n == (ssize_t)sizeof(shebang) - 1 || head[sizeof(shebang) - 1] == '\n' ||
+           head[sizeof(shebang) - 1] == ' ' || head[sizeof(shebang) - 1] == '\t';
+}
+
+/* Caller holds the write lock */
+static void resolve_helpers(void)
+{
+    for (size_t i = 0; i < HELPER_COUNT; i++) {
+        struct helper_entry *h = &g_helpers[i];
+        struct stat st;
+
+        free(h->path);
+        h->path = NULL;
+        h->sh_script = 0;
+
+        if (fstatat(g_helper_dir_fd, h->action, &st, 0) == -1 || !S_ISREG(st.st_mode) ||
+            faccessat(g_helper_dir_fd, h->action, X_OK, 0) == -1) {
+            continue;
+        }
+
+        size_t needed = strlen(g_helper_dir) + 1 + strlen(h->action) + 1;
+        h->path = malloc(needed);
+        if (h->path) {
+            snprintf(h->path, needed, "%s/%s", g_helper_dir, h->action);
+            h->sh_script = is_sh_script(h->action);
+        }
+    }
+}
+
+int demi_helper_spawnattr(posix_spawnattr_t *attr)
+{
+    /* Helpers must not inherit the daemon's blocked signals or handlers */
+    sigset_t none, defaults;
+    sigemptyset(&none);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    sigaddset(&defaults, SIGHUP);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGTERM);
+    sigaddset(&defaults, SIGCHLD);
+
+    int rc = posix_spawnattr_init(attr);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    posix_spawnattr_setsigmask(attr, &none);
+    posix_spawnattr_setsigdefault(attr, &defaults);
+    posix_spawnattr_setpgroup(attr, 0);
+    posix_spawnattr_setflags(attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+    return 0;
+}
+
+int demi_helper_channel(int in[2], int out[2])
+{
+    /* A socket, not a pipe, so a dead helper costs EPIPE and not SIGPIPE */
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, in) == -1) {
+        return -1;
+    }
+    if (pipe(out) == -1) {
+        int saved = errno;
+        close(in[0]);
+        close(in[1]);
+        errno = saved;
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(in[i], F_SETFD, FD_CLOEXEC);
+        fcntl(out[i], F_SETFD, FD_CLOEXEC);
+    }
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+int demi_helpers_init(const char *dir)
+{
+    char resolved[PATH_MAX];
+
+    if (!realpath(dir, resolved)) {
+        return -1;
+    }
+
+    g_helper_dir_fd = open(resolved, DEMI_DIR_OPEN_FLAGS);
+    if (g_helper_dir_fd == -1) {
+        return -1;
+    }
+    g_helper_dir = strdup(resolved);
+    if (!g_helper_dir) {
+        close(g_helper_dir_fd);
+        g_helper_dir_fd = -1;
+        return -1;
+    }
+
+    if (demi_helper_spawnattr(&g_spawn_attr) == -1) {
+        free(g_helper_dir);
+        g_helper_dir = NULL;
+        close(g_helper_dir_fd);
+        g_helper_dir_fd = -1;
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&g_helpers_lock);
+    resolve_helpers();
+    pthread_rwlock_unlock(&g_helpers_lock);
+
+    for (size_t i = 0; i < HELPER_COUNT; i++) {
+        if (!g_helpers[i].path && !g_helpers[i].optional) {
+            fprintf(stderr, "helper '%s/%s' is missing or not executable\n", g_helper_dir, g_helpers[i].action);
+        }
+    }
+
+    g_watch_fd = demi_watch_open(g_helper_dir);
+    if (g_watch_fd == -1) {
+        fprintf(stderr, "cannot watch helper directory '%s': %s\n", g_helper_dir, strerror(errno));
+    }
+
+    return 0;
+}
+
+int demi_helpers_watch_fd(void)
+{
+    return g_watch_fd;
+}
+
+int demi_helpers_reload(void)
+{
+    if (g_helper_dir_fd == -1) {
+        errno = EBADF;
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&g_helpers_lock);
+    resolve_helpers();
+    pthread_rwlock_unlock(&g_helpers_lock);
+
+    demi_logf("helpers reloaded from %s", g_helper_dir);
+    return 0;
+}
+
+void demi_helpers_cleanup(void)
+{
+    pthread_rwlock_wrlock(&g_helpers_lock);
+    for (size_t i = 0; i < HELPER_COUNT; i++) {
+        free(g_helpers[i].path);
+        g_helpers[i].path = NULL;
+    }
+    pthread_rwlock_unlock(&g_helpers_lock);
+
+    if (g_watch_fd != -1) {
+        close(g_watch_fd);
+        g_watch_fd = -1;
+    }
+    if (g_helper_dir_fd != -1) {
+        close(g_helper_dir_fd);
+        g_helper_dir_fd = -1;
+        posix_spawnattr_destroy(&g_spawn_attr);
+    }
+    free(g_helper_dir);
+    g_helper_dir = NULL;
+}
+
+/* "SEQNUM" -> "DEMI_SEQNUM"; devd's lowercase keys come out the same way */
+static char *env_name(char *out, const char *key, size_t key_len)
+{
+    memcpy(out, "DEMI_", 5);
+    out += 5;
+    for (size_t i = 0; i < key_len; i++) {
+        unsigned char c = (unsigned char)key[i];
+        if (c >= 'a' && c <= 'z') {
+            c = (unsigned char)(c - 'a' + 'A');
+        } else if (!((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))) {
+            c = '_';
+        }
+        *out++ = (char)c;
+    }
+    return out;
+}
+
+/* Inherited DEMI_ variables give way to the event's own */
+static int env_shadowed(const char *var, char *const *env, size_t count)
+{
+    const char *eq = strchr(var, '=');
+    size_t len = eq ? (size_t)(eq - var) + 1 : strlen(var);
+
+    if (strncmp(var, "DEMI_", 5) != 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (strncmp(env[i], var, len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+char **demi_helper_env(const char *keys, size_t keys_len, size_t *count)
+{
+    size_t nkeys = 0, nenv = 0;
+
+    for (size_t i = 0; i < keys_len; i++) {
+        nkeys += keys[i] == '\0';
+    }
+    while (environ[nenv]) {
+        nenv++;
+    }
+
+    /* Pointers and strings share one block */
+    size_t vec_size = (nkeys + nenv + 1) * sizeof(char *);
+    char **env = malloc(vec_size + keys_len + nkeys * 5);
+    if (!env) {
+        return NULL;
+    }
+    char *out = (char *)env + vec_size;
+    size_t n = 0;
+
+    for (size_t pos = 0; pos < keys_len; ) {
+        const char *key = keys + pos;
+        size_t len = strlen(key);
+        const char *eq = memchr(key, '=', len);
+
+        pos += len + 1;
+        if (!eq || eq == key) {
+            continue;
+        }
+        env[n++] = out;
+        out = env_name(out, key, (size_t)(eq - key));
+        memcpy(out, eq, len - (size_t)(eq - key) + 1);
+        out += len - (size_t)(eq - key) + 1;
+    }
+    *count = n;
+
+    for (size_t i = 0; i < nenv; i++) {
+        if (!env_shadowed(environ[i], env, *count)) {
+            env[n++] = environ[i];
+        }
+    }
+    env[n] = NULL;
+    return env;
+}
+
+int demi_helper_spawn_batch(const char *action, const char *const *devnodes, size_t count,
+                            char *const *envp, pid_t *pid)
+{
+    struct helper_entry *h = find_helper(action);
+    if (!h) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char *one[3];
+    char **argv = one;
+    if (count > 1) {
+        argv = malloc((count + 2) * sizeof(*argv));
+        if (!argv) {
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        argv[i + 1] = (char *)devnodes[i];
+    }
+    argv[count + 1] = NULL;
+
+    pthread_rwlock_rdlock(&g_helpers_lock);
+    int rc = ENOENT;
+    if (h->path) {
+        argv[0] = h->path;
+        rc = posix_spawn(pid, h->path, NULL, &g_spawn_attr, argv, envp ? envp : environ);
+    }
+    pthread_rwlock_unlock(&g_helpers_lock);
+
+    if (argv != one) {
+        free(argv);
+    }
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+}
+
+int demi_helper_spawn_zygote(const char *action, const char *const *devnodes, size_t count,
+                             char *const *envp, demi_zygote_started_fn started,
+                             demi_zygote_fn exited, void *arg)
+{
+    struct helper_entry *h = find_helper(action);
+    if (!h) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char **argv = malloc((count + 2) * sizeof(*argv));
+    if (!argv) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        argv[i + 1] = (char *)devnodes[i];
+    }
+    argv[count + 1] = NULL;
+
+    int rc = -1;
+    pthread_rwlock_rdlock(&g_helpers_lock);
+    if (h->path) {
+        argv[0] = h->path;
+        rc = demi_zygote_spawn(h->path, argv, envp, started, exited, arg);
+    } else {
+        errno = ENOENT;
+    }
+    pthread_rwlock_unlock(&g_helpers_lock);
+
+    free(argv);
+    return rc;
+}
+
+int demi_helper_script(const char *action, char *path, size_t size)
+{
+    struct helper_entry *h = find_helper(action);
+    int rc = -1;
+
+    if (!h) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&g_helpers_lock);
+    if (!h->path) {
+        errno = ENOENT;
+    } else if (strlen(h->path) >= size) {
+        errno = ENAMETOOLONG;
+    } else {
+        memcpy(path, h->path, strlen(h->path) + 1);
+        rc = h->sh_script;
+    }
+    pthread_rwlock_unlock(&g_helpers_lock);
+    return rc;
+}
@@ -0,0 +1,113 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/demi_state.h"
+
+#define DEVSET_BUCKETS 256
+
+struct devset_entry {
+    struct devset_entry *next;
+    char name[];
+};
+
+struct demi_devset {
+    struct devset_entry *buckets[DEVSET_BUCKETS];
+    unsigned long count;
+};
+
+/* FNV-1a */
+static uint32_t devset_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct devset_entry **devset_find(const struct demi_devset *s, const char *name)
+{
+    struct devset_entry **pp = (struct devset_entry **)&s->buckets[devset_hash(name) & (DEVSET_BUCKETS - 1)];
+    while (*pp && strcmp((*pp)->name, name) != 0) {
+        pp = &(*pp)->next;
+    }
+    return pp;
+}
+
+struct demi_devset *demi_devset_create(void)
+{
+    return calloc(1, sizeof(struct demi_devset));
+}
+
+void demi_devset_free(struct demi_devset *s)
+{
+    if (!s) {
+        return;
+    }
+
+    for (size_t i = 0; i < DEVSET_BUCKETS; i++) {
+        struct devset_entry *e = s->buckets[i];
+        while (e) {
+            struct devset_entry *next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    free(s);
+}
+
+int demi_devset_add(struct demi_devset *s, const char *devname)
+{
+    struct devset_entry **pp = devset_find(s, devname);
+    if (*pp) {
+        return 0;
+    }
+
+    size_t len = strlen(devname) + 1;
+    struct devset_entry *e = malloc(sizeof(*e) + len);
+    if (!e) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(e->name, devname, len);
+    e->next = NULL;
+    *pp = e;
+    s->count++;
+    return 1;
+}
+
+int demi_devset_remove(struct demi_devset *s, const char *devname)
+{
+    struct devset_entry **pp = devset_find(s, devname);
+    struct devset_entry *e = *pp;
+    if (!e) {
+        return 0;
+    }
+
+    *pp = e->next;
+    free(e);
+    s->count--;
+    return 1;
+}
+
+int demi_devset_contains(const struct demi_devset *s, const char *devname)
+{
+    return *devset_find(s, devname) != NULL;
+}
+
+unsigned long demi_devset_count(const struct demi_devset *s)
+{
+    return s->count;
+}
+
+void demi_devset_foreach(const struct demi_devset *s, demi_devset_fn fn, void *arg)
+{
+    for (size_t i = 0; i < DEVSET_BUCKETS; i++) {
+        for (const struct devset_entry *e = s->buckets[i]; e; e = e->next) {
+            fn(e->name, arg);
+        }
+    }
+}
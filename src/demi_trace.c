@@ -0,0 +1,108 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../include/demi_trace.h"
+
+static FILE *g_trace = NULL;
+static char *g_trace_path = NULL;
+
+static FILE *trace_open(const char *path)
+{
+    struct demi_trace_header h;
+    struct timespec rt, mono;
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+    if (fd == -1) {
+        return NULL;
+    }
+    FILE *f = fdopen(fd, "a");
+    if (!f) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return NULL;
+    }
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.dth_magic, DEMI_TRACE_MAGIC, sizeof(h.dth_magic));
+    h.dth_record_size = sizeof(struct demi_trace_record);
+    h.dth_stages = DEMI_STAGE_COUNT;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    h.dth_realtime_ns = ((int64_t)rt.tv_sec - (int64_t)mono.tv_sec) * 1000000000LL +
+                        ((int64_t)rt.tv_nsec - (int64_t)mono.tv_nsec);
+    if (fwrite(&h, sizeof(h), 1, f) != 1) {
+        int saved = errno;
+        fclose(f);
+        errno = saved;
+        return NULL;
+    }
+    return f;
+}
+
+int demi_trace_open(const char *path)
+{
+    char *copy = strdup(path);
+    if (!copy) {
+        return -1;
+    }
+    FILE *f = trace_open(path);
+    if (!f) {
+        int saved = errno;
+        free(copy);
+        errno = saved;
+        return -1;
+    }
+    demi_trace_close();
+    g_trace = f;
+    g_trace_path = copy;
+    return 0;
+}
+
+/* Keep writing to the old file if the new one cannot be opened */
+void demi_trace_reopen(void)
+{
+    if (!g_trace) {
+        return;
+    }
+    FILE *f = trace_open(g_trace_path);
+    if (!f) {
+        demi_logf("trace: cannot reopen %s: %s", g_trace_path, strerror(errno));
+        return;
+    }
+    fclose(g_trace);
+    g_trace = f;
+}
+
+void demi_trace_close(void)
+{
+    if (g_trace) {
+        fclose(g_trace);
+        g_trace = NULL;
+    }
+    free(g_trace_path);
+    g_trace_path = NULL;
+}
+
+int demi_trace_enabled(void)
+{
+    return g_trace != NULL;
+}
+
+void demi_trace_write(const struct demi_trace_record *r)
+{
+    if (g_trace) {
+        fwrite(r, sizeof(*r), 1, g_trace);
+    }
+}
+
+void demi_trace_flush(void)
+{
+    if (g_trace && fflush(g_trace) == EOF) {
+        demi_logf("trace: cannot write %s: %s", g_trace_path, strerror(errno));
+        clearerr(g_trace);
+    }
+}
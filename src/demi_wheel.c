@@ -0,0 +1,217 @@
+#include <limits.h>
+#include <stddef.h>
+
+#include "../include/demi_wheel.h"
+
+#define WHEEL_MASK (DEMI_WHEEL_SLOTS - 1)
+#define WHEEL_DUE DEMI_WHEEL_LEVELS     /* level of a timer taken off for firing */
+
+static void list_init(struct demi_wheel_timer *head)
+{
+    head->prev = head->next = head;
+}
+
+static int list_empty(const struct demi_wheel_timer *head)
+{
+    return head->next == head;
+}
+
+static void list_append(struct demi_wheel_timer *head, struct demi_wheel_timer *t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void list_unlink(struct demi_wheel_timer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+}
+
+/* Move every timer on from to the empty list to */
+static void list_splice(struct demi_wheel_timer *from, struct demi_wheel_timer *to)
+{
+    list_init(to);
+    if (list_empty(from)) {
+        return;
+    }
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    list_init(from);
+}
+
+/* The lowest level whose slots still reach the deadline from now */
+static void wheel_place(struct demi_wheel *w, struct demi_wheel_timer *t)
+{
+    int level;
+    uint64_t pos = 0;
+
+    for (level = 0; level < DEMI_WHEEL_LEVELS; level++) {
+        unsigned int shift = (unsigned int)level * DEMI_WHEEL_BITS;
+        pos = t->expires >> shift;
+        if (pos - (w->now >> shift) < DEMI_WHEEL_SLOTS) {
+            break;
+        }
+    }
+    if (level == DEMI_WHEEL_LEVELS) {
+        /* Beyond the top level: park in its furthest slot and place again from there */
+        level = DEMI_WHEEL_LEVELS - 1;
+        pos = (w->now >> (level * DEMI_WHEEL_BITS)) + DEMI_WHEEL_SLOTS - 1;
+    }
+
+    t->level = level;
+    t->slot = (int)(pos & WHEEL_MASK);
+    list_append(&w->slots[level][t->slot], t);
+    w->occupied[level] |= 1ull << t->slot;
+}
+
+/*
+ * The next millisecond at which something is due: a level-0 slot's own
+ * time, or the start of an upper slot that has to be spread out. Every
+ * upper slot in use starts after now, or at now when it is due.
+ */
+static uint64_t wheel_next(const struct demi_wheel *w)
+{
+    uint64_t best = UINT64_MAX;
+
+    for (int level = 0; level < DEMI_WHEEL_LEVELS; level++) {
+        uint64_t occupied = w->occupied[level];
+        if (!occupied) {
+            continue;
+        }
+
+        unsigned int shift = (unsigned int)level * DEMI_WHEEL_BITS;
+        uint64_t base = w->now >> shift;
+        unsigned int cur = (unsigned int)(base & WHEEL_MASK);
+        uint64_t rotated = cur ? (occupied >> cur) | (occupied << (DEMI_WHEEL_SLOTS - cur)) : occupied;
+        unsigned int ahead = (unsigned int)__builtin_ctzll(rotated);
+
+        uint64_t at;
+        if (level == 0) {
+            at = w->now + ahead;
+        } else {
+            at = ahead == 0 ? w->now : (base + ahead) << shift;
+        }
+        if (at < best) {
+            best = at;
+        }
+    }
+    return best;
+}
+
+static void wheel_cascade(struct demi_wheel *w, int level, int slot)
+{
+    struct demi_wheel_timer moving;
+
+    list_splice(&w->slots[level][slot], &moving);
+    w->occupied[level] &= ~(1ull << slot);
+    while (!list_empty(&moving)) {
+        struct demi_wheel_timer *t = moving.next;
+        list_unlink(t);
+        wheel_place(w, t);
+    }
+}
+
+void demi_wheel_init(struct demi_wheel *w, uint64_t now_ms)
+{
+    w->now = now_ms;
+    w->count = 0;
+    for (int level = 0; level < DEMI_WHEEL_LEVELS; level++) {
+        w->occupied[level] = 0;
+        for (int slot = 0; slot < DEMI_WHEEL_SLOTS; slot++) {
+            list_init(&w->slots[level][slot]);
+        }
+    }
+}
+
+void demi_wheel_add(struct demi_wheel *w, struct demi_wheel_timer *t, uint64_t expires_ms)
+{
+    t->expires = expires_ms < w->now ? w->now : expires_ms;
+    wheel_place(w, t);
+    w->count++;
+}
+
+void demi_wheel_cancel(struct demi_wheel *w, struct demi_wheel_timer *t)
+{
+    if (!demi_wheel_pending(t)) {
+        return;
+    }
+
+    list_unlink(t);
+    if (t->level != WHEEL_DUE && list_empty(&w->slots[t->level][t->slot])) {
+        w->occupied[t->level] &= ~(1ull << t->slot);
+    }
+    t->level = -1;
+    w->count--;
+}
+
+int demi_wheel_pending(const struct demi_wheel_timer *t)
+{
+    return t->level >= 0 && t->prev != NULL;
+}
+
+long demi_wheel_timeout(const struct demi_wheel *w, uint64_t now_ms)
+{
+    if (w->count == 0) {
+        return -1;
+    }
+
+    uint64_t at = wheel_next(w);
+    if (at <= now_ms) {
+        return 0;
+    }
+    return at - now_ms > LONG_MAX ? LONG_MAX : (long)(at - now_ms);
+}
+
+unsigned long demi_wheel_expire(struct demi_wheel *w, uint64_t now_ms, demi_wheel_fn fn, void *arg)
+{
+    unsigned long fired = 0;
+
+    while (w->count > 0) {
+        uint64_t at = wheel_next(w);
+        if (at > now_ms) {
+            break;
+        }
+        w->now = at;
+
+        /* Upper slots starting now are spread out first, top down */
+        for (int level = DEMI_WHEEL_LEVELS - 1; level > 0; level--) {
+            int slot = (int)((at >> (level * DEMI_WHEEL_BITS)) & WHEEL_MASK);
+            if (w->occupied[level] & (1ull << slot)) {
+                wheel_cascade(w, level, slot);
+            }
+        }
+
+        int slot = (int)(at & WHEEL_MASK);
+        if (!(w->occupied[0] & (1ull << slot))) {
+            continue;
+        }
+
+        struct demi_wheel_timer due;
+        list_splice(&w->slots[0][slot], &due);
+        w->occupied[0] &= ~(1ull << slot);
+        for (struct demi_wheel_timer *t = due.next; t != &due; t = t->next) {
+            t->level = WHEEL_DUE;
+        }
+
+        /* A callback may cancel timers still on this list */
+        while (!list_empty(&due)) {
+            struct demi_wheel_timer *t = due.next;
+            list_unlink(t);
+            t->level = -1;
+            w->count--;
+            fired++;
+            fn(t, arg);
+        }
+    }
+
+    if (w->now < now_ms) {
+        w->now = now_ms;
+    }
+    return fired;
+}
@@ -0,0 +1,513 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "../include/demi.h"
+#include "../include/demi_spawn.h"
+#include "../include/demi_zygote.h"
+
+extern char **environ;
+
+/* Largest request: a full batch of devnodes plus an event's environment */
+#define ZYGOTE_MSG_MAX 65536
+
+enum zygote_report_kind {
+    ZYGOTE_STARTED,
+    ZYGOTE_FAILED,      /* status is the errno */
+    ZYGOTE_EXITED,
+};
+
+/* Followed by NUL-terminated path, argc arguments and envc variables */
+struct zygote_request {
+    uint32_t id;
+    uint32_t argc;
+    uint32_t envc;
+};
+
+struct zygote_report {
+    uint32_t id;
+    int32_t kind;
+    int32_t pid;
+    int32_t status;
+    int64_t user_us;            /* resource usage of an exited helper */
+    int64_t sys_us;
+    int64_t maxrss;
+};
+
+struct zygote_pending {
+    struct zygote_pending *next;
+    uint32_t id;
+    demi_zygote_started_fn started;
+    demi_zygote_fn exited;
+    void *arg;
+    pid_t pid;
+};
+
+/* A request the socket would not take yet */
+struct zygote_outbox {
+    struct zygote_outbox *next;
+    size_t len;
+    char msg[];
+};
+
+static int g_zygote_fd = -1;
+static int g_zygote_write_fd = -1;     /* a dup, so it can be polled for writing on its own */
+static pid_t g_zygote_pid = -1;
+static uint32_t g_next_id = 1;
+static struct zygote_pending *g_pending = NULL;
+static struct zygote_outbox *g_outbox = NULL;
+static struct zygote_outbox **g_outbox_tail = &g_outbox;
+
+/* ---- zygote side ---- */
+
+struct zygote_child {
+    pid_t pid;
+    uint32_t id;
+};
+
+static int g_sigchld_pipe[2] = { -1, -1 };
+
+static void zygote_sigchld(int signo)
+{
+    int saved = errno;
+    (void)signo;
+    if (write(g_sigchld_pipe[1], "", 1) == -1) {
+        /* pipe full: a wakeup is already pending */
+    }
+    errno = saved;
+}
+
+static void zygote_report(int sock, uint32_t id, int kind, pid_t pid, int status,
+                          const struct rusage *usage)
+{
+    struct zygote_report rep = { id, kind, (int32_t)pid, status, 0, 0, 0 };
+    if (usage) {
+        rep.user_us = (int64_t)usage->ru_utime.tv_sec * 1000000 + usage->ru_utime.tv_usec;
+        rep.sys_us = (int64_t)usage->ru_stime.tv_sec * 1000000 + usage->ru_stime.tv_usec;
+        rep.maxrss = usage->ru_maxrss;
+    }
+    while (send(sock, &rep, sizeof(rep), 0) == -1 && errno == EINTR) {
+    }
+}
+
+/* Split a request into path, argv and envp pointing into buf */
+static int zygote_unpack(char *buf, size_t len, struct zygote_request *req, char **path,
+                         char ***argv, char ***envp)
+{
+    memset(req, 0, sizeof(*req));
+    if (len < sizeof(*req)) {
+        return -1;
+    }
+    memcpy(req, buf, sizeof(*req));
+    if (req->argc == 0 || req->argc > len || req->envc > len) {
+        return -1;
+    }
+
+    char **vec = calloc((size_t)req->argc + req->envc + 2, sizeof(*vec));
+    if (!vec) {
+        return -1;
+    }
+
+    char *p = buf + sizeof(*req);
+    char *end = buf + len;
+    size_t want = 1 + req->argc + req->envc;
+    for (size_t i = 0; i < want; i++) {
+        char *nul = p < end ? memchr(p, '\0', (size_t)(end - p)) : NULL;
+        if (!nul) {
+            free(vec);
+            return -1;
+        }
+        if (i == 0) {
+            *path = p;
+        } else if (i <= req->argc) {
+            vec[i - 1] = p;
+        } else {
+            vec[i] = p;     /* envp starts after argv's NULL */
+        }
+        p = nul + 1;
+    }
+    *argv = vec;
+    *envp = req->envc ? vec + req->argc + 1 : NULL;
+    return 0;
+}
+
+static void zygote_main(int sock)
+{
+    static char buf[ZYGOTE_MSG_MAX];
+    struct zygote_child *children = NULL;
+    size_t nchildren = 0, cap = 0;
+    posix_spawnattr_t attr;
+    sigset_t none;
+
+    /* Stay up through terminal signals; the daemon's exit closes the socket */
+    signal(SIGINT, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    if (pipe(g_sigchld_pipe) == -1) {
+        _exit(1);
+    }
+    fcntl(g_sigchld_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(g_sigchld_pipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(g_sigchld_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(g_sigchld_pipe[1], F_SETFD, FD_CLOEXEC);
+    signal(SIGCHLD, zygote_sigchld);
+
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    /* Helpers get default signal handling back, as direct ones do */
+    if (demi_helper_spawnattr(&attr) == -1) {
+        _exit(1);
+    }
+
+    for (;;) {
+        struct pollfd pfd[2] = {
+            { .fd = sock, .events = POLLIN },
+            { .fd = g_sigchld_pipe[0], .events = POLLIN },
+        };
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            _exit(1);
+        }
+
+        if (pfd[1].revents) {
+            char drain[64];
+            struct rusage usage;
+            int status;
+            pid_t pid;
+
+            while (read(g_sigchld_pipe[0], drain, sizeof(drain)) > 0) {
+            }
+            while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+                for (size_t i = 0; i < nchildren; i++) {
+                    if (children[i].pid == pid) {
+                        zygote_report(sock, children[i].id, ZYGOTE_EXITED, pid, status, &usage);
+                        children[i] = children[--nchildren];
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (pfd[0].revents) {
+            ssize_t len = recv(sock, buf, sizeof(buf), 0);
+            if (len == 0 || (len == -1 && errno != EINTR)) {
+                _exit(0);       /* the daemon is gone */
+            }
+            if (len == -1) {
+                continue;
+            }
+
+            struct zygote_request req;
+            char *path = NULL, **argv = NULL, **envp = NULL;
+            if (zygote_unpack(buf, (size_t)len, &req, &path, &argv, &envp) == -1) {
+                zygote_report(sock, req.id, ZYGOTE_FAILED, -1, EINVAL, NULL);
+                continue;
+            }
+
+            if (nchildren == cap) {
+                size_t ncap = cap ? cap * 2 : 16;
+                struct zygote_child *grown = realloc(children, ncap * sizeof(*grown));
+                if (!grown) {
+                    free(argv);
+                    zygote_report(sock, req.id, ZYGOTE_FAILED, -1, ENOMEM, NULL);
+                    continue;
+                }
+                children = grown;
+                cap = ncap;
+            }
+
+            pid_t pid;
+            int rc = posix_spawn(&pid, path, NULL, &attr, argv, envp ? envp : environ);
+            free(argv);
+            if (rc != 0) {
+                zygote_report(sock, req.id, ZYGOTE_FAILED, -1, rc, NULL);
+                continue;
+            }
+            children[nchildren].pid = pid;
+            children[nchildren].id = req.id;
+            nchildren++;
+            zygote_report(sock, req.id, ZYGOTE_STARTED, pid, 0, NULL);
+        }
+    }
+}
+
+/* ---- daemon side ---- */
+
+int demi_zygote_start(void)
+{
+    int sv[2];
+
+    /* Close-on-exec on both ends: no helper may talk to the daemon as the fork server */
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        zygote_main(sv[1]);
+        _exit(0);
+    }
+
+    close(sv[1]);
+    /* The loop thread must never wait for the zygote; a full socket queues requests here */
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    g_zygote_write_fd = fcntl(sv[0], F_DUPFD_CLOEXEC, 0);
+    if (g_zygote_write_fd == -1) {
+        int saved = errno;
+        close(sv[0]);
+        while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) {
+        }
+        errno = saved;
+        return -1;
+    }
+    g_zygote_fd = sv[0];
+    g_zygote_pid = pid;
+    return 0;
+}
+
+int demi_zygote_fd(void)
+{
+    return g_zygote_fd;
+}
+
+int demi_zygote_write_fd(void)
+{
+    return g_zygote_write_fd;
+}
+
+int demi_zygote_queued(void)
+{
+    return g_outbox != NULL;
+}
+
+int demi_zygote_flush(void)
+{
+    while (g_outbox) {
+        struct zygote_outbox *o = g_outbox;
+        ssize_t rc = send(g_zygote_fd, o->msg, o->len, MSG_NOSIGNAL);
+        if (rc == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        g_outbox = o->next;
+        free(o);
+    }
+    g_outbox_tail = &g_outbox;
+    return 0;
+}
+
+static void zygote_outbox_free(void)
+{
+    while (g_outbox) {
+        struct zygote_outbox *o = g_outbox;
+        g_outbox = o->next;
+        free(o);
+    }
+    g_outbox_tail = &g_outbox;
+}
+
+static void zygote_close(void)
+{
+    int status;
+
+    close(g_zygote_fd);
+    close(g_zygote_write_fd);
+    g_zygote_fd = g_zygote_write_fd = -1;
+    while (waitpid(g_zygote_pid, &status, 0) == -1 && errno == EINTR) {
+    }
+    g_zygote_pid = -1;
+    zygote_outbox_free();
+}
+
+static int zygote_put(char *buf, size_t *len, const char *s)
+{
+    size_t n = strlen(s) + 1;
+    if (*len + n > ZYGOTE_MSG_MAX) {
+        errno = E2BIG;
+        return -1;
+    }
+    memcpy(buf + *len, s, n);
+    *len += n;
+    return 0;
+}
+
+int demi_zygote_spawn(const char *path, char *const argv[], char *const envp[],
+                      demi_zygote_started_fn started, demi_zygote_fn exited, void *arg)
+{
+    static char buf[ZYGOTE_MSG_MAX];
+    struct zygote_request req = { g_next_id, 0, 0 };
+    size_t len = sizeof(req);
+
+    if (g_zygote_fd == -1) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    if (zygote_put(buf, &len, path) == -1) {
+        return -1;
+    }
+    for (; argv[req.argc]; req.argc++) {
+        if (zygote_put(buf, &len, argv[req.argc]) == -1) {
+            return -1;
+        }
+    }
+    for (; envp && envp[req.envc]; req.envc++) {
+        if (zygote_put(buf, &len, envp[req.envc]) == -1) {
+            return -1;
+        }
+    }
+    memcpy(buf, &req, sizeof(req));
+
+    struct zygote_pending *p = calloc(1, sizeof(*p));
+    if (!p) {
+        return -1;
+    }
+
+    /* Behind queued requests, or when the socket is full, it waits its turn */
+    ssize_t rc = -1;
+    errno = EAGAIN;
+    while (!g_outbox && (rc = send(g_zygote_fd, buf, len, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+    }
+    if (rc == -1) {
+        struct zygote_outbox *o;
+        if ((errno != EAGAIN && errno != EWOULDBLOCK) || !(o = malloc(sizeof(*o) + len))) {
+            free(p);
+            return -1;
+        }
+        o->next = NULL;
+        o->len = len;
+        memcpy(o->msg, buf, len);
+        *g_outbox_tail = o;
+        g_outbox_tail = &o->next;
+    }
+
+    p->id = g_next_id++;
+    p->started = started;
+    p->exited = exited;
+    p->arg = arg;
+    p->pid = -1;
+    p->next = g_pending;
+    g_pending = p;
+    return 0;
+}
+
+static struct zygote_pending **zygote_find(uint32_t id)
+{
+    struct zygote_pending **pp = &g_pending;
+    while (*pp && (*pp)->id != id) {
+        pp = &(*pp)->next;
+    }
+    return pp;
+}
+
+/*
+ * The zygote is gone: everything it was running is lost to us. Helpers it
+ * started are orphans nobody can reap, so they are killed and reported as
+ * such; none may keep running once its device has been let go.
+ */
+static void zygote_lost(void)
+{
+    zygote_close();
+    while (g_pending) {
+        struct zygote_pending *p = g_pending;
+        g_pending = p->next;
+        if (p->pid == -1) {
+            p->exited(-1, ECONNRESET, NULL, p->arg);
+        } else {
+            if (kill(-p->pid, SIGKILL) == -1 && errno == ESRCH) {
+                kill(p->pid, SIGKILL);      /* it left its group */
+            }
+            p->exited(p->pid, SIGKILL, NULL, p->arg);  /* a wait status: killed by SIGKILL */
+        }
+        free(p);
+    }
+}
+
+int demi_zygote_dispatch(void)
+{
+    struct zygote_report rep;
+
+    for (;;) {
+        ssize_t len = recv(g_zygote_fd, &rep, sizeof(rep), MSG_DONTWAIT);
+        if (len == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+        }
+        if (len <= 0) {
+            demi_logf("helper spawner (pid %d) exited", (int)g_zygote_pid);
+            zygote_lost();
+            errno = ECONNRESET;
+            return -1;
+        }
+        if ((size_t)len != sizeof(rep)) {
+            continue;
+        }
+
+        struct zygote_pending **pp = zygote_find(rep.id);
+        struct zygote_pending *p = *pp;
+        if (!p) {
+            continue;
+        }
+
+        if (rep.kind == ZYGOTE_STARTED) {
+            p->pid = rep.pid;
+            if (p->started) {
+                p->started(rep.pid, p->arg);
+            }
+            continue;
+        }
+
+        *pp = p->next;
+        if (rep.kind == ZYGOTE_FAILED) {
+            p->exited(-1, rep.status, NULL, p->arg);
+        } else {
+            struct rusage usage;
+            memset(&usage, 0, sizeof(usage));
+            usage.ru_utime.tv_sec = (time_t)(rep.user_us / 1000000);
+            usage.ru_utime.tv_usec = (suseconds_t)(rep.user_us % 1000000);
+            usage.ru_stime.tv_sec = (time_t)(rep.sys_us / 1000000);
+            usage.ru_stime.tv_usec = (suseconds_t)(rep.sys_us % 1000000);
+            usage.ru_maxrss = (long)rep.maxrss;
+            p->exited(rep.pid, rep.status, &usage, p->arg);
+        }
+        free(p);
+    }
+}
+
+void demi_zygote_stop(void)
+{
+    if (g_zygote_fd == -1) {
+        return;
+    }
+
+    /* Closing the socket ends the zygote; helpers still running carry on */
+    zygote_close();
+    while (g_pending) {
+        struct zygote_pending *p = g_pending;
+        g_pending = p->next;
+        free(p);
+    }
+}
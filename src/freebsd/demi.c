@@ -1,51 +1,47 @@
 #include <errno.h>
-#include <assert.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/un.h>
 #include <sys/socket.h>
 #include <stdarg.h>
+#include <dirent.h>
 
 #include "demi.h"
 #include "demi_internal.h"
+#include "demi_trace.h"
+
+/* Receive arena for demi_read_batch(): one message buffer per batch slot */
+static struct mmsghdr *g_batch_hdrs = NULL;
+static struct iovec *g_batch_iovs = NULL;
+static char *g_batch_arena = NULL;
+static size_t g_batch_msg_max = DEMI_MSG_MAX;
+static int g_batch_grow = 0;        /* a message was truncated: enlarge before next read */
+
+static int g_rcvbuf = 0;
+static int g_resync_pending = 0;
+static struct demi_read_stats g_stats;
 
 // https://freebsd.org/cgi/man.cgi?query=devctl&sektion=4
-int demi_read(int fd, struct demi_event *de)
+int demi_parse_devd(char *buf, size_t len, struct demi_event *de)
 {
-    struct msghdr hdr = {0};
-    struct iovec iov = {0};
-
-    char buf[8192], *msg_ptr, *pos;
+    char *msg_ptr, *pos;
     char *var_ptr, *key, *value;
     size_t value_len;
-    ssize_t ret_len;
-
-    if (!de) {
-        errno = EINVAL;
-        return -1;
-    }
-
-    iov.iov_base = buf;
-    iov.iov_len = sizeof(buf);
-
-    hdr.msg_iov = &iov;
-    hdr.msg_iovlen = 1;
-
-    ret_len = recvmsg(fd, &hdr, 0);
+    ssize_t ret_len = (ssize_t)len;
 
     if (ret_len <= 0) {
         return -1;
     }
 
-    if (hdr.msg_flags & MSG_TRUNC) {
+    ret_len -= 1;
+    if (buf[ret_len] != '\n') {
         return -1;
     }
-
-    ret_len -= 1;
-    assert(buf[ret_len] == '\n');
     buf[ret_len] = '\0';
 
     *de = (struct demi_event){0};
+    de->de_buf = buf;
     pos = strtok_r(buf + 1, " ", &msg_ptr);
 
     if (!pos) {
@@ -60,6 +56,29 @@ int demi_read(int fd, struct demi_event *de)
             continue;
         }
 
+        /* Keep the pair as a view; strtok_r() has NUL-terminated both in place */
+        struct demi_field f = {
+            .df_key = (unsigned short)(key - buf),
+            .df_key_len = (unsigned short)strlen(key),
+            .df_value = (unsigned short)(value - buf),
+            .df_value_len = (unsigned short)strlen(value),
+        };
+        if (de->de_nfields < DEMI_FIELDS_MAX) {
+            de->de_fields[de->de_nfields++] = f;
+        }
+        int known = -1;
+        if (strcmp(key, "subsystem") == 0) {
+            known = DEMI_KEY_SUBSYSTEM;
+        } else if (strcmp(key, "cdev") == 0) {
+            known = DEMI_KEY_DEVNAME;
+        } else if (strcmp(key, "type") == 0) {
+            known = DEMI_KEY_ACTION;
+        }
+        if (known >= 0) {
+            de->de_known[known] = f;
+            de->de_known_mask |= 1u << known;
+        }
+
 	//!system=DEVFS subsystem=CDEV type=CREATE cdev=md0
 	//!system=GEOM subsystem=DEV type=CREATE cdev=md0
 
@@ -67,16 +86,17 @@ int demi_read(int fd, struct demi_event *de)
 	if (strcmp(key, "system") == 0) {
 //		printf("S:[system], value:[%s]\n",value);
 		if (strcmp(value, "DEVFS") != 0 ) {
-			char log_msg[512];
-			snprintf(log_msg, sizeof(log_msg), "devd event: system=%s SKIP by exception (DEVFS only)", value);
-			demi_log(log_msg);
+			demi_logf("devd event: system=%s SKIP by exception (DEVFS only)", value);
 			return 0;
 		}
 	}
 
         if (strcmp(key, "cdev") == 0) {
-            value_len = sizeof(de->de_devname);
-            assert(strlcpy(de->de_devname, value, value_len) < value_len);
+            value_len = strlcpy(de->de_devname, value, sizeof(de->de_devname));
+            if (value_len >= sizeof(de->de_devname)) {
+                demi_logf("devd event: cdev name too long (%zu bytes), dropped", value_len);
+                return -1;
+            }
         }
         else if (strcmp(key, "type") != 0) {
             continue;
@@ -95,6 +115,8 @@ int demi_read(int fd, struct demi_event *de)
         }
     }
     while ((pos = strtok_r(NULL, " ", &msg_ptr)));
+    de->de_stage_ns[DEMI_STAGE_PARSED] = demi_trace_now();
+    DEMI_PROBE2(parsed, de->de_seqnum, de->de_devname);
 
     // Log devd event if device name is present
     if (de->de_devname[0] != '\0') {
@@ -106,26 +128,243 @@ int demi_read(int fd, struct demi_event *de)
             default: break;
         }
 
-        char log_msg[512];
-        snprintf(log_msg, sizeof(log_msg), "devd event: device=%s action=%s", 
-                 de->de_devname, action_str);
-        demi_log(log_msg);
-
         // Filter devices based on DEMI_ALLOWED_DEVICES
         int allowed = demi_is_device_allowed(de->de_devname);
-        snprintf(log_msg, sizeof(log_msg), "device filter: device=%s allowed=%s", 
-                 de->de_devname, allowed ? "yes" : "no");
-        demi_log(log_msg);
+        demi_logf("devd event: device=%s action=%s allowed=%s",
+                  de->de_devname, action_str, allowed ? "yes" : "no");
+        DEMI_PROBE3(filtered, de->de_seqnum, de->de_devname, allowed);
 
         if (!allowed) {
             // Clear the device name to indicate this event should be ignored
+            g_stats.filtered++;
             de->de_devname[0] = '\0';
         }
     }
+    de->de_stage_ns[DEMI_STAGE_FILTERED] = demi_trace_now();
 
     return 0;
 }
 
+/* devd relays the kernel's notes from userland; the read time is the best receive time there is */
+static void demi_note_received(struct demi_event *de, unsigned long long now)
+{
+    de->de_stage_ns[DEMI_STAGE_RECEIVED] = now;
+    DEMI_PROBE3(received, de->de_seqnum, de->de_devname, now);
+}
+
+int demi_read(int fd, struct demi_event *de)
+{
+    /* Events keep views into the buffer until the next read on this thread */
+    static _Thread_local char buf[DEMI_MSG_MAX];
+    struct msghdr hdr = {0};
+    struct iovec iov = {0};
+    ssize_t ret_len;
+
+    if (!de) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+
+    ret_len = recvmsg(fd, &hdr, 0);
+
+    if (ret_len == 0) {
+        errno = ECONNRESET;
+    }
+    if (ret_len <= 0) {
+        return -1;
+    }
+
+    if (hdr.msg_flags & MSG_TRUNC) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    unsigned long long now = demi_trace_now();
+    if (demi_parse_devd(buf, (size_t)ret_len, de) == -1) {
+        return -1;
+    }
+    demi_note_received(de, now);
+    return 0;
+}
+
+static void demi_batch_arena_free(void)
+{
+    free(g_batch_hdrs);
+    free(g_batch_iovs);
+    free(g_batch_arena);
+    g_batch_hdrs = NULL;
+    g_batch_iovs = NULL;
+    g_batch_arena = NULL;
+}
+
+static int demi_batch_arena_init(void)
+{
+    if (g_batch_grow) {
+        /* Grow the per-message buffer after a truncated devd message */
+        g_batch_grow = 0;
+        if (g_batch_msg_max < DEMI_MSG_LIMIT) {
+            g_batch_msg_max *= 2;
+            demi_batch_arena_free();
+            demi_logf("devd: message truncated, receive buffer raised to %zu bytes", g_batch_msg_max);
+        }
+    }
+    if (g_batch_arena) {
+        return 0;
+    }
+
+    g_batch_hdrs = calloc(DEMI_BATCH_MAX, sizeof(*g_batch_hdrs));
+    g_batch_iovs = calloc(DEMI_BATCH_MAX, sizeof(*g_batch_iovs));
+    g_batch_arena = malloc((size_t)DEMI_BATCH_MAX * g_batch_msg_max);
+
+    if (!g_batch_hdrs || !g_batch_iovs || !g_batch_arena) {
+        demi_batch_arena_free();
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (int i = 0; i < DEMI_BATCH_MAX; i++) {
+        g_batch_iovs[i].iov_base = g_batch_arena + (size_t)i * g_batch_msg_max;
+        g_batch_iovs[i].iov_len = g_batch_msg_max;
+    }
+    return 0;
+}
+
+/*
+ * Drain up to n queued devd messages with one recvmmsg(). Blocks for the
+ * first message only (unless the socket is nonblocking). Truncated messages
+ * and filtered devices are skipped, so the result may be 0.
+ *
+ * A truncated message is reported as a DEMI_RESYNC event after the events
+ * that did arrive. devd closing the connection is reported as ECONNRESET.
+ */
+int demi_read_batch(int fd, struct demi_event *events, int n)
+{
+    ssize_t received = 0;
+    int count = 0;
+
+    if (!events || n <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (demi_batch_arena_init() == -1) {
+        return -1;
+    }
+    if (n > DEMI_BATCH_MAX) {
+        n = DEMI_BATCH_MAX;
+    }
+
+    /* Keep one slot free for a DEMI_RESYNC event */
+    int vlen = n > 1 ? n - 1 : 1;
+    if (g_resync_pending) {
+        vlen = 0;
+    }
+
+    if (vlen > 0) {
+        for (int i = 0; i < vlen; i++) {
+            struct msghdr *hdr = &g_batch_hdrs[i].msg_hdr;
+            memset(hdr, 0, sizeof(*hdr));
+            hdr->msg_iov = &g_batch_iovs[i];
+            hdr->msg_iovlen = 1;
+        }
+
+        received = recvmmsg(fd, g_batch_hdrs, (size_t)vlen, MSG_WAITFORONE, NULL);
+        if (received == -1) {
+            return -1;
+        }
+        if (received == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+    }
+
+    unsigned long long now = demi_trace_now();
+    for (ssize_t i = 0; i < received; i++) {
+        struct mmsghdr *mh = &g_batch_hdrs[i];
+        g_stats.received++;
+        if (mh->msg_hdr.msg_flags & MSG_TRUNC) {
+            g_stats.truncated++;
+            g_batch_grow = 1;
+            g_resync_pending = 1;
+            continue;
+        }
+        if (mh->msg_len == 0) {
+            continue;
+        }
+        if (demi_parse_devd(g_batch_iovs[i].iov_base, mh->msg_len, &events[count]) == -1) {
+            continue;
+        }
+        if (events[count].de_devname[0] == '\0') {
+            continue;
+        }
+        demi_note_received(&events[count], now);
+        count++;
+    }
+
+    if (g_resync_pending && count < n) {
+        g_resync_pending = 0;
+        g_stats.resyncs++;
+        events[count] = (struct demi_event){0};
+        events[count].de_type = DEMI_RESYNC;
+        count++;
+    }
+
+    return count;
+}
+
+void demi_read_stats(struct demi_read_stats *st)
+{
+    *st = g_stats;
+    st->msg_max = g_batch_msg_max;
+}
+
+void demi_set_rcvbuf(int bytes)
+{
+    g_rcvbuf = bytes > 0 ? bytes : 0;
+}
+
+/* devd messages carry no sequence number */
+/* No kernel-side filter for this event source; demi_read() filters by device */
+int demi_set_event_filter(const char *actions, const char *subsystems)
+{
+    (void)actions;
+    (void)subsystems;
+    return 0;
+}
+
+void demi_set_seqnum_check(int enabled)
+{
+    (void)enabled;
+}
+
+/* Character devices directly under /dev */
+int demi_scan(demi_scan_fn fn, void *arg)
+{
+    DIR *dir = opendir(DEMI_SCAN_DIR);
+    struct dirent *ent;
+
+    if (!dir) {
+        return -1;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.' || ent->d_type != DT_CHR) {
+            continue;
+        }
+        if (demi_is_device_allowed(ent->d_name)) {
+            fn(ent->d_name, arg);
+        }
+    }
+
+    closedir(dir);
+    return 0;
+}
+
 int demi_init(int flags)
 {
     struct sockaddr_un sa = {0};
@@ -137,6 +376,10 @@ int demi_init(int flags)
         return -1;
     }
 
+    if (g_rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &g_rcvbuf, sizeof(g_rcvbuf)) == -1) {
+        demi_logf("devd: cannot set receive buffer to %d bytes: %s", g_rcvbuf, strerror(errno));
+    }
+
     sa.sun_family = AF_UNIX;
     strlcpy(sa.sun_path, DEMI_MONITOR_DEVD_SOCKET, sizeof(sa.sun_path));
 
@@ -8,3 +8,15 @@
 //#define DEMI_DEVNAME_MAX (SPECNAMELEN + 1)
 
 #define DEMI_MONITOR_DEVD_SOCKET "/var/run/devd.seqpacket.pipe"
+
+/* Receive buffer size per devd message; doubled up to the limit on truncation */
+#define DEMI_MSG_MAX 8192
+#define DEMI_MSG_LIMIT (64 * 1024)
+
+/* Where demi_scan() finds the devices present right now */
+#define DEMI_SCAN_DIR "/dev"
+
+struct demi_event;
+
+/* Parse one devd message in place; filters and logs like demi_read() */
+int demi_parse_devd(char *buf, size_t len, struct demi_event *de);
@@ -0,0 +1,360 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "demi.h"
+#include "demi_loop.h"
+#include "demi_wheel.h"
+
+#define LOOP_EVENTS_MAX 64
+
+enum source_kind {
+    SOURCE_FD,
+    SOURCE_FD_WRITE,
+    SOURCE_SIGNAL,
+    SOURCE_TIMER,       /* on the loop's timer wheel, not in kqueue */
+    SOURCE_PID,
+};
+
+struct demi_loop_source {
+    struct demi_loop_source *prev;
+    struct demi_loop_source *next;
+    enum source_kind kind;
+    int fd;
+    int signo;
+    pid_t pid;
+    int dead;
+    demi_loop_fn fn;
+    demi_loop_signal_fn signal_fn;
+    demi_loop_exit_fn exit_fn;
+    void *arg;
+    struct demi_wheel_timer timer;
+};
+
+struct demi_loop {
+    int kq;
+    int stopping;
+    struct demi_loop_source *sources;
+    struct demi_loop_source *graveyard;     /* removed, freed after dispatch */
+    struct demi_wheel wheel;                /* every timer source; one kevent timeout */
+};
+
+static uint64_t loop_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static struct demi_loop_source *loop_new_source(struct demi_loop *loop, enum source_kind kind)
+{
+    struct demi_loop_source *src = calloc(1, sizeof(*src));
+    if (!src) {
+        return NULL;
+    }
+    src->kind = kind;
+    src->fd = -1;
+
+    src->next = loop->sources;
+    if (loop->sources) {
+        loop->sources->prev = src;
+    }
+    loop->sources = src;
+    return src;
+}
+
+static void loop_unlink(struct demi_loop *loop, struct demi_loop_source *src)
+{
+    if (src->prev) {
+        src->prev->next = src->next;
+    } else {
+        loop->sources = src->next;
+    }
+    if (src->next) {
+        src->next->prev = src->prev;
+    }
+}
+
+static void loop_bury(struct demi_loop *loop)
+{
+    while (loop->graveyard) {
+        struct demi_loop_source *src = loop->graveyard;
+        loop->graveyard = src->next;
+        free(src);
+    }
+}
+
+/* Register or change one kevent; on failure the source is unlinked and freed */
+static struct demi_loop_source *loop_register(struct demi_loop *loop, struct demi_loop_source *src,
+                                              uintptr_t ident, short filter, u_short flags,
+                                              u_int fflags, intptr_t data)
+{
+    struct kevent kev;
+    EV_SET(&kev, ident, filter, flags, fflags, data, src);
+    if (kevent(loop->kq, &kev, 1, NULL, 0, NULL) == -1) {
+        int saved = errno;
+        loop_unlink(loop, src);
+        free(src);
+        errno = saved;
+        return NULL;
+    }
+    return src;
+}
+
+struct demi_loop *demi_loop_create(void)
+{
+    struct demi_loop *loop = calloc(1, sizeof(*loop));
+    if (!loop) {
+        return NULL;
+    }
+
+    loop->kq = kqueue();
+    if (loop->kq == -1) {
+        free(loop);
+        return NULL;
+    }
+    fcntl(loop->kq, F_SETFD, FD_CLOEXEC);
+    demi_wheel_init(&loop->wheel, loop_now_ms());
+
+    /* Children are reaped through EVFILT_PROC; keep SIGCHLD from interrupting threads */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    return loop;
+}
+
+void demi_loop_free(struct demi_loop *loop)
+{
+    if (!loop) {
+        return;
+    }
+
+    while (loop->sources) {
+        demi_loop_remove(loop, loop->sources);
+    }
+    loop_bury(loop);
+    close(loop->kq);
+    free(loop);
+}
+
+struct demi_loop_source *demi_loop_add_fd(struct demi_loop *loop, int fd, demi_loop_fn fn, void *arg)
+{
+    struct demi_loop_source *src = loop_new_source(loop, SOURCE_FD);
+    if (!src) {
+        return NULL;
+    }
+    src->fd = fd;
+    src->fn = fn;
+    src->arg = arg;
+    return loop_register(loop, src, (uintptr_t)fd, EVFILT_READ, EV_ADD, 0, 0);
+}
+
+struct demi_loop_source *demi_loop_add_fd_writable(struct demi_loop *loop, int fd, demi_loop_fn fn, void *arg)
+{
+    struct demi_loop_source *src = loop_new_source(loop, SOURCE_FD_WRITE);
+    if (!src) {
+        return NULL;
+    }
+    src->fd = fd;
+    src->fn = fn;
+    src->arg = arg;
+    return loop_register(loop, src, (uintptr_t)fd, EVFILT_WRITE, EV_ADD, 0, 0);
+}
+
+int demi_loop_pause(struct demi_loop *loop, struct demi_loop_source *src, int paused)
+{
+    if (src->kind != SOURCE_FD) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct kevent kev;
+    EV_SET(&kev, (uintptr_t)src->fd, EVFILT_READ, paused ? EV_DISABLE : EV_ENABLE, 0, 0, src);
+    return kevent(loop->kq, &kev, 1, NULL, 0, NULL);
+}
+
+struct demi_loop_source *demi_loop_add_signal(struct demi_loop *loop, int signo,
+                                              demi_loop_signal_fn fn, void *arg)
+{
+    /* EVFILT_SIGNAL still sees blocked signals; blocking keeps the default action away */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, signo);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    struct demi_loop_source *src = loop_new_source(loop, SOURCE_SIGNAL);
+    if (!src) {
+        return NULL;
+    }
+    src->signo = signo;
+    src->signal_fn = fn;
+    src->arg = arg;
+    return loop_register(loop, src, (uintptr_t)signo, EVFILT_SIGNAL, EV_ADD, 0, 0);
+}
+
+struct demi_loop_source *demi_loop_add_timer(struct demi_loop *loop, unsigned long ms,
+                                             demi_loop_fn fn, void *arg)
+{
+    struct demi_loop_source *src = loop_new_source(loop, SOURCE_TIMER);
+    if (!src) {
+        return NULL;
+    }
+    src->fn = fn;
+    src->arg = arg;
+    demi_wheel_add(&loop->wheel, &src->timer, loop_now_ms() + ms);
+    return src;
+}
+
+struct demi_loop_source *demi_loop_add_pid(struct demi_loop *loop, pid_t pid,
+                                           demi_loop_exit_fn fn, void *arg)
+{
+    struct demi_loop_source *src = loop_new_source(loop, SOURCE_PID);
+    if (!src) {
+        return NULL;
+    }
+    src->pid = pid;
+    src->exit_fn = fn;
+    src->arg = arg;
+
+    struct kevent kev;
+    EV_SET(&kev, (uintptr_t)pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, src);
+    if (kevent(loop->kq, &kev, 1, NULL, 0, NULL) == 0) {
+        return src;
+    }
+    if (errno != ESRCH) {
+        int saved = errno;
+        loop_unlink(loop, src);
+        free(src);
+        errno = saved;
+        return NULL;
+    }
+
+    /* Already exited: reap it from an immediate timer instead */
+    return loop_register(loop, src, (uintptr_t)src, EVFILT_TIMER, EV_ADD | EV_ONESHOT,
+                         NOTE_MSECONDS, 0);
+}
+
+void demi_loop_remove(struct demi_loop *loop, struct demi_loop_source *src)
+{
+    struct kevent kev[2];
+    int n = 0;
+
+    if (!src || src->dead) {
+        return;
+    }
+    src->dead = 1;
+    loop_unlink(loop, src);
+
+    /* One-shot registrations that already fired are gone; ENOENT is harmless */
+    switch (src->kind) {
+    case SOURCE_FD:
+        EV_SET(&kev[n++], (uintptr_t)src->fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+        break;
+    case SOURCE_FD_WRITE:
+        EV_SET(&kev[n++], (uintptr_t)src->fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+        break;
+    case SOURCE_SIGNAL:
+        EV_SET(&kev[n++], (uintptr_t)src->signo, EVFILT_SIGNAL, EV_DELETE, 0, 0, NULL);
+        break;
+    case SOURCE_TIMER:
+        demi_wheel_cancel(&loop->wheel, &src->timer);
+        break;
+    case SOURCE_PID:
+        EV_SET(&kev[n++], (uintptr_t)src->pid, EVFILT_PROC, EV_DELETE, 0, 0, NULL);
+        EV_SET(&kev[n++], (uintptr_t)src, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+        break;
+    }
+    for (int i = 0; i < n; i++) {
+        kevent(loop->kq, &kev[i], 1, NULL, 0, NULL);
+    }
+
+    src->next = loop->graveyard;
+    loop->graveyard = src;
+}
+
+static void loop_timer_fired(struct demi_wheel_timer *t, void *arg)
+{
+    struct demi_loop *loop = arg;
+    struct demi_loop_source *src = (struct demi_loop_source *)((char *)t - offsetof(struct demi_loop_source, timer));
+
+    demi_loop_remove(loop, src);
+    src->fn(src->arg);
+}
+
+static void loop_reap(struct demi_loop *loop, struct demi_loop_source *src)
+{
+    struct rusage usage;
+    int status;
+    pid_t rc;
+
+    /* NOTE_EXIT can be seen just before the child becomes waitable */
+    while ((rc = wait4(src->pid, &status, 0, &usage)) == -1 && errno == EINTR) {
+    }
+    if (rc == -1) {
+        status = -1;    /* reaped by somebody else */
+    }
+
+    demi_loop_remove(loop, src);
+    src->exit_fn(src->pid, status, rc == -1 ? NULL : &usage, src->arg);
+}
+
+int demi_loop_run(struct demi_loop *loop)
+{
+    struct kevent events[LOOP_EVENTS_MAX];
+
+    loop->stopping = 0;
+    while (!loop->stopping) {
+        /* One wakeup for the nearest deadline, however many timers are pending */
+        long timeout = demi_wheel_timeout(&loop->wheel, loop_now_ms());
+        struct timespec ts = { timeout / 1000, (timeout % 1000) * 1000000L };
+        int n = kevent(loop->kq, NULL, 0, events, LOOP_EVENTS_MAX, timeout == -1 ? NULL : &ts);
+        if (n == -1) {
+            if (errno != EINTR) {
+                return -1;
+            }
+            n = 0;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct demi_loop_source *src = events[i].udata;
+            /* A callback earlier in this batch may have removed it */
+            if (!src || src->dead) {
+                continue;
+            }
+
+            switch (src->kind) {
+            case SOURCE_FD:
+            case SOURCE_FD_WRITE:
+                src->fn(src->arg);
+                break;
+            case SOURCE_SIGNAL:
+                src->signal_fn(src->signo, src->arg);
+                break;
+            case SOURCE_TIMER:
+                break;
+            case SOURCE_PID:
+                loop_reap(loop, src);
+                break;
+            }
+        }
+        demi_wheel_expire(&loop->wheel, loop_now_ms(), loop_timer_fired, loop);
+        loop_bury(loop);
+    }
+    return 0;
+}
+
+void demi_loop_stop(struct demi_loop *loop)
+{
+    loop->stopping = 1;
+}
@@ -0,0 +1,56 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/event.h>
+
+#include "demi.h"
+#include "demi_spawn.h"
+
+/* Directory fd registered with the kqueue; must stay open while watched */
+static int g_watch_dir_fd = -1;
+
+int demi_watch_open(const char *dir)
+{
+    struct kevent kev;
+    int kq, dfd;
+
+    dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd == -1) {
+        return -1;
+    }
+
+    kq = kqueue();
+    if (kq == -1) {
+        close(dfd);
+        return -1;
+    }
+
+    EV_SET(&kev, dfd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+           NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_DELETE | NOTE_RENAME, 0, NULL);
+    if (kevent(kq, &kev, 1, NULL, 0, NULL) == -1) {
+        close(kq);
+        close(dfd);
+        return -1;
+    }
+
+    if (g_watch_dir_fd != -1) {
+        close(g_watch_dir_fd);
+    }
+    g_watch_dir_fd = dfd;
+    return kq;
+}
+
+int demi_watch_drain(int fd)
+{
+    struct kevent kev[8];
+    struct timespec zero = {0, 0};
+    int changed = 0;
+    int n;
+
+    while ((n = kevent(fd, NULL, 0, kev, 8, &zero)) > 0) {
+        changed = 1;
+    }
+
+    return changed;
+}
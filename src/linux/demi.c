@@ -1,23 +1,214 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdio.h>
-#include <assert.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <linux/netlink.h>
 #include <stdarg.h>
+#include <dirent.h>
+#include <time.h>
 
 #include "demi.h"
 #include "demi_internal.h"
+#include "demi_trace.h"
+
+/* Records tokenized per pass; a typical uevent has 10-20 */
+#define DEMI_TOKENS_MAX 64
+
+/* Room for the SCM_TIMESTAMPNS a uevent arrives with */
+union demi_cmsg {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(struct timespec))];
+};
+
+/* Receive arena for demi_read_batch(): one message buffer per batch slot */
+static struct mmsghdr *g_batch_hdrs = NULL;
+static struct iovec *g_batch_iovs = NULL;
+static struct sockaddr_nl *g_batch_addrs = NULL;
+static union demi_cmsg *g_batch_ctrl = NULL;
+static char *g_batch_arena = NULL;
+static size_t g_batch_msg_max = DEMI_MSG_MAX;
+static int g_batch_grow = 0;        /* a message was truncated: enlarge before next read */
+
+static int g_rcvbuf = 0;
+static int g_seqnum_check = 1;
+static unsigned long long g_last_seqnum = 0;
+static int g_resync_pending = 0;
+static struct demi_read_stats g_stats;
+
+static char *g_filter_actions = NULL;
+static char *g_filter_subsystems = NULL;
+
+/* Only kernel messages on the uevent group are accepted */
+static int demi_valid_sender(const struct sockaddr_nl *sa)
+{
+    return !(sa->nl_groups == 0x0 || (sa->nl_groups == 0x1 && sa->nl_pid != 0));
+}
+
+static enum demi_event_type uevent_action(const char *value, size_t len)
+{
+    if (len == 3 && memcmp(value, "add", 3) == 0) {
+        return DEMI_ATTACH;
+    }
+    if (len == 6 && memcmp(value, "remove", 6) == 0) {
+        return DEMI_DETACH;
+    }
+    if (len == 6 && memcmp(value, "change", 6) == 0) {
+        return DEMI_CHANGE;
+    }
+    return DEMI_UNKNOWN;
+}
+
+/*
+ * The tokenizer finds every record and its first '=' in one vectorized pass;
+ * each pair is then recorded as offsets into buf, which is left untouched,
+ * and well-known keys are slotted through the perfect hash in
+ * demi_key_lookup().
+ */
+int demi_parse_uevent(char *buf, size_t len, struct demi_event *de)
+{
+    struct demi_token tok[DEMI_TOKENS_MAX];
+    size_t pos = 0, count;
+    int first = 1;
+
+    /* Offsets are 16 bits wide */
+    if (len == 0 || len > DEMI_MSG_LIMIT || buf[len - 1] != '\0') {
+        return -1;
+    }
+
+    de->de_devname[0] = '\0';
+    de->de_type = DEMI_UNKNOWN;
+    de->de_seqnum = 0;
+    de->de_buf = buf;
+    de->de_known_mask = 0;
+    de->de_nfields = 0;
+
+    while ((count = demi_tokenize(buf, len, &pos, tok, DEMI_TOKENS_MAX)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            const struct demi_token *t = &tok[i];
+
+            /* Skip the "action@devpath" header */
+            if (first) {
+                first = 0;
+                if (memchr(buf + t->dt_start, '@', (size_t)(t->dt_end - t->dt_start))) {
+                    continue;
+                }
+            }
+            if (t->dt_eq == t->dt_end || t->dt_eq == t->dt_start) {
+                continue;
+            }
+
+            struct demi_field f = {
+                .df_key = t->dt_start,
+                .df_key_len = (unsigned short)(t->dt_eq - t->dt_start),
+                .df_value = (unsigned short)(t->dt_eq + 1),
+                .df_value_len = (unsigned short)(t->dt_end - t->dt_eq - 1),
+            };
+            if (de->de_nfields < DEMI_FIELDS_MAX) {
+                de->de_fields[de->de_nfields++] = f;
+            }
+
+            int k = demi_key_lookup(buf + f.df_key, f.df_key_len);
+            if (k >= 0) {
+                de->de_known[k] = f;
+                de->de_known_mask |= 1u << k;
+            }
+        }
+    }
+
+    size_t value_len;
+    const char *value = demi_event_get(de, DEMI_KEY_ACTION, &value_len);
+    if (value) {
+        de->de_type = uevent_action(value, value_len);
+    }
+
+    value = demi_event_get(de, DEMI_KEY_DEVNAME, &value_len);
+    if (value) {
+        if (value_len >= sizeof(de->de_devname)) {
+            return -1;
+        }
+        memcpy(de->de_devname, value, value_len + 1);
+    }
+
+    value = demi_event_get(de, DEMI_KEY_SEQNUM, NULL);
+    if (value) {
+        unsigned long long seqnum = 0;
+        for (; *value >= '0' && *value <= '9'; value++) {
+            seqnum = seqnum * 10 + (unsigned long long)(*value - '0');
+        }
+        de->de_seqnum = seqnum;
+    }
+    de->de_stage_ns[DEMI_STAGE_PARSED] = demi_trace_now();
+    DEMI_PROBE2(parsed, de->de_seqnum, de->de_devname);
+
+    // Log netlink event if device name is present
+    if (de->de_devname[0] != '\0') {
+        const char *action_str = "unknown";
+        switch (de->de_type) {
+            case DEMI_ATTACH: action_str = "add"; break;
+            case DEMI_DETACH: action_str = "remove"; break;
+            case DEMI_CHANGE: action_str = "change"; break;
+            default: break;
+        }
+        
+        // Filter devices based on DEMI_ALLOWED_DEVICES
+        int allowed = demi_is_device_allowed(de->de_devname);
+        demi_logf("netlink event: device=%s action=%s allowed=%s",
+                  de->de_devname, action_str, allowed ? "yes" : "no");
+        DEMI_PROBE3(filtered, de->de_seqnum, de->de_devname, allowed);
+
+        if (!allowed) {
+            // Clear the device name to indicate this event should be ignored
+            g_stats.filtered++;
+            de->de_devname[0] = '\0';
+        }
+    }
+    de->de_stage_ns[DEMI_STAGE_FILTERED] = demi_trace_now();
+
+    return 0;
+}
+
+/*
+ * The kernel's receive time moved onto the monotonic clock by its age at
+ * read time (rt, mono); without one, the read time itself
+ */
+static unsigned long long demi_received_ns(struct msghdr *hdr, const struct timespec *rt,
+                                           unsigned long long mono)
+{
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(hdr); c; c = CMSG_NXTHDR(hdr, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_TIMESTAMPNS) {
+            continue;
+        }
+        struct timespec ts;
+        memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+        long long age = ((long long)rt->tv_sec - (long long)ts.tv_sec) * 1000000000LL +
+                        ((long long)rt->tv_nsec - (long long)ts.tv_nsec);
+        if (age < 0) {
+            age = 0;    /* the wall clock stepped back meanwhile */
+        }
+        return (unsigned long long)age < mono ? mono - (unsigned long long)age : mono;
+    }
+    return mono;
+}
+
+static void demi_note_received(struct demi_event *de, struct msghdr *hdr, const struct timespec *rt,
+                               unsigned long long mono)
+{
+    de->de_stage_ns[DEMI_STAGE_RECEIVED] = demi_received_ns(hdr, rt, mono);
+    DEMI_PROBE3(received, de->de_seqnum, de->de_devname, de->de_stage_ns[DEMI_STAGE_RECEIVED]);
+}
 
 int demi_read(int fd, struct demi_event *de)
 {
+    /* Events keep views into the buffer until the next read on this thread */
+    static _Thread_local char buf[DEMI_MSG_MAX];
     struct sockaddr_nl sa = {0};
     struct msghdr hdr = {0};
     struct iovec iov = {0};
-
-    char buf[8192], *msg, *end;
-    char *ptr, *key, *value;
+    union demi_cmsg ctrl;
+    struct timespec rt;
     ssize_t len;
 
     if (!de) {
@@ -32,6 +223,8 @@ int demi_read(int fd, struct demi_event *de)
     hdr.msg_namelen = sizeof(sa);
     hdr.msg_iov = &iov;
     hdr.msg_iovlen = 1;
+    hdr.msg_control = ctrl.buf;
+    hdr.msg_controllen = sizeof(ctrl.buf);
 
     len = recvmsg(fd, &hdr, 0);
 
@@ -40,74 +233,244 @@ int demi_read(int fd, struct demi_event *de)
     }
 
     if (hdr.msg_flags & MSG_TRUNC) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (!demi_valid_sender(&sa)) {
+        errno = EPERM;
         return -1;
     }
 
-    if (sa.nl_groups == 0x0 || (sa.nl_groups == 0x1 && sa.nl_pid != 0)) {
+    clock_gettime(CLOCK_REALTIME, &rt);
+    unsigned long long mono = demi_trace_now();
+    if (demi_parse_uevent(buf, (size_t)len, de) == -1) {
         return -1;
     }
+    demi_note_received(de, &hdr, &rt, mono);
+    return 0;
+}
+
+static void demi_batch_arena_free(void)
+{
+    free(g_batch_hdrs);
+    free(g_batch_iovs);
+    free(g_batch_addrs);
+    free(g_batch_ctrl);
+    free(g_batch_arena);
+    g_batch_hdrs = NULL;
+    g_batch_iovs = NULL;
+    g_batch_addrs = NULL;
+    g_batch_ctrl = NULL;
+    g_batch_arena = NULL;
+}
 
-    len -= 1;
-    assert(buf[len] == '\0');
-    msg = buf;
-    *de = (struct demi_event){0};
+static int demi_batch_arena_init(void)
+{
+    if (g_batch_grow) {
+        /* Grow the per-message buffer after a truncated uevent */
+        g_batch_grow = 0;
+        if (g_batch_msg_max < DEMI_MSG_LIMIT) {
+            g_batch_msg_max *= 2;
+            demi_batch_arena_free();
+            demi_logf("netlink: uevent truncated, receive buffer raised to %zu bytes", g_batch_msg_max);
+        }
+    }
+    if (g_batch_arena) {
+        return 0;
+    }
 
-    for (end = msg + len; msg < end; msg += strlen(msg) + 1) {
-        key = strtok_r(msg, "=", &ptr);
-        value = strtok_r(NULL, "=", &ptr);
+    g_batch_hdrs = calloc(DEMI_BATCH_MAX, sizeof(*g_batch_hdrs));
+    g_batch_iovs = calloc(DEMI_BATCH_MAX, sizeof(*g_batch_iovs));
+    g_batch_addrs = calloc(DEMI_BATCH_MAX, sizeof(*g_batch_addrs));
+    g_batch_ctrl = calloc(DEMI_BATCH_MAX, sizeof(*g_batch_ctrl));
+    g_batch_arena = malloc((size_t)DEMI_BATCH_MAX * g_batch_msg_max);
 
-        if (!key || !value) {
-            continue;
+    if (!g_batch_hdrs || !g_batch_iovs || !g_batch_addrs || !g_batch_ctrl || !g_batch_arena) {
+        demi_batch_arena_free();
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (int i = 0; i < DEMI_BATCH_MAX; i++) {
+        g_batch_iovs[i].iov_base = g_batch_arena + (size_t)i * g_batch_msg_max;
+        g_batch_iovs[i].iov_len = g_batch_msg_max;
+    }
+    g_stats.msg_max = g_batch_msg_max;
+    return 0;
+}
+
+static void demi_note_seqnum(unsigned long long seqnum)
+{
+    if (seqnum == 0) {
+        return;
+    }
+    if (g_seqnum_check && g_last_seqnum != 0 && seqnum > g_last_seqnum + 1) {
+        g_stats.seqnum_gaps++;
+        g_resync_pending = 1;
+        demi_logf("netlink: SEQNUM gap %llu -> %llu, %llu uevents lost",
+                  g_last_seqnum, seqnum, seqnum - g_last_seqnum - 1);
+    }
+    g_last_seqnum = seqnum;
+}
+
+/*
+ * Drain up to n queued uevents with one recvmmsg(). Blocks for the first
+ * message only (unless the socket is nonblocking). Foreign or truncated
+ * messages and filtered devices are skipped, so the result may be 0.
+ *
+ * Lost events (receive queue overflow, truncation, SEQNUM gaps) are reported
+ * as a single DEMI_RESYNC event after the events that did arrive.
+ */
+int demi_read_batch(int fd, struct demi_event *events, int n)
+{
+    int received, count = 0;
+
+    if (!events || n <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (demi_batch_arena_init() == -1) {
+        return -1;
+    }
+    if (n > DEMI_BATCH_MAX) {
+        n = DEMI_BATCH_MAX;
+    }
+
+    /* Keep one slot free for a DEMI_RESYNC event */
+    int vlen = n > 1 ? n - 1 : 1;
+    if (g_resync_pending) {
+        vlen = 0;
+    }
+
+    received = 0;
+    if (vlen > 0) {
+        for (int i = 0; i < vlen; i++) {
+            struct msghdr *hdr = &g_batch_hdrs[i].msg_hdr;
+            hdr->msg_name = &g_batch_addrs[i];
+            hdr->msg_namelen = sizeof(g_batch_addrs[i]);
+            hdr->msg_iov = &g_batch_iovs[i];
+            hdr->msg_iovlen = 1;
+            hdr->msg_control = g_batch_ctrl[i].buf;
+            hdr->msg_controllen = sizeof(g_batch_ctrl[i].buf);
+            hdr->msg_flags = 0;
         }
 
-        if (strcmp(key, "DEVNAME") == 0) {
-            assert(strlen(value) < sizeof(de->de_devname));
-            snprintf(de->de_devname, sizeof(de->de_devname), "%s", value);
+        received = recvmmsg(fd, g_batch_hdrs, (unsigned int)vlen, MSG_WAITFORONE, NULL);
+        if (received == -1) {
+            if (errno != ENOBUFS) {
+                return -1;
+            }
+            /* The kernel dropped uevents for us; the queue itself is still readable */
+            g_stats.overflows++;
+            g_resync_pending = 1;
+            demi_logf("netlink: receive queue overflow (ENOBUFS)");
+            received = 0;
         }
-        else if (strcmp(key, "ACTION") != 0) {
+    }
+
+    /* One clock reading ages every kernel timestamp in the batch */
+    struct timespec rt;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    unsigned long long mono = demi_trace_now();
+
+    for (int i = 0; i < received; i++) {
+        struct mmsghdr *mh = &g_batch_hdrs[i];
+        g_stats.received++;
+        if (!demi_valid_sender(&g_batch_addrs[i])) {
+            g_stats.foreign++;
             continue;
         }
-        else if (strcmp(value, "add") == 0) {
-            de->de_type = DEMI_ATTACH;
-        }
-        else if (strcmp(value, "remove") == 0) {
-            de->de_type = DEMI_DETACH;
+        if (mh->msg_hdr.msg_flags & MSG_TRUNC) {
+            g_stats.truncated++;
+            g_batch_grow = 1;
+            g_resync_pending = 1;
+            continue;
         }
-        else if (strcmp(value, "change") == 0) {
-            de->de_type = DEMI_CHANGE;
+        if (demi_parse_uevent(g_batch_iovs[i].iov_base, mh->msg_len, &events[count]) == -1) {
+            continue;
         }
-        else {
-            de->de_type = DEMI_UNKNOWN;
+        demi_note_seqnum(events[count].de_seqnum);
+        if (events[count].de_devname[0] == '\0') {
+            continue;
         }
+        demi_note_received(&events[count], &mh->msg_hdr, &rt, mono);
+        count++;
     }
 
-    // Log netlink event if device name is present
-    if (de->de_devname[0] != '\0') {
-        const char *action_str = "unknown";
-        switch (de->de_type) {
-            case DEMI_ATTACH: action_str = "add"; break;
-            case DEMI_DETACH: action_str = "remove"; break;
-            case DEMI_CHANGE: action_str = "change"; break;
-            default: break;
+    if (g_resync_pending && count < n) {
+        g_resync_pending = 0;
+        g_stats.resyncs++;
+        events[count] = (struct demi_event){0};
+        events[count].de_type = DEMI_RESYNC;
+        count++;
+    }
+
+    return count;
+}
+
+void demi_read_stats(struct demi_read_stats *st)
+{
+    *st = g_stats;
+    st->msg_max = g_batch_msg_max;
+}
+
+void demi_set_rcvbuf(int bytes)
+{
+    g_rcvbuf = bytes > 0 ? bytes : 0;
+}
+
+void demi_set_seqnum_check(int enabled)
+{
+    g_seqnum_check = enabled;
+}
+
+int demi_set_event_filter(const char *actions, const char *subsystems)
+{
+    char *a = actions ? strdup(actions) : NULL;
+    char *s = subsystems ? strdup(subsystems) : NULL;
+
+    if ((actions && !a) || (subsystems && !s)) {
+        free(a);
+        free(s);
+        errno = ENOMEM;
+        return -1;
+    }
+    free(g_filter_actions);
+    free(g_filter_subsystems);
+    g_filter_actions = a;
+    g_filter_subsystems = s;
+    return 0;
+}
+
+/* Block devices as the kernel names them in DEVNAME ('!' in sysfs is '/') */
+int demi_scan(demi_scan_fn fn, void *arg)
+{
+    DIR *dir = opendir(DEMI_SCAN_DIR);
+    struct dirent *ent;
+
+    if (!dir) {
+        return -1;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+        char devname[DEMI_DEVNAME_MAX];
+
+        if (ent->d_name[0] == '.') {
+            continue;
         }
-        
-        char log_msg[512];
-        snprintf(log_msg, sizeof(log_msg), "netlink event: device=%s action=%s", 
-                 de->de_devname, action_str);
-        demi_log(log_msg);
-        
-        // Filter devices based on DEMI_ALLOWED_DEVICES
-        int allowed = demi_is_device_allowed(de->de_devname);
-        snprintf(log_msg, sizeof(log_msg), "device filter: device=%s allowed=%s", 
-                 de->de_devname, allowed ? "yes" : "no");
-        demi_log(log_msg);
-        
-        if (!allowed) {
-            // Clear the device name to indicate this event should be ignored
-            de->de_devname[0] = '\0';
+        snprintf(devname, sizeof(devname), "%s", ent->d_name);
+        for (char *p = devname; *p; p++) {
+            if (*p == '!') {
+                *p = '/';
+            }
+        }
+        if (demi_is_device_allowed(devname)) {
+            fn(devname, arg);
         }
     }
 
+    closedir(dir);
     return 0;
 }
 
@@ -122,6 +485,29 @@ int demi_init(int flags)
         return -1;
     }
 
+    /* A large queue rides out storms; FORCE needs CAP_NET_ADMIN to pass rmem_max */
+    if (g_rcvbuf > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &g_rcvbuf, sizeof(g_rcvbuf)) == -1 &&
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &g_rcvbuf, sizeof(g_rcvbuf)) == -1) {
+        demi_logf("netlink: cannot set receive buffer to %d bytes: %s", g_rcvbuf, strerror(errno));
+    }
+
+    /* Each uevent is stamped with the time the kernel queued it, for tracing */
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == -1) {
+        demi_logf("netlink: no receive timestamps, using read times: %s", strerror(errno));
+    }
+
+    /* Attach before bind() so no unfiltered uevent is ever queued */
+    int filtered = demi_bpf_attach(fd, g_filter_actions, g_filter_subsystems);
+    if (filtered == -1) {
+        demi_logf("netlink: cannot attach event filter: %s", strerror(errno));
+    } else if (filtered == 1 && g_seqnum_check) {
+        /* Dropped uevents still consume SEQNUMs; only ENOBUFS means loss now */
+        g_seqnum_check = 0;
+        demi_logf("netlink: event filter attached, SEQNUM gap check disabled");
+    }
+
     sa.nl_family = AF_NETLINK;
     sa.nl_groups = DEMI_MONITOR_NETLINK_GROUP;
 
@@ -0,0 +1,238 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+
+#include "demi.h"
+#include "demi_internal.h"
+
+/*
+ * Classic BPF filter for the uevent socket, generated from the configured
+ * actions and subsystems, so uninteresting uevents are dropped in the kernel
+ * instead of waking us up.
+ *
+ * A kernel uevent starts with "action@devpath\0ACTION=action\0DEVPATH=devpath\0
+ * SUBSYSTEM=...". The action is matched against the header directly. The
+ * SUBSYSTEM key follows at 2 * H + 15, where H is the header length including
+ * its NUL; classic BPF cannot loop, so the NUL is found by an unrolled scan.
+ * Anything that does not have this shape is let through for userspace to
+ * judge.
+ */
+
+#define BPF_ACCEPT 0xffffffffu
+#define BPF_DROP 0u
+
+/* Longest "action@devpath" header the scan looks at */
+#define DEMI_BPF_SCAN 256
+
+#define DEMI_BPF_WORDS_MAX 32
+
+struct bpf_builder {
+    struct sock_filter *insns;
+    size_t len;
+    size_t cap;
+    size_t *labels;             /* label -> instruction index */
+    size_t nlabels;
+    int failed;
+};
+
+/* ja operands hold label numbers until bpf_resolve() turns them into offsets */
+static void bpf_emit(struct bpf_builder *b, uint16_t code, uint8_t jt, uint8_t jf, uint32_t k)
+{
+    if (b->len == b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 256;
+        struct sock_filter *insns = realloc(b->insns, cap * sizeof(*insns));
+        if (!insns) {
+            b->failed = 1;
+            return;
+        }
+        b->insns = insns;
+        b->cap = cap;
+    }
+    b->insns[b->len++] = (struct sock_filter)BPF_JUMP(code, k, jt, jf);
+}
+
+static size_t bpf_new_label(struct bpf_builder *b)
+{
+    size_t *labels = realloc(b->labels, (b->nlabels + 1) * sizeof(*labels));
+    if (!labels) {
+        b->failed = 1;
+        return 0;
+    }
+    b->labels = labels;
+    b->labels[b->nlabels] = SIZE_MAX;
+    return b->nlabels++;
+}
+
+static void bpf_place(struct bpf_builder *b, size_t label)
+{
+    if (!b->failed) {
+        b->labels[label] = b->len;
+    }
+}
+
+static void bpf_jump(struct bpf_builder *b, size_t label)
+{
+    bpf_emit(b, BPF_JMP | BPF_JA, 0, 0, (uint32_t)label);
+}
+
+static void bpf_resolve(struct bpf_builder *b)
+{
+    for (size_t i = 0; i < b->len && !b->failed; i++) {
+        struct sock_filter *insn = &b->insns[i];
+        if (insn->code == (BPF_JMP | BPF_JA)) {
+            insn->k = (uint32_t)(b->labels[insn->k] - (i + 1));
+        }
+    }
+}
+
+/*
+ * Compare len bytes of s with the packet at offset (relative to X when
+ * indirect); continue on a match, jump to fail otherwise.
+ */
+static void bpf_match_bytes(struct bpf_builder *b, const char *s, size_t len, uint32_t offset,
+                            int indirect, size_t fail)
+{
+    const uint16_t mode = indirect ? BPF_IND : BPF_ABS;
+    size_t pos = 0;
+
+    while (pos < len) {
+        size_t chunk = len - pos >= 4 ? 4 : len - pos >= 2 ? 2 : 1;
+        uint16_t size = chunk == 4 ? BPF_W : chunk == 2 ? BPF_H : BPF_B;
+        uint32_t value = 0;
+
+        /* BPF loads are big-endian */
+        for (size_t i = 0; i < chunk; i++) {
+            value = (value << 8) | (unsigned char)s[pos + i];
+        }
+
+        bpf_emit(b, BPF_LD | size | mode, 0, 0, offset + (uint32_t)pos);
+        bpf_emit(b, BPF_JMP | BPF_JEQ | BPF_K, 1, 0, value);
+        bpf_jump(b, fail);
+        pos += chunk;
+    }
+}
+
+static const char *uevent_action(const char *action)
+{
+    if (strcmp(action, "attach") == 0) {
+        return "add@";
+    }
+    if (strcmp(action, "detach") == 0) {
+        return "remove@";
+    }
+    if (strcmp(action, "change") == 0) {
+        return "change@";
+    }
+    return NULL;
+}
+
+/* Split a whitespace-separated list in place */
+static size_t split_words(char *list, char **words, size_t max)
+{
+    size_t count = 0;
+    char *save = NULL;
+
+    for (char *w = strtok_r(list, " \t", &save); w && count < max; w = strtok_r(NULL, " \t", &save)) {
+        words[count++] = w;
+    }
+    return count;
+}
+
+static void bpf_build(struct bpf_builder *b, char **actions, size_t nactions,
+                      char **subsystems, size_t nsubsystems)
+{
+    if (nactions > 0) {
+        size_t action_ok = bpf_new_label(b);
+
+        for (size_t i = 0; i < nactions; i++) {
+            const char *prefix = uevent_action(actions[i]);
+            size_t next = bpf_new_label(b);
+            bpf_match_bytes(b, prefix, strlen(prefix), 0, 0, next);
+            bpf_jump(b, action_ok);
+            bpf_place(b, next);
+        }
+        bpf_emit(b, BPF_RET | BPF_K, 0, 0, BPF_DROP);
+        bpf_place(b, action_ok);
+    }
+
+    if (nsubsystems > 0) {
+        size_t found = bpf_new_label(b);
+        size_t accept = bpf_new_label(b);
+
+        /* X = offset of "SUBSYSTEM=" once the header's NUL is found at i */
+        for (uint32_t i = 1; i < DEMI_BPF_SCAN; i++) {
+            bpf_emit(b, BPF_LD | BPF_B | BPF_ABS, 0, 0, i);
+            bpf_emit(b, BPF_JMP | BPF_JEQ | BPF_K, 0, 2, 0);
+            bpf_emit(b, BPF_LDX | BPF_IMM, 0, 0, 2 * i + 17);
+            bpf_jump(b, found);
+        }
+        bpf_emit(b, BPF_RET | BPF_K, 0, 0, BPF_ACCEPT);
+
+        bpf_place(b, found);
+        bpf_match_bytes(b, "SUBSYSTEM=", 10, 0, 1, accept);
+
+        for (size_t i = 0; i < nsubsystems; i++) {
+            size_t next = bpf_new_label(b);
+            /* Include the NUL so "block" does not match "blockx" */
+            bpf_match_bytes(b, subsystems[i], strlen(subsystems[i]) + 1, 10, 1, next);
+            bpf_emit(b, BPF_RET | BPF_K, 0, 0, BPF_ACCEPT);
+            bpf_place(b, next);
+        }
+        bpf_emit(b, BPF_RET | BPF_K, 0, 0, BPF_DROP);
+        bpf_place(b, accept);
+    }
+
+    bpf_emit(b, BPF_RET | BPF_K, 0, 0, BPF_ACCEPT);
+    bpf_resolve(b);
+}
+
+int demi_bpf_attach(int fd, const char *actions, const char *subsystems)
+{
+    char *action_list = strdup(actions ? actions : "");
+    char *subsystem_list = strdup(subsystems ? subsystems : "");
+    char *action_words[DEMI_BPF_WORDS_MAX];
+    char *subsystem_words[DEMI_BPF_WORDS_MAX];
+    struct bpf_builder b = {0};
+    int rc = -1;
+
+    if (!action_list || !subsystem_list) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    size_t nactions = split_words(action_list, action_words, DEMI_BPF_WORDS_MAX);
+    size_t nsubsystems = split_words(subsystem_list, subsystem_words, DEMI_BPF_WORDS_MAX);
+
+    for (size_t i = 0; i < nactions; i++) {
+        if (!uevent_action(action_words[i])) {
+            errno = EINVAL;
+            goto out;
+        }
+    }
+    if (nactions == 0 && nsubsystems == 0) {
+        rc = 0;     /* nothing to filter */
+        goto out;
+    }
+
+    bpf_build(&b, action_words, nactions, subsystem_words, nsubsystems);
+    if (b.failed) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    struct sock_fprog prog = { .len = (unsigned short)b.len, .filter = b.insns };
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1) {
+        goto out;
+    }
+    rc = 1;
+
+out:
+    free(b.insns);
+    free(b.labels);
+    free(action_list);
+    free(subsystem_list);
+    return rc;
+}
@@ -11,4 +11,42 @@
 /* Netlink multicast group for uevents */
 #define DEMI_MONITOR_NETLINK_GROUP 0x1
 
+/* Receive buffer size per uevent message; doubled up to the limit on truncation */
+#define DEMI_MSG_MAX 8192
+#define DEMI_MSG_LIMIT (64 * 1024)
+
+/* Where demi_scan() finds the block devices present right now */
+#define DEMI_SCAN_DIR "/sys/class/block"
+
+struct demi_event;
+
+/*
+ * Parse one raw uevent in place; filters and logs like demi_read(). Stamps
+ * the parsed and filtered stages; the received stage is left to the caller.
+ */
+int demi_parse_uevent(char *buf, size_t len, struct demi_event *de);
+
+/* One NUL-terminated record: [dt_start, dt_end), '=' at dt_eq or dt_eq == dt_end */
+struct demi_token {
+    unsigned short dt_start;
+    unsigned short dt_eq;
+    unsigned short dt_end;
+};
+
+/*
+ * Split buf into records starting at *pos, at most max of them; *pos is left
+ * at the first record not returned. Uses the best SIMD kernel available.
+ */
+size_t demi_tokenize(const char *buf, size_t len, size_t *pos, struct demi_token *tok, size_t max);
+/* Force a kernel ("avx2", "sse2", "scalar"), e.g. for benchmarks */
+int demi_tokenize_use(const char *kernel);
+const char *demi_tokenize_kernel(void);
+
+/*
+ * Attach a socket filter passing only the listed actions (attach, detach,
+ * change) and subsystems; an empty list passes everything. Returns 1 if a
+ * filter was attached, 0 if there was nothing to filter, -1 on error.
+ */
+int demi_bpf_attach(int fd, const char *actions, const char *subsystems);
+
 #endif /* _DEMI_INTERNAL_LINUX_H_ */
@@ -0,0 +1,421 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "demi.h"
+#include "demi_loop.h"
+#include "demi_wheel.h"
+
+#define LOOP_EVENTS_MAX 64
+
+enum source_kind {
+    SOURCE_FD,
+    SOURCE_FD_WRITE,
+    SOURCE_SIGNALFD,    /* the loop's own signalfd */
+    SOURCE_SIGNAL,      /* a registered handler, not in epoll */
+    SOURCE_TIMER,       /* on the loop's timer wheel, not in epoll */
+    SOURCE_PID,         /* fd is a pidfd, or -1 when reaped on SIGCHLD */
+};
+
+struct demi_loop_source {
+    struct demi_loop_source *prev;
+    struct demi_loop_source *next;
+    enum source_kind kind;
+    int fd;
+    int owns_fd;        /* closed on removal; fd sources belong to the caller */
+    int signo;
+    pid_t pid;
+    int dead;
+    demi_loop_fn fn;
+    demi_loop_signal_fn signal_fn;
+    demi_loop_exit_fn exit_fn;
+    void *arg;
+    struct demi_wheel_timer timer;
+};
+
+struct demi_loop {
+    int epfd;
+    int sigfd;
+    sigset_t sigmask;
+    int stopping;
+    struct demi_loop_source *sources;
+    struct demi_loop_source *graveyard;     /* removed, freed after dispatch */
+    struct demi_loop_source *signals[NSIG];
+    unsigned long pid_fallback;             /* pid sources without a pidfd */
+    struct demi_wheel wheel;                /* every timer source; one epoll timeout */
+};
+
+static uint64_t loop_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static int loop_pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static struct demi_loop_source *loop_new_source(struct demi_loop *loop, enum source_kind kind, int fd)
+{
+    struct demi_loop_source *src = calloc(1, sizeof(*src));
+    if (!src) {
+        return NULL;
+    }
+    src->kind = kind;
+    src->fd = fd;
+    src->owns_fd = kind != SOURCE_FD && kind != SOURCE_FD_WRITE;
+
+    if (fd != -1 && kind != SOURCE_SIGNAL) {
+        struct epoll_event ev = { .events = kind == SOURCE_FD_WRITE ? EPOLLOUT : EPOLLIN, .data.ptr = src };
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            free(src);
+            return NULL;
+        }
+    }
+
+    src->next = loop->sources;
+    if (loop->sources) {
+        loop->sources->prev = src;
+    }
+    loop->sources = src;
+    return src;
+}
+
+static void loop_bury(struct demi_loop *loop)
+{
+    while (loop->graveyard) {
+        struct demi_loop_source *src = loop->graveyard;
+        loop->graveyard = src->next;
+        free(src);
+    }
+}
+
+struct demi_loop *demi_loop_create(void)
+{
+    struct demi_loop *loop = calloc(1, sizeof(*loop));
+    if (!loop) {
+        return NULL;
+    }
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd == -1) {
+        free(loop);
+        return NULL;
+    }
+    demi_wheel_init(&loop->wheel, loop_now_ms());
+
+    /* SIGCHLD is always routed here so children can be reaped without pidfds */
+    sigemptyset(&loop->sigmask);
+    sigaddset(&loop->sigmask, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &loop->sigmask, NULL);
+
+    loop->sigfd = signalfd(-1, &loop->sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (loop->sigfd == -1 || !loop_new_source(loop, SOURCE_SIGNALFD, loop->sigfd)) {
+        if (loop->sigfd != -1) {
+            close(loop->sigfd);
+        }
+        close(loop->epfd);
+        free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+void demi_loop_free(struct demi_loop *loop)
+{
+    if (!loop) {
+        return;
+    }
+
+    while (loop->sources) {
+        demi_loop_remove(loop, loop->sources);
+    }
+    loop_bury(loop);
+    close(loop->epfd);
+    free(loop);
+}
+
+struct demi_loop_source *demi_loop_add_fd(struct demi_loop *loop, int fd, demi_loop_fn fn, void *arg)
+{
+    struct demi_loop_source *src = loop_new_source(loop, SOURCE_FD, fd);
+    if (src) {
+        src->fn = fn;
+        src->arg = arg;
+    }
+    return src;
+}
+
+struct demi_loop_source *demi_loop_add_fd_writable(struct demi_loop *loop, int fd, demi_loop_fn fn, void *arg)
+{
+    struct demi_loop_source *src = loop_new_source(loop, SOURCE_FD_WRITE, fd);
+    if (src) {
+        src->fn = fn;
+        src->arg = arg;
+    }
+    return src;
+}
+
+int demi_loop_pause(struct demi_loop *loop, struct demi_loop_source *src, int paused)
+{
+    if (src->kind != SOURCE_FD) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = paused ? 0 : EPOLLIN, .data.ptr = src };
+    return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, src->fd, &ev);
+}
+
+struct demi_loop_source *demi_loop_add_signal(struct demi_loop *loop, int signo,
+                                              demi_loop_signal_fn fn, void *arg)
+{
+    if (signo <= 0 || signo >= NSIG || loop->signals[signo]) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    sigset_t mask = loop->sigmask;
+    sigaddset(&mask, signo);
+    if (signalfd(loop->sigfd, &mask, 0) == -1) {
+        return NULL;
+    }
+
+    struct demi_loop_source *src = loop_new_source(loop, SOURCE_SIGNAL, -1);
+    if (!src) {
+        return NULL;
+    }
+    src->signo = signo;
+    src->signal_fn = fn;
+    src->arg = arg;
+    loop->signals[signo] = src;
+    loop->sigmask = mask;
+
+    sigset_t block;
+    sigemptyset(&block);
+    sigaddset(&block, signo);
+    pthread_sigmask(SIG_BLOCK, &block, NULL);
+    return src;
+}
+
+struct demi_loop_source *demi_loop_add_timer(struct demi_loop *loop, unsigned long ms,
+                                             demi_loop_fn fn, void *arg)
+{
+    struct demi_loop_source *src = loop_new_source(loop, SOURCE_TIMER, -1);
+    if (!src) {
+        return NULL;
+    }
+    src->fn = fn;
+    src->arg = arg;
+    demi_wheel_add(&loop->wheel, &src->timer, loop_now_ms() + ms);
+    return src;
+}
+
+struct demi_loop_source *demi_loop_add_pid(struct demi_loop *loop, pid_t pid,
+                                           demi_loop_exit_fn fn, void *arg)
+{
+    /* A zombie still has a pidfd, so a child that already exited is not missed */
+    int fd = loop_pidfd_open(pid);
+    if (fd == -1 && errno != ENOSYS) {
+        return NULL;
+    }
+
+    struct demi_loop_source *src = loop_new_source(loop, SOURCE_PID, fd);
+    if (!src) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
+    }
+    src->pid = pid;
+    src->exit_fn = fn;
+    src->arg = arg;
+
+    if (fd == -1) {
+        /* No pidfd (kernel < 5.3): reap on SIGCHLD, and now in case it already exited */
+        loop->pid_fallback++;
+        if (kill(getpid(), SIGCHLD) == -1) {
+            demi_logf("event loop: cannot poke SIGCHLD: %s", strerror(errno));
+        }
+    }
+    return src;
+}
+
+void demi_loop_remove(struct demi_loop *loop, struct demi_loop_source *src)
+{
+    if (!src || src->dead) {
+        return;
+    }
+    src->dead = 1;
+
+    if (src->prev) {
+        src->prev->next = src->next;
+    } else {
+        loop->sources = src->next;
+    }
+    if (src->next) {
+        src->next->prev = src->prev;
+    }
+
+    switch (src->kind) {
+    case SOURCE_FD:
+    case SOURCE_FD_WRITE:
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+        break;
+    case SOURCE_SIGNAL:
+        loop->signals[src->signo] = NULL;
+        break;
+    case SOURCE_TIMER:
+        demi_wheel_cancel(&loop->wheel, &src->timer);
+        break;
+    case SOURCE_PID:
+        if (src->fd == -1) {
+            loop->pid_fallback--;
+        }
+        break;
+    default:
+        break;
+    }
+    if (src->owns_fd && src->fd != -1) {
+        /* Closing the fd also drops it from the epoll set */
+        close(src->fd);
+    }
+    src->fd = -1;
+
+    src->next = loop->graveyard;
+    loop->graveyard = src;
+}
+
+/* Returns 1 and reports the exit if the child has been reaped */
+static int loop_reap(struct demi_loop *loop, struct demi_loop_source *src)
+{
+    struct rusage usage;
+    int status;
+    pid_t rc;
+
+    while ((rc = wait4(src->pid, &status, WNOHANG, &usage)) == -1 && errno == EINTR) {
+    }
+    if (rc == 0) {
+        return 0;
+    }
+    if (rc == -1) {
+        status = -1;    /* reaped by somebody else */
+    }
+
+    demi_loop_exit_fn fn = src->exit_fn;
+    void *arg = src->arg;
+    pid_t pid = src->pid;
+    demi_loop_remove(loop, src);
+    fn(pid, status, rc == -1 ? NULL : &usage, arg);
+    return 1;
+}
+
+static void loop_reap_fallback(struct demi_loop *loop)
+{
+    struct demi_loop_source *src = loop->sources;
+
+    while (src && loop->pid_fallback > 0) {
+        struct demi_loop_source *next = src->next;
+        if (src->kind == SOURCE_PID && src->fd == -1 && loop_reap(loop, src)) {
+            /* The callback may have changed the list; start over */
+            next = loop->sources;
+        }
+        src = next;
+    }
+}
+
+static void loop_signals(struct demi_loop *loop)
+{
+    struct signalfd_siginfo si;
+
+    while (read(loop->sigfd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+        int signo = (int)si.ssi_signo;
+        if (signo == SIGCHLD && loop->pid_fallback > 0) {
+            loop_reap_fallback(loop);
+        }
+        if (signo > 0 && signo < NSIG && loop->signals[signo]) {
+            struct demi_loop_source *src = loop->signals[signo];
+            src->signal_fn(signo, src->arg);
+        }
+    }
+}
+
+static void loop_timer_fired(struct demi_wheel_timer *t, void *arg)
+{
+    struct demi_loop *loop = arg;
+    struct demi_loop_source *src = (struct demi_loop_source *)((char *)t - offsetof(struct demi_loop_source, timer));
+
+    demi_loop_remove(loop, src);
+    src->fn(src->arg);
+}
+
+static void loop_dispatch(struct demi_loop *loop, struct demi_loop_source *src)
+{
+    switch (src->kind) {
+    case SOURCE_FD:
+    case SOURCE_FD_WRITE:
+        src->fn(src->arg);
+        break;
+    case SOURCE_SIGNALFD:
+        loop_signals(loop);
+        break;
+    case SOURCE_PID:
+        loop_reap(loop, src);
+        break;
+    case SOURCE_TIMER:
+    case SOURCE_SIGNAL:
+        break;
+    }
+}
+
+int demi_loop_run(struct demi_loop *loop)
+{
+    struct epoll_event events[LOOP_EVENTS_MAX];
+
+    loop->stopping = 0;
+    while (!loop->stopping) {
+        /* One wakeup for the nearest deadline, however many timers are pending */
+        long timeout = demi_wheel_timeout(&loop->wheel, loop_now_ms());
+        int n = epoll_wait(loop->epfd, events, LOOP_EVENTS_MAX, timeout > INT_MAX ? INT_MAX : (int)timeout);
+        if (n == -1) {
+            if (errno != EINTR) {
+                return -1;
+            }
+            n = 0;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct demi_loop_source *src = events[i].data.ptr;
+            /* A callback earlier in this batch may have removed it */
+            if (!src->dead) {
+                loop_dispatch(loop, src);
+            }
+        }
+        demi_wheel_expire(&loop->wheel, loop_now_ms(), loop_timer_fired, loop);
+        loop_bury(loop);
+    }
+    return 0;
+}
+
+void demi_loop_stop(struct demi_loop *loop)
+{
+    loop->stopping = 1;
+}
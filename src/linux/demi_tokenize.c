@@ -0,0 +1,212 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "demi.h"
+#include "demi_internal.h"
+
+/*
+ * uevent tokenizer: one pass over the message finds every NUL and the first
+ * '=' of each record. The vector kernels compare a whole block against both
+ * bytes at once and walk the resulting bitmasks; the best kernel the CPU
+ * supports is picked on first use.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DEMI_TOKENIZE_X86 1
+#include <immintrin.h>
+#endif
+
+typedef size_t (*tokenize_fn)(const char *buf, size_t len, size_t *pos,
+                              struct demi_token *tok, size_t max);
+
+struct tokenize_state {
+    size_t start;       /* first byte of the current record */
+    size_t eq;          /* first '=' in it, SIZE_MAX if none yet */
+    size_t count;
+};
+
+/* Returns 1 when the token array is full */
+static inline int emit_nul(struct tokenize_state *st, size_t at, struct demi_token *tok, size_t max)
+{
+    struct demi_token *t = &tok[st->count++];
+    t->dt_start = (unsigned short)st->start;
+    t->dt_eq = (unsigned short)(st->eq == SIZE_MAX ? at : st->eq);
+    t->dt_end = (unsigned short)at;
+    st->start = at + 1;
+    st->eq = SIZE_MAX;
+    return st->count == max;
+}
+
+/* Byte loop from i to len; also finishes the tail of the vector kernels */
+static size_t tokenize_tail(const char *buf, size_t len, size_t i, size_t *pos,
+                            struct demi_token *tok, size_t max, struct tokenize_state *st)
+{
+    for (; i < len; i++) {
+        if (buf[i] == '\0') {
+            if (emit_nul(st, i, tok, max)) {
+                break;
+            }
+        } else if (buf[i] == '=' && st->eq == SIZE_MAX) {
+            st->eq = i;
+        }
+    }
+    *pos = st->start;
+    return st->count;
+}
+
+/* Walk the NUL and '=' bits of one block in byte order */
+static inline int walk_masks(uint64_t nul, uint64_t eq, size_t base, struct demi_token *tok,
+                             size_t max, struct tokenize_state *st)
+{
+    uint64_t bits = nul | eq;
+
+    while (bits) {
+        unsigned int b = (unsigned int)__builtin_ctzll(bits);
+        uint64_t bit = 1ull << b;
+        bits &= bits - 1;
+
+        if (nul & bit) {
+            if (emit_nul(st, base + b, tok, max)) {
+                return 1;
+            }
+        } else if (st->eq == SIZE_MAX) {
+            st->eq = base + b;
+        }
+    }
+    return 0;
+}
+
+static size_t tokenize_scalar(const char *buf, size_t len, size_t *pos,
+                              struct demi_token *tok, size_t max)
+{
+    struct tokenize_state st = { *pos, SIZE_MAX, 0 };
+    return tokenize_tail(buf, len, *pos, pos, tok, max, &st);
+}
+
+#ifdef DEMI_TOKENIZE_X86
+__attribute__((target("sse2")))
+static size_t tokenize_sse2(const char *buf, size_t len, size_t *pos,
+                            struct demi_token *tok, size_t max)
+{
+    struct tokenize_state st = { *pos, SIZE_MAX, 0 };
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i equals = _mm_set1_epi8('=');
+    size_t i = *pos;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        uint64_t nul = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+        uint64_t eq = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, equals));
+        if ((nul | eq) && walk_masks(nul, eq, i, tok, max, &st)) {
+            *pos = st.start;
+            return st.count;
+        }
+    }
+    return tokenize_tail(buf, len, i, pos, tok, max, &st);
+}
+
+__attribute__((target("avx2")))
+static size_t tokenize_avx2(const char *buf, size_t len, size_t *pos,
+                            struct demi_token *tok, size_t max)
+{
+    struct tokenize_state st = { *pos, SIZE_MAX, 0 };
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i equals = _mm256_set1_epi8('=');
+    size_t i = *pos;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        uint64_t nul = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+        uint64_t eq = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, equals));
+        if ((nul | eq) && walk_masks(nul, eq, i, tok, max, &st)) {
+            *pos = st.start;
+            return st.count;
+        }
+    }
+    return tokenize_tail(buf, len, i, pos, tok, max, &st);
+}
+#endif
+
+struct tokenize_kernel {
+    const char *name;
+    tokenize_fn fn;
+    int (*supported)(void);
+};
+
+static int always(void)
+{
+    return 1;
+}
+
+#ifdef DEMI_TOKENIZE_X86
+static int has_sse2(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+static int has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+/* Best first */
+static const struct tokenize_kernel g_kernels[] = {
+#ifdef DEMI_TOKENIZE_X86
+    { "avx2", tokenize_avx2, has_avx2 },
+    { "sse2", tokenize_sse2, has_sse2 },
+#endif
+    { "scalar", tokenize_scalar, always },
+};
+
+#define KERNEL_COUNT (sizeof(g_kernels) / sizeof(g_kernels[0]))
+
+static const struct tokenize_kernel *g_kernel = NULL;
+static pthread_once_t g_kernel_once = PTHREAD_ONCE_INIT;
+
+static void tokenize_pick(void)
+{
+#ifdef DEMI_TOKENIZE_X86
+    __builtin_cpu_init();
+#endif
+    for (size_t i = 0; i < KERNEL_COUNT; i++) {
+        if (g_kernels[i].supported()) {
+            g_kernel = &g_kernels[i];
+            return;
+        }
+    }
+}
+
+size_t demi_tokenize(const char *buf, size_t len, size_t *pos, struct demi_token *tok, size_t max)
+{
+    pthread_once(&g_kernel_once, tokenize_pick);
+    if (max == 0 || *pos >= len) {
+        return 0;
+    }
+    return g_kernel->fn(buf, len, pos, tok, max);
+}
+
+int demi_tokenize_use(const char *kernel)
+{
+    pthread_once(&g_kernel_once, tokenize_pick);
+    for (size_t i = 0; i < KERNEL_COUNT; i++) {
+        if (strcmp(g_kernels[i].name, kernel) == 0) {
+            if (!g_kernels[i].supported()) {
+                errno = ENOTSUP;
+                return -1;
+            }
+            g_kernel = &g_kernels[i];
+            return 0;
+        }
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+const char *demi_tokenize_kernel(void)
+{
+    pthread_once(&g_kernel_once, tokenize_pick);
+    return g_kernel->name;
+}
@@ -0,0 +1,44 @@
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "demi.h"
+#include "demi_spawn.h"
+
+int demi_watch_open(const char *dir)
+{
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    uint32_t mask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                    IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+    if (inotify_add_watch(fd, dir, mask) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int demi_watch_drain(int fd)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+
+    for (;;) {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len > 0) {
+            changed = 1;
+            continue;
+        }
+        if (len == -1 && errno == EINTR) {
+            continue;
+        }
+        break;
+    }
+
+    return changed;
+}
@@ -18,6 +18,7 @@ int demi_read(int fd, struct demi_event *de)
         errno = EINVAL;
         return -1;
     }
+    *de = (struct demi_event){0};
 
     if (read(fd, &he, sizeof(he)) <= 0) {
         return -1;
@@ -40,6 +41,52 @@ int demi_read(int fd, struct demi_event *de)
     return 0;
 }
 
+/* No multi-message receive here: deliver one event per call */
+int demi_read_batch(int fd, struct demi_event *events, int n)
+{
+    if (!events || n <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (demi_read(fd, &events[0]) == -1) {
+        return -1;
+    }
+
+    return events[0].de_devname[0] != '\0' ? 1 : 0;
+}
+
+void demi_read_stats(struct demi_read_stats *st)
+{
+    *st = (struct demi_read_stats){0};
+}
+
+void demi_set_rcvbuf(int bytes)
+{
+    (void)bytes;
+}
+
+/* No kernel-side filter for this event source; demi_read() filters by device */
+int demi_set_event_filter(const char *actions, const char *subsystems)
+{
+    (void)actions;
+    (void)subsystems;
+    return 0;
+}
+
+void demi_set_seqnum_check(int enabled)
+{
+    (void)enabled;
+}
+
+/* No device enumeration here; a resync finds nothing to reconcile */
+int demi_scan(demi_scan_fn fn, void *arg)
+{
+    (void)fn;
+    (void)arg;
+    return 0;
+}
+
 int demi_init(int flags)
 {
     return open("/dev/hotplug", O_RDONLY | flags);
@@ -0,0 +1,149 @@
+/*
+ * Event coalescing test: bursts of one action per device collapse into the
+ * latest job, other actions release what was held first, windows run out
+ * through the event loop, and a detach/attach flap is cancelled or turned
+ * into a change.
+ *
+ * cc -DDEMI_PLATFORM_LINUX -Iinclude -Isrc/linux -o test_coalesce \
+ *    test_coalesce.c src/demi_coalesce.c src/linux/demi_loop.c src/demi_wheel.c \
+ *    src/demi_log.c -lpthread
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "include/demi_coalesce.h"
+#include "include/demi_loop.h"
+
+static char g_fired[64][32];
+static int g_nfired;
+static int g_discarded;
+
+static void fire_job(void *job)
+{
+    snprintf(g_fired[g_nfired++], sizeof(g_fired[0]), "%s", (char *)job);
+    free(job);
+}
+
+static void drop_job(void *job)
+{
+    g_discarded++;
+    free(job);
+}
+
+static int g_flap_to_change;
+
+static void *flap_job(void *detach_job, void *attach_job)
+{
+    free(detach_job);
+    free(attach_job);
+    return g_flap_to_change ? strdup("flapchange") : NULL;
+}
+
+static void stop_loop(void *arg)
+{
+    demi_loop_stop((struct demi_loop *)arg);
+}
+
+static void submit(struct demi_coalesce *c, const char *dev, enum demi_event_type type, const char *name)
+{
+    demi_coalesce_submit(c, dev, type, strdup(name));
+}
+
+static int expect(const char *what, const char *const *names, int n)
+{
+    int ok = g_nfired == n;
+    for (int i = 0; ok && i < n; i++) {
+        ok = strcmp(g_fired[i], names[i]) == 0;
+    }
+
+    printf("  %-44s fired:", what);
+    for (int i = 0; i < g_nfired; i++) {
+        printf(" %s", g_fired[i]);
+    }
+    printf(" -> %s\n", ok ? "OK" : "FAIL");
+    return ok ? 0 : 1;
+}
+
+int main() {
+    int failures = 0;
+    struct demi_coalesce_stats st;
+
+    printf("=== Event coalescing test ===\n\n");
+
+    struct demi_loop *loop = demi_loop_create();
+    struct demi_coalesce *c = loop ? demi_coalesce_create(loop, fire_job, drop_job) : NULL;
+    if (!c) {
+        printf("  failed to create coalescer\n");
+        return 1;
+    }
+    demi_coalesce_set_window(c, DEMI_CHANGE, 50);
+
+    /* No window: passed straight on */
+    submit(c, "sda", DEMI_ATTACH, "attach1");
+    static const char *const direct[] = { "attach1" };
+    failures += expect("attach without a window", direct, 1);
+
+    /* A change burst on sda, one change on sdb, then a detach for sda */
+    g_nfired = 0;
+    for (int i = 1; i <= 5; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "change%d", i);
+        submit(c, "sda", DEMI_CHANGE, name);
+    }
+    submit(c, "sdb", DEMI_CHANGE, "changeB");
+    static const char *const held[] = { 0 };
+    failures += expect("changes held inside the window", held, 0);
+
+    submit(c, "sda", DEMI_DETACH, "detach1");
+    static const char *const ordered[] = { "change5", "detach1" };
+    failures += expect("detach releases the latest change first", ordered, 2);
+
+    demi_loop_add_timer(loop, 200, stop_loop, loop);
+    demi_loop_run(loop);
+    static const char *const expired[] = { "change5", "detach1", "changeB" };
+    failures += expect("sdb released when its window ran out", expired, 3);
+
+    demi_coalesce_stats(c, &st);
+    printf("  pending=%lu absorbed=%lu delayed=%lu discarded=%d\n",
+           st.pending, st.absorbed, st.delayed, g_discarded);
+    if (st.pending != 0 || st.absorbed != 4 || st.delayed != 1 || g_discarded != 4) {
+        printf("  FAIL: unexpected counters\n");
+        failures++;
+    }
+
+    /* Flaps: detach held for a grace period, then the device comes back */
+    demi_coalesce_set_window(c, DEMI_DETACH, 50);
+    demi_coalesce_set_flap(c, flap_job);
+    g_nfired = 0;
+    submit(c, "sdd", DEMI_DETACH, "detachD");
+    submit(c, "sdd", DEMI_ATTACH, "attachD");
+    static const char *const cancelled[] = { 0 };
+    failures += expect("detach + attach cancelled", cancelled, 0);
+
+    g_flap_to_change = 1;
+    submit(c, "sde", DEMI_DETACH, "detachE");
+    submit(c, "sde", DEMI_ATTACH, "attachE");
+    submit(c, "sdf", DEMI_DETACH, "detachF");
+    demi_loop_add_timer(loop, 200, stop_loop, loop);
+    demi_loop_run(loop);
+    static const char *const flapped[] = { "flapchange", "detachF" };
+    failures += expect("flap reduced to change, lone detach kept", flapped, 2);
+
+    demi_coalesce_stats(c, &st);
+    if (st.flaps != 2) {
+        printf("  FAIL: flaps=%lu, expected 2\n", st.flaps);
+        failures++;
+    }
+
+    /* Held jobs are discarded on destroy */
+    submit(c, "sdc", DEMI_CHANGE, "changeC");
+    demi_coalesce_destroy(c);
+    if (g_discarded != 5) {
+        printf("  FAIL: held job not discarded on destroy\n");
+        failures++;
+    }
+    demi_loop_free(loop);
+
+    printf("\n=== Event coalescing test %s ===\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * Kernel-side uevent filter test. The generated BPF program is attached to an
+ * AF_UNIX datagram socketpair (netlink needs root) and kernel-formatted
+ * uevents are sent through it; the test checks which ones arrive.
+ *
+ * cc -DDEMI_PLATFORM_LINUX -Iinclude -Isrc/linux -o test_event_filter \
+ *    test_event_filter.c src/linux/demi.c src/linux/demi_bpf.c src/linux/demi_tokenize.c src/demi_event.c src/demi_filter.c src/demi_log.c -lpthread
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "include/demi.h"
+#include "demi_internal.h"
+
+struct filter_case {
+    const char *action;
+    const char *devpath;
+    const char *subsystem;
+    int expected;
+};
+
+static const struct filter_case cases[] = {
+    { "add", "/devices/pci0000:00/0000:00:1f.2/ata1/host0/target0:0:0/0:0:0:0/block/sda", "block", 1 },
+    { "remove", "/devices/virtual/block/loop0", "block", 1 },
+    { "change", "/devices/virtual/block/md0", "block", 1 },
+    { "bind", "/devices/virtual/block/md0", "block", 0 },
+    { "add", "/devices/virtual/net/veth1234", "net", 0 },
+    { "add", "/devices/virtual/net/b", "blockx", 0 },
+    { "add", "/devices/virtual/net/b", "bloc", 0 },
+    { "remove", "/devices/pci0000:00/0000:00:14.0/usb1/1-1", "usb", 0 },
+};
+
+static size_t build_uevent(char *buf, size_t cap, const struct filter_case *c)
+{
+    int n = snprintf(buf, cap, "%s@%s", c->action, c->devpath);
+    size_t len = (size_t)n + 1;
+    len += (size_t)snprintf(buf + len, cap - len, "ACTION=%s", c->action) + 1;
+    len += (size_t)snprintf(buf + len, cap - len, "DEVPATH=%s", c->devpath) + 1;
+    len += (size_t)snprintf(buf + len, cap - len, "SUBSYSTEM=%s", c->subsystem) + 1;
+    len += (size_t)snprintf(buf + len, cap - len, "SEQNUM=1") + 1;
+    return len;
+}
+
+static int delivered(int sv[2], const char *msg, size_t len)
+{
+    char buf[DEMI_MSG_MAX];
+    send(sv[1], msg, len, 0);
+    return recv(sv[0], buf, sizeof(buf), MSG_DONTWAIT) > 0;
+}
+
+int main() {
+    int failures = 0;
+    int sv[2];
+    char msg[1024];
+
+    printf("=== Kernel-side uevent filter test ===\n\n");
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == -1) {
+        perror("socketpair");
+        return 1;
+    }
+    if (demi_bpf_attach(sv[0], "attach detach change", "block") != 1) {
+        perror("demi_bpf_attach");
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        size_t len = build_uevent(msg, sizeof(msg), &cases[i]);
+        int got = delivered(sv, msg, len);
+        printf("  %-6s %-9s -> %s%s\n", cases[i].action, cases[i].subsystem,
+               got ? "PASS" : "DROP", got == cases[i].expected ? "" : "  <-- FAIL");
+        if (got != cases[i].expected) {
+            failures++;
+        }
+    }
+
+    /* Headers beyond the scan window are left for userspace to judge */
+    char longpath[400];
+    memset(longpath, 'x', sizeof(longpath) - 1);
+    longpath[0] = '/';
+    longpath[sizeof(longpath) - 1] = '\0';
+    struct filter_case longcase = { "add", longpath, "net", 1 };
+    int got = delivered(sv, msg, build_uevent(msg, sizeof(msg), &longcase));
+    printf("  long devpath         -> %s%s\n", got ? "PASS" : "DROP", got ? "" : "  <-- FAIL");
+    failures += !got;
+
+    if (demi_bpf_attach(sv[0], "attach bogus", NULL) != -1) {
+        printf("  unknown action accepted  <-- FAIL\n");
+        failures++;
+    }
+
+    close(sv[0]);
+    close(sv[1]);
+
+    printf("\n=== Kernel-side uevent filter test %s ===\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
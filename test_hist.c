@@ -0,0 +1,92 @@
+/*
+ * Histogram test: small values are exact, larger ones land in a bucket
+ * whose upper bound is within 1/16 above them, quantiles of a uniform
+ * spread come out within that error, and merging adds up.
+ *
+ * cc -Iinclude -o test_hist test_hist.c src/demi_hist.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "include/demi_hist.h"
+
+static struct demi_hist g_a;
+static struct demi_hist g_b;
+
+static int test_exact(void)
+{
+    int failures = 0;
+
+    printf("Test 1: values below %d are exact\n", 1 << DEMI_HIST_SUB_BITS);
+    for (uint64_t v = 0; v < (1 << DEMI_HIST_SUB_BITS); v++) {
+        demi_hist_init(&g_a);
+        demi_hist_add(&g_a, v);
+        if (demi_hist_quantile(&g_a, 0.5) != v) {
+            printf("  value %llu reported as %llu\n", (unsigned long long)v,
+                   (unsigned long long)demi_hist_quantile(&g_a, 0.5));
+            failures++;
+        }
+    }
+    printf("  %s\n", failures ? "FAIL" : "OK");
+    return failures;
+}
+
+static int test_precision(void)
+{
+    int failures = 0;
+
+    printf("Test 2: bucket bounds stay within 1/16 of the value\n");
+    for (uint64_t v = 1; v < (1ULL << DEMI_HIST_MAX_BITS); v = v * 3 + 1) {
+        demi_hist_init(&g_a);
+        demi_hist_add(&g_a, v);
+        uint64_t q = demi_hist_quantile(&g_a, 1.0);
+        if (q < v || q - v > v / 16) {
+            printf("  value %llu reported as %llu\n", (unsigned long long)v, (unsigned long long)q);
+            failures++;
+        }
+    }
+    printf("  %s\n", failures ? "FAIL" : "OK");
+    return failures;
+}
+
+static int test_quantiles(void)
+{
+    static const double qs[] = { 0.5, 0.9, 0.99 };
+    int failures = 0;
+
+    printf("Test 3: quantiles of 1..100000 and merging\n");
+    demi_hist_init(&g_a);
+    demi_hist_init(&g_b);
+    for (uint64_t v = 1; v <= 100000; v++) {
+        demi_hist_add(v % 2 ? &g_a : &g_b, v);
+    }
+    demi_hist_merge(&g_a, &g_b);
+
+    if (g_a.count != 100000 || g_a.min != 1 || g_a.max != 100000 || g_a.sum != 5000050000ULL) {
+        printf("  count=%llu min=%llu max=%llu sum=%llu\n", (unsigned long long)g_a.count,
+               (unsigned long long)g_a.min, (unsigned long long)g_a.max, (unsigned long long)g_a.sum);
+        failures++;
+    }
+    for (size_t i = 0; i < sizeof(qs) / sizeof(qs[0]); i++) {
+        uint64_t want = (uint64_t)(qs[i] * 100000);
+        uint64_t got = demi_hist_quantile(&g_a, qs[i]);
+        if (got < want || got - want > want / 16) {
+            printf("  p%g: want about %llu, got %llu\n", qs[i] * 100, (unsigned long long)want,
+                   (unsigned long long)got);
+            failures++;
+        }
+    }
+    printf("  %s\n", failures ? "FAIL" : "OK");
+    return failures;
+}
+
+int main() {
+    int failures = 0;
+
+    printf("=== Histogram test ===\n\n");
+    failures += test_exact();
+    failures += test_precision();
+    failures += test_quantiles();
+
+    printf("\n%s\n", failures ? "FAILED" : "All histogram tests passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * Device matcher test: compiled patterns (exact names, '*' and '?'
+ * wildcards, [] and [!] classes, lists) match as expected, a large
+ * per-serial allowlist answers correctly, and its lookup cost is printed.
+ *
+ * cc -Iinclude -o test_matcher test_matcher.c src/demi_filter.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "include/demi.h"
+
+struct match_case {
+    const char *patterns;
+    const char *devname;
+    int expected;
+};
+
+static const struct match_case cases[] = {
+    { "md[0-3]", "md0", 1 },
+    { "md[0-3]", "md3", 1 },
+    { "md[0-3]", "md4", 0 },
+    { "md[0-3]", "md10", 0 },
+    { "md[0-3]", "md", 0 },
+    { "sd[a-c]1", "sdb1", 1 },
+    { "sd[a-c]1", "sdb2", 0 },
+    { "sd[!a-c]", "sdd", 1 },
+    { "sd[!a-c]", "sda", 0 },
+    { "da?p*", "da0p1", 1 },
+    { "da?p*", "da0", 0 },
+    { "*p1", "nvme0n1p1", 1 },
+    { "*p1", "nvme0n1p2", 0 },
+    { "nvme*n1", "nvme12n1", 1 },
+    { "nvme*n1", "nvme12n1p1", 0 },
+    { "cd* vtbd* ada*", "ada12", 1 },
+    { "cd* vtbd* ada*", "ad0", 0 },
+    { "sda sdab", "sda", 1 },
+    { "sda sdab", "sdab", 1 },
+    { "sda sdab", "sdaa", 0 },
+    { "  sda\tsdb  ", "sdb", 1 },
+    { "md[0-3", "md[0-3", 1 },
+    { "*", "anything", 1 },
+};
+
+int main() {
+    int failures = 0;
+
+    printf("=== Compiled device matcher test ===\n\n");
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        struct demi_matcher *m = demi_matcher_compile(cases[i].patterns);
+        int got = m ? demi_matcher_match(m, cases[i].devname) : -1;
+        printf("  '%s' vs %-12s -> %s%s\n", cases[i].patterns, cases[i].devname,
+               got ? "MATCH" : "no match", got == cases[i].expected ? "" : "  <-- FAIL");
+        if (got != cases[i].expected) {
+            failures++;
+        }
+        demi_matcher_free(m);
+    }
+
+    /* Per-serial allowlist: thousands of exact names plus a few wildcards */
+    size_t cap = 8 * 5000 + 64;
+    char *big = malloc(cap);
+    size_t len = 0;
+    for (int i = 0; i < 5000; i++) {
+        len += (size_t)snprintf(big + len, cap - len, "da%04d ", i);
+    }
+    snprintf(big + len, cap - len, "cd* md[0-3]");
+
+    demi_set_allowed_devices(big);
+    const char *names[] = { "da0000", "da4999", "da5000", "cd1", "md2", "md9", "sda" };
+    int expected[] = { 1, 1, 0, 1, 1, 0, 0 };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        int got = demi_is_device_allowed(names[i]);
+        printf("  5002 patterns vs %-8s -> %s%s\n", names[i], got ? "ALLOWED" : "BLOCKED",
+               got == expected[i] ? "" : "  <-- FAIL");
+        if (got != expected[i]) {
+            failures++;
+        }
+    }
+
+    struct timespec t0, t1;
+    volatile int sink = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < 1000000; i++) {
+        sink += demi_is_device_allowed(names[i % 7]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double ns = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / 1e6;
+    printf("\n  %.1f ns per lookup against 5002 patterns\n", ns);
+
+    demi_set_allowed_devices(NULL);
+    free(big);
+
+    printf("\n=== Compiled device matcher test %s ===\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,400 @@
+/*
+ * Resident helper test, against /bin/sh stubs: records arrive framed and
+ * intact, even when the body is sent in short writes; acknowledgements
+ * complete records in any order and unknown ones are ignored; records wait
+ * while the helper is at its in-flight limit; a helper that dies loses what
+ * it had, is restarted after a pause and gets what was still waiting; an
+ * expired record stops the helper's whole process group.
+ *
+ * cc -DDEMI_PLATFORM_LINUX -Iinclude -Isrc/linux -o test_resident \
+ *    test_resident.c src/demi_resident.c src/demi_spawn.c src/demi_zygote.c \
+ *    src/linux/demi_loop.c src/linux/demi_watch.c src/demi_wheel.c \
+ *    src/demi_log.c -lpthread
+ */
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "include/demi_loop.h"
+#include "include/demi_resident.h"
+
+/* Acks each record with its number of KEY=value lines, -2 if a line is not K<n>=$PAD */
+static const char echo_stub[] =
+    "#!/bin/sh\n"
+    "while IFS= read -r line; do\n"
+    "  case \"$line\" in\n"
+    "    \"EVENT \"*) seq=${line#EVENT }; n=0; bad=0;;\n"
+    "    \"\") if [ $bad = 1 ]; then echo \"$seq -2\"; else echo \"$seq $n\"; fi;;\n"
+    "    *) [ \"$line\" = \"K$n=$PAD\" ] || bad=1; n=$((n + 1));;\n"
+    "  esac\n"
+    "done\n";
+
+/* Holds three records, then acks them newest first around an unknown and a bad line */
+static const char reverse_stub[] =
+    "#!/bin/sh\n"
+    "seqs=\n"
+    "while IFS= read -r line; do\n"
+    "  case \"$line\" in\n"
+    "    \"EVENT \"*) seqs=\"${line#EVENT } $seqs\";;\n"
+    "    \"\") set -- $seqs\n"
+    "        if [ $# = 3 ]; then\n"
+    "          echo \"999 0\"; echo garbage\n"
+    "          for s in $seqs; do echo \"$s $s\"; done\n"
+    "          seqs=\n"
+    "        fi;;\n"
+    "  esac\n"
+    "done\n";
+
+/* Never acks */
+static const char hold_stub[] =
+    "#!/bin/sh\n"
+    "while read -r line; do :; done\n";
+
+/* Acks records, but exits on one carrying DIE=1 */
+static const char die_stub[] =
+    "#!/bin/sh\n"
+    "while IFS= read -r line; do\n"
+    "  case \"$line\" in\n"
+    "    \"EVENT \"*) seq=${line#EVENT };;\n"
+    "    DIE=1) exit 3;;\n"
+    "    \"\") echo \"$seq 0\";;\n"
+    "  esac\n"
+    "done\n";
+
+/* Shrugs off SIGTERM and leaves a child behind in its process group; once */
+static const char hang_stub[] =
+    "#!/bin/sh\n"
+    "[ -e \"$STUB_DIR/child\" ] && exec cat >/dev/null\n"
+    "trap '' TERM\n"
+    "sleep 30 &\n"
+    "echo $! > \"$STUB_DIR/child\"\n"
+    "read -r line\n"
+    "wait\n";
+
+static char g_dir[] = "/tmp/test_resident.XXXXXX";
+static struct demi_loop *g_loop;
+
+/* Completed records, in completion order */
+static long g_done_arg[64];
+static int g_done_status[64];
+static unsigned long long g_done_ms[64];
+static int g_ndone;
+
+static unsigned long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + (unsigned long long)ts.tv_nsec / 1000000;
+}
+
+static void record_done(int status, void *arg)
+{
+    g_done_arg[g_ndone] = (long)arg;
+    g_done_status[g_ndone] = status;
+    g_done_ms[g_ndone] = now_ms();
+    g_ndone++;
+}
+
+static void stop_loop(void *arg)
+{
+    demi_loop_stop((struct demi_loop *)arg);
+}
+
+/* Run the loop until want records completed or ms passed */
+static void run_until(int want, unsigned long ms)
+{
+    unsigned long long end = now_ms() + ms;
+    while (g_ndone < want && now_ms() < end) {
+        demi_loop_add_timer(g_loop, 20, stop_loop, g_loop);
+        demi_loop_run(g_loop);
+    }
+}
+
+static void run_for(unsigned long ms)
+{
+    demi_loop_add_timer(g_loop, ms, stop_loop, g_loop);
+    demi_loop_run(g_loop);
+}
+
+static struct demi_resident *start_stub(const char *name, const char *text, unsigned int max_inflight)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", g_dir, name);
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        return NULL;
+    }
+    fputs(text, f);
+    fclose(f);
+    chmod(path, 0755);
+
+    g_ndone = 0;
+    struct demi_resident *r = demi_resident_create(g_loop, path, max_inflight, 200);
+    if (!r) {
+        printf("  failed to start %s: %s\n", name, strerror(errno));
+    }
+    return r;
+}
+
+static int check(const char *what, int ok)
+{
+    printf("  %-52s -> %s\n", what, ok ? "OK" : "FAIL");
+    return ok ? 0 : 1;
+}
+
+static void on_alarm(int signo)
+{
+    (void)signo;
+}
+
+static int test_framing(void)
+{
+    int failures = 0;
+    setenv("PAD", "pad", 1);
+    struct demi_resident *r = start_stub("echo", echo_stub, 8);
+    if (!r) {
+        return 1;
+    }
+
+    /* Bodies of 0, 1 and 3 lines */
+    const char *small[] = { "", "K0=pad\n", "K0=pad\nK1=pad\nK2=pad\n" };
+    for (long i = 0; i < 3; i++) {
+        demi_resident_submit(r, small[i], strlen(small[i]), record_done, (void *)i);
+    }
+    run_until(3, 2000);
+    failures += check("records framed with their line counts",
+                      g_ndone == 3 && g_done_status[0] == 0 && g_done_status[1] == 1 && g_done_status[2] == 3);
+
+    /*
+     * Far more than the socket buffer, sent while a timer keeps interrupting
+     * the blocked write, so it goes out in pieces
+     */
+    enum { LINES = 100000 };
+    size_t cap = (size_t)LINES * 24, len = 0;
+    char *big = malloc(cap);
+    for (int i = 0; i < LINES; i++) {
+        len += (size_t)snprintf(big + len, cap - len, "K%d=pad\n", i);
+    }
+
+    struct sigaction sa = { .sa_handler = on_alarm };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGALRM, &sa, NULL);     /* no SA_RESTART: writes come back short */
+    struct itimerval every_ms = { { 0, 1000 }, { 0, 1000 } };
+    setitimer(ITIMER_REAL, &every_ms, NULL);
+
+    g_ndone = 0;
+    demi_resident_submit(r, big, len, record_done, (void *)10L);
+    demi_resident_submit(r, small[1], strlen(small[1]), record_done, (void *)11L);
+
+    struct itimerval off = { { 0, 0 }, { 0, 0 } };
+    setitimer(ITIMER_REAL, &off, NULL);
+    free(big);
+
+    run_until(2, 10000);
+    failures += check("large record intact after short writes",
+                      g_ndone == 2 && g_done_arg[0] == 10 && g_done_status[0] == LINES);
+    failures += check("next record framed after it", g_ndone == 2 && g_done_status[1] == 1);
+
+    struct demi_resident_stats st;
+    demi_resident_stats(r, &st);
+    printf("  sent=%lu acked=%lu lost=%lu inflight=%lu\n", st.sent, st.acked, st.lost, st.inflight);
+    failures += check("counters", st.sent == 5 && st.acked == 5 && st.lost == 0 && st.inflight == 0);
+    demi_resident_destroy(r);
+    return failures;
+}
+
+static int test_out_of_order(void)
+{
+    int failures = 0;
+    struct demi_resident *r = start_stub("reverse", reverse_stub, 4);
+    if (!r) {
+        return 1;
+    }
+
+    for (long i = 1; i <= 3; i++) {
+        demi_resident_submit(r, "", 0, record_done, (void *)i);
+    }
+    run_until(3, 2000);
+    run_for(100);      /* nothing more may complete */
+
+    printf("  completed:");
+    for (int i = 0; i < g_ndone; i++) {
+        printf(" %ld=%d", g_done_arg[i], g_done_status[i]);
+    }
+    printf("\n");
+    failures += check("acks complete the records they name",
+                      g_ndone == 3 && g_done_arg[0] == 3 && g_done_arg[1] == 2 && g_done_arg[2] == 1 &&
+                      g_done_status[0] == 3 && g_done_status[1] == 2 && g_done_status[2] == 1);
+
+    struct demi_resident_stats st;
+    demi_resident_stats(r, &st);
+    failures += check("unknown and bad acks ignored",
+                      st.acked == 3 && st.lost == 0 && st.inflight == 0 && st.restarts == 0);
+    demi_resident_destroy(r);
+    return failures;
+}
+
+static int test_inflight_limit(void)
+{
+    struct demi_resident *r = start_stub("hold", hold_stub, 2);
+    if (!r) {
+        return 1;
+    }
+
+    for (long i = 1; i <= 5; i++) {
+        demi_resident_submit(r, "A=1\n", 4, record_done, (void *)i);
+    }
+    run_for(100);
+
+    struct demi_resident_stats st;
+    demi_resident_stats(r, &st);
+    printf("  sent=%lu inflight=%lu waiting=%lu\n", st.sent, st.inflight, st.waiting);
+    int failures = check("only max_inflight records sent",
+                         st.sent == 2 && st.inflight == 2 && st.waiting == 3 && g_ndone == 0);
+    demi_resident_destroy(r);
+    return failures;
+}
+
+static int test_restart(void)
+{
+    int failures = 0;
+    struct demi_resident *r = start_stub("die", die_stub, 1);
+    if (!r) {
+        return 1;
+    }
+
+    demi_resident_submit(r, "A=1\n", 4, record_done, (void *)1L);
+    demi_resident_submit(r, "DIE=1\n", 6, record_done, (void *)2L);
+    demi_resident_submit(r, "A=3\n", 4, record_done, (void *)3L);
+    run_until(3, 4000);
+
+    printf("  completed:");
+    for (int i = 0; i < g_ndone; i++) {
+        printf(" %ld=%d", g_done_arg[i], g_done_status[i]);
+    }
+    printf("\n");
+    failures += check("record in flight lost with the helper",
+                      g_ndone >= 2 && g_done_arg[0] == 1 && g_done_status[0] == 0 &&
+                      g_done_arg[1] == 2 && g_done_status[1] == -1);
+    failures += check("waiting record goes to the next instance",
+                      g_ndone == 3 && g_done_arg[2] == 3 && g_done_status[2] == 0);
+    failures += check("quick death restarted only after a pause",
+                      g_ndone == 3 && g_done_ms[2] - g_done_ms[1] >= 900);
+
+    struct demi_resident_stats st;
+    demi_resident_stats(r, &st);
+    printf("  sent=%lu acked=%lu lost=%lu restarts=%lu\n", st.sent, st.acked, st.lost, st.restarts);
+    failures += check("counters", st.sent == 3 && st.acked == 2 && st.lost == 1 && st.restarts == 1);
+    demi_resident_destroy(r);
+    return failures;
+}
+
+static int gone(pid_t pid)
+{
+    if (kill(pid, 0) == -1) {
+        return errno == ESRCH;
+    }
+
+    /* A zombie nobody reaps here is gone as well */
+    char path[64], stat[256];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return 1;
+    }
+    size_t n = fread(stat, 1, sizeof(stat) - 1, f);
+    fclose(f);
+    stat[n] = '\0';
+    char *paren = strrchr(stat, ')');
+    return paren && paren[1] == ' ' && paren[2] == 'Z';
+}
+
+static int test_expire(void)
+{
+    int failures = 0;
+    char child_path[256];
+    snprintf(child_path, sizeof(child_path), "%s/child", g_dir);
+    setenv("STUB_DIR", g_dir, 1);
+
+    struct demi_resident *r = start_stub("hang", hang_stub, 1);
+    if (!r) {
+        return 1;
+    }
+    demi_resident_submit(r, "A=1\n", 4, record_done, (void *)1L);
+    demi_resident_submit(r, "A=2\n", 4, record_done, (void *)2L);
+    run_for(200);
+
+    pid_t child = 0;
+    FILE *f = fopen(child_path, "r");
+    if (f) {
+        int pid;
+        if (fscanf(f, "%d", &pid) == 1) {
+            child = pid;
+        }
+        fclose(f);
+    }
+
+    /* Not sent yet: dropped without touching the helper */
+    demi_resident_expire(r, (void *)2L);
+    struct demi_resident_stats st;
+    demi_resident_stats(r, &st);
+    failures += check("waiting record expired on its own",
+                      g_ndone == 1 && g_done_arg[0] == 2 && g_done_status[0] == -1 &&
+                      st.waiting == 0 && st.inflight == 1);
+
+    demi_resident_expire(r, (void *)1L);
+    failures += check("record the helper holds reported lost",
+                      g_ndone == 2 && g_done_arg[1] == 1 && g_done_status[1] == -1);
+
+    /* SIGTERM is ignored; SIGKILL after the grace period takes the group */
+    run_for(600);
+    failures += check("child in its process group killed", child > 0 && gone(child));
+
+    run_for(1200);
+    demi_resident_stats(r, &st);
+    printf("  lost=%lu restarts=%lu\n", st.lost, st.restarts);
+    failures += check("helper restarted", st.lost == 2 && st.restarts == 1);
+    demi_resident_destroy(r);
+    return failures;
+}
+
+int main() {
+    int failures = 0;
+
+    printf("=== Resident helper test ===\n");
+
+    g_loop = demi_loop_create();
+    if (!g_loop || !mkdtemp(g_dir)) {
+        printf("  setup failed\n");
+        return 1;
+    }
+
+    printf("\n1. record framing:\n");
+    failures += test_framing();
+
+    printf("\n2. out of order and unknown acknowledgements:\n");
+    failures += test_out_of_order();
+
+    printf("\n3. in-flight limit:\n");
+    failures += test_inflight_limit();
+
+    printf("\n4. helper death and restart:\n");
+    failures += test_restart();
+
+    printf("\n5. expiry of a hung helper:\n");
+    failures += test_expire();
+
+    demi_loop_free(g_loop);
+
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", g_dir);
+    system(cmd);
+
+    printf("\n=== Resident helper test %s ===\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
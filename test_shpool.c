@@ -0,0 +1,211 @@
+/*
+ * Warm shell test, against a /bin/sh helper script: arguments and exported
+ * values reach the helper byte for byte, quotes, newlines and shell syntax
+ * included; names sh cannot take are skipped; the helper's exit status comes
+ * back; a run that does not fit is refused without losing the shell; a shell
+ * that dies reports its run lost and is restarted only after a pause.
+ *
+ * cc -DDEMI_PLATFORM_LINUX -Iinclude -Isrc/linux -o test_shpool \
+ *    test_shpool.c src/demi_shpool.c src/demi_spawn.c src/demi_zygote.c \
+ *    src/linux/demi_loop.c src/linux/demi_watch.c src/demi_wheel.c \
+ *    src/demi_log.c -lpthread
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "include/demi_loop.h"
+#include "include/demi_shpool.h"
+
+/* Writes each argument and DEMI_A, DEMI_B as <...> to $OUT, then exits with $STATUS */
+static const char helper[] =
+    "printf '%d' $# > \"$OUT\"\n"
+    "for a in \"$@\"; do printf '<%s>' \"$a\" >> \"$OUT\"; done\n"
+    "printf '|<%s><%s><%s>' \"$DEMI_A\" \"$DEMI_B\" \"${BAD_NAME-unset}\" >> \"$OUT\"\n"
+    "[ \"$DIE\" = 1 ] && kill -9 $$\n"
+    "exit $STATUS\n";
+
+static char g_dir[] = "/tmp/test_shpool.XXXXXX";
+static char g_script[256];
+static char g_out[256];
+static struct demi_loop *g_loop;
+
+static int g_status;
+static int g_ndone;
+
+static void run_done(int exit_code, void *arg)
+{
+    (void)arg;
+    g_status = exit_code;
+    g_ndone++;
+}
+
+static void stop_loop(void *arg)
+{
+    demi_loop_stop((struct demi_loop *)arg);
+}
+
+static unsigned long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + (unsigned long long)ts.tv_nsec / 1000000;
+}
+
+/* Run the loop until the run completed or two seconds passed */
+static void wait_done(void)
+{
+    unsigned long long end = now_ms() + 2000;
+    while (g_ndone == 0 && now_ms() < end) {
+        demi_loop_add_timer(g_loop, 20, stop_loop, g_loop);
+        demi_loop_run(g_loop);
+    }
+}
+
+static int run(struct demi_shpool *pool, const char *const *devnodes, size_t count, char *const *env,
+               size_t nenv)
+{
+    g_ndone = 0;
+    g_status = -100;
+    unlink(g_out);
+    if (demi_shpool_run(pool, g_script, devnodes, count, env, nenv, run_done, NULL) == -1) {
+        return -1;
+    }
+    wait_done();
+    return g_ndone ? g_status : -100;
+}
+
+static int check_output(const char *what, const char *want)
+{
+    char got[4096];
+    size_t n = 0;
+    FILE *f = fopen(g_out, "r");
+    if (f) {
+        n = fread(got, 1, sizeof(got) - 1, f);
+        fclose(f);
+    }
+    got[n] = '\0';
+
+    int ok = f && strcmp(got, want) == 0;
+    printf("  %-44s -> %s\n", what, ok ? "OK" : "FAIL");
+    if (!ok) {
+        printf("    got:  %s\n    want: %s\n", got, want);
+    }
+    return ok ? 0 : 1;
+}
+
+static int check(const char *what, int ok)
+{
+    printf("  %-44s -> %s\n", what, ok ? "OK" : "FAIL");
+    return ok ? 0 : 1;
+}
+
+int main() {
+    int failures = 0;
+
+    printf("=== Warm shell test ===\n");
+
+    g_loop = demi_loop_create();
+    if (!g_loop || !mkdtemp(g_dir)) {
+        printf("  setup failed\n");
+        return 1;
+    }
+    snprintf(g_script, sizeof(g_script), "%s/it's a helper", g_dir);
+    snprintf(g_out, sizeof(g_out), "%s/out", g_dir);
+    FILE *f = fopen(g_script, "w");
+    if (!f) {
+        printf("  setup failed\n");
+        return 1;
+    }
+    fputs(helper, f);
+    fclose(f);
+    setenv("OUT", g_out, 1);
+    setenv("STATUS", "0", 1);
+
+    struct demi_shpool *pool = demi_shpool_create(g_loop, 1);
+    if (!pool) {
+        printf("  failed to create pool: %s\n", strerror(errno));
+        return 1;
+    }
+
+    printf("\n1. quoting:\n");
+    static const char *const plain[] = { "/dev/sda", "/dev/sdb" };
+    static char *const plain_env[] = { "DEMI_A=one", "DEMI_B=two" };
+    int status = run(pool, plain, 2, plain_env, 2);
+    failures += check("plain run", status == 0);
+    failures += check_output("plain values", "2</dev/sda></dev/sdb>|<one><two><unset>");
+
+    static const char *const odd[] = { "it's", "", "a b", "$(touch x)\n`id`;'\\'" };
+    static char *const odd_env[] = {
+        "DEMI_A=it's \"quoted\"\nsecond line\n",
+        "DEMI_B='; exit 9; '$HOME\\",
+        "BAD-NAME=skipped",
+        "=no name",
+        "no equals sign",
+    };
+    status = run(pool, odd, 4, odd_env, 5);
+    failures += check("quotes, newlines and syntax", status == 0);
+    failures += check_output("values byte for byte",
+                             "4<it's><><a b><$(touch x)\n`id`;'\\'>"
+                             "|<it's \"quoted\"\nsecond line\n><'; exit 9; '$HOME\\><unset>");
+
+    printf("\n2. exit status and limits:\n");
+    static char *const status_env[] = { "STATUS=7" };
+    status = run(pool, plain, 1, status_env, 1);
+    failures += check("helper exit status returned", status == 7);
+
+    size_t big_len = 70000;
+    char *big = malloc(big_len + 8);
+    memcpy(big, "DEMI_A=", 7);
+    memset(big + 7, '\'', big_len);     /* each quote takes four bytes quoted */
+    big[7 + big_len] = '\0';
+    char *big_env[] = { big };
+    g_ndone = 0;
+    int rc = demi_shpool_run(pool, g_script, plain, 1, big_env, 1, run_done, NULL);
+    failures += check("oversized run refused with E2BIG", rc == -1 && errno == E2BIG);
+    free(big);
+    status = run(pool, plain, 1, plain_env, 2);
+    failures += check("shell still usable after it", status == 0);
+
+    printf("\n3. shell death:\n");
+    static char *const die_env[] = { "DIE=1" };
+    unsigned long long died = now_ms();
+    status = run(pool, plain, 1, die_env, 1);
+    failures += check("run lost with its shell", status == -1);
+
+    rc = demi_shpool_run(pool, g_script, plain, 1, plain_env, 2, run_done, NULL);
+    failures += check("no shell while the restart waits", rc == -1 && errno == EAGAIN);
+
+    /* The shell was up for under a second, so it comes back a second after dying */
+    unsigned long long back = 0;
+    while (now_ms() - died < 3000) {
+        g_ndone = 0;
+        if (demi_shpool_run(pool, g_script, plain, 1, plain_env, 2, run_done, NULL) == 0) {
+            back = now_ms();
+            wait_done();
+            break;
+        }
+        demi_loop_add_timer(g_loop, 50, stop_loop, g_loop);
+        demi_loop_run(g_loop);
+    }
+    printf("  restarted after %llums\n", back ? back - died : 0);
+    failures += check("restarted after a pause", back && back - died >= 900);
+    failures += check("restarted shell runs helpers", g_ndone == 1 && g_status == 0);
+
+    struct demi_shpool_stats st;
+    demi_shpool_stats(pool, &st);
+    printf("  shells=%u busy=%u runs=%lu restarts=%lu\n", st.shells, st.busy, st.runs, st.restarts);
+    failures += check("counters", st.busy == 0 && st.runs == 6 && st.restarts == 1);
+
+    demi_shpool_destroy(pool);
+    demi_loop_free(g_loop);
+
+    char cmd[300];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", g_dir);
+    system(cmd);
+
+    printf("\n=== Warm shell test %s ===\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
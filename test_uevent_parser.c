@@ -0,0 +1,131 @@
+/*
+ * uevent parser test: well-known keys through the accessor API, arbitrary
+ * keys by name, message order iteration and malformed input.
+ *
+ * cc -DDEMI_PLATFORM_LINUX -Iinclude -Isrc/linux -o test_uevent_parser \
+ *    test_uevent_parser.c src/linux/demi.c src/linux/demi_bpf.c src/linux/demi_tokenize.c src/demi_event.c src/demi_filter.c src/demi_log.c -lpthread
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "include/demi.h"
+#include "demi_internal.h"
+
+static int g_failures;
+
+static size_t build(char *buf, const char **vars, size_t count)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t n = strlen(vars[i]) + 1;
+        memcpy(buf + len, vars[i], n);
+        len += n;
+    }
+    return len;
+}
+
+static void expect(const char *what, const char *got, const char *want)
+{
+    int ok = (!got && !want) || (got && want && strcmp(got, want) == 0);
+    printf("  %-22s = %-12s%s\n", what, got ? got : "(none)", ok ? "" : "  <-- FAIL");
+    if (!ok) {
+        g_failures++;
+    }
+}
+
+int main() {
+    static const char *vars[] = {
+        "add@/devices/pci0000:00/0000:00:1d.0/nvme/nvme0/nvme0n1/nvme0n1p2",
+        "ACTION=add",
+        "DEVPATH=/devices/pci0000:00/0000:00:1d.0/nvme/nvme0/nvme0n1/nvme0n1p2",
+        "SUBSYSTEM=block",
+        "MAJOR=259",
+        "MINOR=2",
+        "DEVNAME=nvme0n1p2",
+        "DEVTYPE=partition",
+        "DISKSEQ=17",
+        "PARTN=2",
+        "PARTNAME=root=sys",
+        "SEQNUM=8812",
+    };
+    char buf[1024];
+    struct demi_event de;
+
+    printf("=== uevent parser test ===\n\n");
+    demi_set_allowed_devices("nvme*");
+
+    size_t len = build(buf, vars, sizeof(vars) / sizeof(vars[0]));
+    char copy[sizeof(buf)];
+    memcpy(copy, buf, len);
+
+    if (demi_parse_uevent(buf, len, &de) != 0) {
+        printf("  parse failed  <-- FAIL\n");
+        return 1;
+    }
+    if (memcmp(copy, buf, len) != 0) {
+        printf("  receive buffer was modified  <-- FAIL\n");
+        g_failures++;
+    }
+    if (de.de_type != DEMI_ATTACH || strcmp(de.de_devname, "nvme0n1p2") != 0 || de.de_seqnum != 8812) {
+        printf("  type/devname/seqnum wrong  <-- FAIL\n");
+        g_failures++;
+    }
+
+    const char *want[DEMI_KEY_COUNT] = {
+        "add", "nvme0n1p2", "block", "partition",
+        "/devices/pci0000:00/0000:00:1d.0/nvme/nvme0/nvme0n1/nvme0n1p2",
+        "8812", "259", "2", "17", "2",
+    };
+    for (int k = 0; k < DEMI_KEY_COUNT; k++) {
+        expect(demi_key_name((enum demi_key)k), demi_event_get(&de, (enum demi_key)k, NULL), want[k]);
+        if (demi_key_lookup(demi_key_name((enum demi_key)k), strlen(demi_key_name((enum demi_key)k))) != k) {
+            printf("  perfect hash misses %s  <-- FAIL\n", demi_key_name((enum demi_key)k));
+            g_failures++;
+        }
+    }
+    expect("PARTNAME (lookup)", demi_event_lookup(&de, "PARTNAME", NULL), "root=sys");
+    expect("ID_FS_TYPE (lookup)", demi_event_lookup(&de, "ID_FS_TYPE", NULL), NULL);
+    if (demi_key_lookup("PARTNAME", 8) != -1 || demi_key_lookup("MAJ", 3) != -1) {
+        printf("  non-key matched the perfect hash  <-- FAIL\n");
+        g_failures++;
+    }
+
+    const char *key, *value;
+    size_t key_len;
+    unsigned int count = 0;
+    while (demi_event_field(&de, count, &key, &key_len, &value, NULL) == 0) {
+        count++;
+    }
+    printf("  %u fields in message order (first %.*s)\n", count, (int)key_len, key);
+    if (count != sizeof(vars) / sizeof(vars[0]) - 1) {
+        g_failures++;
+    }
+
+    /* Malformed: missing terminator, oversized DEVNAME */
+    if (demi_parse_uevent(buf, len - 1, &de) != -1) {
+        printf("  unterminated message accepted  <-- FAIL\n");
+        g_failures++;
+    }
+    char longname[DEMI_DEVNAME_MAX + 16] = "DEVNAME=";
+    memset(longname + 8, 'a', sizeof(longname) - 9);
+    longname[sizeof(longname) - 1] = '\0';
+    const char *bad[] = { "add@/devices/x", "ACTION=add", longname };
+    if (demi_parse_uevent(buf, build(buf, bad, 3), &de) != -1) {
+        printf("  oversized DEVNAME accepted  <-- FAIL\n");
+        g_failures++;
+    }
+
+    len = build(buf, vars, sizeof(vars) / sizeof(vars[0]));
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < 1000000; i++) {
+        demi_parse_uevent(buf, len, &de);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double ns = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / 1e6;
+    printf("\n  %.1f ns per %zu-byte uevent\n", ns, len);
+
+    printf("\n=== uevent parser test %s ===\n", g_failures ? "FAILED" : "passed");
+    return g_failures ? 1 : 0;
+}
@@ -0,0 +1,182 @@
+/*
+ * Timer wheel test: deadlines on every level fire in order and on time,
+ * cancelled timers never fire, callbacks may add and cancel timers, and
+ * deadlines past the top level come back down. Time is simulated; no
+ * sleeping.
+ *
+ * cc -Iinclude -o test_wheel test_wheel.c src/demi_wheel.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "include/demi_wheel.h"
+
+#define TIMERS 5000
+
+struct test_timer {
+    struct demi_wheel_timer t;     /* first, so the wheel's pointer is ours */
+    uint64_t deadline;
+    uint64_t fired_at;
+    int fired;
+};
+
+static struct test_timer g_timers[TIMERS];
+static uint64_t g_now;
+static uint64_t g_last;
+static int g_out_of_order;
+static struct demi_wheel g_wheel;
+
+static void on_fire(struct demi_wheel_timer *t, void *arg)
+{
+    struct test_timer *tt = (struct test_timer *)t;
+    (void)arg;
+
+    tt->fired++;
+    tt->fired_at = g_now;
+    if (tt->deadline < g_last) {
+        g_out_of_order++;
+    }
+    g_last = tt->deadline;
+}
+
+/* Step simulated time to each wakeup the wheel asks for, up to end */
+static unsigned long run_until(uint64_t end, unsigned long *wakeups)
+{
+    unsigned long fired = 0;
+
+    for (;;) {
+        long timeout = demi_wheel_timeout(&g_wheel, g_now);
+        if (timeout == -1 || g_now + (uint64_t)timeout > end) {
+            g_now = end;
+            fired += demi_wheel_expire(&g_wheel, g_now, on_fire, NULL);
+            return fired;
+        }
+        g_now += (uint64_t)timeout;
+        (*wakeups)++;
+        fired += demi_wheel_expire(&g_wheel, g_now, on_fire, NULL);
+    }
+}
+
+static int test_ordering(void)
+{
+    unsigned long wakeups = 0;
+    int failures = 0;
+
+    printf("--- %d timers from 0 ms to about 2 hours, every third cancelled ---\n", TIMERS);
+    g_now = 1000;
+    g_last = 0;
+    g_out_of_order = 0;
+    demi_wheel_init(&g_wheel, g_now);
+    srand(1);
+    for (int i = 0; i < TIMERS; i++) {
+        /* Spread over every level: up to 64 ms, 4 s, 4 min and 2 h */
+        static const uint64_t spans[] = { 64, 4096, 262144, 7200000 };
+        uint64_t delay = (uint64_t)rand() % spans[i % 4];
+        memset(&g_timers[i], 0, sizeof(g_timers[i]));
+        g_timers[i].deadline = g_now + delay;
+        demi_wheel_add(&g_wheel, &g_timers[i].t, g_timers[i].deadline);
+    }
+    for (int i = 0; i < TIMERS; i += 3) {
+        demi_wheel_cancel(&g_wheel, &g_timers[i].t);
+    }
+
+    unsigned long fired = run_until(g_now + 8000000, &wakeups);
+    int late = 0, wrong = 0;
+    for (int i = 0; i < TIMERS; i++) {
+        int expect = i % 3 != 0;
+        if (g_timers[i].fired != expect) {
+            wrong++;
+        } else if (expect && g_timers[i].fired_at != g_timers[i].deadline) {
+            late++;
+        }
+    }
+    printf("  fired=%lu wakeups=%lu wrong=%d off_time=%d out_of_order=%d\n",
+           fired, wakeups, wrong, late, g_out_of_order);
+    if (wrong || late || g_out_of_order || demi_wheel_timeout(&g_wheel, g_now) != -1) {
+        printf("  FAIL\n");
+        failures++;
+    } else {
+        printf("  OK\n");
+    }
+    return failures;
+}
+
+static struct test_timer g_chain;
+static struct test_timer g_victim;
+static int g_chain_left;
+
+static void on_chain(struct demi_wheel_timer *t, void *arg)
+{
+    (void)arg;
+    /* Re-arm itself and cancel a timer due at the same moment */
+    demi_wheel_cancel(&g_wheel, &g_victim.t);
+    if (--g_chain_left > 0) {
+        demi_wheel_add(&g_wheel, t, g_now + 10);
+    }
+}
+
+static int test_callbacks(void)
+{
+    int failures = 0;
+
+    printf("--- callbacks re-arm and cancel ---\n");
+    g_now = 0;
+    demi_wheel_init(&g_wheel, g_now);
+    memset(&g_chain, 0, sizeof(g_chain));
+    memset(&g_victim, 0, sizeof(g_victim));
+    g_chain_left = 5;
+    demi_wheel_add(&g_wheel, &g_chain.t, 10);
+    demi_wheel_add(&g_wheel, &g_victim.t, 10);
+
+    for (int i = 0; i < 100 && demi_wheel_timeout(&g_wheel, g_now) != -1; i++) {
+        g_now += (uint64_t)demi_wheel_timeout(&g_wheel, g_now);
+        demi_wheel_expire(&g_wheel, g_now, on_chain, NULL);
+    }
+    printf("  now=%llu left=%d victim_pending=%d\n", (unsigned long long)g_now, g_chain_left,
+           demi_wheel_pending(&g_victim.t));
+    if (g_now != 50 || g_chain_left != 0 || demi_wheel_pending(&g_victim.t)) {
+        printf("  FAIL\n");
+        failures++;
+    } else {
+        printf("  OK\n");
+    }
+    return failures;
+}
+
+static int test_far(void)
+{
+    unsigned long wakeups = 0;
+    int failures = 0;
+    struct test_timer far;
+
+    printf("--- deadline past the top level ---\n");
+    g_now = 123;
+    g_last = 0;
+    demi_wheel_init(&g_wheel, g_now);
+    memset(&far, 0, sizeof(far));
+    far.deadline = g_now + 3ull * 24 * 3600 * 1000;     /* 3 days */
+    demi_wheel_add(&g_wheel, &far.t, far.deadline);
+
+    run_until(far.deadline + 1000, &wakeups);
+    printf("  fired=%d at +%llu ms (wanted +%llu) wakeups=%lu\n", far.fired,
+           (unsigned long long)(far.fired_at - 123), (unsigned long long)(far.deadline - 123), wakeups);
+    if (far.fired != 1 || far.fired_at != far.deadline) {
+        printf("  FAIL\n");
+        failures++;
+    } else {
+        printf("  OK\n");
+    }
+    return failures;
+}
+
+int main() {
+    int failures = 0;
+
+    printf("=== Timer wheel test ===\n\n");
+    failures += test_ordering();
+    failures += test_callbacks();
+    failures += test_far();
+
+    printf("\n%s\n", failures ? "FAILED" : "All timer wheel tests passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * Helper pool test: no more jobs run at once than there are slots, queued
+ * jobs start in order as slots free up, and each overflow policy handles a
+ * full queue as documented: block keeps everything, drop-oldest discards
+ * and stays within capacity even when its discard submits again, spill
+ * grows the queue and loses nothing.
+ *
+ * cc -Iinclude -o test_worker_pool test_worker_pool.c src/demi_pool.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "include/demi_pool.h"
+
+#define SLOTS 4
+
+/* Jobs holding a slot, finished by the test the way helper exits would be */
+static void *g_running[SLOTS * 2];
+static int g_nrunning;
+static int g_ran;
+static int g_discarded;
+static int g_max_running;
+
+static int start_job(void *job)
+{
+    g_running[g_nrunning++] = job;
+    if (g_nrunning > g_max_running) {
+        g_max_running = g_nrunning;
+    }
+    return 0;
+}
+
+static void drop_job(void *job)
+{
+    g_discarded++;
+    free(job);
+}
+
+static void finish_one(struct demi_pool *pool)
+{
+    void *job = g_running[0];
+    memmove(&g_running[0], &g_running[1], (size_t)(g_nrunning - 1) * sizeof(g_running[0]));
+    g_nrunning--;
+    g_ran++;
+    free(job);
+    demi_pool_done(pool);
+}
+
+static int run_policy(enum demi_pool_overflow overflow, int jobs)
+{
+    int full_seen = 0;
+
+    g_nrunning = g_ran = g_discarded = g_max_running = 0;
+
+    struct demi_pool *pool = demi_pool_create(SLOTS, 16, overflow, start_job, drop_job);
+    if (!pool) {
+        printf("  failed to create pool\n");
+        return 1;
+    }
+
+    for (int i = 0; i < jobs; i++) {
+        /* Block policy: the caller stops feeding until a slot frees up */
+        while (demi_pool_full(pool)) {
+            full_seen = 1;
+            finish_one(pool);
+        }
+        demi_pool_submit(pool, malloc(16));
+    }
+
+    struct demi_pool_stats st;
+    demi_pool_stats(pool, &st);
+    printf("  after submit: depth=%lu high=%lu running=%u/%u dropped=%lu spilled=%lu\n",
+           st.depth, st.high_water, st.running, st.slots, st.dropped, st.spilled);
+
+    while (g_nrunning > 0) {
+        finish_one(pool);
+    }
+    demi_pool_destroy(pool);
+
+    int failures = 0;
+    printf("  ran=%d discarded=%d total=%d max_running=%d -> %s\n", g_ran, g_discarded,
+           g_ran + g_discarded, g_max_running,
+           g_ran + g_discarded == jobs && g_max_running <= SLOTS ? "OK" : "FAIL");
+    if (g_ran + g_discarded != jobs || g_max_running > SLOTS) {
+        failures++;
+    }
+    if (overflow == DEMI_POOL_BLOCK && !full_seen) {
+        printf("  FAIL: block policy never reported a full queue\n");
+        failures++;
+    }
+    return failures;
+}
+
+static struct demi_pool *g_pool;
+
+/* As the daemon's discard does: dropping a job lets its device's next job in */
+static void drop_and_resubmit(void *job)
+{
+    g_discarded++;
+    free(job);
+    if (g_discarded % 2) {
+        demi_pool_submit(g_pool, malloc(16));
+    }
+}
+
+static int run_reentrant(void)
+{
+    g_nrunning = g_ran = g_discarded = g_max_running = 0;
+
+    g_pool = demi_pool_create(SLOTS, 16, DEMI_POOL_DROP_OLDEST, start_job, drop_and_resubmit);
+    if (!g_pool) {
+        printf("  failed to create pool\n");
+        return 1;
+    }
+    for (int i = 0; i < 200; i++) {
+        demi_pool_submit(g_pool, malloc(16));
+    }
+
+    struct demi_pool_stats st;
+    demi_pool_stats(g_pool, &st);
+    printf("  depth=%lu high=%lu capacity=16 dropped=%lu -> %s\n", st.depth, st.high_water, st.dropped,
+           st.high_water <= 16 ? "OK" : "FAIL");
+
+    while (g_nrunning > 0) {
+        finish_one(g_pool);
+    }
+    demi_pool_destroy(g_pool);
+    return st.high_water <= 16 ? 0 : 1;
+}
+
+int main() {
+    int failures = 0;
+
+    printf("=== Helper pool test ===\n");
+
+    printf("\n1. block policy (nothing may be lost):\n");
+    failures += run_policy(DEMI_POOL_BLOCK, 200);
+    if (g_discarded != 0) {
+        printf("  FAIL: block policy discarded jobs\n");
+        failures++;
+    }
+
+    printf("\n2. drop-oldest policy:\n");
+    failures += run_policy(DEMI_POOL_DROP_OLDEST, 200);
+
+    printf("\n2b. drop-oldest with a discard that submits again (queue stays bounded):\n");
+    failures += run_reentrant();
+
+    printf("\n3. spill policy (nothing may be lost):\n");
+    failures += run_policy(DEMI_POOL_SPILL, 200);
+    if (g_discarded != 0) {
+        printf("  FAIL: spill policy discarded jobs\n");
+        failures++;
+    }
+
+    printf("\n=== Helper pool test %s ===\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
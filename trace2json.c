@@ -0,0 +1,200 @@
+/*
+ * Turn a DEMI_TRACE_FILE into Chrome trace-event JSON, for chrome://tracing
+ * or ui.perfetto.dev. Each event becomes one span from the kernel queueing
+ * it to its helper exiting, split into the stages it went through; events
+ * are grouped by device. Records keep only the first 35 bytes of a device
+ * name, so devices whose names differ only past that share a track.
+ *
+ * cc -Iinclude -o trace2json trace2json.c
+ *
+ * ./trace2json /var/log/devd-watcher.trace > trace.json
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "include/demi_trace.h"
+
+/* Devices given their own track; the rest share track 0 */
+#define DEVICES_MAX 4096
+
+static const struct {
+    enum demi_stage from;
+    enum demi_stage to;
+    const char *name;
+} g_spans[] = {
+    { DEMI_STAGE_RECEIVED, DEMI_STAGE_PARSED, "receive" },
+    { DEMI_STAGE_PARSED, DEMI_STAGE_FILTERED, "filter" },
+    { DEMI_STAGE_FILTERED, DEMI_STAGE_ENQUEUED, "dispatch" },
+    { DEMI_STAGE_ENQUEUED, DEMI_STAGE_LOCKED, "queue" },        /* coalescing, device busy */
+    { DEMI_STAGE_LOCKED, DEMI_STAGE_SPAWNED, "start" },         /* batching, pool slot, spawn */
+    { DEMI_STAGE_SPAWNED, DEMI_STAGE_EXITED, "helper" },
+};
+
+static char *g_devices[DEVICES_MAX];
+static unsigned int g_ndevices = 0;
+static int g_first = 1;
+
+static const char *action_name(unsigned int type)
+{
+    switch (type) {
+        case DEMI_ATTACH:
+            return "attach";
+        case DEMI_DETACH:
+            return "detach";
+        case DEMI_CHANGE:
+            return "change";
+        case DEMI_RESYNC:
+            return "reconcile";     /* after an event storm, for no device */
+        default:
+            return "unknown";
+    }
+}
+
+static void print_string(const char *s)
+{
+    putchar('"');
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if (c < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+static void print_ts(unsigned long long ns)
+{
+    printf("%llu.%03llu", ns / 1000, ns % 1000);
+}
+
+static void begin_event(void)
+{
+    printf(g_first ? "\n" : ",\n");
+    g_first = 0;
+}
+
+/* The device's track, named when first seen */
+static unsigned int device_tid(const char *devname)
+{
+    for (unsigned int i = 0; i < g_ndevices; i++) {
+        if (strcmp(g_devices[i], devname) == 0) {
+            return i + 1;
+        }
+    }
+    if (g_ndevices == DEVICES_MAX || !(g_devices[g_ndevices] = strdup(devname))) {
+        return 0;
+    }
+    begin_event();
+    printf("{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", g_ndevices + 1);
+    print_string(devname);
+    printf("}}");
+    return ++g_ndevices;
+}
+
+static void print_span(const char *phase, const char *name, unsigned long id, unsigned int tid,
+                       unsigned long long ns)
+{
+    begin_event();
+    printf("{\"ph\":\"%s\",\"cat\":\"event\",\"name\":", phase);
+    print_string(name);
+    printf(",\"id\":%lu,\"pid\":1,\"tid\":%u,\"ts\":", id, tid);
+    print_ts(ns);
+    printf("}");
+}
+
+static void print_record(const struct demi_trace_record *r, unsigned long id, long long realtime_ns)
+{
+    const uint64_t *ns = r->dtr_stage_ns;
+    char devname[sizeof(r->dtr_devname) + 1];
+    char title[sizeof(devname) + 16];
+
+    memcpy(devname, r->dtr_devname, sizeof(r->dtr_devname));
+    devname[sizeof(r->dtr_devname)] = '\0';
+    if (ns[DEMI_STAGE_RECEIVED] == 0 || ns[DEMI_STAGE_EXITED] < ns[DEMI_STAGE_RECEIVED]) {
+        return;
+    }
+    unsigned int tid = device_tid(devname);
+
+    /* Async spans: events for one device may overlap, and these still nest */
+    snprintf(title, sizeof(title), "%s %s", action_name(r->dtr_type), devname);
+    begin_event();
+    printf("{\"ph\":\"b\",\"cat\":\"event\",\"name\":");
+    print_string(title);
+    printf(",\"id\":%lu,\"pid\":1,\"tid\":%u,\"ts\":", id, tid);
+    print_ts(ns[DEMI_STAGE_RECEIVED]);
+    printf(",\"args\":{\"seqnum\":%llu,\"pid\":%d,\"attempt\":%u,\"batch\":%u,\"failed\":%s,"
+           "\"received_realtime_ns\":%lld}}",
+           (unsigned long long)r->dtr_seqnum, (int)r->dtr_pid, (unsigned int)r->dtr_attempt,
+           (unsigned int)r->dtr_batch, r->dtr_failed ? "true" : "false",
+           (long long)ns[DEMI_STAGE_RECEIVED] + realtime_ns);
+
+    for (size_t i = 0; i < sizeof(g_spans) / sizeof(g_spans[0]); i++) {
+        uint64_t from = ns[g_spans[i].from], to = ns[g_spans[i].to];
+        if (from == 0 || to < from) {
+            continue;
+        }
+        print_span("b", g_spans[i].name, id, tid, from);
+        print_span("e", g_spans[i].name, id, tid, to);
+    }
+    print_span("e", title, id, tid, ns[DEMI_STAGE_EXITED]);
+}
+
+int main(int argc, char *argv[])
+{
+    struct demi_trace_header h;
+    struct demi_trace_record r;
+    long long realtime_ns = 0;
+    unsigned long id = 0;
+    int have_header = 0;
+
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "-h") == 0)) {
+        fprintf(stderr, "Usage: %s [trace_file] > trace.json\n", argv[0]);
+        return argc == 2 ? 0 : 1;
+    }
+    FILE *in = argc == 2 ? fopen(argv[1], "rb") : stdin;
+    if (!in) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    printf("\n{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":1,\"args\":{\"name\":\"devd-watcher\"}}");
+    g_first = 0;
+
+    /* A header starts each daemon run; everything else is a record */
+    char magic[sizeof(h.dth_magic)];
+    while (fread(magic, sizeof(magic), 1, in) == 1) {
+        if (memcmp(magic, DEMI_TRACE_MAGIC, sizeof(magic)) == 0) {
+            if (fread((char *)&h + sizeof(magic), sizeof(h) - sizeof(magic), 1, in) != 1) {
+                break;
+            }
+            if (h.dth_record_size != sizeof(r) || h.dth_stages != DEMI_STAGE_COUNT) {
+                fprintf(stderr, "trace written by another version (%u-byte records, %u stages)\n",
+                        h.dth_record_size, h.dth_stages);
+                return 1;
+            }
+            realtime_ns = h.dth_realtime_ns;
+            have_header = 1;
+            continue;
+        }
+        if (!have_header) {
+            fprintf(stderr, "not a trace file\n");
+            return 1;
+        }
+        memcpy(&r, magic, sizeof(magic));
+        if (fread((char *)&r + sizeof(magic), sizeof(r) - sizeof(magic), 1, in) != 1) {
+            break;      /* cut short while the daemon was writing */
+        }
+        print_record(&r, ++id, realtime_ns);
+    }
+    printf("\n]}\n");
+
+    if (in != stdin) {
+        fclose(in);
+    }
+    return 0;
+}